@@ -151,6 +151,12 @@ public:
         RtlCopyBytes(Buffer, m_Entries[Index], min(NumObjects, m_Entries[Index].m_NumObjects) * sizeof(TObject));
     }
 
+    size_t EntrySize(size_t Index)
+    {
+        ASSERT(Index < m_NumEntries);
+        return m_Entries[Index].m_NumObjects;
+    }
+
     CBufferSet(CBufferSet<PoolType, Tag, TObject> &Other)
     {
         *this = Other;
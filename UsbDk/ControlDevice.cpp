@@ -58,7 +58,6 @@ NTSTATUS CUsbDkControlDeviceInit::Create(WDFDRIVER Driver)
 
     SetRequestAttributes(requestAttributes);
 
-    SetExclusive();
     SetIoBuffered();
 
     SetIoInCallerContextCallback(CUsbDkControlDevice::IoInCallerContext);
@@ -95,11 +94,79 @@ void CUsbDkControlDeviceQueue::DeviceControl(WDFQUEUE Queue,
             EnumerateDevices(WdfRequest, Queue);
             break;
         }
+        case IOCTL_USBDK_ENUM_DEVICES_COMPACT:
+        {
+            EnumerateDevicesCompact(WdfRequest, Queue);
+            break;
+        }
+        case IOCTL_USBDK_ENUM_DEVICES_FILTERED:
+        {
+            EnumerateDevicesFiltered(WdfRequest, Queue);
+            break;
+        }
         case IOCTL_USBDK_GET_CONFIG_DESCRIPTOR:
         {
             GetConfigurationDescriptor(WdfRequest, Queue);
             break;
         }
+        case IOCTL_USBDK_GET_CONFIG_DESCRIPTOR_EX:
+        {
+            GetConfigurationDescriptorEx(WdfRequest, Queue);
+            break;
+        }
+        case IOCTL_USBDK_GET_ENUM_GENERATION:
+        {
+            GetEnumerationGeneration(WdfRequest, Queue);
+            break;
+        }
+        case IOCTL_USBDK_GET_DESCRIPTORS_SNAPSHOT:
+        {
+            GetDescriptorsSnapshot(WdfRequest, Queue);
+            break;
+        }
+        case IOCTL_USBDK_UPDATE_REG_PARAMETERS:
+        case IOCTL_USBDK_ADD_REDIRECT:
+        {
+            ForwardToSerialQueue(WdfRequest, Queue);
+            break;
+        }
+        default:
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "Wrong IoControlCode 0x%X\n", IoControlCode);
+            WdfRequest.SetStatus(STATUS_INVALID_DEVICE_REQUEST);
+            break;
+        }
+    }
+}
+
+void CUsbDkControlDeviceQueue::ForwardToSerialQueue(CControlRequest &Request, WDFQUEUE Queue)
+{
+    auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+    auto status = devExt->UsbDkControl->ForwardToSerialQueue(Request);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! failed: %!STATUS!", status);
+    }
+}
+
+void CUsbDkControlDeviceSerialQueue::SetCallbacks(WDF_IO_QUEUE_CONFIG &QueueConfig)
+{
+    QueueConfig.EvtIoDeviceControl = CUsbDkControlDeviceQueue::SerialDeviceControl;
+}
+
+void CUsbDkControlDeviceQueue::SerialDeviceControl(WDFQUEUE Queue,
+                                                   WDFREQUEST Request,
+                                                   size_t OutputBufferLength,
+                                                   size_t InputBufferLength,
+                                                   ULONG IoControlCode)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    CControlRequest WdfRequest(Request);
+
+    switch (IoControlCode)
+    {
         case IOCTL_USBDK_UPDATE_REG_PARAMETERS:
         {
             UpdateRegistryParameters(WdfRequest, Queue);
@@ -134,6 +201,21 @@ void CUsbDkControlDeviceQueue::CountDevices(CControlRequest &Request, WDFQUEUE Q
     Request.SetStatus(status);
 }
 
+void CUsbDkControlDeviceQueue::GetEnumerationGeneration(CControlRequest &Request, WDFQUEUE Queue)
+{
+    ULONG64 *Generation;
+    auto status = Request.FetchOutputObject(Generation);
+    if (NT_SUCCESS(status))
+    {
+        auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+        *Generation = devExt->UsbDkControl->EnumerationGeneration();
+
+        Request.SetOutputDataLen(sizeof(*Generation));
+    }
+
+    Request.SetStatus(status);
+}
+
 void CUsbDkControlDeviceQueue::UpdateRegistryParameters(CControlRequest &Request, WDFQUEUE Queue)
 {
     auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
@@ -168,6 +250,66 @@ void CUsbDkControlDeviceQueue::EnumerateDevices(CControlRequest &Request, WDFQUE
     }
 }
 
+void CUsbDkControlDeviceQueue::EnumerateDevicesCompact(CControlRequest &Request, WDFQUEUE Queue)
+{
+    USB_DK_COMPACT_ENUM_HEADER *Header;
+    size_t OutputLength;
+    size_t BytesWritten = 0;
+
+    auto status = Request.FetchOutputObject(Header, &OutputLength);
+    if (NT_SUCCESS(status))
+    {
+        auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+        status = devExt->UsbDkControl->EnumerateDevicesCompact(*Header, OutputLength, BytesWritten);
+    }
+
+    Request.SetOutputDataLen(BytesWritten);
+    Request.SetStatus(status);
+}
+
+void CUsbDkControlDeviceQueue::EnumerateDevicesFiltered(CControlRequest &Request, WDFQUEUE Queue)
+{
+    USB_DK_DEVICE_FILTER *FilterInput;
+    USB_DK_COMPACT_ENUM_HEADER *Header;
+    size_t OutputLength;
+    size_t BytesWritten = 0;
+
+    auto status = Request.FetchInputObject(FilterInput);
+    if (NT_SUCCESS(status))
+    {
+        //Input and output share the same system buffer,
+        //so the filter must be copied before output is written
+        auto Filter = *FilterInput;
+
+        status = Request.FetchOutputObject(Header, &OutputLength);
+        if (NT_SUCCESS(status))
+        {
+            auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+            status = devExt->UsbDkControl->EnumerateDevicesCompact(*Header, OutputLength, BytesWritten, &Filter);
+        }
+    }
+
+    Request.SetOutputDataLen(BytesWritten);
+    Request.SetStatus(status);
+}
+
+void CUsbDkControlDeviceQueue::GetDescriptorsSnapshot(CControlRequest &Request, WDFQUEUE Queue)
+{
+    USB_DK_DESCRIPTORS_SNAPSHOT *Snapshot;
+    size_t SnapshotLength;
+    size_t BytesWritten = 0;
+
+    auto status = Request.FetchOutputObject(Snapshot, &SnapshotLength);
+    if (NT_SUCCESS(status))
+    {
+        auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+        status = devExt->UsbDkControl->GetDescriptorsSnapshot(*Snapshot, SnapshotLength, BytesWritten);
+    }
+
+    Request.SetOutputDataLen(BytesWritten);
+    Request.SetStatus(status);
+}
+
 void CUsbDkControlDeviceQueue::AddRedirect(CControlRequest &Request, WDFQUEUE Queue)
 {
     NTSTATUS status;
@@ -175,13 +317,19 @@ void CUsbDkControlDeviceQueue::AddRedirect(CControlRequest &Request, WDFQUEUE Qu
     PUSB_DK_DEVICE_ID DeviceId;
     PULONG64 RedirectorDevice;
 
-    auto TargetProcessHandle = Request.Context()->CallerProcessHandle;
+    auto Context = Request.Context();
+    auto TargetProcessHandle = Context->CallerProcessHandle;
     if (TargetProcessHandle != WDF_NO_HANDLE)
     {
         if (FetchBuffersForAddRedirectRequest(Request, DeviceId, RedirectorDevice))
         {
             auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
-            status = devExt->UsbDkControl->AddRedirect(*DeviceId, TargetProcessHandle, reinterpret_cast<PHANDLE>(RedirectorDevice));
+            status = devExt->UsbDkControl->AddRedirect(*DeviceId, Request);
+            if (status == STATUS_PENDING)
+            {
+                //Request and process handle are owned by pending redirects queue now
+                return;
+            }
         }
         else
         {
@@ -189,6 +337,7 @@ void CUsbDkControlDeviceQueue::AddRedirect(CControlRequest &Request, WDFQUEUE Qu
         }
 
         ZwClose(TargetProcessHandle);
+        Context->CallerProcessHandle = WDF_NO_HANDLE;
     }
     else
     {
@@ -197,10 +346,25 @@ void CUsbDkControlDeviceQueue::AddRedirect(CControlRequest &Request, WDFQUEUE Qu
         status = STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    //Parked redirection gets reattached without pending the request
     Request.SetOutputDataLen(NT_SUCCESS(status) ? sizeof(*RedirectorDevice) : 0);
     Request.SetStatus(status);
 }
 
+void CUsbDkPendingRedirectsQueue::SetCallbacks(WDF_IO_QUEUE_CONFIG &QueueConfig)
+{
+    QueueConfig.EvtIoCanceledOnQueue = CUsbDkPendingRedirectsQueue::CanceledOnQueue;
+}
+
+void CUsbDkPendingRedirectsQueue::CanceledOnQueue(WDFQUEUE Queue, WDFREQUEST Request)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Pending redirection cancelled");
+
+    CControlRequest WdfRequest(Request);
+    auto devExt = UsbDkControlGetContext(WdfIoQueueGetDevice(Queue));
+    devExt->UsbDkControl->CompleteRedirect(WdfRequest, STATUS_CANCELLED);
+}
+
 template <typename TInputObj, typename TOutputObj>
 static void CUsbDkControlDeviceQueue::DoUSBDeviceOp(CControlRequest &Request,
                                                     WDFQUEUE Queue,
@@ -258,7 +422,99 @@ void CUsbDkControlDeviceQueue::GetConfigurationDescriptor(CControlRequest &Reque
     DoUSBDeviceOp<USB_DK_CONFIG_DESCRIPTOR_REQUEST, USB_CONFIGURATION_DESCRIPTOR>(Request, Queue, &CUsbDkControlDevice::GetConfigurationDescriptor);
 }
 
+void CUsbDkControlDeviceQueue::GetConfigurationDescriptorEx(CControlRequest &Request, WDFQUEUE Queue)
+{
+    DoUSBDeviceOp<USB_DK_CONFIG_DESCRIPTOR_REQUEST, USB_DK_CONFIG_DESCRIPTOR_RESULT>(Request, Queue, &CUsbDkControlDevice::GetConfigurationDescriptorEx);
+}
+
+CUsbDkDeviceInfoSnapshot *CUsbDkDeviceInfoSnapshot::Create(size_t MaxDevices, LONGLONG Generation)
+{
+    //Device entries are stored right after the object,
+    //followed by the classes of each device
+    auto Memory = ExAllocatePoolWithTag(USBDK_NON_PAGED_POOL,
+                                        sizeof(CUsbDkDeviceInfoSnapshot) + MaxDevices * (sizeof(USB_DK_DEVICE_INFO) + sizeof(ULONG)),
+                                        'SEHR');
+    if (Memory == nullptr)
+    {
+        return nullptr;
+    }
+
+    return new (Memory) CUsbDkDeviceInfoSnapshot(MaxDevices, Generation);
+}
+
+USB_DK_DEVICE_INFO *CUsbDkDeviceInfoSnapshot::Devices()
+{
+    return reinterpret_cast<USB_DK_DEVICE_INFO *>(this + 1);
+}
+
+PULONG CUsbDkDeviceInfoSnapshot::ClassesBitMasks()
+{
+    return reinterpret_cast<PULONG>(Devices() + m_MaxDevices);
+}
+
+void CUsbDkControlDevice::RebuildDeviceInfoSnapshot(LONGLONG Generation)
+{
+    CObjHolder<CUsbDkDeviceInfoSnapshot, CRefCountingDeleter> Snapshot;
+
+    for (;;)
+    {
+        size_t numberAllocatedDevices = CountChildren();
+        Snapshot.reset(CUsbDkDeviceInfoSnapshot::Create(numberAllocatedDevices, Generation));
+        if (!Snapshot)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate snapshot of %llu devices", static_cast<ULONG64>(numberAllocatedDevices));
+            break;
+        }
+
+        size_t numberExistingDevices;
+        if (EnumerateChildren(Snapshot->Devices(), numberAllocatedDevices, numberExistingDevices,
+                              Snapshot->ClassesBitMasks()))
+        {
+            Snapshot->SetCount(numberExistingDevices);
+            break;
+        }
+
+        //Device arrived after counting, try again
+    }
+
+    //Concurrent rebuilds may finish out of order, the newest one wins
+    {
+        CLockedContext<CWdmSpinLock> Ctx(m_DeviceInfoSnapshotLock);
+        if (Generation < m_DeviceInfoSnapshotGeneration)
+        {
+            return;
+        }
+
+        m_DeviceInfoSnapshotGeneration = Generation;
+        auto Current = m_DeviceInfoSnapshot.detach();
+        m_DeviceInfoSnapshot = Snapshot.detach();
+        Snapshot = Current;
+    }
+}
+
+CUsbDkDeviceInfoSnapshot *CUsbDkControlDevice::ReferenceDeviceInfoSnapshot()
+{
+    CLockedContext<CWdmSpinLock> Ctx(m_DeviceInfoSnapshotLock);
+    CUsbDkDeviceInfoSnapshot *Snapshot = m_DeviceInfoSnapshot;
+    if (Snapshot != nullptr)
+    {
+        Snapshot->AddRef();
+    }
+    return Snapshot;
+}
+
 ULONG CUsbDkControlDevice::CountDevices()
+{
+    CObjHolder<CUsbDkDeviceInfoSnapshot, CRefCountingDeleter> Snapshot(ReferenceDeviceInfoSnapshot());
+    if (Snapshot)
+    {
+        return static_cast<ULONG>(Snapshot->Count());
+    }
+
+    return CountChildren();
+}
+
+ULONG CUsbDkControlDevice::CountChildren()
 {
     ULONG numberDevices = 0;
 
@@ -288,23 +544,47 @@ void CUsbDkControlDevice::RegisterHiddenDevice(CUsbDkFilterDevice &FilterDevice)
     // information entry each time we redirect of hide a device.
     //
     // This function implements a simple but efficient mechanism
-    // for serial number generation for virtual UsbDk devices
+    // for serial number generation for virtual UsbDk devices:
+    // numbers in use are kept in a bitmap and the lowest clear
+    // bit is assigned, so numbers of unplugged devices are re-used first.
 
     CLockedContext<CWdmSpinLock> Ctx(m_HiddenDevicesLock);
 
-    bool NoSuchSN = false;
+    auto SN = m_HiddenSerialNumbers.Allocate();
+    if ((SN == THiddenSerialNumbers::NO_NUMBER) && m_HiddenSerialNumbers.Grow())
+    {
+        //Account for numbers assigned by the fallback
+        //scan below beyond the previous bitmap size
+        m_HiddenDevices.ForEach([this](CUsbDkFilterDevice *Filter)
+                                {
+                                    m_HiddenSerialNumbers.MarkUsed(Filter->GetSerialNumber());
+                                    return true;
+                                });
+
+        SN = m_HiddenSerialNumbers.Allocate();
+    }
 
-    for (ULONG MinSN = 0; !NoSuchSN; MinSN++)
+    if (SN == THiddenSerialNumbers::NO_NUMBER)
     {
-        NoSuchSN = m_HiddenDevices.ForEach([MinSN](CUsbDkFilterDevice *Filter)
-                   { return (Filter->GetSerialNumber() != MinSN); });
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to grow serial numbers bitmap of %lu",
+                    m_HiddenSerialNumbers.Size());
 
-        if (NoSuchSN)
+        //Bitmap is full and cannot grow, fall back to the list scan
+        bool NoSuchSN = false;
+
+        for (ULONG MinSN = m_HiddenSerialNumbers.Size(); !NoSuchSN; MinSN++)
         {
-            FilterDevice.SetSerialNumber(MinSN);
+            NoSuchSN = m_HiddenDevices.ForEach([MinSN](CUsbDkFilterDevice *Filter)
+                       { return (Filter->GetSerialNumber() != MinSN); });
+
+            if (NoSuchSN)
+            {
+                SN = MinSN;
+            }
         }
     }
 
+    FilterDevice.SetSerialNumber(SN);
     m_HiddenDevices.PushBack(&FilterDevice);
 }
 
@@ -312,52 +592,210 @@ void CUsbDkControlDevice::UnregisterHiddenDevice(CUsbDkFilterDevice &FilterDevic
 {
     CLockedContext<CWdmSpinLock> Ctx(m_HiddenDevicesLock);
     m_HiddenDevices.Remove(&FilterDevice);
+
+    m_HiddenSerialNumbers.Free(FilterDevice.GetSerialNumber());
 }
 
-bool CUsbDkControlDevice::ShouldHideDevice(CUsbDkChildDevice &Device) const
+CUsbDkHideRulesEngine *CUsbDkHideRulesEngine::Create(size_t MaxRules)
+{
+    auto Engine = new CUsbDkHideRulesEngine();
+    if (Engine == nullptr)
+    {
+        return nullptr;
+    }
+
+    if (!Engine->Reserve(MaxRules))
+    {
+        Engine->Release();
+        return nullptr;
+    }
+
+    return Engine;
+}
+
+bool CUsbDkHideRulesEngine::ShouldHide(const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask) const
+{
+    auto Hide = CUsbDkHideRulesLookup::ShouldHide(Descriptor, UsbClassesBitmask);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_FILTERDEVICE, "%!FUNC! %X:%X hide = %d",
+                Descriptor.idVendor, Descriptor.idProduct, Hide);
+    return Hide;
+}
+
+bool CUsbDkHideDecisionCache::Lookup(const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask, LONGLONG Generation, bool &Hide)
 {
-    const USB_DEVICE_DESCRIPTOR &DevDescriptor = Device.DeviceDescriptor();
-    auto Hide = false;
-    ULONG classes = Device.ClassesBitMask();
-    const auto &HideVisitor = [&DevDescriptor, &Hide](CUsbDkHideRule *Entry) -> bool
     {
-        Entry->Dump(TRACE_LEVEL_VERBOSE);
-        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_FILTERDEVICE,
-            "checking old hide rules %X:%X", DevDescriptor.idVendor, DevDescriptor.idProduct);
-        if (Entry->Match(DevDescriptor))
+        CLockedContext<CWdmSpinLock> Ctx(m_Lock);
+        const auto &Entry = m_Entries[Slot(Descriptor)];
+        if ((Entry.Generation == Generation) &&
+            (Entry.VID == Descriptor.idVendor) &&
+            (Entry.PID == Descriptor.idProduct) &&
+            (Entry.BCD == Descriptor.bcdDevice) &&
+            (Entry.Class == Descriptor.bDeviceClass) &&
+            (Entry.Classes == UsbClassesBitmask))
         {
-            Hide = Entry->ShouldHide();
-            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_FILTERDEVICE, "Match: hide = %d", Hide);
-            return !Entry->ForceDecision();
+            Hide = Entry.Hide;
+            m_Hits++;
+            return true;
         }
+    }
 
-        return true;
-    };
+    m_Misses++;
+    return false;
+}
+
+void CUsbDkHideDecisionCache::Store(const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask, LONGLONG Generation, bool Hide)
+{
+    CLockedContext<CWdmSpinLock> Ctx(m_Lock);
+    auto &Entry = m_Entries[Slot(Descriptor)];
+
+    //Do not let a late lookup of older rules evict a newer decision
+    if (Entry.Generation > Generation)
+    {
+        return;
+    }
+
+    Entry.Generation = Generation;
+    Entry.VID = Descriptor.idVendor;
+    Entry.PID = Descriptor.idProduct;
+    Entry.BCD = Descriptor.bcdDevice;
+    Entry.Class = Descriptor.bDeviceClass;
+    Entry.Classes = UsbClassesBitmask;
+    Entry.Hide = Hide;
+}
+
+void CUsbDkHideDecisionCache::DumpStatistics()
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Hide decisions cache hits: %llu, misses: %llu",
+                static_cast<ULONG64>(static_cast<LONGLONG>(m_Hits)), static_cast<ULONG64>(static_cast<LONGLONG>(m_Misses)));
+}
 
-    const auto &HideVisitorExt = [&DevDescriptor, &Hide, classes](CUsbDkHideRule *Entry) -> bool
+void CUsbDkControlDevice::CompileHideRules()
+{
+    auto Generation = ++m_HideRulesGeneration;
+    CObjHolder<CUsbDkHideRulesEngine, CRefCountingDeleter> Engine;
+
+    for (;;)
     {
-        Entry->Dump(TRACE_LEVEL_VERBOSE);
-        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_FILTERDEVICE,
-            "checking ext hide rules %X:%X", DevDescriptor.idVendor, DevDescriptor.idProduct);
-        if (Entry->Match(classes, DevDescriptor))
+        size_t NumRules = 0;
+        auto Counter = [&NumRules](CUsbDkHideRule *) { NumRules++; return true; };
+        m_HideRules.ForEach(Counter);
+        m_PersistentHideRules.ForEach(Counter);
+        m_ExtHideRules.ForEach(Counter);
+        m_PersistentExtHideRules.ForEach(Counter);
+
+        Engine.reset(CUsbDkHideRulesEngine::Create(NumRules));
+        if (!Engine)
         {
-            Hide = Entry->ShouldHide();
-            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_FILTERDEVICE, "Match: hide = %d", Hide);
-            return !Entry->ForceDecision();
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate engine for %llu rules", static_cast<ULONG64>(NumRules));
+            break;
         }
 
-        return true;
-    };
+        auto AddLayer = [&Engine](HideRulesSet &Set, CUsbDkHideRulesEngine::TLayer Layer)
+        { return Set.ForEach([&Engine, Layer](CUsbDkHideRule *Rule) { return Engine->Add(Layer, *Rule); }); };
+
+        if (AddLayer(m_HideRules, CUsbDkHideRulesEngine::LAYER_DEFAULT) &&
+            AddLayer(m_PersistentHideRules, CUsbDkHideRulesEngine::LAYER_PERSISTENT) &&
+            AddLayer(m_ExtHideRules, CUsbDkHideRulesEngine::LAYER_EXT) &&
+            AddLayer(m_PersistentExtHideRules, CUsbDkHideRulesEngine::LAYER_PERSISTENT_EXT))
+        {
+            break;
+        }
+
+        //Rule added after counting, try again
+    }
+
+    //Concurrent rebuilds may finish out of order, the newest one wins
+    {
+        CLockedContext<CWdmSpinLock> Ctx(m_HideRulesEngineLock);
+        if (Generation < m_HideRulesEngineGeneration)
+        {
+            return;
+        }
+
+        m_HideRulesEngineGeneration = Generation;
+        auto Current = m_HideRulesEngine.detach();
+        m_HideRulesEngine = Engine.detach();
+        Engine = Current;
+    }
+
+    //Cached decisions are dropped implicitly by the generation change
+    m_HideDecisions.DumpStatistics();
+}
+
+CUsbDkHideRulesEngine *CUsbDkControlDevice::ReferenceHideRulesEngine(LONGLONG &Generation) const
+{
+    CLockedContext<CWdmSpinLock> Ctx(m_HideRulesEngineLock);
+    Generation = m_HideRulesEngineGeneration;
+    CUsbDkHideRulesEngine *Engine = m_HideRulesEngine;
+    if (Engine != nullptr)
+    {
+        Engine->AddRef();
+    }
+    return Engine;
+}
+
+bool CUsbDkControlDevice::ShouldHideDevice(CUsbDkChildDevice &Device) const
+{
+    LONGLONG Generation;
+    CObjHolder<CUsbDkHideRulesEngine, CRefCountingDeleter> Engine(ReferenceHideRulesEngine(Generation));
+    if (Engine)
+    {
+        const auto &Descriptor = Device.DeviceDescriptor();
+        auto Classes = Device.ClassesBitMask();
+
+        bool Hide;
+        if (!m_HideDecisions.Lookup(Descriptor, Classes, Generation, Hide))
+        {
+            Hide = Engine->ShouldHide(Descriptor, Classes);
+            m_HideDecisions.Store(Descriptor, Classes, Generation, Hide);
+        }
+        return Hide;
+    }
+
+    return ShouldHideDeviceByRuleSets(Device);
+}
 
-    const_cast<HideRulesSet*>(&m_HideRules)->ForEach(HideVisitor);
-    const_cast<HideRulesSet*>(&m_PersistentHideRules)->ForEach(HideVisitor);
+//Hide rule sets of the control device by layer, for UsbDkShouldHideByRuleSets()
+template <typename TSet>
+class CHideRuleSetsByLayer
+{
+public:
+    CHideRuleSetsByLayer(TSet &Default, TSet &Persistent, TSet &Ext, TSet &PersistentExt)
+    {
+        m_Sets[CUsbDkHideRulesLayers::LAYER_DEFAULT] = &Default;
+        m_Sets[CUsbDkHideRulesLayers::LAYER_PERSISTENT] = &Persistent;
+        m_Sets[CUsbDkHideRulesLayers::LAYER_EXT] = &Ext;
+        m_Sets[CUsbDkHideRulesLayers::LAYER_PERSISTENT_EXT] = &PersistentExt;
+    }
 
-    if (!Hide)
+    template <typename TFunctor>
+    bool ForEach(CUsbDkHideRulesLayers::TLayer Layer, TFunctor Functor)
     {
-        const_cast<HideRulesSet*>(&m_ExtHideRules)->ForEach(HideVisitorExt);
-        const_cast<HideRulesSet*>(&m_PersistentExtHideRules)->ForEach(HideVisitorExt);
+        return m_Sets[Layer]->ForEach([&Functor](CUsbDkHideRule *Rule)
+                                      {
+                                          Rule->Dump(TRACE_LEVEL_VERBOSE);
+                                          return Functor(*Rule);
+                                      });
     }
 
+private:
+    TSet *m_Sets[CUsbDkHideRulesLayers::NUM_LAYERS];
+};
+
+bool CUsbDkControlDevice::ShouldHideDeviceByRuleSets(CUsbDkChildDevice &Device) const
+{
+    const USB_DEVICE_DESCRIPTOR &DevDescriptor = Device.DeviceDescriptor();
+
+    CHideRuleSetsByLayer<HideRulesSet> Sets(*const_cast<HideRulesSet*>(&m_HideRules),
+                                            *const_cast<HideRulesSet*>(&m_PersistentHideRules),
+                                            *const_cast<HideRulesSet*>(&m_ExtHideRules),
+                                            *const_cast<HideRulesSet*>(&m_PersistentExtHideRules));
+
+    auto Hide = UsbDkShouldHideByRuleSets(Sets, DevDescriptor, Device.ClassesBitMask());
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_FILTERDEVICE, "%!FUNC! %X:%X hide = %d",
+                DevDescriptor.idVendor, DevDescriptor.idProduct, Hide);
     return Hide;
 }
 
@@ -385,11 +823,9 @@ bool CUsbDkControlDevice::ShouldHide(const USB_DK_DEVICE_ID &DevId)
 /* for the first time. The error should be benign, as we double check for a driver before */
 /* doing anything that assumes this is a RawFiltered device, and the error will be corrected */
 /* the second time the device is plugged in. */
-bool CUsbDkControlDevice::ShouldRawFiltDevice(CUsbDkChildDevice &Device, bool Is2ndCall)
+bool CUsbDkControlDevice::GetRawFiltIdent(const CUsbDkChildDevice &Device, ULONG &VidPid, ULONG &PortHub)
 {
-    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Checking against %S, %S Is2ndCall %d",Device.DeviceID(), Device.LocationID(), Is2ndCall);
-
-    ULONG VidPid, PortHub;
+    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Checking against %S, %S",Device.DeviceID(), Device.LocationID());
 
     /* Format is "USB\VID_XXXX&PID_XXXX" */
     auto status = EightHexToInteger(Device.DeviceID(), 8, 17, &VidPid);
@@ -409,79 +845,85 @@ bool CUsbDkControlDevice::ShouldRawFiltDevice(CUsbDkChildDevice &Device, bool Is
         return false;
     }
             
-    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
         "%!FUNC! ChildDevice Ident = 0x%08x 0x%08x'",VidPid, PortHub);
+    return true;
+}
 
-    /* Make sure that the "has a function driver" Set is initialized */
-    if (!m_FDriverInited)
+bool CUsbDkControlDevice::ShouldRawFiltDevice(CUsbDkChildDevice &Device, bool Is2ndCall)
+{
+    ULONG VidPid, PortHub;
+    if (!GetRawFiltIdent(Device, VidPid, PortHub))
     {
-        ReloadHasDriverList();
+        return false;
     }
 
-    /* See if this Device has an entry in the Set */
-    CUsbDkFDriverRule *Entry = nullptr;
-    bool hasentry = false;
-    bool hasfdriv = true;        /* default to not adding RawFilter */
-    const auto &FiltVisitor = [VidPid, PortHub, &Entry, &hasentry, &hasfdriv, this](CUsbDkFDriverRule *e) -> bool
+    CObjHolder<CUsbDkFDriverRule, CRefCountingDeleter> ReinstallEntry;
+    auto Result = ShouldRawFiltIdent(VidPid, PortHub, Is2ndCall, ReinstallEntry);
+    if (ReinstallEntry)
     {
-        if (e->Match(VidPid, PortHub))
-        {
-            Entry = e;
-
-            /* Check if there is a Driver value */
-            CRegKey regkey;
-            
-            auto status = regkey.Open(*e->KeyName());
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                    "%!FUNC! Failed to open Key '%wZ' registry key",e->KeyName());
-                hasentry = false;            /* Do ReloadHasDriverList() */
-                return false;                /* Terminate ForEach() */
-            }
+        SetRawDeviceToReinstall(Device, *ReinstallEntry);
+    }
+    return Result;
+}
+
+void CUsbDkControlDevice::SetRawDeviceToReinstall(CUsbDkChildDevice &Device, CUsbDkFDriverRule &Entry)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                "%!FUNC! Setting m_SetReinstall flag on Key '%wZ'",Entry.KeyName());
+    auto status = Device.SetRawDeviceToReinstall(Entry.KeyName());
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+            "%!FUNC! Failed to SetRawDeviceToReinstall (status %!STATUS!)",status);
+    }
+}
 
-            hasentry = true;            /* Don't ReloadHasDriverList() */
+bool CUsbDkControlDevice::ShouldRawFiltIdent(ULONG VidPid, ULONG PortHub, bool Is2ndCall,
+                                             CObjHolder<CUsbDkFDriverRule, CRefCountingDeleter> &ReinstallEntry)
+{
+    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Is2ndCall %d", Is2ndCall);
 
-            CStringHolder DriverNameHolder;
-            status = DriverNameHolder.Attach(TEXT("Driver"));
-            ASSERT(NT_SUCCESS(status));
+    /* Make sure that the "has a function driver" index is initialized and up to date */
+    UpdateHasDriverList();
 
-            CWdmMemoryBuffer Buffer;
-            status = regkey.QueryValueInfo(*DriverNameHolder, KeyValuePartialInformation, Buffer);
-            if (!NT_SUCCESS(status))
+    /* See if this Device has an entry in the Set */
+    CObjHolder<CUsbDkFDriverRule, CRefCountingDeleter> Entry;
+    bool hasentry = false;
+    bool hasfdriv = true;        /* default to not adding RawFilter */
+    const auto &CheckEntry = [VidPid, PortHub, &Entry, &hasentry, &hasfdriv, this]()
+    {
+        Entry.reset(m_FDriversRules.Reference(VidPid, PortHub));
+        if (Entry)
+        {
+            /* Registry is accessed with no index lock held */
+            hasentry = RuleHasDriver(*Entry, hasfdriv);
+            if (!hasentry)
             {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                    "%!FUNC! Failed to read value '%wZ' (status %!STATUS!)", DriverNameHolder, status);
-                hasfdriv = false;
-            } else {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                    "%!FUNC! Was able to read value '%wZ' (status %!STATUS!)", DriverNameHolder, status);
-                hasfdriv = true;
+                hasfdriv = true;     /* Key is gone, re-read the VID/PID key */
             }
-            return false;            /* Terminate ForEach() */
         }
-        return true;            /* Continue ForEach() */
     };
-    const_cast<FDriverRulesSet*>(&m_FDriversRules)->ForEach(FiltVisitor);
+    CheckEntry();
 
-    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
         "%!FUNC! Check FDriverRulesSet returned hasentry %d, hasfdriv %d",hasentry, hasfdriv);
 
     /* If there's no Set entry, then try and create one and check again. */
     if (!hasentry) {
 
-        if (!Is2ndCall)          /* Try re-creating the list */
+        if (!Is2ndCall)          /* Try re-reading this VID/PID key */
         {
-            ReloadHasDriverList();
+            UpdateHasDriverList(VidPid);
     
             /* Check again */
             hasentry = false;
             hasfdriv = true;       /* default to not adding RawFilter. */
 
-            const_cast<FDriverRulesSet*>(&m_FDriversRules)->ForEach(FiltVisitor);
+            CheckEntry();
         }
 
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
             "%!FUNC! Check 2 FDriverRulesSet got Set count %d, hasentry %d, hasfdriv %d",
                                           m_FDriversRules.GetCount(),hasentry, hasfdriv);
 
@@ -510,43 +952,77 @@ bool CUsbDkControlDevice::ShouldRawFiltDevice(CUsbDkChildDevice &Device, bool Is
     /* using Device Manager to make it work with its new Function Driver as well as UsbDk. We can */
     /* avoid this problem if we set CONFIGFLAG_REINSTALL in the Enum/USB ConfigFlags, so */
     /* that PnP checks for a Function Driver on a Raw device each time it is plugged in. */
-    if (Is2ndCall && Entry != nullptr && hasentry && !hasfdriv)
+    if (Is2ndCall && Entry && hasentry && !hasfdriv)
     {
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                    "%!FUNC! Setting m_SetReinstall flag on Key '%wZ'",Entry->KeyName());
-        status = Device.SetRawDeviceToReinstall(Entry->KeyName());
-        if (!NT_SUCCESS(status))
-        {
-            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                "%!FUNC! Failed to SetRawDeviceToReinstall (status %!STATUS!)",status);
-        }
+        ReinstallEntry.reset(Entry.detach());
     }
     return !hasfdriv;        /* Add RawFilter if there is no function driver */
 }
 
 bool CUsbDkControlDevice::ShouldRawFilt(const USB_DK_DEVICE_ID &DevId)
 {
-    bool b = false;
+    ULONG VidPid, PortHub;
+    bool found = false;
 
     TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-        "%!FUNC! About to call ShouldRawFiltDevice()");
+        "%!FUNC! About to call ShouldRawFiltIdent()");
 
+    //Only the identity is taken under the index lock, the rules
+    //check below waits for the Enum\USB scan and reads registry
     EnumUsbDevicesByID(DevId,
-        [&b, this](CUsbDkChildDevice *Child) -> bool
+        [&found, &VidPid, &PortHub](CUsbDkChildDevice *Child) -> bool
     {
-        b = ShouldRawFiltDevice(*Child, true);
+        found = GetRawFiltIdent(*Child, VidPid, PortHub);
         return false;
     });
 
+    if (!found)
+    {
+        return false;
+    }
+
+    CObjHolder<CUsbDkFDriverRule, CRefCountingDeleter> ReinstallEntry;
+    auto b = ShouldRawFiltIdent(VidPid, PortHub, true, ReinstallEntry);
+    if (ReinstallEntry)
+    {
+        EnumUsbDevicesByID(DevId,
+            [&ReinstallEntry](CUsbDkChildDevice *Child) -> bool
+        {
+            SetRawDeviceToReinstall(*Child, *ReinstallEntry);
+            return false;
+        });
+    }
+
     return b;
 }
 
 bool CUsbDkControlDevice::EnumerateDevices(USB_DK_DEVICE_INFO *outBuff, size_t numberAllocatedDevices, size_t &numberExistingDevices)
+{
+    CObjHolder<CUsbDkDeviceInfoSnapshot, CRefCountingDeleter> Snapshot(ReferenceDeviceInfoSnapshot());
+    if (!Snapshot)
+    {
+        return EnumerateChildren(outBuff, numberAllocatedDevices, numberExistingDevices);
+    }
+
+    numberExistingDevices = Snapshot->Count();
+    if (numberExistingDevices > numberAllocatedDevices)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! FAILED! Number existing devices is more than allocated buffer!");
+        numberExistingDevices = 0;
+        return false;
+    }
+
+    RtlCopyMemory(outBuff, Snapshot->Devices(), numberExistingDevices * sizeof(USB_DK_DEVICE_INFO));
+    return true;
+}
+
+bool CUsbDkControlDevice::EnumerateChildren(USB_DK_DEVICE_INFO *outBuff, size_t numberAllocatedDevices, size_t &numberExistingDevices,
+                                            PULONG ClassesBitMasks)
 {
     numberExistingDevices = 0;
 
     return UsbDevicesForEachIf(ConstTrue,
-                               [&outBuff, numberAllocatedDevices, &numberExistingDevices](CUsbDkChildDevice *Child) -> bool
+                               [&outBuff, numberAllocatedDevices, &numberExistingDevices, &ClassesBitMasks](CUsbDkChildDevice *Child) -> bool
                                {
                                    if (numberExistingDevices == numberAllocatedDevices)
                                    {
@@ -561,12 +1037,325 @@ bool CUsbDkControlDevice::EnumerateDevices(USB_DK_DEVICE_INFO *outBuff, size_t n
                                    outBuff->Speed = Child->Speed();
                                    outBuff->DeviceDescriptor = Child->DeviceDescriptor();
 
+                                   if (ClassesBitMasks != nullptr)
+                                   {
+                                       *ClassesBitMasks++ = Child->ClassesBitMask();
+                                   }
+
                                    outBuff++;
                                    numberExistingDevices++;
                                    return true;
                                });
 }
 
+//Port reset of device being redirected, done by system worker thread
+class CUsbDkRedirectReset : public CAllocatable<USBDK_NON_PAGED_POOL, 'RRHR'>
+{
+public:
+    USB_DK_DEVICE_ID DeviceId;
+    WDFREQUEST Request = WDF_NO_HANDLE;
+    PIO_WORKITEM WorkItem = nullptr;
+};
+
+//String table of compact enumeration output.
+//Identical strings are stored once, duplicates are looked up
+//via open addressing hash index of offsets into the table.
+//When the table runs out of space it keeps counting the length
+//required, without deduplication, which gives an upper bound.
+class CEnumStringTable
+{
+public:
+    CEnumStringTable(PUCHAR Buffer, size_t Capacity)
+        : m_Buffer(Buffer)
+        , m_Capacity(Capacity)
+    {}
+
+    void CreateIndex(size_t MaxStrings)
+    {
+        m_IndexSize = 1;
+        while (m_IndexSize < 2 * MaxStrings)
+        {
+            m_IndexSize <<= 1;
+        }
+
+        m_Index = TIndexAllocator::allocate(m_IndexSize);
+        if (m_Index)
+        {
+            RtlZeroMemory(m_Index, m_IndexSize * sizeof(ULONG));
+        }
+    }
+
+    ULONG Add(PCWCHAR String)
+    {
+        auto StringLength = (wcslen(String) + 1) * sizeof(WCHAR);
+
+        //Index is kept at most half full so probing always terminates
+        if (!m_Overflow && m_Index && (2 * m_IndexUsed < m_IndexSize))
+        {
+            auto Slot = UsbDkStringHash(String) & (m_IndexSize - 1);
+            for (; m_Index[Slot] != 0; Slot = (Slot + 1) & (m_IndexSize - 1))
+            {
+                auto Offset = m_Index[Slot] - 1;
+                if (!wcscmp(reinterpret_cast<PCWCHAR>(m_Buffer + Offset), String))
+                {
+                    return Offset;
+                }
+            }
+
+            if (m_Length + StringLength <= m_Capacity)
+            {
+                m_Index[Slot] = static_cast<ULONG>(m_Length + 1);
+                m_IndexUsed++;
+            }
+        }
+
+        auto Offset = static_cast<ULONG>(m_Length);
+
+        m_Overflow = m_Overflow || (m_Length + StringLength > m_Capacity);
+        if (!m_Overflow)
+        {
+            RtlCopyMemory(m_Buffer + m_Length, String, StringLength);
+        }
+
+        m_Length += StringLength;
+        return Offset;
+    }
+
+    size_t Length() const
+    { return m_Length; }
+
+    bool Overflow() const
+    { return m_Overflow; }
+
+private:
+    PUCHAR m_Buffer;
+    size_t m_Capacity;
+    size_t m_Length = 0;
+    bool m_Overflow = false;
+
+    using TIndexAllocator = CPrimitiveAllocator<USBDK_NON_PAGED_POOL, ULONG, 'TSHR'>;
+    CObjHolder<ULONG, TIndexAllocator> m_Index;
+    size_t m_IndexSize = 0;
+    size_t m_IndexUsed = 0;
+};
+
+static ULONG MatchAllMapper(ULONG64 Value)
+{
+    return Value == USB_DK_HIDE_RULE_MATCH_ALL ? USBDK_REG_HIDE_RULE_MATCH_ALL
+                                               : static_cast<ULONG>(Value);
+}
+
+NTSTATUS CUsbDkControlDevice::EnumerateDevicesCompact(USB_DK_COMPACT_ENUM_HEADER &Header,
+                                                      size_t OutputLength,
+                                                      size_t &BytesWritten,
+                                                      const USB_DK_DEVICE_FILTER *Filter)
+{
+    auto OutputBase = reinterpret_cast<PUCHAR>(&Header);
+
+    //Filter is matched the same way as determinative type hide rules,
+    //no filter is a rule that matches all devices
+    auto ClassMask = Filter ? MatchAllMapper(Filter->Class) : USBDK_REG_HIDE_RULE_MATCH_ALL;
+    CUsbDkHideRule FilterRule(false,
+                              ClassMask,
+                              Filter ? MatchAllMapper(Filter->VID) : USBDK_REG_HIDE_RULE_MATCH_ALL,
+                              Filter ? MatchAllMapper(Filter->PID) : USBDK_REG_HIDE_RULE_MATCH_ALL,
+                              Filter ? MatchAllMapper(Filter->BCD) : USBDK_REG_HIDE_RULE_MATCH_ALL);
+    auto FilterID = Filter ? Filter->FilterID : USB_DK_DEVICE_FILTER_MATCH_ALL;
+
+    auto Matches = [&FilterRule, ClassMask, FilterID](ULONG ClassesBitMask, const USB_DEVICE_DESCRIPTOR &Descriptor,
+                                                      ULONG64 ParentID) -> bool
+                   {
+                       //Devices with empty classes mask must match the "all classes" filter as well
+                       auto Classes = (ClassMask == USBDK_REG_HIDE_RULE_MATCH_ALL) ? USBDK_REG_HIDE_RULE_MATCH_ALL
+                                                                                    : ClassesBitMask;
+
+                       return FilterRule.Match(Classes, Descriptor) &&
+                              ((FilterID == USB_DK_DEVICE_FILTER_MATCH_ALL) || (FilterID == ParentID));
+                   };
+
+    //Served from the enumeration snapshot when there is one,
+    //so the list and its generation always belong together
+    CObjHolder<CUsbDkDeviceInfoSnapshot, CRefCountingDeleter> Snapshot(ReferenceDeviceInfoSnapshot());
+
+    //Records table is sized by the current number of devices,
+    //string table is placed right after it
+    size_t NumAllocatedDevices = Snapshot ? Snapshot->Count() : CountChildren();
+    auto Devices = reinterpret_cast<PUSB_DK_COMPACT_DEVICE_INFO>(OutputBase + sizeof(Header));
+    auto StringsOffset = sizeof(Header) + NumAllocatedDevices * sizeof(USB_DK_COMPACT_DEVICE_INFO);
+    auto RecordsFit = (StringsOffset <= OutputLength);
+    size_t NumDevices = 0;
+
+    Header.Version = USB_DK_COMPACT_ENUM_VERSION;
+    Header.Generation = m_EnumGeneration;
+    if (Snapshot)
+    {
+        Header.Generation = Snapshot->Generation();
+    }
+    Header.DevicesOffset = sizeof(Header);
+    Header.DeviceRecordSize = sizeof(USB_DK_COMPACT_DEVICE_INFO);
+    Header.Reserved = 0;
+
+    CEnumStringTable Strings(OutputBase + StringsOffset,
+                             (StringsOffset < OutputLength) ? OutputLength - StringsOffset : 0);
+    Strings.CreateIndex(2 * NumAllocatedDevices);
+
+    auto AddDevice = [&](PCWCHAR DeviceID, PCWCHAR InstanceID, ULONG64 ParentID, ULONG64 Port, ULONG64 Speed,
+                         const USB_DEVICE_DESCRIPTOR &Descriptor)
+                     {
+                         auto DeviceIDOffset = Strings.Add(DeviceID);
+                         auto InstanceIDOffset = Strings.Add(InstanceID);
+
+                         if (RecordsFit && (NumDevices < NumAllocatedDevices))
+                         {
+                             auto &Device = Devices[NumDevices];
+
+                             Device.DeviceIDOffset = DeviceIDOffset;
+                             Device.InstanceIDOffset = InstanceIDOffset;
+                             Device.FilterID = static_cast<ULONG>(ParentID);
+                             Device.Port = static_cast<ULONG>(Port);
+                             Device.Speed = static_cast<ULONG>(Speed);
+                             Device.DeviceDescriptor = Descriptor;
+                         }
+
+                         NumDevices++;
+                     };
+
+    if (Snapshot)
+    {
+        auto Infos = Snapshot->Devices();
+        auto ClassesBitMasks = Snapshot->ClassesBitMasks();
+
+        for (size_t i = 0; i < Snapshot->Count(); i++)
+        {
+            if (Matches(ClassesBitMasks[i], Infos[i].DeviceDescriptor, Infos[i].FilterID))
+            {
+                AddDevice(Infos[i].ID.DeviceID, Infos[i].ID.InstanceID,
+                          Infos[i].FilterID, Infos[i].Port, Infos[i].Speed, Infos[i].DeviceDescriptor);
+            }
+        }
+    }
+    else
+    {
+        UsbDevicesForEachIf([&Matches](CUsbDkChildDevice *Child) -> bool
+                            { return Matches(Child->ClassesBitMask(), Child->DeviceDescriptor(), Child->ParentID()); },
+                            [&AddDevice](CUsbDkChildDevice *Child) -> bool
+                            {
+                                AddDevice(Child->DeviceID(), Child->InstanceID(),
+                                          Child->ParentID(), Child->Port(), Child->Speed(), Child->DeviceDescriptor());
+                                return true;
+                            });
+    }
+
+    if (!RecordsFit || Strings.Overflow() || (NumDevices > NumAllocatedDevices))
+    {
+        Header.Length = static_cast<ULONG>(sizeof(Header) +
+                                           max(NumDevices, NumAllocatedDevices) * sizeof(USB_DK_COMPACT_DEVICE_INFO) +
+                                           Strings.Length());
+        Header.NumDevices = 0;
+        Header.StringsOffset = 0;
+        Header.StringsLength = 0;
+        BytesWritten = sizeof(Header);
+
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE, "%!FUNC! Buffer too short, %lu bytes required", Header.Length);
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    Header.NumDevices = static_cast<ULONG>(NumDevices);
+    Header.StringsOffset = static_cast<ULONG>(StringsOffset);
+    Header.StringsLength = static_cast<ULONG>(Strings.Length());
+    Header.Length = static_cast<ULONG>(StringsOffset + Strings.Length());
+    BytesWritten = Header.Length;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CUsbDkControlDevice::GetDescriptorsSnapshot(USB_DK_DESCRIPTORS_SNAPSHOT &Snapshot,
+                                                     size_t SnapshotLength,
+                                                     size_t &BytesWritten)
+{
+    auto SnapshotBase = reinterpret_cast<PUCHAR>(&Snapshot);
+
+    Snapshot.Generation = m_EnumGeneration;
+    Snapshot.DevicesOffset = sizeof(Snapshot);
+
+    //Devices table is sized by the current number of devices,
+    //variable length data is placed right after it
+    size_t NumAllocatedDevices = CountChildren();
+    auto Devices = reinterpret_cast<PUSB_DK_SNAPSHOT_DEVICE>(SnapshotBase + Snapshot.DevicesOffset);
+    auto DataStart = sizeof(Snapshot) + NumAllocatedDevices * sizeof(USB_DK_SNAPSHOT_DEVICE);
+    size_t DataLength = 0;
+    size_t NumDevices = 0;
+    auto Fits = (DataStart <= SnapshotLength);
+
+    UsbDevicesForEachIf(ConstTrue,
+                        [&](CUsbDkChildDevice *Child) -> bool
+                        {
+                            auto NumConfigs = Child->DeviceDescriptor().bNumConfigurations;
+
+                            size_t ChildDataLength = ALIGN_UP_BY(NumConfigs * sizeof(USB_DK_SNAPSHOT_CONFIG), sizeof(ULONG64));
+                            for (UCHAR i = 0; i < NumConfigs; i++)
+                            {
+                                size_t Length = 0;
+                                Child->ConfigurationDescriptorLength(i, Length);
+                                ChildDataLength += ALIGN_UP_BY(Length, sizeof(ULONG64));
+                            }
+
+                            auto ChildDataOffset = DataStart + DataLength;
+
+                            //Device appeared after counting or no room left,
+                            //keep walking to report the length required
+                            Fits = Fits &&
+                                   (NumDevices < NumAllocatedDevices) &&
+                                   (ChildDataOffset + ChildDataLength <= SnapshotLength);
+
+                            if (Fits)
+                            {
+                                auto &Device = Devices[NumDevices];
+
+                                UsbDkFillIDStruct(&Device.Info.ID, Child->DeviceID(), Child->InstanceID());
+                                Device.Info.FilterID = Child->ParentID();
+                                Device.Info.Port = Child->Port();
+                                Device.Info.Speed = Child->Speed();
+                                Device.Info.DeviceDescriptor = Child->DeviceDescriptor();
+                                Device.NumConfigurations = NumConfigs;
+                                Device.ConfigsOffset = ChildDataOffset;
+
+                                auto Configs = reinterpret_cast<PUSB_DK_SNAPSHOT_CONFIG>(SnapshotBase + ChildDataOffset);
+                                auto ConfigOffset = ChildDataOffset + ALIGN_UP_BY(NumConfigs * sizeof(USB_DK_SNAPSHOT_CONFIG), sizeof(ULONG64));
+                                for (UCHAR i = 0; i < NumConfigs; i++)
+                                {
+                                    size_t Length = 0;
+                                    Child->ConfigurationDescriptorLength(i, Length);
+                                    Child->ConfigurationDescriptor(i, *reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(SnapshotBase + ConfigOffset), Length);
+
+                                    Configs[i].Offset = ConfigOffset;
+                                    Configs[i].Length = Length;
+                                    ConfigOffset += ALIGN_UP_BY(Length, sizeof(ULONG64));
+                                }
+                            }
+
+                            DataLength += ChildDataLength;
+                            NumDevices++;
+                            return true;
+                        });
+
+    if (!Fits)
+    {
+        Snapshot.Length = sizeof(Snapshot) +
+                          max(NumDevices, NumAllocatedDevices) * sizeof(USB_DK_SNAPSHOT_DEVICE) +
+                          DataLength;
+        Snapshot.NumDevices = 0;
+        BytesWritten = sizeof(Snapshot);
+
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE, "%!FUNC! Buffer too short, %llu bytes required", Snapshot.Length);
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    Snapshot.Length = DataStart + DataLength;
+    Snapshot.NumDevices = NumDevices;
+    BytesWritten = static_cast<size_t>(Snapshot.Length);
+    return STATUS_SUCCESS;
+}
+
 // EnumUsbDevicesByID runs over the list of USB devices looking for device by ID.
 // For each device with matching ID Functor() is called.
 // If Functor() returns false EnumUsbDevicesByID() interrupts the loop and exits immediately.
@@ -578,7 +1367,9 @@ bool CUsbDkControlDevice::EnumerateDevices(USB_DK_DEVICE_INFO *outBuff, size_t n
 template <typename TFunctor>
 bool CUsbDkControlDevice::EnumUsbDevicesByID(const USB_DK_DEVICE_ID &ID, TFunctor Functor)
 {
-    return UsbDevicesForEachIf([&ID](CUsbDkChildDevice *c) { return c->Match(ID.DeviceID, ID.InstanceID); }, Functor);
+    return m_ChildrenByID.ForEachIf(CUsbDkChildDevice::IDHash(ID.DeviceID, ID.InstanceID),
+                                    [&ID](CUsbDkChildDevice *c) { return c->Match(ID.DeviceID, ID.InstanceID); },
+                                    Functor);
 }
 
 bool CUsbDkControlDevice::UsbDeviceExists(const USB_DK_DEVICE_ID &ID)
@@ -647,7 +1438,9 @@ CUsbDkChildDevice *CUsbDkControlDevice::GetChildByDeviceID(const USB_DK_DEVICE_I
 template <typename TFunctor>
 bool CUsbDkControlDevice::EnumUsbDevicesByPDO(const PDEVICE_OBJECT PDO, TFunctor Functor)
 {
-    return UsbDevicesForEachIf([PDO](CUsbDkChildDevice *c) { return c->PDO() == PDO; }, Functor);
+    return m_ChildrenByPDO.ForEachIf(CUsbDkChildDevice::PDOHash(PDO),
+                                     [PDO](CUsbDkChildDevice *c) { return c->Match(PDO); },
+                                     Functor);
 }
 
 CUsbDkChildDevice *CUsbDkControlDevice::GetChildByPDO(const PDEVICE_OBJECT PDO)
@@ -983,16 +1776,150 @@ NTSTATUS CUsbDkControlDevice::Register()
         return status;
     }
 
+    //Serial queue must exist before the default one starts forwarding to it
+    status = m_SerialQueue.Create(*this);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
     status = m_DeviceQueue.Create(*this);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = CreatePendingRedirectsHandlers();
     if (NT_SUCCESS(status))
     {
         FinishInitializing();
+        ReloadRedirectionParameters();
         ReloadPersistentHideRules();
     }
 
     return status;
 }
 
+NTSTATUS CUsbDkControlDevice::CreatePendingRedirectsHandlers()
+{
+    auto status = m_PendingRedirectsQueue.Create(*this);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    WDF_OBJECT_ATTRIBUTES Attributes;
+    WDF_OBJECT_ATTRIBUTES_INIT(&Attributes);
+    Attributes.ParentObject = m_Device;
+
+    WDF_WORKITEM_CONFIG WorkItemConfig;
+    WDF_WORKITEM_CONFIG_INIT(&WorkItemConfig, PendingRedirectsWorkItem);
+
+    status = WdfWorkItemCreate(&WorkItemConfig, &Attributes, &m_PendingRedirectsWorkItem);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! WdfWorkItemCreate failed. %!STATUS!", status);
+        return status;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&WorkItemConfig, ParkedRedirectsWorkItem);
+
+    status = WdfWorkItemCreate(&WorkItemConfig, &Attributes, &m_ParkedRedirectsWorkItem);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! WdfWorkItemCreate failed. %!STATUS!", status);
+        return status;
+    }
+
+    WDF_TIMER_CONFIG TimerConfig;
+    WDF_TIMER_CONFIG_INIT(&TimerConfig, PendingRedirectsTimer);
+
+    status = WdfTimerCreate(&TimerConfig, &Attributes, &m_PendingRedirectsTimer);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! WdfTimerCreate failed. %!STATUS!", status);
+    }
+
+    return status;
+}
+
+void CUsbDkControlDevice::PendingRedirectsWorkItem(WDFWORKITEM WorkItem)
+{
+    auto devExt = UsbDkControlGetContext(WdfWorkItemGetParentObject(WorkItem));
+    devExt->UsbDkControl->ProcessPendingRedirects();
+}
+
+void CUsbDkControlDevice::ParkedRedirectsWorkItem(WDFWORKITEM WorkItem)
+{
+    auto devExt = UsbDkControlGetContext(WdfWorkItemGetParentObject(WorkItem));
+    devExt->UsbDkControl->ProcessParkedRedirections();
+}
+
+void CUsbDkControlDevice::PendingRedirectsTimer(WDFTIMER Timer)
+{
+    auto devExt = UsbDkControlGetContext(WdfTimerGetParentObject(Timer));
+    WdfWorkItemEnqueue(devExt->UsbDkControl->m_PendingRedirectsWorkItem);
+    WdfWorkItemEnqueue(devExt->UsbDkControl->m_ParkedRedirectsWorkItem);
+}
+
+void CUsbDkControlDevice::ProcessPendingRedirects()
+{
+    WDFREQUEST Previous = WDF_NO_HANDLE;
+    bool WaitingLeft = false;
+
+    for (;;)
+    {
+        WDFREQUEST Found;
+        auto status = WdfIoQueueFindRequest(m_PendingRedirectsQueue, Previous, WDF_NO_HANDLE, nullptr, &Found);
+
+        auto Rescan = (status == STATUS_NOT_FOUND) && (Previous != WDF_NO_HANDLE);
+        if (Previous != WDF_NO_HANDLE)
+        {
+            WdfObjectDereference(Previous);
+            Previous = WDF_NO_HANDLE;
+        }
+
+        if (Rescan)
+        {
+            //Previous request left the queue meanwhile, start over
+            continue;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        auto Context = UsbDkControlRequestGetContext(Found);
+        auto ResetStatus = Context->ResetStatus;
+        auto Attached = Context->Redirection->IsRedirected();
+        auto Expired = KeQueryInterruptTime() >= Context->Deadline;
+
+        if (!Attached && !Expired && NT_SUCCESS(ResetStatus))
+        {
+            WaitingLeft = true;
+            Previous = Found;
+            continue;
+        }
+
+        WDFREQUEST Request;
+        status = WdfIoQueueRetrieveFoundRequest(m_PendingRedirectsQueue, Found, &Request);
+        WdfObjectDereference(Found);
+
+        if (NT_SUCCESS(status))
+        {
+            CControlRequest WdfRequest(Request);
+            CompleteRedirect(WdfRequest, !NT_SUCCESS(ResetStatus) ? ResetStatus :
+                                         Attached ? STATUS_SUCCESS : STATUS_DEVICE_NOT_CONNECTED);
+        }
+    }
+
+    if (WaitingLeft)
+    {
+        WdfTimerStart(m_PendingRedirectsTimer, WDF_REL_TIMEOUT_IN_SEC(1));
+    }
+}
+
 void CUsbDkControlDevice::IoInCallerContext(WDFDEVICE Device, WDFREQUEST Request)
 {
     NTSTATUS status = STATUS_SUCCESS;
@@ -1006,6 +1933,7 @@ void CUsbDkControlDevice::IoInCallerContext(WDFDEVICE Device, WDFREQUEST Request
     {
         auto Context = CtrlRequest.Context();
 
+        Context->CallerPid = (ULONG)(ULONG_PTR)PsGetCurrentProcessId();
         status = UsbDkCreateCurrentProcessHandle(Context->CallerProcessHandle);
 
         if (!NT_SUCCESS(status))
@@ -1162,8 +2090,62 @@ NTSTATUS CUsbDkControlDevice::GetConfigurationDescriptor(const USB_DK_CONFIG_DES
     return status;
 }
 
-NTSTATUS CUsbDkControlDevice::AddRedirect(const USB_DK_DEVICE_ID &DeviceId, HANDLE RequestorProcess, PHANDLE RedirectorDevice)
+NTSTATUS CUsbDkControlDevice::GetConfigurationDescriptorEx(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request,
+                                                           USB_DK_CONFIG_DESCRIPTOR_RESULT *Result,
+                                                           size_t *OutputBuffLen)
+{
+    //Generation is sampled before the lookup, so the descriptor
+    //returned is never newer than the generation reported with it
+    Result->Generation = m_EnumGeneration;
+
+    auto DescriptorIndex = static_cast<UCHAR>(Request.Index);
+    auto Descriptor = reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(Result + 1);
+    auto DescriptorBuffLen = *OutputBuffLen - sizeof(*Result);
+    size_t Length = 0;
+    bool result = false;
+
+    if (EnumUsbDevicesByID(Request.ID,
+                           [&result, DescriptorIndex, Descriptor, DescriptorBuffLen, &Length](CUsbDkChildDevice *Child) -> bool
+                           {
+                               result = Child->ConfigurationDescriptorLength(DescriptorIndex, Length);
+                               if (result && (Length <= DescriptorBuffLen))
+                               {
+                                   Child->ConfigurationDescriptor(DescriptorIndex, *Descriptor, Length);
+                               }
+                               return false;
+                           }))
+    {
+        *OutputBuffLen = 0;
+        return STATUS_NOT_FOUND;
+    }
+
+    if (!result)
+    {
+        *OutputBuffLen = 0;
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    Result->Length = Length;
+
+    if (Length > DescriptorBuffLen)
+    {
+        //Let the caller know the size required
+        *OutputBuffLen = sizeof(*Result);
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    *OutputBuffLen = sizeof(*Result) + Length;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CUsbDkControlDevice::AddRedirect(const USB_DK_DEVICE_ID &DeviceId, CControlRequest &Request)
 {
+    auto reattachRes = ReattachParkedRedirection(DeviceId, Request);
+    if (reattachRes != STATUS_NOT_FOUND)
+    {
+        return reattachRes;
+    }
+
     CUsbDkRedirection *Redirection;
     auto addRes = AddRedirectionToSet(DeviceId, &Redirection);
     if (!NT_SUCCESS(addRes))
@@ -1176,85 +2158,335 @@ NTSTATUS CUsbDkControlDevice::AddRedirect(const USB_DK_DEVICE_ID &DeviceId, HAND
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Success. New redirections list:");
     m_Redirections.Dump();
 
-    auto resetRes = ResetUsbDevice(DeviceId);
-    if (!NT_SUCCESS(resetRes))
+    //Port cycle takes a while, it is done by system worker thread,
+    //so resets of devices redirected one after another overlap
+    CObjHolder<CUsbDkRedirectReset> Reset(new CUsbDkRedirectReset);
+    if (!Reset)
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Reset after start redirection failed. %!STATUS!", resetRes);
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate reset context");
         AddRedirectRollBack(DeviceId, false);
-        return resetRes;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    auto waitRes = Redirection->WaitForAttachment();
-    if ((waitRes == STATUS_TIMEOUT) || !NT_SUCCESS(waitRes))
+    Reset->WorkItem = IoAllocateWorkItem(WdmObject());
+    if (Reset->WorkItem == nullptr)
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Wait for redirector attachment failed. %!STATUS!", waitRes);
-        AddRedirectRollBack(DeviceId, true);
-        return (waitRes == STATUS_TIMEOUT) ? STATUS_DEVICE_NOT_CONNECTED : waitRes;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate reset work item");
+        AddRedirectRollBack(DeviceId, false);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    auto status = Redirection->CreateRedirectorHandle(RequestorProcess, RedirectorDevice);
+    Reset->DeviceId = DeviceId;
+    Reset->Request = Request;
+
+    //Do not hold control queue while device re-enumerates,
+    //request gets completed once redirector attached or timed out
+    auto Context = Request.Context();
+    Context->Redirection = dereferencer.detach();
+    Context->Deadline = KeQueryInterruptTime() + SecondsTo100Nanoseconds(15);
+    Context->ResetStatus = STATUS_PENDING;
+    Context->ResetState = USBDK_REDIRECT_RESET_IN_FLIGHT;
+
+    //Reset worker updates the context, even if the request is cancelled meanwhile
+    WdfObjectReference(Reset->Request);
+
+    auto status = Request.ForwardToIoQueue(m_PendingRedirectsQueue);
     if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! CreateRedirectorHandle() failed. %!STATUS!", status);
-        AddRedirectRollBack(DeviceId, true);
-        return STATUS_DEVICE_NOT_CONNECTED;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to pend redirection request. %!STATUS!", status);
+        WdfObjectDereference(Reset->Request);
+        IoFreeWorkItem(Reset->WorkItem);
+        Context->Redirection->Release();
+        Context->Redirection = nullptr;
+        AddRedirectRollBack(DeviceId, false);
+        return status;
     }
 
-    return STATUS_SUCCESS;
+    auto WorkItem = Reset->WorkItem;
+    IoQueueWorkItem(WorkItem, ResetForRedirectWorker, DelayedWorkQueue, Reset.detach());
+
+    //Redirector may have attached before the request got queued
+    WdfTimerStart(m_PendingRedirectsTimer, WDF_REL_TIMEOUT_IN_SEC(1));
+    return STATUS_PENDING;
 }
 
-NTSTATUS CUsbDkControlDevice::AddHideRuleToSet(const USB_DK_HIDE_RULE &UsbDkRule, HideRulesSet &Set)
+void CUsbDkControlDevice::ResetForRedirectWorker(PDEVICE_OBJECT DeviceObject, PVOID Context)
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! entry");
+    CObjHolder<CUsbDkRedirectReset> Reset(static_cast<CUsbDkRedirectReset *>(Context));
+    auto devExt = UsbDkControlGetContext(WdfWdmDeviceGetWdfDeviceHandle(DeviceObject));
 
-    auto MatchAllMapper = [](ULONG64 Value) -> ULONG
-    { return Value == USB_DK_HIDE_RULE_MATCH_ALL ? USBDK_REG_HIDE_RULE_MATCH_ALL
-                                                 : static_cast<ULONG>(Value); };
-
-    CObjHolder<CUsbDkHideRule> NewRule(new CUsbDkHideRule(UsbDkRule.Hide ? true : false,
-                                                          MatchAllMapper(UsbDkRule.Class),
-                                                          MatchAllMapper(UsbDkRule.VID),
-                                                          MatchAllMapper(UsbDkRule.PID),
-                                                          MatchAllMapper(UsbDkRule.BCD)));
-    if (!NewRule)
+    auto status = devExt->UsbDkControl->ResetUsbDevice(Reset->DeviceId);
+    if (!NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate new rule");
-        return STATUS_INSUFFICIENT_RESOURCES;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Reset after start redirection failed. %!STATUS!", status);
     }
 
-    if(!Set.Add(NewRule))
+    auto RequestContext = UsbDkControlRequestGetContext(Reset->Request);
+    RequestContext->ResetStatus = status;
+
+    //Request got completed with failure while the port was being reset
+    if ((InterlockedExchange(&RequestContext->ResetState, USBDK_REDIRECT_RESET_DONE) ==
+            USBDK_REDIRECT_RESET_ROLLBACK_WHEN_DONE) && NT_SUCCESS(status))
     {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! failed. Hide rule already present.");
-        return STATUS_OBJECT_NAME_COLLISION;
+        auto resetRes = devExt->UsbDkControl->ResetUsbDevice(Reset->DeviceId);
+        if (!NT_SUCCESS(resetRes))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Roll-back reset failed. %!STATUS!", resetRes);
+        }
     }
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Current hide rules:");
-    Set.Dump();
+    WdfObjectDereference(Reset->Request);
+    IoFreeWorkItem(Reset->WorkItem);
 
-    NewRule.detach();
-    return STATUS_SUCCESS;
+    if (!NT_SUCCESS(status))
+    {
+        WdfWorkItemEnqueue(devExt->UsbDkControl->m_PendingRedirectsWorkItem);
+    }
 }
 
-void CUsbDkControlDevice::ClearHideRules()
+void CUsbDkControlDevice::CompleteRedirect(CControlRequest &Request, NTSTATUS Status)
 {
-    m_HideRules.Clear();
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! All dynamic hide rules dropped.");
-}
+    auto Context = Request.Context();
+    CObjHolder<CUsbDkRedirection, CRefCountingDeleter> Redirection(Context->Redirection);
+    Context->Redirection = nullptr;
 
-class CHideRulesRegKey final : public CRegKey
-{
-public:
-    NTSTATUS Open()
+    PUSB_DK_DEVICE_ID DeviceId = nullptr;
+    PULONG64 RedirectorDevice;
+    if (!CUsbDkControlDeviceQueue::FetchBuffersForAddRedirectRequest(Request, DeviceId, RedirectorDevice))
     {
-        auto DriverParamsRegPath = CDriverParamsRegistryPath::Get();
-        if (DriverParamsRegPath->Length == 0)
+        //Buffers were validated before the request got pended
+        ASSERT(FALSE);
+        Status = STATUS_BUFFER_TOO_SMALL;
+    }
+    else if (NT_SUCCESS(Status))
+    {
+        Status = Redirection->CreateRedirectorHandle(Context->CallerProcessHandle, Context->CallerPid,
+                                                     reinterpret_cast<PHANDLE>(RedirectorDevice));
+        if (!NT_SUCCESS(Status))
         {
-            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                "%!FUNC! Driver parameters registry key path not available.");
-
-            return STATUS_INVALID_DEVICE_STATE;
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! CreateRedirectorHandle() failed. %!STATUS!", Status);
+            Status = STATUS_DEVICE_NOT_CONNECTED;
         }
-
+    }
+    else
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Wait for redirector attachment failed. %!STATUS!", Status);
+    }
+
+    if (!NT_SUCCESS(Status) && (DeviceId != nullptr))
+    {
+        //If the port reset is still in flight its worker does
+        //the roll-back reset once done, otherwise it is done here.
+        //No need to reset device again if the reset itself failed.
+        auto ResetInFlight = InterlockedCompareExchange(&Context->ResetState,
+                                                        USBDK_REDIRECT_RESET_ROLLBACK_WHEN_DONE,
+                                                        USBDK_REDIRECT_RESET_IN_FLIGHT) == USBDK_REDIRECT_RESET_IN_FLIGHT;
+
+        AddRedirectRollBack(*DeviceId, !ResetInFlight && NT_SUCCESS(Context->ResetStatus));
+    }
+
+    ZwClose(Context->CallerProcessHandle);
+    Context->CallerProcessHandle = WDF_NO_HANDLE;
+
+    Request.SetOutputDataLen(NT_SUCCESS(Status) ? sizeof(*RedirectorDevice) : 0);
+    Request.SetStatus(Status);
+}
+
+static CUsbDkHideRule *CreateHideRule(const USB_DK_HIDE_RULE &UsbDkRule)
+{
+    return new CUsbDkHideRule(UsbDkRule.Hide ? true : false,
+                              MatchAllMapper(UsbDkRule.Class),
+                              MatchAllMapper(UsbDkRule.VID),
+                              MatchAllMapper(UsbDkRule.PID),
+                              MatchAllMapper(UsbDkRule.BCD));
+}
+
+NTSTATUS CUsbDkControlDevice::AddHideRuleToSet(const USB_DK_HIDE_RULE &UsbDkRule, HideRulesSet &Set)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! entry");
+
+    CObjHolder<CUsbDkHideRule> NewRule(CreateHideRule(UsbDkRule));
+    if (!NewRule)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate new rule");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if(!Set.Add(NewRule))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! failed. Hide rule already present.");
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Current hide rules:");
+    Set.Dump();
+
+    NewRule.detach();
+    return STATUS_SUCCESS;
+}
+
+//Open addressing set of rules, drops duplicates of a batch in linear time
+class CHideRulesDeduplicator
+{
+public:
+    bool Create(size_t MaxRules)
+    {
+        m_Size = 16;
+        while (m_Size < MaxRules * 2)
+        {
+            m_Size *= 2;
+        }
+
+        m_Table = TAllocator::allocate(m_Size);
+        if (!m_Table)
+        {
+            return false;
+        }
+
+        RtlZeroMemory(m_Table, m_Size * sizeof(m_Table[0]));
+        return true;
+    }
+
+    //Returns false if equal rule is already there
+    bool Insert(CUsbDkHideRule *Rule)
+    {
+        for (auto Slot = Rule->Hash() & (m_Size - 1); ; Slot = (Slot + 1) & (m_Size - 1))
+        {
+            if (m_Table[Slot] == nullptr)
+            {
+                m_Table[Slot] = Rule;
+                return true;
+            }
+
+            if (*m_Table[Slot] == *Rule)
+            {
+                return false;
+            }
+        }
+    }
+
+private:
+    using TAllocator = CPrimitiveAllocator<PagedPool, CUsbDkHideRule *, 'UDHR'>;
+    CObjHolder<CUsbDkHideRule *, TAllocator> m_Table;
+    size_t m_Size = 0;
+};
+
+NTSTATUS CUsbDkControlDevice::AddHideRules(const USB_DK_HIDE_RULE *Rules, size_t NumRules, bool ReplaceAll)
+{
+    PAGED_CODE();
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! %llu rules, replace all: %!bool!",
+                static_cast<ULONG64>(NumRules), ReplaceAll);
+
+    for (size_t i = 0; i < NumRules; i++)
+    {
+        if ((Rules[i].Type != USBDK_HIDER_RULE_DEFAULT) &&
+            (Rules[i].Type != USBDK_HIDER_RULE_DETERMINATIVE_TYPES))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    //Requests of the hider device are sequential, so dynamic rules do not change
+    //while new sets are built from them and the batch, then the sets are swapped in
+    HideRulesSet NewRules;
+    HideRulesSet NewExtRules;
+
+    size_t NumExisting = 0;
+    if (!ReplaceAll)
+    {
+        auto Counter = [&NumExisting](CUsbDkHideRule *) { NumExisting++; return true; };
+        m_HideRules.ForEach(Counter);
+        m_ExtHideRules.ForEach(Counter);
+    }
+
+    CHideRulesDeduplicator Dedup;
+    CHideRulesDeduplicator ExtDedup;
+    if (!Dedup.Create(NumExisting + NumRules) ||
+        !ExtDedup.Create(NumExisting + NumRules))
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    auto status = STATUS_SUCCESS;
+    auto Copy = [&status](HideRulesSet &From, HideRulesSet &To, CHideRulesDeduplicator &ToDedup)
+    {
+        From.ForEach([&status, &To, &ToDedup](CUsbDkHideRule *Rule)
+                     {
+                         auto NewRule = new CUsbDkHideRule(*Rule);
+                         if (NewRule == nullptr)
+                         {
+                             status = STATUS_INSUFFICIENT_RESOURCES;
+                             return false;
+                         }
+                         ToDedup.Insert(NewRule);
+                         To.AddUnchecked(NewRule);
+                         return true;
+                     });
+    };
+
+    if (!ReplaceAll)
+    {
+        Copy(m_HideRules, NewRules, Dedup);
+        Copy(m_ExtHideRules, NewExtRules, ExtDedup);
+    }
+
+    size_t NumDuplicates = 0;
+    for (size_t i = 0; NT_SUCCESS(status) && (i < NumRules); i++)
+    {
+        CObjHolder<CUsbDkHideRule> NewRule(CreateHideRule(Rules[i]));
+        if (!NewRule)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        auto IsExt = (Rules[i].Type == USBDK_HIDER_RULE_DETERMINATIVE_TYPES);
+        if (!(IsExt ? ExtDedup : Dedup).Insert(NewRule))
+        {
+            NumDuplicates++;
+            continue;
+        }
+
+        (IsExt ? NewExtRules : NewRules).AddUnchecked(NewRule.detach());
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Failed to allocate rules");
+        return status;
+    }
+
+    NewRules.MoveList(m_HideRules);
+    NewExtRules.MoveList(m_ExtHideRules);
+    CompileHideRules();
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Rules loaded, %llu duplicates dropped",
+                static_cast<ULONG64>(NumDuplicates));
+    return STATUS_SUCCESS;
+}
+
+void CUsbDkControlDevice::ClearHideRules()
+{
+    m_HideRules.Clear();
+    CompileHideRules();
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! All dynamic hide rules dropped.");
+}
+
+class CHideRulesRegKey final : public CRegKey
+{
+public:
+    NTSTATUS Open()
+    {
+        auto DriverParamsRegPath = CDriverParamsRegistryPath::Get();
+        if (DriverParamsRegPath->Length == 0)
+        {
+            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                "%!FUNC! Driver parameters registry key path not available.");
+
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
         CStringHolder ParamsSubkey;
         auto status = ParamsSubkey.Attach(TEXT("\\") USBDK_HIDE_RULES_SUBKEY_NAME);
         ASSERT(NT_SUCCESS(status));
@@ -1278,60 +2510,58 @@ public:
 
         return status;
     }
-};
 
-class CRegHideRule final : private CRegKey
-{
-public:
-    NTSTATUS Open(const CRegKey &HideRulesRegKey, const UNICODE_STRING &Name)
+    template <typename TFunctor>
+    NTSTATUS ForEachBlobRule(TFunctor Functor)
     {
-        return CRegKey::Open(HideRulesRegKey, Name);
-    }
+        CStringHolder ValueNameHolder;
+        auto status = ValueNameHolder.Attach(USBDK_HIDE_RULES_BLOB);
+        ASSERT(NT_SUCCESS(status));
 
-    NTSTATUS Read(USB_DK_HIDE_RULE &Rule)
-    {
-        auto status = ReadBoolValue(USBDK_HIDE_RULE_SHOULD_HIDE, Rule.Hide);
-        if (!NT_SUCCESS(status))
-        {
-            return status;
-        }
+        CWdmMemoryBuffer Buffer;
 
-        DWORD32 val;
-        status = ReadDwordValue(USBDK_HIDE_RULE_TYPE, val);
+        status = QueryValueInfo(*ValueNameHolder, KeyValuePartialInformation, Buffer);
         if (!NT_SUCCESS(status))
         {
             return status;
         }
-        Rule.Type = val;
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_VID, Rule.VID);
-        if (!NT_SUCCESS(status))
+        auto Info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(Buffer.Ptr());
+        if (Info->Type != REG_BINARY)
         {
-            return status;
-        }
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
+                "%!FUNC! Wrong data type for hide rules blob: %d", Info->Type);
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_PID, Rule.PID);
-        if (!NT_SUCCESS(status))
-        {
-            return status;
+            return STATUS_DATA_ERROR;
         }
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_BCD, Rule.BCD);
-        if (!NT_SUCCESS(status))
+        DWORD NumRules;
+        auto RegRules = HideRulesFromRegistryBlob(&Info->Data[0], Info->DataLength, NumRules);
+        if (RegRules == nullptr)
         {
-            return status;
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
+                "%!FUNC! Hide rules blob is corrupted or of unknown version, ignored");
+
+            return STATUS_DATA_ERROR;
         }
 
-        status = ReadDwordMaskValue(USBDK_HIDE_RULE_CLASS, Rule.Class);
-        if (!NT_SUCCESS(status))
+        for (DWORD i = 0; i < NumRules; i++)
         {
-            return status;
+            USB_DK_HIDE_RULE Rule;
+            HideRuleFromRegistry(RegRules[i], Rule);
+            Functor(Rule);
         }
 
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+            "%!FUNC! Loaded %lu hide rules from blob", NumRules);
+
         return STATUS_SUCCESS;
     }
+};
 
-private:
+class CRegDwordKey : public CRegKey
+{
+public:
     NTSTATUS ReadDwordValue(PCWSTR ValueName, DWORD32 &Value)
     {
         CStringHolder ValueNameHolder;
@@ -1369,7 +2599,78 @@ private:
         Value = *reinterpret_cast<PDWORD32>(&Info->Data[0]);
         return STATUS_SUCCESS;
     }
+};
+
+class CDriverParamsRegKey final : public CRegDwordKey
+{
+public:
+    NTSTATUS Open()
+    {
+        auto DriverParamsRegPath = CDriverParamsRegistryPath::Get();
+        if (DriverParamsRegPath->Length == 0)
+        {
+            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                "%!FUNC! Driver parameters registry key path not available.");
 
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        return CRegKey::Open(*DriverParamsRegPath);
+    }
+};
+
+class CRegHideRule final : private CRegDwordKey
+{
+public:
+    NTSTATUS Open(const CRegKey &HideRulesRegKey, const UNICODE_STRING &Name)
+    {
+        return CRegKey::Open(HideRulesRegKey, Name);
+    }
+
+    NTSTATUS Read(USB_DK_HIDE_RULE &Rule)
+    {
+        auto status = ReadBoolValue(USBDK_HIDE_RULE_SHOULD_HIDE, Rule.Hide);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        DWORD32 val;
+        status = ReadDwordValue(USBDK_HIDE_RULE_TYPE, val);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        Rule.Type = val;
+
+        status = ReadDwordMaskValue(USBDK_HIDE_RULE_VID, Rule.VID);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadDwordMaskValue(USBDK_HIDE_RULE_PID, Rule.PID);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadDwordMaskValue(USBDK_HIDE_RULE_BCD, Rule.BCD);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        status = ReadDwordMaskValue(USBDK_HIDE_RULE_CLASS, Rule.Class);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+private:
     NTSTATUS ReadBoolValue(PCWSTR ValueName, ULONG64 &Value)
     {
         DWORD32 RawValue;
@@ -1397,6 +2698,21 @@ private:
     }
 };
 
+void CUsbDkControlDevice::ReloadRedirectionParameters()
+{
+    DWORD32 ParkTimeout = 0;
+
+    CDriverParamsRegKey ParamsKey;
+    if (!NT_SUCCESS(ParamsKey.Open()) ||
+        !NT_SUCCESS(ParamsKey.ReadDwordValue(USBDK_REDIRECTION_PARK_TIMEOUT, ParkTimeout)))
+    {
+        ParkTimeout = 0;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE, "%!FUNC! Redirection park timeout: %lu sec", ParkTimeout);
+    m_ParkTimeout = ParkTimeout;
+}
+
 NTSTATUS CUsbDkControlDevice::ReloadPersistentHideRules()
 {
     m_PersistentHideRules.Clear();
@@ -1406,6 +2722,12 @@ NTSTATUS CUsbDkControlDevice::ReloadPersistentHideRules()
     auto status = RulesKey.Open();
     if (NT_SUCCESS(status))
     {
+        RulesKey.ForEachBlobRule([this](const USB_DK_HIDE_RULE &Rule)
+        {
+            AddPersistentHideRule(Rule);
+        });
+
+        //Rules written by older helper versions
         status = RulesKey.ForEachSubKey([&RulesKey, this](PCUNICODE_STRING Name)
         {
             CRegHideRule Rule;
@@ -1419,6 +2741,8 @@ NTSTATUS CUsbDkControlDevice::ReloadPersistentHideRules()
         });
     }
 
+    CompileHideRules();
+
     if (status == STATUS_OBJECT_NAME_NOT_FOUND)
     {
         status = STATUS_SUCCESS;
@@ -1465,6 +2789,186 @@ NTSTATUS CUsbDkControlDevice::AddRedirectionToSet(const USB_DK_DEVICE_ID &Device
 }
 
 NTSTATUS CUsbDkControlDevice::RemoveRedirect(const USB_DK_DEVICE_ID &DeviceId, ULONG pid)
+{
+    //Zero pid means the last handle of redirector is being closed
+    if ((pid == 0) && ParkRedirection(DeviceId))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    return DropRedirection(DeviceId, pid);
+}
+
+bool CUsbDkControlDevice::ParkRedirection(const USB_DK_DEVICE_ID &DeviceId)
+{
+    ULONG ParkTimeout = m_ParkTimeout;
+    if (ParkTimeout == 0)
+    {
+        return false;
+    }
+
+    auto Deadline = KeQueryInterruptTime() + SecondsTo100Nanoseconds(ParkTimeout);
+    bool Parked = false;
+    m_Redirections.ModifyOne(&DeviceId, [&Parked, Deadline](CUsbDkRedirection *R){ Parked = R->Park(Deadline); });
+
+    if (Parked)
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                    "%!FUNC! Parked %S:%S for %lu sec",
+                    DeviceId.DeviceID, DeviceId.InstanceID, ParkTimeout);
+
+        WdfTimerStart(m_PendingRedirectsTimer, WDF_REL_TIMEOUT_IN_SEC(1));
+    }
+
+    return Parked;
+}
+
+NTSTATUS CUsbDkControlDevice::ReattachParkedRedirection(const USB_DK_DEVICE_ID &DeviceId, CControlRequest &Request)
+{
+    auto Context = Request.Context();
+    auto CallerPid = Context->CallerPid;
+
+    CUsbDkRedirection *Redirection = nullptr;
+    bool NotOwner = false;
+    m_Redirections.ModifyOne(&DeviceId, [&Redirection, &NotOwner, CallerPid](CUsbDkRedirection *R)
+                                        {
+                                            if (!R->IsParked())
+                                            {
+                                                return;
+                                            }
+
+                                            //Only the process that parked the redirection takes it back
+                                            if (!R->MatchProcess(CallerPid))
+                                            {
+                                                NotOwner = true;
+                                                return;
+                                            }
+
+                                            R->Unpark();
+                                            R->AddRef();
+                                            Redirection = R;
+                                        });
+    if (NotOwner)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
+                    "%!FUNC! %S:%S is parked by another process",
+                    DeviceId.DeviceID, DeviceId.InstanceID);
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (Redirection == nullptr)
+    {
+        return STATUS_NOT_FOUND;
+    }
+    CObjHolder<CUsbDkRedirection, CRefCountingDeleter> dereferencer(Redirection);
+
+    PULONG64 RedirectorDevice;
+    auto status = Request.FetchOutputObject(RedirectorDevice);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    //Output shares system buffer with DeviceId, which is not used after success.
+    //Parked redirector is up already, so handle creation is not retried.
+    status = Redirection->CreateRedirectorHandle(Context->CallerProcessHandle, CallerPid,
+                                                 reinterpret_cast<PHANDLE>(RedirectorDevice), false);
+    if (NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                    "%!FUNC! Reattached to %S:%S",
+                    DeviceId.DeviceID, DeviceId.InstanceID);
+        return STATUS_SUCCESS;
+    }
+
+    //Parked redirector is gone, e.g. device was unplugged,
+    //return it to system in background instead of blocking
+    //control queue until the redirector detaches
+    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! CreateRedirectorHandle() failed. %!STATUS!", status);
+    m_Redirections.ModifyOne(&DeviceId, [](CUsbDkRedirection *R){ R->Park(0); });
+    WdfWorkItemEnqueue(m_ParkedRedirectsWorkItem);
+    return STATUS_DEVICE_NOT_CONNECTED;
+}
+
+void CUsbDkControlDevice::ProcessParkedRedirections()
+{
+    for (;;)
+    {
+        auto Now = KeQueryInterruptTime();
+        auto ReleaseDeadline = Now + SecondsTo100Nanoseconds(120);
+        bool Left = false;
+        bool Expired = false;
+        bool Released = false;
+        USB_DK_DEVICE_ID Id;
+
+        m_Redirections.ForEach([Now, ReleaseDeadline, &Left, &Expired, &Released, &Id](CUsbDkRedirection *R) -> bool
+                               {
+                                   //Claim it, so it won't be reattached meanwhile
+                                   if (R->ClaimExpired(Now, ReleaseDeadline))
+                                   {
+                                       R->GetID(Id);
+                                       Expired = true;
+                                       return false;
+                                   }
+
+                                   if (R->ReleaseFinished(Now))
+                                   {
+                                       R->GetID(Id);
+                                       Released = true;
+                                       return false;
+                                   }
+
+                                   Left = Left || R->IsParked() || R->IsReleasing();
+                                   return true;
+                               });
+
+        if (Expired)
+        {
+            StartParkedRelease(Id);
+        }
+        else if (Released)
+        {
+            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                        "%!FUNC! Released %S:%S",
+                        Id.DeviceID, Id.InstanceID);
+            m_Redirections.Delete(&Id);
+        }
+        else
+        {
+            if (Left)
+            {
+                WdfTimerStart(m_PendingRedirectsTimer, WDF_REL_TIMEOUT_IN_SEC(1));
+            }
+            return;
+        }
+    }
+}
+
+void CUsbDkControlDevice::StartParkedRelease(const USB_DK_DEVICE_ID &DeviceId)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+                "%!FUNC! Returning idle %S:%S to system",
+                DeviceId.DeviceID, DeviceId.InstanceID);
+
+    if (!NotifyRedirectorRemovalStarted(DeviceId, 0))
+    {
+        return;
+    }
+
+    //Detachment is picked up by ProcessParkedRedirections(),
+    //nothing to wait for if the device is gone or reset failed
+    auto res = ResetUsbDevice(DeviceId);
+    if (!NT_SUCCESS(res))
+    {
+        if (res != STATUS_NO_SUCH_DEVICE)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, "%!FUNC! Usb device reset failed. %!STATUS!", res);
+        }
+        m_Redirections.Delete(&DeviceId);
+    }
+}
+
+NTSTATUS CUsbDkControlDevice::DropRedirection(const USB_DK_DEVICE_ID &DeviceId, ULONG pid)
 {
     if (NotifyRedirectorRemovalStarted(DeviceId, pid))
     {
@@ -1515,7 +3019,14 @@ bool CUsbDkControlDevice::NotifyRedirectorAttached(CRegText *DeviceID, CRegText
     USB_DK_DEVICE_ID ID;
     UsbDkFillIDStruct(&ID, *DeviceID->begin(), *InstanceID->begin());
 
-    return m_Redirections.ModifyOne(&ID, [RedirectorDevice](CUsbDkRedirection *R){ R->NotifyRedirectorCreated(RedirectorDevice); });
+    if (!m_Redirections.ModifyOne(&ID, [RedirectorDevice](CUsbDkRedirection *R){ R->NotifyRedirectorCreated(RedirectorDevice); }))
+    {
+        return false;
+    }
+
+    //Redirector handle creation may take time, do not block PnP start path
+    WdfWorkItemEnqueue(m_PendingRedirectsWorkItem);
+    return true;
 }
 
 bool CUsbDkControlDevice::NotifyRedirectorRemovalStarted(const USB_DK_DEVICE_ID &ID, ULONG pid)
@@ -1572,7 +3083,49 @@ void CUsbDkRedirection::NotifyRedirectorCreated(CUsbDkFilterDevice *RedirectorDe
 
     m_RedirectorDevice = RedirectorDevice;
     m_RedirectorDevice->AddRef();
-    m_RedirectionCreated.Set();
+}
+
+bool CUsbDkRedirection::Park(ULONGLONG Deadline)
+{
+    if (m_Parked)
+    {
+        return true;
+    }
+
+    if (!IsRedirected() || IsPreparedForRemove())
+    {
+        return false;
+    }
+
+    m_Parked = true;
+    m_ParkDeadline = Deadline;
+    return true;
+}
+
+bool CUsbDkRedirection::Unpark()
+{
+    auto WasParked = m_Parked;
+    m_Parked = false;
+    return WasParked;
+}
+
+bool CUsbDkRedirection::ClaimExpired(ULONGLONG Now, ULONGLONG ReleaseDeadline)
+{
+    if (!ParkingExpired(Now))
+    {
+        return false;
+    }
+
+    m_Parked = false;
+    m_Releasing = true;
+    m_ReleaseDeadline = ReleaseDeadline;
+    return true;
+}
+
+void CUsbDkRedirection::GetID(USB_DK_DEVICE_ID &Id) const
+{
+    m_DeviceID.ToWSTR(Id.DeviceID, sizeof(Id.DeviceID));
+    m_InstanceID.ToWSTR(Id.InstanceID, sizeof(Id.InstanceID));
 }
 
 void CUsbDkRedirection::NotifyRedirectionRemoved()
@@ -1594,7 +3147,6 @@ void CUsbDkRedirection::NotifyRedirectionRemovalStarted()
     m_RemovalInProgress = true;
     m_RedirectorDevice->Release();
     m_RedirectorDevice = nullptr;
-    m_RedirectionCreated.Clear();
 }
 
 bool CUsbDkRedirection::WaitForDetachment()
@@ -1627,7 +3179,8 @@ bool CUsbDkRedirection::operator==(const CUsbDkRedirection &Other) const
            (m_InstanceID == Other.m_InstanceID);
 }
 
-NTSTATUS CUsbDkRedirection::CreateRedirectorHandle(HANDLE RequestorProcess, PHANDLE ObjectHandle)
+NTSTATUS CUsbDkRedirection::CreateRedirectorHandle(HANDLE RequestorProcess, ULONG RequestorPid, PHANDLE ObjectHandle,
+                                                   bool WaitForReady)
 {
     // Although we got notification from devices enumeration thread regarding redirector creation
     // system requires some (rather short) time to get the device ready for requests processing.
@@ -1637,7 +3190,7 @@ NTSTATUS CUsbDkRedirection::CreateRedirectorHandle(HANDLE RequestorProcess, PHAN
     // and poll it for some time.
 
     static const LONGLONG RETRY_TIMEOUT_MS = 20;
-    unsigned int iterationsLeft = 10000 / RETRY_TIMEOUT_MS; //Max timeout is 10 seconds
+    unsigned int iterationsLeft = WaitForReady ? 10000 / RETRY_TIMEOUT_MS : 0; //Max timeout is 10 seconds
 
     NTSTATUS status;
     LARGE_INTEGER interval;
@@ -1654,9 +3207,9 @@ NTSTATUS CUsbDkRedirection::CreateRedirectorHandle(HANDLE RequestorProcess, PHAN
         status = m_RedirectorDevice->CreateUserModeHandle(RequestorProcess, ObjectHandle);
         if (NT_SUCCESS(status))
         {
-            ULONG pid = (ULONG)(ULONG_PTR)PsGetCurrentProcessId();
-            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_WDFDEVICE, "%!FUNC! done for process 0x%X", pid);
-            m_OwnerPid = pid;
+            //Runs from worker thread, so owner is the process that requested redirection
+            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_WDFDEVICE, "%!FUNC! done for process 0x%X", RequestorPid);
+            m_OwnerPid = RequestorPid;
             return status;
         }
 
@@ -1708,15 +3261,26 @@ CDriverParamsRegistryPath::CAllocatablePath *CDriverParamsRegistryPath::m_Path =
 
 NTSTATUS CUsbDkControlDevice::AddHideRule(const USB_DK_HIDE_RULE &UsbDkRule)
 {
+    NTSTATUS status;
+
     if (UsbDkRule.Type == USBDK_HIDER_RULE_DEFAULT)
     {
-        return AddHideRuleToSet(UsbDkRule, m_HideRules);
+        status = AddHideRuleToSet(UsbDkRule, m_HideRules);
     }
     else if (UsbDkRule.Type == USBDK_HIDER_RULE_DETERMINATIVE_TYPES)
     {
-        return AddHideRuleToSet(UsbDkRule, m_ExtHideRules);
+        status = AddHideRuleToSet(UsbDkRule, m_ExtHideRules);
     }
-    return STATUS_INVALID_PARAMETER;
+    else
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        CompileHideRules();
+    }
+    return status;
 }
 
 NTSTATUS CUsbDkControlDevice::AddPersistentHideRule(const USB_DK_HIDE_RULE &UsbDkRule)
@@ -1732,233 +3296,408 @@ NTSTATUS CUsbDkControlDevice::AddPersistentHideRule(const USB_DK_HIDE_RULE &UsbD
     return STATUS_INVALID_PARAMETER;
 }
 
-/* Create or re-create the "Has Function Driver" registry key Set */
-NTSTATUS CUsbDkControlDevice::ReloadHasDriverList()
+void CUsbDkFDriverIndex::Replace(ULONG VidPid, CUsbDkFDriverRulesList &NewRules)
+{
+    //Replaced rules are destroyed after the lock is released
+    CUsbDkFDriverRulesList OldRules;
+
+    CExclusiveLockedContext<> LockedContext(m_Lock);
+
+    m_Rules.ForEachDetachedIf([VidPid](CUsbDkFDriverRule *Rule) { return Rule->VidPid() == VidPid; },
+                              [this, &OldRules](CUsbDkFDriverRule *Rule)
+                              {
+                                  m_ByID.Remove(Rule);
+                                  OldRules.PushBack(Rule);
+                                  return true;
+                              });
+
+    NewRules.ForEachDetached([this](CUsbDkFDriverRule *Rule)
+                             {
+                                 m_Rules.PushBack(Rule);
+                                 m_ByID.Add(Rule);
+                                 return true;
+                             });
+}
+
+/* Find the Registry root of ...\Enum\USB and start watching it for changes */
+NTSTATUS CUsbDkControlDevice::InitHasDriverList()
+{
+    /* Find the first filter */
+    CUsbDkFilterDevice *ffilter = nullptr;
+    m_FilterDevices.ForEach([&ffilter](CUsbDkFilterDevice *Filter)
+        {
+            ffilter = Filter;
+            return false;
+        });
+
+    if (ffilter == nullptr) {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_WDFDEVICE, "%!FUNC! No filters");
+        return STATUS_SUCCESS;        /* Ignore error, retry on next check */
+    }
+
+    /* Get the Hub Driver HW key */
+    WDFKEY hwkeyh;
+    auto status = WdfDeviceOpenRegistryKey(ffilter->WdfObject(), PLUGPLAY_REGKEY_DEVICE, KEY_READ,
+                                           WDF_NO_OBJECT_ATTRIBUTES, &hwkeyh);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Failed to get Control HWKey %!STATUS!",status);
+        return status;
+    }
+
+    CRegKey regkey;
+    regkey.Acquire(WdfRegistryWdmGetHandle(hwkeyh));
+
+    // Could also use ObReferenceObjectByHandle(), ObQueryObjectName(), ObDereferenceObject()
+    CWdmMemoryBuffer InfoBuffer;
+    status = regkey.QueryKeyInfo(KeyNameInformation, InfoBuffer);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Failed to get Key path %!STATUS!",status);
+        WdfRegistryClose(hwkeyh);
+        return status;
+    }
+
+    auto NameInfo = reinterpret_cast<PKEY_NAME_INFORMATION>(InfoBuffer.Ptr());
+    CStringHolder RootHolder;
+    RootHolder.Attach(NameInfo->Name, static_cast<USHORT>(NameInfo->NameLength));
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_WDFDEVICE, "%!FUNC! Got Hub HW reg path '%wZ'",RootHolder);
+
+    WdfRegistryClose(hwkeyh);
+
+    /* Now we truncate m_RootName at the end of "\Enum\USB\" */
+    if (!RootHolder.TruncateAfter(TEXT("\\Enum\\USB\\"))) {
+        return STATUS_REGISTRY_IO_FAILED;        /* Hmm. */
+    }
+
+    m_RootName.Create(RootHolder);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_WDFDEVICE, "%!FUNC! Got Base HW reg path '%wZ'",
+                                                                              m_RootName);
+
+    /* Only instance keys being added or removed change the index, "Driver" values */
+    /* are watched per rule. Without notifications every update rescans the VID/PID */
+    /* keys, which is still cheap as only the keys with a new last write time get re-read. */
+    status = m_FDriverWatcher.Create(*m_RootName, REG_NOTIFY_CHANGE_NAME, true);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
+            "%!FUNC! Failed to watch '%wZ' for changes (status %!STATUS!)", m_RootName, status);
+    }
+
+    m_FDriverInited = true;
+    return STATUS_SUCCESS;
+}
+
+/* Bring the "Has Function Driver" index up to date with the registry. Only VID/PID */
+/* keys changed since the previous scan are re-read. A non-zero MissedVidPid is the */
+/* VidPid of a device with no index entry, its key is re-read unconditionally because */
+/* instance values can be written after the key itself was last scanned. */
+void CUsbDkControlDevice::UpdateHasDriverList(ULONG MissedVidPid)
 {
-    /* See if we need to figure out the Registry root of ...\Enum\USB */
+    m_FDriverScanLock.Wait();
+
     if (!m_FDriverInited)
     {
-        /* Find the first filter */
-        CUsbDkFilterDevice *ffilter = nullptr;
-        m_FilterDevices.ForEach([&ffilter](CUsbDkFilterDevice *Filter)
-            {
-                ffilter = Filter;
-                return false;
-            });
-    
-        if (ffilter == nullptr) {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! No filters");
-            STATUS_SUCCESS;        /* Ignore error ? */
-        }
-    
-        /* Get the Hub Driver HW key */
-        WDFKEY hwkeyh;
-        auto status = WdfDeviceOpenRegistryKey(ffilter->WdfObject(), PLUGPLAY_REGKEY_DEVICE, KEY_READ,
-                                               WDF_NO_OBJECT_ATTRIBUTES, &hwkeyh);
-        if (!NT_SUCCESS(status)) {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Failed to get Control HWKey %!STATUS!",status);
-            return status;
-        }
-    
-        CRegKey regkey;
-        regkey.Acquire(WdfRegistryWdmGetHandle(hwkeyh));
-    
-        // Could also use ObReferenceObjectByHandle(), ObQueryObjectName(), ObDereferenceObject()
-        CWdmMemoryBuffer InfoBuffer;
-        status = regkey.QueryKeyInfo(KeyNameInformation, InfoBuffer);
-        if (!NT_SUCCESS(status)) {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Failed to get Key path %!STATUS!",status);
-            WdfRegistryClose(hwkeyh);
-            return status;
+        InitHasDriverList();
+    }
+
+    if (m_FDriverInited)
+    {
+        if (m_FDriverWatcher.Changed())
+        {
+            ScanHasDriverList();
         }
-    
-        auto NameInfo = reinterpret_cast<PKEY_NAME_INFORMATION>(InfoBuffer.Ptr());
-        CStringHolder RootHolder;
-        RootHolder.Attach(NameInfo->Name, static_cast<USHORT>(NameInfo->NameLength));
-    
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Got Hub HW reg path '%wZ'",RootHolder);
-    
-        WdfRegistryClose(hwkeyh);
-    
-        /* Now we truncate m_RootName at the end of "\Enum\USB\" */
-        if (!RootHolder.TruncateAfter(TEXT("\\Enum\\USB\\"))) {
-            return STATUS_REGISTRY_IO_FAILED;        /* Hmm. */
+
+        if (MissedVidPid != 0)
+        {
+            CRegKey RootKey;
+            if (NT_SUCCESS(RootKey.Open(*m_RootName)))
+            {
+                ReloadHasDriverKey(RootKey, MissedVidPid);
+            }
         }
-        
-        m_RootName.Create(RootHolder);
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Got Base HW reg path '%wZ'",
-                                                                                  m_RootName);
-        m_FDriverInited = true;
     }
 
+    m_FDriverScanLock.Set();
+}
+
+/* Check if there is a Driver value, the answer is cached in */
+/* the rule until its instance key changes */
+bool CUsbDkControlDevice::RuleHasDriver(CUsbDkFDriverRule &Rule, bool &HasDriver)
+{
+    m_FDriverScanLock.Wait();
+    auto Found = RuleHasDriverLocked(Rule, HasDriver);
+    m_FDriverScanLock.Set();
+
+    return Found;
+}
+
+bool CUsbDkControlDevice::RuleHasDriverLocked(CUsbDkFDriverRule &Rule, bool &HasDriver)
+{
+    if (Rule.CachedHasDriver(HasDriver))
+    {
+        return true;
+    }
+
+    CRegKey regkey;
+
+    auto status = regkey.Open(*Rule.KeyName());
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+            "%!FUNC! Failed to open Key '%wZ' registry key",Rule.KeyName());
+        return false;
+    }
+
+    CStringHolder DriverNameHolder;
+    status = DriverNameHolder.Attach(TEXT("Driver"));
+    ASSERT(NT_SUCCESS(status));
+
+    CWdmMemoryBuffer Buffer;
+    status = regkey.QueryValueInfo(*DriverNameHolder, KeyValuePartialInformation, Buffer);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
+            "%!FUNC! Failed to read value '%wZ' (status %!STATUS!)", DriverNameHolder, status);
+        HasDriver = false;
+    } else {
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
+            "%!FUNC! Was able to read value '%wZ' (status %!STATUS!)", DriverNameHolder, status);
+        HasDriver = true;
+    }
+
+    Rule.CacheHasDriver(HasDriver);
+    return true;
+}
+
+CUsbDkFDriverKey *CUsbDkControlDevice::FindHasDriverKey(ULONG VidPid)
+{
+    CUsbDkFDriverKey *Found = nullptr;
+
+    m_FDriverKeysByVidPid.ForEachIf(VidPid,
+                                    [VidPid](CUsbDkFDriverKey *Key) { return Key->VidPid() == VidPid; },
+                                    [&Found](CUsbDkFDriverKey *Key) { Found = Key; return false; });
+    return Found;
+}
+
+NTSTATUS CUsbDkControlDevice::ScanHasDriverList()
+{
     /* Open our root key */
-    CRegKey rootkey;
-    auto status2 = rootkey.Open(*m_RootName);
-    if (!NT_SUCCESS(status2))
+    CRegKey RootKey;
+    auto status = RootKey.Open(*m_RootName);
+    if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
             "%!FUNC! Failed to open RootKey '%wZ' registry key",m_RootName);
-        return status2;
+        return status;
     }
 
-    FDriverRulesSet Set;
-
-    CStringHolder LocationNameHolder;
-    auto status = LocationNameHolder.Attach(TEXT("LocationInformation"));
-    ASSERT(NT_SUCCESS(status));
+    auto Pass = ++m_FDriverScanPass;
+    ULONG NumReloaded = 0;
 
     /* Search the sub keys for "VID_????&PID_????" */
-    status = rootkey.ForEachSubKey([rootkey, &LocationNameHolder, &Set, this]
-                                                    (CStringHolder &Sub1Name)
+    status = RootKey.ForEachSubKeyWithTime([&RootKey, Pass, &NumReloaded, this]
+                                           (CStringHolder &Sub1Name, const LARGE_INTEGER &LastWriteTime)
     {
-        if (!Sub1Name.WCMatch(TEXT("VID_????&PID_????")))
+        ULONG VidPid;
+
+        if (!Sub1Name.WCMatch(TEXT("VID_????&PID_????")) ||
+            !NT_SUCCESS(EightHexToInteger(Sub1Name, 4, 13, &VidPid)))
             return;
 
+        auto Key = FindHasDriverKey(VidPid);
+        if (Key == nullptr)
+        {
+            Key = new CUsbDkFDriverKey(VidPid);
+            if (Key == nullptr)
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
+                     "%!FUNC! Failed to allocate FDriver key state");
+                return;
+            }
+
+            m_FDriverKeys.PushBack(Key);
+            m_FDriverKeysByVidPid.Add(Key);
+        }
+
+        Key->SetScanPass(Pass);
+
+        /* Instance subkeys added or removed */
+        if (Key->LastWriteTime().QuadPart != LastWriteTime.QuadPart &&
+            NT_SUCCESS(ReloadHasDriverKey(RootKey, VidPid)))
+        {
+            Key->SetLastWriteTime(LastWriteTime);
+            NumReloaded++;
+        }
+    });
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+            "%!FUNC! Failed to open Sub1Keys of '%wZ' registry key",PCUNICODE_STRING(m_RootName));
+        return status;
+    }
+
+    /* Drop rules of VID/PID keys that are gone */
+    m_FDriverKeys.ForEachDetachedIf([Pass](CUsbDkFDriverKey *Key) { return Key->ScanPass() != Pass; },
+                                    [this](CUsbDkFDriverKey *Key)
+                                    {
+                                        CUsbDkFDriverRulesList NoRules;
+                                        m_FDriversRules.Replace(Key->VidPid(), NoRules);
+
+                                        m_FDriverKeysByVidPid.Remove(Key);
+                                        delete Key;
+                                        return true;
+                                    });
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+         "%!FUNC! Re-read %lu VID/PID keys, we now have %lu entries in FDriversRules",
+         NumReloaded, m_FDriversRules.GetCount());
+
+    return STATUS_SUCCESS;
+}
+
+/* Re-create the "Has Function Driver" rules of a single VID/PID key */
+NTSTATUS CUsbDkControlDevice::ReloadHasDriverKey(CRegKey &RootKey, ULONG VidPid)
+{
+    WCHAR Sub1NameBuffer[sizeof("VID_XXXX&PID_XXXX")];
+    auto status = RtlStringCbPrintfW(Sub1NameBuffer, sizeof(Sub1NameBuffer), L"VID_%04X&PID_%04X",
+                                     VidPid >> 16, VidPid & 0xFFFF);
+    ASSERT(NT_SUCCESS(status));
+
+    CStringHolder Sub1Name;
+    status = Sub1Name.Attach(Sub1NameBuffer);
+    ASSERT(NT_SUCCESS(status));
+
+    CUsbDkFDriverRulesList Rules;
+
+    /* Open the sub-key */
+    CRegKey sub1key;
+    status = sub1key.Open(RootKey, *Sub1Name);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        /* Key is gone, so are its rules */
+        m_FDriversRules.Replace(VidPid, Rules);
+        return status;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+            "%!FUNC! Failed to open Sub1Key '%wZ' %!STATUS!",Sub1Name,status);
+        return status;
+    }
+
+    CStringHolder LocationNameHolder;
+    status = LocationNameHolder.Attach(TEXT("LocationInformation"));
+    ASSERT(NT_SUCCESS(status));
+
+    /* Search the instance sub keys */
+    status = sub1key.ForEachSubKey([&sub1key, &Sub1Name, &LocationNameHolder, &Rules, VidPid, this]
+                                                               (CStringHolder &Sub2Name)
+    {
         //TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-        //   "%!FUNC! Found matching Sub1Name '%wZ'",Sub1Name);
+        //   "%!FUNC! Searching instance '%wZ'",Sub2Name);
 
-        /* Open the sub-key */
-        CRegKey sub1key;
-        auto status = sub1key.Open(rootkey, *Sub1Name);
+        /* Open the instance sub-key */
+        CRegKey sub2key;
+        auto status = sub2key.Open(sub1key, *Sub2Name);
         if (!NT_SUCCESS(status))
         {
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                "%!FUNC! Failed to open Sub1Key '%wZ' %!STATUS!",Sub1Name,status);
+                "%!FUNC! Failed to open instance '%wZ' %!STATUS!",Sub2Name,status);
             return;
         }
 
-        /* Search the instance sub keys */
-        status = sub1key.ForEachSubKey([sub1key, &Sub1Name, &LocationNameHolder, &Set, this]
-                                                                   (CStringHolder &Sub2Name)
+        /* Get the a 'LocationInformation' value */
+        CWdmMemoryBuffer Buffer;
+        status = sub2key.QueryValueInfo(*LocationNameHolder, KeyValuePartialInformation, Buffer);
+        if (!NT_SUCCESS(status))
         {
-            //TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-            //   "%!FUNC! Searching instance '%wZ'",Sub2Name);
-
-            /* Open the instance sub-key */
-            CRegKey sub2key;
-            auto status = sub2key.Open(sub1key, *Sub2Name);
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-                    "%!FUNC! Failed to open instance '%wZ' %!STATUS!",Sub2Name,status);
-                return;
-            }
+            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
+                "%!FUNC! Failed to read value %wZ (status %!STATUS!)", LocationNameHolder, status);
+            return;
+        }
 
-            /* Get the a 'LocationInformation' value */
-            CWdmMemoryBuffer Buffer;
-            status = sub2key.QueryValueInfo(*LocationNameHolder, KeyValuePartialInformation, Buffer);
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                    "%!FUNC! Failed to read value %wZ (status %!STATUS!)", LocationNameHolder, status);
-                return;
-            }
-            //TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-            //    "%!FUNC! Found subkey 'LocationInfo'");
+        auto Info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(Buffer.Ptr());
 
-            auto Info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(Buffer.Ptr());
+        if (Info->Type != REG_SZ
+         || Info->DataLength > (21 * sizeof(WCHAR)))
+            return;
 
-            //TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-            //        "%!FUNC! Info Type = %d, Length = %d", Info->Type,Info->DataLength);
-            if (Info->Type != REG_SZ
-             || Info->DataLength > (21 * sizeof(WCHAR)))
-                return;
+        CStringHolder LocationValueHolder;
+        status = LocationValueHolder.Attach(reinterpret_cast<PCWSTR>(&Info->Data[0]),
+                                                 static_cast<USHORT>(Info->DataLength));
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
+                "%!FUNC! Failed to Attach to Location value (status %!STATUS!)", status);
+            return;
+        }
 
-            CStringHolder LocationValueHolder;
-            status = LocationValueHolder.Attach(reinterpret_cast<PCWSTR>(&Info->Data[0]),
-                                                     static_cast<USHORT>(Info->DataLength));
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                    "%!FUNC! Failed to Attach to Location value (status %!STATUS!)", status);
-                return;
-            }
-            
-            //TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-            //    "%!FUNC! Location = '%wZ'",LocationValueHolder);
+        if (!LocationValueHolder.WCMatch(TEXT("Port_#????.Hub_#????")))
+            return;
 
-            if (!LocationValueHolder.WCMatch(TEXT("Port_#????.Hub_#????")))
-                return;
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
+            "%!FUNC! Function Driver Ident = %wZ %wZ'",Sub1Name, LocationValueHolder);
 
+        ULONG PortHub;
+        status = EightHexToInteger(LocationValueHolder, 6, 16, &PortHub);
+        if (!NT_SUCCESS(status))
+        {
             TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                "%!FUNC! Function Driver Ident = %wZ %wZ'",Sub1Name, LocationValueHolder);
-
-            /* Form the overall device sub-key name */
-            CString KeyName;
-            status = KeyName.Append(m_RootName);
-            if (NT_SUCCESS(status)) status = KeyName.Append(Sub1Name);
-            if (NT_SUCCESS(status)) status = KeyName.Append(TEXT("\\"));
-            if (NT_SUCCESS(status)) status = KeyName.Append(Sub2Name);
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                    "%!FUNC! Failed to create overall sub-key name (status %!STATUS!)", status);
-                return;
-            }
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_WDFDEVICE, "%!FUNC! Overall sub-key name '%wZ'",
-                                                                                        KeyName);
+                "%!FUNC! Failed to Convert PortHub string into ULONG (status %!STATUS!)", status);
+            return;
+        }
 
-            /* Get the device ID as integers */
-            ULONG VidPid, PortHub;
+        /* First instance found for a port wins */
+        if (!Rules.ForEachIf([VidPid, PortHub](CUsbDkFDriverRule *Rule) { return Rule->Match(VidPid, PortHub); },
+                             ConstFalse))
+        {
+            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
+               "%!FUNC! FDriver rule already present.");
+            return;
+        }
 
-            status = EightHexToInteger(Sub1Name, 4, 13, &VidPid);
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                    "%!FUNC! Failed to Convert VidPid string into ULONG (status %!STATUS!)", status);
-                return;
-            }
-            
-            status = EightHexToInteger(LocationValueHolder, 6, 16, &PortHub);
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                    "%!FUNC! Failed to Convert PortHub string into ULONG (status %!STATUS!)", status);
-                return;
-            }
-            
+        /* Form the overall device sub-key name */
+        CString KeyName;
+        status = KeyName.Append(m_RootName);
+        if (NT_SUCCESS(status)) status = KeyName.Append(Sub1Name);
+        if (NT_SUCCESS(status)) status = KeyName.Append(TEXT("\\"));
+        if (NT_SUCCESS(status)) status = KeyName.Append(Sub2Name);
+        if (!NT_SUCCESS(status))
+        {
             TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-                "%!FUNC! Function Driver Ident = 0x%08x 0x%08x'",VidPid, PortHub);
-
-            /* (Note KeyName will be empty after the constructor.) */
-            CObjHolder<CUsbDkFDriverRule> NewRule(new CUsbDkFDriverRule(VidPid, PortHub, KeyName));
-            if (!NewRule)
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
-                     "%!FUNC! Failed to allocate new FDriver rule");
-                return;
-            }
+                "%!FUNC! Failed to create overall sub-key name (status %!STATUS!)", status);
+            return;
+        }
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_WDFDEVICE, "%!FUNC! Overall sub-key name '%wZ'",
+                                                                                    KeyName);
 
-            if(!Set.Add(NewRule))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
-                   "%!FUNC! failed. FDriver rule already present.");
-                return;
-            }
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_CONTROLDEVICE,
+            "%!FUNC! Function Driver Ident = 0x%08x 0x%08x'",VidPid, PortHub);
 
-            NewRule.detach();
-        });
+        /* (Note KeyName will be empty after the constructor.) */
+        auto NewRule = new CUsbDkFDriverRule(VidPid, PortHub, KeyName);
+        if (NewRule == nullptr)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE,
+                 "%!FUNC! Failed to allocate new FDriver rule");
+            return;
+        }
 
-        if (status == STATUS_OBJECT_NAME_NOT_FOUND)
-           status = STATUS_SUCCESS;
+        Rules.PushBack(NewRule);
     });
 
-    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
-        status = STATUS_SUCCESS;
-
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
-            "%!FUNC! Failed to open Sub1Keys of '%wZ' registry key",PCUNICODE_STRING(m_RootName));
+            "%!FUNC! Failed to enumerate instances of '%wZ' (status %!STATUS!)", Sub1Name, status);
         return status;
     }
 
-    /* Overwrite m_FDriversRules with the temporary set */
-    Set.MoveList(m_FDriversRules);
-
-    TraceEvents(TRACE_LEVEL_ERROR, TRACE_CONTROLDEVICE, 
-         "%!FUNC! We now have %d entries in DFDriversRules",m_FDriversRules.GetCount());
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_CONTROLDEVICE,
+        "%!FUNC! %wZ has %lu FDriver rules", Sub1Name, Rules.GetCount());
 
+    m_FDriversRules.Replace(VidPid, Rules);
     return STATUS_SUCCESS;
 }
-
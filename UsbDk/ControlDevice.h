@@ -27,22 +27,47 @@
 #include "WdfRequest.h"
 #include "Alloc.h"
 #include "UsbDkUtil.h"
+#include "MemoryBuffer.h"
+#include "Registry.h"
+#include "UsbDkNumberBitmap.h"
 #include "FilterDevice.h"
 #include "HiderDevice.h"
 #include "UsbDkDataHider.h"
 #include "HideRulesRegPublic.h"
+#include "UsbDkHideRulesEngine.h"
 
 typedef struct tag_USB_DK_DEVICE_ID USB_DK_DEVICE_ID;
 typedef struct tag_USB_DK_DEVICE_INFO USB_DK_DEVICE_INFO;
 typedef struct tag_USB_DK_CONFIG_DESCRIPTOR_REQUEST USB_DK_CONFIG_DESCRIPTOR_REQUEST;
+typedef struct tag_USB_DK_CONFIG_DESCRIPTOR_RESULT USB_DK_CONFIG_DESCRIPTOR_RESULT;
+typedef struct tag_USB_DK_DESCRIPTORS_SNAPSHOT USB_DK_DESCRIPTORS_SNAPSHOT;
+typedef struct tag_USB_DK_COMPACT_ENUM_HEADER USB_DK_COMPACT_ENUM_HEADER;
+typedef struct tag_USB_DK_DEVICE_FILTER USB_DK_DEVICE_FILTER;
 class CUsbDkFilterDevice;
+class CUsbDkRedirection;
 class CWdfRequest;
 
 typedef struct tag_USBDK_CONTROL_REQUEST_CONTEXT
 {
     HANDLE CallerProcessHandle;
+    ULONG CallerPid;
+
+    //Valid while ADD_REDIRECT request waits for redirector attachment
+    CUsbDkRedirection *Redirection;
+    ULONGLONG Deadline;
+    NTSTATUS ResetStatus;
+    volatile LONG ResetState;
 } USBDK_CONTROL_REQUEST_CONTEXT, *PUSBDK_CONTROL_REQUEST_CONTEXT;
 
+//Port reset of pended ADD_REDIRECT, request completion and reset worker
+//race for the roll-back reset, only one of them may reset the device
+enum : LONG
+{
+    USBDK_REDIRECT_RESET_IN_FLIGHT,
+    USBDK_REDIRECT_RESET_DONE,
+    USBDK_REDIRECT_RESET_ROLLBACK_WHEN_DONE
+};
+
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(USBDK_CONTROL_REQUEST_CONTEXT, UsbDkControlRequestGetContext);
 
 class CControlRequest : public CWdfRequest
@@ -58,11 +83,13 @@ public:
     }
 };
 
+//Read-only queries are served in parallel by the default queue,
+//state changing requests are forwarded to the serial queue
 class CUsbDkControlDeviceQueue : public CWdfDefaultQueue
 {
 public:
     CUsbDkControlDeviceQueue()
-        : CWdfDefaultQueue(WdfIoQueueDispatchSequential, WdfExecutionLevelPassive)
+        : CWdfDefaultQueue(WdfIoQueueDispatchParallel, WdfExecutionLevelPassive)
     {}
 
 private:
@@ -72,12 +99,23 @@ private:
                               size_t OutputBufferLength,
                               size_t InputBufferLength,
                               ULONG IoControlCode);
+    static void SerialDeviceControl(WDFQUEUE Queue,
+                                    WDFREQUEST Request,
+                                    size_t OutputBufferLength,
+                                    size_t InputBufferLength,
+                                    ULONG IoControlCode);
+    static void ForwardToSerialQueue(CControlRequest &Request, WDFQUEUE Queue);
 
     static void CountDevices(CControlRequest &Request, WDFQUEUE Queue);
     static void UpdateRegistryParameters(CControlRequest &Request, WDFQUEUE Queue);
     static void EnumerateDevices(CControlRequest &Request, WDFQUEUE Queue);
+    static void EnumerateDevicesCompact(CControlRequest &Request, WDFQUEUE Queue);
+    static void EnumerateDevicesFiltered(CControlRequest &Request, WDFQUEUE Queue);
     static void AddRedirect(CControlRequest &Request, WDFQUEUE Queue);
     static void GetConfigurationDescriptor(CControlRequest &Request, WDFQUEUE Queue);
+    static void GetConfigurationDescriptorEx(CControlRequest &Request, WDFQUEUE Queue);
+    static void GetEnumerationGeneration(CControlRequest &Request, WDFQUEUE Queue);
+    static void GetDescriptorsSnapshot(CControlRequest &Request, WDFQUEUE Queue);
 
     typedef NTSTATUS(CUsbDkControlDevice::*USBDevControlMethod)(const USB_DK_DEVICE_ID&);
     static void DoUSBDeviceOp(CControlRequest &Request, WDFQUEUE Queue, USBDevControlMethod Method);
@@ -93,75 +131,118 @@ private:
 
     static bool FetchBuffersForAddRedirectRequest(CControlRequest &WdfRequest, PUSB_DK_DEVICE_ID &DeviceId, PULONG64 &RedirectorDevice);
 
+    friend class CUsbDkControlDeviceSerialQueue;
+
     CUsbDkControlDeviceQueue(const CUsbDkControlDeviceQueue&) = delete;
     CUsbDkControlDeviceQueue& operator= (const CUsbDkControlDeviceQueue&) = delete;
+    friend class CUsbDkControlDevice;
 };
 
-class CUsbDkHideRule : public CAllocatable < USBDK_NON_PAGED_POOL, 'RHHR' >
+class CUsbDkControlDeviceSerialQueue : public CWdfSpecificQueue
+{
+public:
+    CUsbDkControlDeviceSerialQueue()
+        : CWdfSpecificQueue(WdfIoQueueDispatchSequential, WdfExecutionLevelPassive)
+    {}
+
+private:
+    virtual void SetCallbacks(WDF_IO_QUEUE_CONFIG &QueueConfig) override;
+
+    CUsbDkControlDeviceSerialQueue(const CUsbDkControlDeviceSerialQueue&) = delete;
+    CUsbDkControlDeviceSerialQueue& operator= (const CUsbDkControlDeviceSerialQueue&) = delete;
+};
+
+class CUsbDkPendingRedirectsQueue : public CWdfSpecificQueue
+{
+public:
+    CUsbDkPendingRedirectsQueue()
+        : CWdfSpecificQueue(WdfIoQueueDispatchManual, WdfExecutionLevelPassive)
+    {}
+
+private:
+    virtual void SetCallbacks(WDF_IO_QUEUE_CONFIG &QueueConfig) override;
+    static void CanceledOnQueue(WDFQUEUE Queue, WDFREQUEST Request);
+
+    CUsbDkPendingRedirectsQueue(const CUsbDkPendingRedirectsQueue&) = delete;
+    CUsbDkPendingRedirectsQueue& operator= (const CUsbDkPendingRedirectsQueue&) = delete;
+};
+
+class CUsbDkHideRule : public CAllocatable < USBDK_NON_PAGED_POOL, 'RHHR' >, public CUsbDkHideRuleBase
 {
 public:
 
     CUsbDkHideRule(bool Hide, ULONG Class, ULONG VID, ULONG PID, ULONG BCD)
-        : m_Hide(Hide)
-        , m_Class(Class)
-        , m_VID(VID)
-        , m_PID(PID)
-        , m_BCD(BCD)
+        : CUsbDkHideRuleBase(Hide, Class, VID, PID, BCD)
     {}
 
-    bool Match(const USB_DEVICE_DESCRIPTOR &Descriptor) const
-    {
-        return MatchCharacteristic(m_Class, Descriptor.bDeviceClass) &&
-               MatchCharacteristic(m_VID, Descriptor.idVendor)       &&
-               MatchCharacteristic(m_PID, Descriptor.idProduct)      &&
-               MatchCharacteristic(m_BCD, Descriptor.bcdDevice);
-    }
+    void Dump(LONG traceLevel = m_defaultDumpLevel) const;
 
-    bool Match(ULONG UsbClassesBitmask, const USB_DEVICE_DESCRIPTOR &Descriptor) const
-    {
-        return (UsbClassesBitmask & m_Class) &&
-            MatchCharacteristic(m_VID, Descriptor.idVendor) &&
-            MatchCharacteristic(m_PID, Descriptor.idProduct) &&
-            MatchCharacteristic(m_BCD, Descriptor.bcdDevice);
-    }
+private:
+    static  LONG m_defaultDumpLevel;
+    DECLARE_CWDMLIST_ENTRY(CUsbDkHideRule);
+};
 
-    bool ShouldHide() const
-    {
-        return m_Hide;
-    }
+class CUsbDkHideRulesEngine : public CAllocatable<USBDK_NON_PAGED_POOL, 'EHHR'>, public CWdmRefCountingObject,
+                              public CUsbDkHideRulesLookup<CPrimitiveAllocator<USBDK_NON_PAGED_POOL, CUsbDkHideRulesLookupEntry, 'EHHR'>>
+{
+public:
+    static CUsbDkHideRulesEngine *Create(size_t MaxRules);
 
-    bool ForceDecision() const
-    {
-        //All do-not-hide rules are terminal
-        return !m_Hide;
-    }
+    bool ShouldHide(const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask) const;
 
-    bool operator ==(const CUsbDkHideRule &Other) const
-    {
-        return m_Hide == Other.m_Hide   &&
-               m_Class == Other.m_Class &&
-               m_VID == Other.m_VID     &&
-               m_PID == Other.m_PID     &&
-               m_BCD == Other.m_BCD;
+private:
+    CUsbDkHideRulesEngine()
+    {}
+    ~CUsbDkHideRulesEngine()
+    {}
 
-    }
+    virtual void OnLastReferenceGone()
+    { delete this; }
 
-    void Dump(LONG traceLevel = m_defaultDumpLevel) const;
+    CUsbDkHideRulesEngine(const CUsbDkHideRulesEngine&) = delete;
+    CUsbDkHideRulesEngine& operator= (const CUsbDkHideRulesEngine&) = delete;
+};
+
+//Direct mapped cache of hide decisions by device identity,
+//entries made with older rules generation never match
+class CUsbDkHideDecisionCache
+{
+public:
+    CUsbDkHideDecisionCache()
+    { RtlZeroMemory(m_Entries, sizeof(m_Entries)); }
+
+    bool Lookup(const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask, LONGLONG Generation, bool &Hide);
+    void Store(const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask, LONGLONG Generation, bool Hide);
+    void DumpStatistics();
 
 private:
-    bool MatchCharacteristic(ULONG CharacteristicFilter, ULONG CharacteristicValue) const
+    enum : ULONG
     {
-        return (CharacteristicFilter == USBDK_REG_HIDE_RULE_MATCH_ALL) ||
-               (CharacteristicValue == CharacteristicFilter);
-    }
+        NUM_ENTRIES = 64
+    };
 
-    bool    m_Hide;
-    ULONG   m_Class;
-    ULONG   m_VID;
-    ULONG   m_PID;
-    ULONG   m_BCD;
-    static  LONG m_defaultDumpLevel;
-    DECLARE_CWDMLIST_ENTRY(CUsbDkHideRule);
+    struct CEntry
+    {
+        LONGLONG Generation;
+        USHORT VID;
+        USHORT PID;
+        USHORT BCD;
+        UCHAR Class;
+        bool Hide;
+        ULONG Classes;
+    };
+
+    static ULONG Slot(const USB_DEVICE_DESCRIPTOR &Descriptor)
+    { return ((Descriptor.idVendor * 31) ^ Descriptor.idProduct ^ Descriptor.bcdDevice) % NUM_ENTRIES; }
+
+    CEntry m_Entries[NUM_ENTRIES];
+    CWdmSpinLock m_Lock;
+
+    CAtomicCounter m_Hits;
+    CAtomicCounter m_Misses;
+
+    CUsbDkHideDecisionCache(const CUsbDkHideDecisionCache&) = delete;
+    CUsbDkHideDecisionCache& operator= (const CUsbDkHideDecisionCache&) = delete;
 };
 
 class CUsbDkRedirection : public CAllocatable<USBDK_NON_PAGED_POOL, 'NRHR'>, public CWdmRefCountingObject
@@ -192,12 +273,31 @@ public:
 
     bool MatchProcess(ULONG pid);
 
-    NTSTATUS WaitForAttachment()
-    { return m_RedirectionCreated.Wait(true, -SecondsTo100Nanoseconds(15)); }
+    //Parked redirection stays attached after its last handle is closed,
+    //until it is reattached by its owner or the park deadline passes
+    bool Park(ULONGLONG Deadline);
+    bool Unpark();
+    bool IsParked() const
+    { return m_Parked; }
+    bool ParkingExpired(ULONGLONG Now) const
+    { return m_Parked && (Now >= m_ParkDeadline); }
+
+    //Expired parked redirection is returned to system in background,
+    //it is released once redirector is detached or the deadline passes
+    bool ClaimExpired(ULONGLONG Now, ULONGLONG ReleaseDeadline);
+    bool IsReleasing() const
+    { return m_Releasing; }
+    bool ReleaseFinished(ULONGLONG Now) const
+    { return m_Releasing && (m_RedirectionRemoved.IsSet() || (Now >= m_ReleaseDeadline)); }
+
+    void GetID(USB_DK_DEVICE_ID &Id) const;
 
     bool WaitForDetachment();
 
-    NTSTATUS CreateRedirectorHandle(HANDLE RequestorProcess, PHANDLE ObjectHandle);
+    //Without WaitForReady redirector is expected to be up already,
+    //so handle creation is tried once
+    NTSTATUS CreateRedirectorHandle(HANDLE RequestorProcess, ULONG RequestorPid, PHANDLE ObjectHandle,
+                                    bool WaitForReady = true);
 
 private:
     ~CUsbDkRedirection()
@@ -215,17 +315,20 @@ private:
     CString m_DeviceID;
     CString m_InstanceID;
 
-    CWdmEvent m_RedirectionCreated;
     CWdmEvent m_RedirectionRemoved;
     CUsbDkFilterDevice *m_RedirectorDevice = nullptr;
     ULONG m_OwnerPid = 0;
 
     bool m_RemovalInProgress = false;
+    bool m_Parked = false;
+    ULONGLONG m_ParkDeadline = 0;
+    bool m_Releasing = false;
+    ULONGLONG m_ReleaseDeadline = 0;
 
     DECLARE_CWDMLIST_ENTRY(CUsbDkRedirection);
 };
 
-class CUsbDkFDriverRule : public CAllocatable < USBDK_NON_PAGED_POOL, 'FDRR' >
+class CUsbDkFDriverRule : public CAllocatable < USBDK_NON_PAGED_POOL, 'FDRR' >, public CWdmRefCountingObject
 {
 public:
 
@@ -251,15 +354,167 @@ public:
 
     CString& KeyName() { return m_KeyName; }
 
+    ULONG VidPid() const { return m_VidPid; }
+
+    /* Presence of the "Driver" value as last read, returns false if it */
+    /* has to be read (again) because the instance key might have changed. */
+    /* Both are called with the index scan lock held. */
+    bool CachedHasDriver(bool &HasDriver)
+    {
+        if (!m_DriverWatched)
+        {
+            /* Watcher that failed to arm reports a change on every check */
+            m_DriverWatcher.Create(*m_KeyName, REG_NOTIFY_CHANGE_LAST_SET, false);
+            m_DriverWatched = true;
+        }
+
+        if (m_DriverWatcher.Changed())
+        {
+            m_HasDriverValid = false;
+        }
+
+        HasDriver = m_HasDriver;
+        return m_HasDriverValid;
+    }
+
+    void CacheHasDriver(bool HasDriver)
+    {
+        m_HasDriver = HasDriver;
+        m_HasDriverValid = true;
+    }
+
+    static ULONG IDHash(ULONG VidPid, ULONG PortHub)
+    { return (VidPid * 16777619UL) ^ PortHub; }
+
+    class CIDHashTraits
+    {
+    public:
+        static CUsbDkFDriverRule *&Next(CUsbDkFDriverRule *Rule)
+        { return Rule->m_IDHashNext; }
+        static ULONG Hash(const CUsbDkFDriverRule *Rule)
+        { return IDHash(Rule->m_VidPid, Rule->m_PortHub); }
+    };
+
 private:
     ULONG   m_VidPid;
     ULONG   m_PortHub;
     CString m_KeyName;                /* HKLM/CCS/Enum/USB/VidPid/Location Registry key path */
+    CUsbDkFDriverRule *m_IDHashNext = nullptr;
+    CRegKeyWatcher m_DriverWatcher;   /* Value changes of the m_KeyName key only */
+    bool m_DriverWatched = false;
+    bool m_HasDriver = false;
+    bool m_HasDriverValid = false;
+
+    virtual void OnLastReferenceGone()
+    { delete this; }
 
     static  LONG m_defaultDumpLevel;
     DECLARE_CWDMLIST_ENTRY(CUsbDkFDriverRule);
 };
 
+typedef CWdmList<CUsbDkFDriverRule, CRawAccess, CCountingObject, CRefCountingDeleter> CUsbDkFDriverRulesList;
+
+/* "Has Function Driver" rules indexed by VidPid + PortHub. */
+/* Rules of one VidPid are replaced as a whole when its Enum\USB subtree changes. */
+class CUsbDkFDriverIndex
+{
+public:
+    /* Replace all rules of VidPid with NewRules, NewRules gets emptied */
+    void Replace(ULONG VidPid, CUsbDkFDriverRulesList &NewRules);
+
+    /* Returns referenced rule for VidPid + PortHub or nullptr, */
+    /* caller inspects it without the index lock held and releases it */
+    CUsbDkFDriverRule *Reference(ULONG VidPid, ULONG PortHub)
+    {
+        CUsbDkFDriverRule *Found = nullptr;
+
+        CSharedLockedContext<> LockedContext(m_Lock);
+        m_ByID.ForEachIf(CUsbDkFDriverRule::IDHash(VidPid, PortHub),
+                         [VidPid, PortHub](CUsbDkFDriverRule *Rule) { return Rule->Match(VidPid, PortHub); },
+                         [&Found](CUsbDkFDriverRule *Rule) { Rule->AddRef(); Found = Rule; return false; });
+        return Found;
+    }
+
+    ULONG GetCount()
+    { return m_Rules.GetCount(); }
+
+private:
+    CWdmExSpinLock m_Lock;
+    CUsbDkFDriverRulesList m_Rules;
+    CWdmHashTable<CUsbDkFDriverRule, CUsbDkFDriverRule::CIDHashTraits, CRawAccess, 256> m_ByID;
+};
+
+/* Enum\USB\VID_????&PID_???? key state as of the last scan */
+class CUsbDkFDriverKey : public CAllocatable < USBDK_NON_PAGED_POOL, 'FDRK' >
+{
+public:
+    CUsbDkFDriverKey(ULONG VidPid)
+        : m_VidPid(VidPid)
+    {}
+
+    ULONG VidPid() const { return m_VidPid; }
+
+    const LARGE_INTEGER &LastWriteTime() const { return m_LastWriteTime; }
+    void SetLastWriteTime(const LARGE_INTEGER &Time) { m_LastWriteTime = Time; }
+
+    //Scan pass the key was last seen in
+    ULONG ScanPass() const { return m_ScanPass; }
+    void SetScanPass(ULONG Pass) { m_ScanPass = Pass; }
+
+    class CHashTraits
+    {
+    public:
+        static CUsbDkFDriverKey *&Next(CUsbDkFDriverKey *Key)
+        { return Key->m_HashNext; }
+        static ULONG Hash(const CUsbDkFDriverKey *Key)
+        { return Key->m_VidPid; }
+    };
+
+private:
+    ULONG m_VidPid;
+    LARGE_INTEGER m_LastWriteTime = {};
+    ULONG m_ScanPass = 0;
+    CUsbDkFDriverKey *m_HashNext = nullptr;
+
+    DECLARE_CWDMLIST_ENTRY(CUsbDkFDriverKey);
+};
+
+//Immutable copy of enumeration data shared by readers,
+//rebuilt each time a USB device appears or disappears
+class CUsbDkDeviceInfoSnapshot : public CAllocatable<USBDK_NON_PAGED_POOL, 'SEHR'>, public CWdmRefCountingObject
+{
+public:
+    static CUsbDkDeviceInfoSnapshot *Create(size_t MaxDevices, LONGLONG Generation);
+
+    USB_DK_DEVICE_INFO *Devices();
+    //Interface classes of each device, as in CUsbDkChildDevice::ClassesBitMask()
+    PULONG ClassesBitMasks();
+    size_t Count() const
+    { return m_Count; }
+    void SetCount(size_t Count)
+    { m_Count = Count; }
+    LONGLONG Generation() const
+    { return m_Generation; }
+
+private:
+    CUsbDkDeviceInfoSnapshot(size_t MaxDevices, LONGLONG Generation)
+        : m_MaxDevices(MaxDevices)
+        , m_Generation(Generation)
+    {}
+    ~CUsbDkDeviceInfoSnapshot()
+    {}
+
+    virtual void OnLastReferenceGone()
+    { delete this; }
+
+    size_t m_Count = 0;
+    size_t m_MaxDevices;
+    LONGLONG m_Generation;
+
+    CUsbDkDeviceInfoSnapshot(const CUsbDkDeviceInfoSnapshot&) = delete;
+    CUsbDkDeviceInfoSnapshot& operator= (const CUsbDkDeviceInfoSnapshot&) = delete;
+};
+
 class CDriverParamsRegistryPath final
 {
 public:
@@ -288,24 +543,55 @@ public:
     NTSTATUS Create(WDFDRIVER Driver);
     NTSTATUS Register();
 
+    //State changing requests are serialized on a dedicated queue
+    NTSTATUS ForwardToSerialQueue(CControlRequest &Request)
+    { return Request.ForwardToIoQueue(m_SerialQueue); }
+
     void RegisterFilter(CUsbDkFilterDevice &FilterDevice)
     { m_FilterDevices.PushBack(&FilterDevice); }
     void UnregisterFilter(CUsbDkFilterDevice &FilterDevice)
     { m_FilterDevices.Remove(&FilterDevice); }
 
+    //Children are looked up by ID and PDO via indices maintained by hub filters,
+    //child must be unregistered before it is destroyed
+    void RegisterChild(CUsbDkChildDevice &Child)
+    {
+        m_ChildrenByID.Add(&Child);
+        m_ChildrenByPDO.Add(&Child);
+    }
+    void UnregisterChild(CUsbDkChildDevice &Child)
+    {
+        m_ChildrenByPDO.Remove(&Child);
+        m_ChildrenByID.Remove(&Child);
+    }
+
     void RegisterHiddenDevice(CUsbDkFilterDevice &FilterDevice);
     void UnregisterHiddenDevice(CUsbDkFilterDevice &FilterDevice);
 
     ULONG CountDevices();
+    ULONG64 EnumerationGeneration()
+    { return m_EnumGeneration; }
+    void NotifyChildrenChanged()
+    { RebuildDeviceInfoSnapshot(++m_EnumGeneration); }
     NTSTATUS RescanRegistry()
-    { return ReloadPersistentHideRules(); }
+    {
+        ReloadRedirectionParameters();
+        return ReloadPersistentHideRules();
+    }
 
     bool EnumerateDevices(USB_DK_DEVICE_INFO *outBuff, size_t numberAllocatedDevices, size_t &numberExistingDevices);
+    NTSTATUS EnumerateDevicesCompact(USB_DK_COMPACT_ENUM_HEADER &Header, size_t OutputLength, size_t &BytesWritten,
+                                     const USB_DK_DEVICE_FILTER *Filter = nullptr);
+    NTSTATUS GetDescriptorsSnapshot(USB_DK_DESCRIPTORS_SNAPSHOT &Snapshot, size_t SnapshotLength, size_t &BytesWritten);
     NTSTATUS ResetUsbDevice(const USB_DK_DEVICE_ID &DeviceId);
-    NTSTATUS AddRedirect(const USB_DK_DEVICE_ID &DeviceId, HANDLE RequestorProcess, PHANDLE ObjectHandle);
+    NTSTATUS AddRedirect(const USB_DK_DEVICE_ID &DeviceId, CControlRequest &Request);
+    void CompleteRedirect(CControlRequest &Request, NTSTATUS Status);
 
     NTSTATUS AddHideRule(const USB_DK_HIDE_RULE &UsbDkRule);
-    NTSTATUS AddPersistentHideRule(const USB_DK_HIDE_RULE &UsbDkRule);
+
+    //Loads a batch of dynamic rules at once dropping duplicates,
+    //with ReplaceAll the batch replaces all existing dynamic rules
+    NTSTATUS AddHideRules(const USB_DK_HIDE_RULE *Rules, size_t NumRules, bool ReplaceAll);
 
     void ClearHideRules();
 
@@ -313,6 +599,9 @@ public:
     NTSTATUS GetConfigurationDescriptor(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request,
                                         PUSB_CONFIGURATION_DESCRIPTOR Descriptor,
                                         size_t *OutputBuffLen);
+    NTSTATUS GetConfigurationDescriptorEx(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request,
+                                          USB_DK_CONFIG_DESCRIPTOR_RESULT *Result,
+                                          size_t *OutputBuffLen);
 
     bool GetDeviceDescriptor(const USB_DK_DEVICE_ID &DeviceID,
                              USB_DEVICE_DESCRIPTOR &Descriptor);
@@ -350,26 +639,78 @@ public:
     bool NotifyRedirectorRemovalStarted(const USB_DK_DEVICE_ID &ID, ULONG pid);
     bool WaitForDetachment(const USB_DK_DEVICE_ID &ID);
 
-    NTSTATUS ReloadHasDriverList();
-
     CUsbDkChildDevice *GetChildByPDO(const PDEVICE_OBJECT PDO);
 
 private:
     NTSTATUS ReloadPersistentHideRules();
+    void ReloadRedirectionParameters();
+
+    NTSTATUS DropRedirection(const USB_DK_DEVICE_ID &DeviceId, ULONG pid);
+    bool ParkRedirection(const USB_DK_DEVICE_ID &DeviceId);
+    NTSTATUS ReattachParkedRedirection(const USB_DK_DEVICE_ID &DeviceId, CControlRequest &Request);
+    void ProcessParkedRedirections();
+    void StartParkedRelease(const USB_DK_DEVICE_ID &DeviceId);
+
+    //Returns expired parked redirections to system, runs apart
+    //from pending redirects not to delay their completion
+    WDFWORKITEM m_ParkedRedirectsWorkItem = WDF_NO_HANDLE;
+    static void ParkedRedirectsWorkItem(WDFWORKITEM WorkItem);
 
     CUsbDkControlDeviceQueue m_DeviceQueue;
+    CUsbDkControlDeviceSerialQueue m_SerialQueue;
+
+    //ADD_REDIRECT requests waiting for redirector attachment,
+    //completed by work item raised on attachment or on timer tick
+    CUsbDkPendingRedirectsQueue m_PendingRedirectsQueue;
+    WDFWORKITEM m_PendingRedirectsWorkItem = WDF_NO_HANDLE;
+    WDFTIMER m_PendingRedirectsTimer = WDF_NO_HANDLE;
+
+    NTSTATUS CreatePendingRedirectsHandlers();
+    void ProcessPendingRedirects();
+    static void PendingRedirectsWorkItem(WDFWORKITEM WorkItem);
+    static void PendingRedirectsTimer(WDFTIMER Timer);
+    static void ResetForRedirectWorker(PDEVICE_OBJECT DeviceObject, PVOID Context);
+
     static CRefCountingHolder<CUsbDkControlDevice> *m_UsbDkControlDevice;
 
     CObjHolder<CUsbDkHiderDevice, CWdfDeviceDeleter<CUsbDkHiderDevice> > m_HiderDevice;
 
-    CWdmList<CUsbDkFilterDevice, CLockedAccess, CNonCountingObject, CRefCountingDeleter> m_FilterDevices;
+    CWdmList<CUsbDkFilterDevice, CRWLockedAccess, CNonCountingObject, CRefCountingDeleter> m_FilterDevices;
+
+    //(DeviceID, InstanceID) and PDO indices of children of all filters,
+    //lookup functors run under index lock which keeps the child alive
+    CWdmHashTable<CUsbDkChildDevice, CUsbDkChildDevice::CIDHashTraits, CRWLockedAccess, 256> m_ChildrenByID;
+    CWdmHashTable<CUsbDkChildDevice, CUsbDkChildDevice::CPDOHashTraits, CRWLockedAccess, 256> m_ChildrenByPDO;
+
+    //Incremented each time a USB device appears or disappears,
+    //lets user mode to validate its cached per-device data
+    CAtomicCounter m_EnumGeneration;
+
+    //Served to COUNT, ENUM and compact enumeration requests, nullptr if
+    //the last rebuild failed, in that case children are walked directly
+    CObjHolder<CUsbDkDeviceInfoSnapshot, CRefCountingDeleter> m_DeviceInfoSnapshot;
+    LONGLONG m_DeviceInfoSnapshotGeneration = 0;
+    CWdmSpinLock m_DeviceInfoSnapshotLock;
+
+    void RebuildDeviceInfoSnapshot(LONGLONG Generation);
+    CUsbDkDeviceInfoSnapshot *ReferenceDeviceInfoSnapshot();
+    ULONG CountChildren();
+    bool EnumerateChildren(USB_DK_DEVICE_INFO *outBuff, size_t numberAllocatedDevices, size_t &numberExistingDevices,
+                           PULONG ClassesBitMasks = nullptr);
 
     CWdmList<CUsbDkFilterDevice, CRawAccess, CNonCountingObject, CRefCountingDeleter> m_HiddenDevices;
     CWdmSpinLock m_HiddenDevicesLock;
 
+    //Serial numbers of hidden devices in use, guarded by m_HiddenDevicesLock
+    using THiddenSerialNumbers = CUsbDkNumberBitmap<CPrimitiveAllocator<USBDK_NON_PAGED_POOL, ULONG, 'NSHR'>>;
+    THiddenSerialNumbers m_HiddenSerialNumbers;
+
     typedef CWdmSet<CUsbDkRedirection, CLockedAccess, CNonCountingObject, CRefCountingDeleter> RedirectionsSet;
     RedirectionsSet m_Redirections;
 
+    //Seconds to keep redirection parked after its last handle is closed
+    ULONG m_ParkTimeout = 0;
+
     typedef CWdmSet<CUsbDkHideRule, CLockedAccess, CNonCountingObject> HideRulesSet;
     HideRulesSet m_HideRules;
     HideRulesSet m_PersistentHideRules;
@@ -377,13 +718,45 @@ private:
     HideRulesSet m_PersistentExtHideRules;
 
     NTSTATUS AddHideRuleToSet(const USB_DK_HIDE_RULE &UsbDkRule, HideRulesSet &Set);
+    NTSTATUS AddPersistentHideRule(const USB_DK_HIDE_RULE &UsbDkRule);
+
+    //Rebuilt after each change of the rule sets above and used by ShouldHideDevice,
+    //nullptr if the last rebuild failed, in that case the sets are walked directly
+    CObjHolder<CUsbDkHideRulesEngine, CRefCountingDeleter> m_HideRulesEngine;
+    LONGLONG m_HideRulesEngineGeneration = 0;
+    mutable CWdmSpinLock m_HideRulesEngineLock;
+    CAtomicCounter m_HideRulesGeneration;
+    mutable CUsbDkHideDecisionCache m_HideDecisions;
 
-    /* DeviceID + LocationID list of "Function Driver" registry keys */
-    typedef CWdmSet<CUsbDkFDriverRule, CLockedAccess, CCountingObject> FDriverRulesSet;
-    FDriverRulesSet m_FDriversRules;
+    void CompileHideRules();
+    CUsbDkHideRulesEngine *ReferenceHideRulesEngine(LONGLONG &Generation) const;
+    bool ShouldHideDeviceByRuleSets(CUsbDkChildDevice &Device) const;
+
+    /* DeviceID + LocationID index of "Function Driver" registry keys */
+    CUsbDkFDriverIndex m_FDriversRules;
     CString m_RootName;
     bool m_FDriverInited = false;        /* Set after m_RootName created. */
 
+    /* Enum\USB change tracking, all of it is guarded by m_FDriverScanLock */
+    CWdmEvent m_FDriverScanLock{ SynchronizationEvent, TRUE };
+    CRegKeyWatcher m_FDriverWatcher;
+    CWdmList<CUsbDkFDriverKey, CRawAccess, CNonCountingObject> m_FDriverKeys;
+    CWdmHashTable<CUsbDkFDriverKey, CUsbDkFDriverKey::CHashTraits, CRawAccess, 64> m_FDriverKeysByVidPid;
+    ULONG m_FDriverScanPass = 0;
+
+    static bool GetRawFiltIdent(const CUsbDkChildDevice &Device, ULONG &VidPid, ULONG &PortHub);
+    bool ShouldRawFiltIdent(ULONG VidPid, ULONG PortHub, bool Is2ndCall,
+                            CObjHolder<CUsbDkFDriverRule, CRefCountingDeleter> &ReinstallEntry);
+    static void SetRawDeviceToReinstall(CUsbDkChildDevice &Device, CUsbDkFDriverRule &Entry);
+    bool RuleHasDriver(CUsbDkFDriverRule &Rule, bool &HasDriver);
+    static bool RuleHasDriverLocked(CUsbDkFDriverRule &Rule, bool &HasDriver);
+
+    NTSTATUS InitHasDriverList();
+    void UpdateHasDriverList(ULONG MissedVidPid = 0);
+    NTSTATUS ScanHasDriverList();
+    NTSTATUS ReloadHasDriverKey(CRegKey &RootKey, ULONG VidPid);
+    CUsbDkFDriverKey *FindHasDriverKey(ULONG VidPid);
+
     template <typename TPredicate, typename TFunctor>
     bool UsbDevicesForEachIf(TPredicate Predicate, TFunctor Functor)
     { return m_FilterDevices.ForEach([&](CUsbDkFilterDevice* Dev){ return Dev->EnumerateChildrenIf(Predicate, Functor); }); }
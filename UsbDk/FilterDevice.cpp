@@ -141,6 +141,18 @@ void CUsbDkHubFilterStrategy::Delete()
     if (m_ControlDevice != nullptr)
     {
         m_ControlDevice->UnregisterFilter(*m_Owner);
+
+        bool HadChildren = false;
+        Children().ForEach([this, &HadChildren](CUsbDkChildDevice *Child)
+                           {
+                               m_ControlDevice->UnregisterChild(*Child);
+                               HadChildren = true;
+                               return true;
+                           });
+        if (HadChildren)
+        {
+            m_ControlDevice->NotifyChildrenChanged();
+        }
     }
 
     CUsbDkFilterStrategy::Delete();
@@ -199,9 +211,6 @@ public:
     bool ForEach(TFunctor Functor) const
     { return ForEachIf(ConstTrue, Functor); }
 
-    bool Contains(const CUsbDkChildDevice &Dev) const
-    { return !ForEach([&Dev](PDEVICE_OBJECT Relation) { return !Dev.Match(Relation); }); }
-
     void Dump() const
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Array size: %lu (ptr: %p)",
@@ -301,8 +310,13 @@ NTSTATUS CUsbDkHubFilterStrategy::PNPPreProcess(PIRP Irp)
                                         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Starting relations array processing:");
                                         Relations.Dump();
 
-                                        DropRemovedDevices(Relations);
-                                        AddNewDevices(Relations);
+                                        //Snapshot is rebuilt once per pass, not per child
+                                        auto Dropped = DropRemovedDevices(Relations);
+                                        auto Added = AddNewDevices(Relations);
+                                        if (Dropped || Added)
+                                        {
+                                            m_ControlDevice->NotifyChildrenChanged();
+                                        }
                                         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Finished relations array processing");
                                         return STATUS_SUCCESS;
                                     });
@@ -318,16 +332,33 @@ NTSTATUS CUsbDkHubFilterStrategy::PNPPreProcess(PIRP Irp)
     return CUsbDkFilterStrategy::PNPPreProcess(Irp);
 }
 
-void CUsbDkHubFilterStrategy::DropRemovedDevices(const CDeviceRelations &Relations)
+bool CUsbDkHubFilterStrategy::DropRemovedDevices(const CDeviceRelations &Relations)
 {
     //Child device must be deleted on PASSIVE_LEVEL
     //So we put those to non-locked list and let its destructor do the job
     CWdmList<CUsbDkChildDevice, CRawAccess, CNonCountingObject> ToBeDeleted;
-    Children().ForEachDetachedIf([&Relations](CUsbDkChildDevice *Child) { return !Relations.Contains(*Child); },
-                                 [&ToBeDeleted](CUsbDkChildDevice *Child) -> bool
+
+    //Mark children present in relations array, unmarked ones are gone
+    auto Pass = ++m_RelationsPass;
+    Relations.ForEach([this, Pass](PDEVICE_OBJECT PDO)
+                      {
+                          m_ChildrenByPDO.ForEachIf(CUsbDkChildDevice::PDOHash(PDO),
+                                                    [PDO](CUsbDkChildDevice *Child) { return Child->Match(PDO); },
+                                                    [Pass](CUsbDkChildDevice *Child)
+                                                    {
+                                                        Child->SetRelationsPass(Pass);
+                                                        return false;
+                                                    });
+                          return true;
+                      });
+
+    Children().ForEachDetachedIf([Pass](CUsbDkChildDevice *Child) { return Child->RelationsPass() != Pass; },
+                                 [this, &ToBeDeleted](CUsbDkChildDevice *Child) -> bool
                                  {
                                      TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Deleting child object:");
                                      Child->Dump();
+                                     m_ChildrenByPDO.Remove(Child);
+                                     m_ControlDevice->UnregisterChild(*Child);
                                      ToBeDeleted.PushBack(Child);
                                      return true;
                                  });
@@ -339,6 +370,7 @@ void CUsbDkHubFilterStrategy::DropRemovedDevices(const CDeviceRelations &Relatio
                             m_ControlDevice->NotifyRedirectionRemoved(*Device);
                             return true;
                         });
+    return !ToBeDeleted.IsEmpty();
 }
 
 void CUsbDkHubFilterStrategy::DropAllDevices()
@@ -346,13 +378,19 @@ void CUsbDkHubFilterStrategy::DropAllDevices()
     //Child device must be deleted on PASSIVE_LEVEL
     //So we put those to non-locked list and let its destructor do the job
     CWdmList<CUsbDkChildDevice, CRawAccess, CNonCountingObject> ToBeDeleted;
-    Children().ForEachDetached([&ToBeDeleted](CUsbDkChildDevice *Child) -> bool
+    Children().ForEachDetached([this, &ToBeDeleted](CUsbDkChildDevice *Child) -> bool
                                {
                                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Deleting child object:");
                                    Child->Dump();
+                                   m_ChildrenByPDO.Remove(Child);
+                                   m_ControlDevice->UnregisterChild(*Child);
                                    ToBeDeleted.PushBack(Child);
                                    return true;
                                });
+    if (!ToBeDeleted.IsEmpty())
+    {
+        m_ControlDevice->NotifyChildrenChanged();
+    }
     ToBeDeleted.ForEach([this](CUsbDkChildDevice *Device) -> bool
                         {
                             /* If the device is ReallyRaw, make it re-install on next plug */
@@ -365,26 +403,25 @@ void CUsbDkHubFilterStrategy::DropAllDevices()
 
 bool CUsbDkHubFilterStrategy::IsChildRegistered(PDEVICE_OBJECT PDO)
 {
-    return !Children().ForEachIf([PDO](CUsbDkChildDevice *Child)
-                                 {
-                                     if (Child->Match(PDO))
-                                     {
-                                         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! PDO %p already registered:", PDO);
-                                         Child->Dump();
-                                         return true;
-                                     }
-                                     return false;
-                                 },
-                                 ConstFalse);
+    return !m_ChildrenByPDO.ForEachIf(CUsbDkChildDevice::PDOHash(PDO),
+                                      [PDO](CUsbDkChildDevice *Child) { return Child->Match(PDO); },
+                                      [PDO](CUsbDkChildDevice *Child)
+                                      {
+                                          TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! PDO %p already registered:", PDO);
+                                          Child->Dump();
+                                          return false;
+                                      });
 }
 
-void CUsbDkHubFilterStrategy::AddNewDevices(const CDeviceRelations &Relations)
+bool CUsbDkHubFilterStrategy::AddNewDevices(const CDeviceRelations &Relations)
 {
+    bool Added = false;
     Relations.ForEachIf([this](PDEVICE_OBJECT PDO){ return !IsChildRegistered(PDO); },
-                        [this](PDEVICE_OBJECT PDO){ RegisterNewChild(PDO); return true; });
+                        [this, &Added](PDEVICE_OBJECT PDO){ if (RegisterNewChild(PDO)) { Added = true; } return true; });
+    return Added;
 }
 
-void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
+bool CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
 {
     CWdmUsbDeviceAccess pdoAccess(PDO);
 
@@ -400,7 +437,7 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
     if (!UsbDkGetWdmDeviceIdentity(PDO, &DevID, &InstanceID, &LocationID))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot query device identity");
-        return;
+        return false;
     }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Registering new child (PDO: %p):", PDO);
@@ -412,21 +449,21 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
     if (!DevID->MatchPrefix(L"USB\\"))
     {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_FILTERDEVICE, "%!FUNC! Not a usb device, skip child registration");
-        return;
+        return false;
     }
 
     auto Port = pdoAccess.GetAddress();
     if (Port == CWdmDeviceAccess::NO_ADDRESS)
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot read device port number");
-        return;
+        return false;
     }
 
     auto Speed = UsbDkWdmUsbDeviceGetSpeed(PDO, m_Owner->GetDriverObject());
     if (Speed == NoSpeed)
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot query device speed");
-        return;
+        return false;
     }
 
     USB_DEVICE_DESCRIPTOR DevDescriptor;
@@ -434,7 +471,7 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot query device descriptor");
-        return;
+        return false;
     }
 
 #if (NTDDI_VERSION == NTDDI_WIN7)
@@ -451,13 +488,13 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
     if (!CfgDescriptors.Create())
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot create descriptors cache");
-        return;
+        return false;
     }
 
     if (!FetchConfigurationDescriptors(pdoAccess, CfgDescriptors))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot fetch configuration descriptors");
-        return;
+        return false;
     }
 
     CUsbDkChildDevice *Device = new CUsbDkChildDevice(DevID, InstanceID, LocationID, Port, Speed,
@@ -466,7 +503,7 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
     if (Device == nullptr)
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE, "%!FUNC! Cannot allocate child device instance");
-        return;
+        return false;
     }
 
     DevID.detach();
@@ -476,8 +513,11 @@ void CUsbDkHubFilterStrategy::RegisterNewChild(PDEVICE_OBJECT PDO)
     TraceEvents(TRACE_LEVEL_ERROR, TRACE_FILTERDEVICE,
         "%!FUNC! Adding child 0x%p PDO 0x%p", Device, PDO);
     Children().PushBack(Device);
+    m_ChildrenByPDO.Add(Device);
+    m_ControlDevice->RegisterChild(*Device);
 
     ApplyRedirectionPolicy(*Device);
+    return true;
 }
 
 bool CUsbDkHubFilterStrategy::FetchConfigurationDescriptors(CWdmUsbDeviceAccess &devAccess,
@@ -95,9 +95,60 @@ public:
         return false;
     }
 
+    bool ConfigurationDescriptorLength(UCHAR Index, size_t &Length)
+    {
+        if (Index < m_CfgDescriptors.Size())
+        {
+            Length = m_CfgDescriptors.EntrySize(Index);
+            return true;
+        }
+        return false;
+    }
+
     bool Match(PCWCHAR deviceID, PCWCHAR instanceID) const
     { return m_DeviceID->Match(deviceID) && m_InstanceID->Match(instanceID); }
 
+    static ULONG IDHash(PCWCHAR deviceID, PCWCHAR instanceID)
+    { return UsbDkStringHash(instanceID, UsbDkStringHash(deviceID)); }
+
+    class CIDHashTraits
+    {
+    public:
+        static CUsbDkChildDevice *&Next(CUsbDkChildDevice *Child)
+        { return Child->m_IDHashNext; }
+        static ULONG Hash(const CUsbDkChildDevice *Child)
+        { return IDHash(Child->DeviceID(), Child->InstanceID()); }
+    };
+
+    static ULONG PDOHash(PDEVICE_OBJECT PDO)
+    { return UsbDkPointerHash(PDO); }
+
+    //Child is indexed by PDO both globally and by its hub,
+    //so each index has its own chain link
+    class CPDOHashTraits
+    {
+    public:
+        static CUsbDkChildDevice *&Next(CUsbDkChildDevice *Child)
+        { return Child->m_PDOHashNext; }
+        static ULONG Hash(const CUsbDkChildDevice *Child)
+        { return PDOHash(Child->PDO()); }
+    };
+
+    class CHubPDOHashTraits
+    {
+    public:
+        static CUsbDkChildDevice *&Next(CUsbDkChildDevice *Child)
+        { return Child->m_HubPDOHashNext; }
+        static ULONG Hash(const CUsbDkChildDevice *Child)
+        { return PDOHash(Child->PDO()); }
+    };
+
+    //Relations processing pass the child was last reported in
+    ULONG RelationsPass() const
+    { return m_RelationsPass; }
+    void SetRelationsPass(ULONG Pass)
+    { m_RelationsPass = Pass; }
+
     bool Match(PDEVICE_OBJECT PDO) const
     { return m_PDO == PDO; }
 
@@ -138,6 +189,11 @@ private:
     UCHAR m_RawConfiguration = 0;      /* We're only setting configuration on devices marked raw */
     CString m_HwKeyPath;
 
+    CUsbDkChildDevice *m_IDHashNext = nullptr;
+    CUsbDkChildDevice *m_PDOHashNext = nullptr;
+    CUsbDkChildDevice *m_HubPDOHashNext = nullptr;
+    ULONG m_RelationsPass = 0;
+
     void DetermineDeviceClasses();
 
     DECLARE_CWDMLIST_ENTRY(CUsbDkChildDevice);
@@ -157,14 +213,17 @@ public:
     ~CUsbDkHubFilterStrategy() {};
 
 private:
-    void DropRemovedDevices(const CDeviceRelations &Relations);
+    bool DropRemovedDevices(const CDeviceRelations &Relations);
     void DropAllDevices();
-    void AddNewDevices(const CDeviceRelations &Relations);
-    void RegisterNewChild(PDEVICE_OBJECT PDO);
+    bool AddNewDevices(const CDeviceRelations &Relations);
+    bool RegisterNewChild(PDEVICE_OBJECT PDO);
     void ApplyRedirectionPolicy(CUsbDkChildDevice &Device);
     bool FetchConfigurationDescriptors(CWdmUsbDeviceAccess &devAccess,
                                        CUsbDkChildDevice::TDescriptorsCache &DescriptorsHolder);
     bool IsChildRegistered(PDEVICE_OBJECT PDO);
+
+    CWdmHashTable<CUsbDkChildDevice, CUsbDkChildDevice::CHubPDOHashTraits, CRWLockedAccess, 128> m_ChildrenByPDO;
+    ULONG m_RelationsPass = 0;
 };
 
 class CUsbDkFilterDevice : public CWdfDevice,
@@ -51,7 +51,7 @@ public:
 
     virtual NTSTATUS MakeAvailable() = 0;
 
-    typedef CWdmList<CUsbDkChildDevice, CLockedAccess, CCountingObject> TChildrenList;
+    typedef CWdmList<CUsbDkChildDevice, CRWLockedAccess, CCountingObject> TChildrenList;
 
     virtual TChildrenList& Children()
     { return m_Children; }
@@ -26,6 +26,10 @@
 #define USBDK_PARAMS_SUBKEY_NAME        TEXT("Parameters")
 #define USBDK_HIDE_RULES_SUBKEY_NAME    TEXT("HideRules")
 
+//DWORD, seconds to keep closed redirection attached for reuse,
+//0 or missing value disables redirection parking
+#define USBDK_REDIRECTION_PARK_TIMEOUT  TEXT("RedirectionParkTimeout")
+
 #define USBDK_HIDE_RULE_SHOULD_HIDE     TEXT("ShouldHide")
 #define USBDK_HIDE_RULE_VID             TEXT("VID")
 #define USBDK_HIDE_RULE_PID             TEXT("PID")
@@ -33,6 +37,14 @@
 #define USBDK_HIDE_RULE_CLASS           TEXT("Class")
 #define USBDK_HIDE_RULE_TYPE            TEXT("Type")
 
+//REG_BINARY in the hide rules key holding all persistent rules,
+//legacy per-rule subkeys are still honored when present
+#define USBDK_HIDE_RULES_BLOB           TEXT("Rules")
+
+#define USBDK_PARAMS_PATH        TEXT("SYSTEM\\CurrentControlSet\\Services\\") \
+                                 USBDK_DRIVER_NAME TEXT("\\")                  \
+                                 USBDK_PARAMS_SUBKEY_NAME
+
 #define USBDK_HIDE_RULES_PATH    TEXT("SYSTEM\\CurrentControlSet\\Services\\") \
                                  USBDK_DRIVER_NAME TEXT("\\")                  \
                                  USBDK_PARAMS_SUBKEY_NAME TEXT("\\")           \
@@ -50,3 +62,89 @@ static inline ULONG64 HideRuleBoolFromRegistry(DWORD Value)
 {
     return !!Value;
 }
+
+#define USBDK_HIDE_RULES_BLOB_SIGNATURE 0x52484455 /* "UDHR" */
+#define USBDK_HIDE_RULES_BLOB_VERSION   1
+
+typedef struct tag_USBDK_REG_HIDE_RULES_HEADER
+{
+    DWORD Signature;
+    DWORD Version;
+    DWORD NumRules;
+    DWORD Checksum;
+} USBDK_REG_HIDE_RULES_HEADER, *PUSBDK_REG_HIDE_RULES_HEADER;
+
+//Rule fields are stored in registry format, i.e. the same
+//way as values of legacy per-rule subkeys
+typedef struct tag_USBDK_REG_HIDE_RULE
+{
+    DWORD Type;
+    DWORD Hide;
+    DWORD VID;
+    DWORD PID;
+    DWORD BCD;
+    DWORD Class;
+} USBDK_REG_HIDE_RULE, *PUSBDK_REG_HIDE_RULE;
+
+static inline DWORD HideRulesBlobChecksum(const USBDK_REG_HIDE_RULE *Rules, DWORD NumRules)
+{
+    //FNV-1a over rules array
+    auto Bytes = reinterpret_cast<const unsigned char *>(Rules);
+    DWORD Hash = 2166136261;
+
+    for (SIZE_T i = 0; i < NumRules * sizeof(USBDK_REG_HIDE_RULE); i++)
+    {
+        Hash = (Hash ^ Bytes[i]) * 16777619;
+    }
+
+    return Hash ^ NumRules;
+}
+
+static inline SIZE_T HideRulesBlobSize(DWORD NumRules)
+{
+    return sizeof(USBDK_REG_HIDE_RULES_HEADER) + NumRules * sizeof(USBDK_REG_HIDE_RULE);
+}
+
+//Returns rules array of a valid blob or nullptr
+static inline const USBDK_REG_HIDE_RULE *HideRulesFromRegistryBlob(const void *Blob, SIZE_T Size, DWORD &NumRules)
+{
+    auto Header = static_cast<const USBDK_REG_HIDE_RULES_HEADER *>(Blob);
+
+    if ((Size < sizeof(*Header)) ||
+        (Header->Signature != USBDK_HIDE_RULES_BLOB_SIGNATURE) ||
+        (Header->Version != USBDK_HIDE_RULES_BLOB_VERSION) ||
+        (Header->NumRules > (Size - sizeof(*Header)) / sizeof(USBDK_REG_HIDE_RULE)) ||
+        (Size != HideRulesBlobSize(Header->NumRules)))
+    {
+        return nullptr;
+    }
+
+    auto Rules = reinterpret_cast<const USBDK_REG_HIDE_RULE *>(Header + 1);
+    if (Header->Checksum != HideRulesBlobChecksum(Rules, Header->NumRules))
+    {
+        return nullptr;
+    }
+
+    NumRules = Header->NumRules;
+    return Rules;
+}
+
+static inline void HideRuleFromRegistry(const USBDK_REG_HIDE_RULE &RegRule, USB_DK_HIDE_RULE &Rule)
+{
+    Rule.Type  = RegRule.Type;
+    Rule.Hide  = HideRuleBoolFromRegistry(RegRule.Hide);
+    Rule.VID   = HideRuleUlongMaskFromRegistry(RegRule.VID);
+    Rule.PID   = HideRuleUlongMaskFromRegistry(RegRule.PID);
+    Rule.BCD   = HideRuleUlongMaskFromRegistry(RegRule.BCD);
+    Rule.Class = HideRuleUlongMaskFromRegistry(RegRule.Class);
+}
+
+static inline void HideRuleToRegistry(const USB_DK_HIDE_RULE &Rule, USBDK_REG_HIDE_RULE &RegRule)
+{
+    RegRule.Type  = static_cast<DWORD>(Rule.Type);
+    RegRule.Hide  = static_cast<DWORD>(Rule.Hide);
+    RegRule.VID   = static_cast<DWORD>(Rule.VID);
+    RegRule.PID   = static_cast<DWORD>(Rule.PID);
+    RegRule.BCD   = static_cast<DWORD>(Rule.BCD);
+    RegRule.Class = static_cast<DWORD>(Rule.Class);
+}
@@ -114,6 +114,45 @@ void CUsbDkHiderDeviceQueue::DeviceControl(WDFQUEUE Queue,
             WdfRequest.SetStatus(status);
             return;
         }
+        case IOCTL_USBDK_ADD_HIDE_RULES:
+        {
+            PUSB_DK_HIDE_RULES_HEADER Header;
+            size_t Length;
+
+            auto status = WdfRequest.FetchInputObject(Header, &Length);
+            if (NT_SUCCESS(status) &&
+                (Header->NumRules > (Length - sizeof(*Header)) / sizeof(USB_DK_HIDE_RULE)))
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_HIDERDEVICE, "%!FUNC! Wrong request buffer size (%llu rules in %llu bytes)",
+                            Header->NumRules, static_cast<ULONG64>(Length));
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+
+            if (!NT_SUCCESS(status))
+            {
+                WdfRequest.SetBytesRead(0);
+                WdfRequest.SetStatus(status);
+                return;
+            }
+
+            auto devExt = UsbDkHiderGetContext(WdfIoQueueGetDevice(Queue));
+            auto ControlDevice = CUsbDkControlDevice::Reference(devExt->UsbDkHider->DriverHandle());
+            if (ControlDevice == nullptr)
+            {
+                WdfRequest.SetBytesRead(0);
+                WdfRequest.SetStatus(STATUS_INSUFFICIENT_RESOURCES);
+                return;
+            }
+
+            status = ControlDevice->AddHideRules(reinterpret_cast<PUSB_DK_HIDE_RULE>(Header + 1),
+                                                 static_cast<size_t>(Header->NumRules),
+                                                 (Header->Flags & USBDK_HIDE_RULES_REPLACE_ALL) != 0);
+
+            CUsbDkControlDevice::Release();
+            WdfRequest.SetBytesRead(Length);
+            WdfRequest.SetStatus(status);
+            return;
+        }
         case IOCTL_USBDK_CLEAR_HIDE_RULES:
         {
             WdfRequest.SetBytesRead(0);
@@ -43,12 +43,24 @@
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x855, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
 #define IOCTL_USBDK_UPDATE_REG_PARAMETERS \
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x858, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
+#define IOCTL_USBDK_GET_CONFIG_DESCRIPTOR_EX \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x859, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
+#define IOCTL_USBDK_GET_ENUM_GENERATION \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85A, METHOD_BUFFERED, FILE_READ_ACCESS ))
+#define IOCTL_USBDK_GET_DESCRIPTORS_SNAPSHOT \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85B, METHOD_BUFFERED, FILE_READ_ACCESS ))
+#define IOCTL_USBDK_ENUM_DEVICES_COMPACT \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85C, METHOD_BUFFERED, FILE_READ_ACCESS ))
+#define IOCTL_USBDK_ENUM_DEVICES_FILTERED \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85D, METHOD_BUFFERED, FILE_READ_ACCESS ))
 
 // UsbDk Hider device IOCTLs
 #define IOCTL_USBDK_ADD_HIDE_RULE \
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x856, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
 #define IOCTL_USBDK_CLEAR_HIDE_RULES \
     ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x857, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
+#define IOCTL_USBDK_ADD_HIDE_RULES \
+    ULONG(CTL_CODE( USBDK_DEVICE_TYPE, 0x85E, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS ))
 
 //UsbDk redirector device IOCTLs
 #define IOCTL_USBDK_DEVICE_ABORT_PIPE \
@@ -145,3 +145,76 @@ NTSTATUS CRegKey::SetValueInfo(const UNICODE_STRING &ValueName,
                              Info->DataLength);
     return status;
 }
+
+NTSTATUS CRegKey::NotifyChange(HANDLE Event, PIO_STATUS_BLOCK IoStatus, ULONG Filter, bool WatchTree)
+{
+    auto status = ZwNotifyChangeKey(m_Key,
+                                    Event,
+                                    nullptr,
+                                    nullptr,
+                                    IoStatus,
+                                    Filter,
+                                    WatchTree ? TRUE : FALSE,
+                                    nullptr,
+                                    0,
+                                    TRUE);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_REGISTRY,
+            "%!FUNC! Failed to arm change notification (status: %!STATUS!)", status);
+    }
+
+    return status;
+}
+
+CRegKeyWatcher::~CRegKeyWatcher()
+{
+    //Pending notification keeps its own reference to the event
+    //and gets cancelled when m_Key is closed
+    if (m_Event != nullptr)
+    {
+        ZwClose(m_Event);
+    }
+}
+
+NTSTATUS CRegKeyWatcher::Create(const UNICODE_STRING &RegPath, ULONG Filter, bool WatchTree)
+{
+    m_Filter = Filter;
+    m_WatchTree = WatchTree;
+
+    auto status = m_Key.Open(RegPath);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    OBJECT_ATTRIBUTES EventAttributes;
+    InitializeObjectAttributes(&EventAttributes, nullptr, OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+    status = ZwCreateEvent(&m_Event, EVENT_ALL_ACCESS, &EventAttributes, SynchronizationEvent, FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_REGISTRY,
+            "%!FUNC! Failed to create notification event (status: %!STATUS!)", status);
+        m_Event = nullptr;
+    }
+
+    return status;
+}
+
+bool CRegKeyWatcher::Changed()
+{
+    if (m_Armed)
+    {
+        LARGE_INTEGER NoWait = {};
+        if (ZwWaitForSingleObject(m_Event, FALSE, &NoWait) != STATUS_SUCCESS)
+        {
+            return false;
+        }
+    }
+
+    //Re-arm before the caller rescans so changes made
+    //during the rescan are reported by the next call
+    m_Armed = (m_Event != nullptr) && NT_SUCCESS(m_Key.NotifyChange(m_Event, &m_IoStatus, m_Filter, m_WatchTree));
+    return true;
+}
@@ -34,6 +34,14 @@ public:
 
     template<typename TFunctor>
     NTSTATUS ForEachSubKey(TFunctor Functor)
+    {
+        return ForEachSubKeyWithTime([&Functor](CStringHolder &Name, const LARGE_INTEGER &)
+                                     { Functor(Name); });
+    }
+
+    //Functor receives subkey name and its last write time
+    template<typename TFunctor>
+    NTSTATUS ForEachSubKeyWithTime(TFunctor Functor)
     {
         auto status = STATUS_SUCCESS;
         for (ULONG Index = 0; status == STATUS_SUCCESS; Index++)
@@ -46,7 +54,7 @@ public:
                 CStringHolder Name;
                 Name.Attach(Info->Name, static_cast<USHORT>(Info->NameLength));
 
-                Functor(Name);
+                Functor(Name, Info->LastWriteTime);
             }
         }
 
@@ -76,6 +84,11 @@ public:
     NTSTATUS SetValueInfo(const UNICODE_STRING &ValueName,
                             PKEY_VALUE_PARTIAL_INFORMATION Info);
 
+    //Arms asynchronous notification signaling Event on changes
+    //selected by Filter (REG_NOTIFY_CHANGE_*) of the key,
+    //and of its subkeys if WatchTree is set
+    NTSTATUS NotifyChange(HANDLE Event, PIO_STATUS_BLOCK IoStatus, ULONG Filter, bool WatchTree);
+
 protected:
 
     NTSTATUS QuerySubkeyInfo(ULONG Index,
@@ -84,3 +97,29 @@ protected:
 
     HANDLE m_Key = nullptr;
 };
+
+//Tracks changes of a registry key or subtree. Notification is polled
+//by the owner, so nothing runs in context of registry writers.
+class CRegKeyWatcher
+{
+public:
+    ~CRegKeyWatcher();
+
+    NTSTATUS Create(const UNICODE_STRING &RegPath, ULONG Filter, bool WatchTree);
+
+    //Returns true if the key might have changed since previous call,
+    //true is returned also when notification could not be armed.
+    //Must not be called concurrently.
+    bool Changed();
+
+    CRegKey &Key()
+    { return m_Key; }
+
+private:
+    CRegKey m_Key;
+    HANDLE m_Event = nullptr;
+    IO_STATUS_BLOCK m_IoStatus;
+    ULONG m_Filter = 0;
+    bool m_WatchTree = false;
+    bool m_Armed = false;
+};
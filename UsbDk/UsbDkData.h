@@ -45,12 +45,97 @@ typedef struct tag_USB_DK_DEVICE_INFO
     USB_DEVICE_DESCRIPTOR DeviceDescriptor;
 } USB_DK_DEVICE_INFO, *PUSB_DK_DEVICE_INFO;
 
+#define USB_DK_DEVICE_FILTER_MATCH_ALL ((ULONG64)(-1))
+
+// Predicate of IOCTL_USBDK_ENUM_DEVICES_FILTERED,
+// each field may be USB_DK_DEVICE_FILTER_MATCH_ALL
+typedef struct tag_USB_DK_DEVICE_FILTER
+{
+    ULONG64 Class;      // Mask of (1 << USB class), matched as for determinative type hide rules
+    ULONG64 VID;
+    ULONG64 PID;
+    ULONG64 BCD;
+    ULONG64 FilterID;   // Hub the device is attached to, as reported in USB_DK_DEVICE_INFO
+} USB_DK_DEVICE_FILTER, *PUSB_DK_DEVICE_FILTER;
+
+// IOCTL_USBDK_ENUM_DEVICES_COMPACT output layout.
+// All offsets are in bytes, DevicesOffset and StringsOffset are
+// relative to the beginning of the output, string offsets of
+// device records are relative to the string table:
+//
+//   USB_DK_COMPACT_ENUM_HEADER                              header
+//   USB_DK_COMPACT_DEVICE_INFO[NumDevices]                  at DevicesOffset, DeviceRecordSize each
+//   Deduplicated NULL-terminated WCHAR strings              at StringsOffset
+
+#define USB_DK_COMPACT_ENUM_VERSION (1)
+
+typedef struct tag_USB_DK_COMPACT_ENUM_HEADER
+{
+    ULONG Version;          // USB_DK_COMPACT_ENUM_VERSION
+    ULONG Length;           // Output length, or length required if output buffer is too short
+    ULONG NumDevices;
+    ULONG DevicesOffset;
+    ULONG DeviceRecordSize; // Records may grow in later versions, use as a stride
+    ULONG StringsOffset;
+    ULONG StringsLength;
+    ULONG Reserved;
+    ULONG64 Generation;     // Enumeration generation the list belongs to
+} USB_DK_COMPACT_ENUM_HEADER, *PUSB_DK_COMPACT_ENUM_HEADER;
+
+typedef struct tag_USB_DK_COMPACT_DEVICE_INFO
+{
+    ULONG DeviceIDOffset;
+    ULONG InstanceIDOffset;
+    ULONG FilterID;
+    ULONG Port;
+    ULONG Speed;
+    USB_DEVICE_DESCRIPTOR DeviceDescriptor;
+} USB_DK_COMPACT_DEVICE_INFO, *PUSB_DK_COMPACT_DEVICE_INFO;
+
 typedef struct tag_USB_DK_CONFIG_DESCRIPTOR_REQUEST
 {
     USB_DK_DEVICE_ID ID;
     ULONG64 Index;
 } USB_DK_CONFIG_DESCRIPTOR_REQUEST, *PUSB_DK_CONFIG_DESCRIPTOR_REQUEST;
 
+// Header of IOCTL_USBDK_GET_CONFIG_DESCRIPTOR_EX output,
+// followed by the full configuration descriptor
+typedef struct tag_USB_DK_CONFIG_DESCRIPTOR_RESULT
+{
+    ULONG64 Generation; // Enumeration generation the descriptor belongs to
+    ULONG64 Length;     // Full descriptor length (wTotalLength)
+} USB_DK_CONFIG_DESCRIPTOR_RESULT, *PUSB_DK_CONFIG_DESCRIPTOR_RESULT;
+
+// IOCTL_USBDK_GET_DESCRIPTORS_SNAPSHOT output layout.
+// All offsets are in bytes from the beginning of the snapshot
+// and are aligned to 8 bytes:
+//
+//   USB_DK_DESCRIPTORS_SNAPSHOT                      header
+//   USB_DK_SNAPSHOT_DEVICE[NumDevices]               at DevicesOffset
+//   USB_DK_SNAPSHOT_CONFIG[NumConfigurations]        at ConfigsOffset of each device
+//   Configuration descriptors                        at Offset of each config
+
+typedef struct tag_USB_DK_SNAPSHOT_CONFIG
+{
+    ULONG64 Offset;
+    ULONG64 Length;
+} USB_DK_SNAPSHOT_CONFIG, *PUSB_DK_SNAPSHOT_CONFIG;
+
+typedef struct tag_USB_DK_SNAPSHOT_DEVICE
+{
+    USB_DK_DEVICE_INFO Info;
+    ULONG64 NumConfigurations;
+    ULONG64 ConfigsOffset;
+} USB_DK_SNAPSHOT_DEVICE, *PUSB_DK_SNAPSHOT_DEVICE;
+
+typedef struct tag_USB_DK_DESCRIPTORS_SNAPSHOT
+{
+    ULONG64 Length;     // Snapshot length, or length required if output buffer is too short
+    ULONG64 Generation; // Enumeration generation the snapshot belongs to
+    ULONG64 NumDevices;
+    ULONG64 DevicesOffset;
+} USB_DK_DESCRIPTORS_SNAPSHOT, *PUSB_DK_DESCRIPTORS_SNAPSHOT;
+
 typedef struct tag_USB_DK_ISO_TRANSFER_RESULT
 {
     ULONG64 ActualLength;
@@ -45,4 +45,12 @@ public:
 };
 
 typedef USB_DK_HIDE_RULE *PUSB_DK_HIDE_RULE;
+
+//Input of IOCTL_USBDK_ADD_HIDE_RULES,
+//NumRules USB_DK_HIDE_RULE entries follow the header
+typedef struct tag_USB_DK_HIDE_RULES_HEADER
+{
+    ULONG64 Flags;
+    ULONG64 NumRules;
+} USB_DK_HIDE_RULES_HEADER, *PUSB_DK_HIDE_RULES_HEADER;
 #endif
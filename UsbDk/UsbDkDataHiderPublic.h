@@ -36,3 +36,6 @@ typedef struct tag_USB_DK_HIDE_RULE_PUBLIC
 
 #define USBDK_HIDER_RULE_DEFAULT                  0
 #define USBDK_HIDER_RULE_DETERMINATIVE_TYPES      1
+
+//Flags of bulk hide rules load
+#define USBDK_HIDE_RULES_REPLACE_ALL              0x00000001
@@ -0,0 +1,104 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+//Hashing helpers and intrusive hash table shared by the driver and
+//user mode tests. TAccessStrategy is locked through CLockedContext
+//and CSharedLockedContext templates the includer provides, in the
+//driver those of UsbDkUtil.h.
+
+//FNV-1a hash of zero terminated wide string,
+//pass result of previous call as Hash to hash a sequence of strings
+static inline ULONG UsbDkStringHash(PCWCHAR String, ULONG Hash = 2166136261UL)
+{
+    for (; *String != L'\0'; String++)
+    {
+        Hash = (Hash ^ *String) * 16777619UL;
+    }
+    return Hash;
+}
+
+//Object addresses are pool aligned, low bits carry no information
+static inline ULONG UsbDkPointerHash(const void *Pointer)
+{
+    auto Value = reinterpret_cast<ULONG_PTR>(Pointer);
+    return static_cast<ULONG>((Value >> 4) ^ (Value >> 16));
+}
+
+//Intrusive hash table with fixed number of chains.
+//Entries are not owned by the table, TTraits describes how to
+//link and hash them:
+//    static TEntryType *&Next(TEntryType *Entry) - chain link kept in the entry
+//    static ULONG Hash(const TEntryType *Entry)
+template <typename TEntryType, typename TTraits, typename TAccessStrategy, ULONG NumChains>
+class CWdmHashTable : private TAccessStrategy
+{
+public:
+    CWdmHashTable()
+    {}
+
+    void Add(TEntryType *Entry)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+        auto &Chain = m_Chains[TTraits::Hash(Entry) % NumChains];
+        TTraits::Next(Entry) = Chain;
+        Chain = Entry;
+    }
+
+    void Remove(TEntryType *Entry)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+        for (auto Link = &m_Chains[TTraits::Hash(Entry) % NumChains]; *Link != nullptr; Link = &TTraits::Next(*Link))
+        {
+            if (*Link == Entry)
+            {
+                *Link = TTraits::Next(Entry);
+                TTraits::Next(Entry) = nullptr;
+                return;
+            }
+        }
+    }
+
+    //Calls Functor for entries of the chain Hash belongs to that satisfy Predicate,
+    //stops and returns false as soon as Functor returns false
+    template <typename TPredicate, typename TFunctor>
+    bool ForEachIf(ULONG Hash, TPredicate Predicate, TFunctor Functor)
+    {
+        CSharedLockedContext<TAccessStrategy> LockedContext(*this);
+        for (auto Entry = m_Chains[Hash % NumChains]; Entry != nullptr; Entry = TTraits::Next(Entry))
+        {
+            if (Predicate(Entry) && !Functor(Entry))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    CWdmHashTable(const CWdmHashTable&) = delete;
+    CWdmHashTable& operator= (const CWdmHashTable&) = delete;
+
+private:
+    TEntryType *m_Chains[NumChains] = {};
+};
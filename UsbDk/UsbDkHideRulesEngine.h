@@ -0,0 +1,358 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+//Hide rules matching and lookup shared by the driver and user mode
+//tests. USBDK_REG_HIDE_RULE_MATCH_ALL of HideRulesRegPublic.h and
+//USB_DEVICE_DESCRIPTOR are expected to be defined by the includer.
+
+class CUsbDkHideRuleBase
+{
+public:
+
+    CUsbDkHideRuleBase(bool Hide, ULONG Class, ULONG VID, ULONG PID, ULONG BCD)
+        : m_Hide(Hide)
+        , m_Class(Class)
+        , m_VID(VID)
+        , m_PID(PID)
+        , m_BCD(BCD)
+    {}
+
+    bool Match(const USB_DEVICE_DESCRIPTOR &Descriptor) const
+    {
+        return MatchCharacteristic(m_Class, Descriptor.bDeviceClass) &&
+               MatchCharacteristic(m_VID, Descriptor.idVendor)       &&
+               MatchCharacteristic(m_PID, Descriptor.idProduct)      &&
+               MatchCharacteristic(m_BCD, Descriptor.bcdDevice);
+    }
+
+    bool Match(ULONG UsbClassesBitmask, const USB_DEVICE_DESCRIPTOR &Descriptor) const
+    {
+        return (UsbClassesBitmask & m_Class) &&
+            MatchCharacteristic(m_VID, Descriptor.idVendor) &&
+            MatchCharacteristic(m_PID, Descriptor.idProduct) &&
+            MatchCharacteristic(m_BCD, Descriptor.bcdDevice);
+    }
+
+    bool ShouldHide() const
+    {
+        return m_Hide;
+    }
+
+    bool ForceDecision() const
+    {
+        //All do-not-hide rules are terminal
+        return !m_Hide;
+    }
+
+    ULONG VID() const
+    { return m_VID; }
+    ULONG PID() const
+    { return m_PID; }
+
+    //Consistent with operator ==
+    ULONG Hash() const
+    {
+        const ULONG Fields[] = { m_Hide ? 1UL : 0UL, m_Class, m_VID, m_PID, m_BCD };
+        ULONG Hash = 2166136261UL;
+        for (auto Value : Fields)
+        {
+            Hash = (Hash ^ Value) * 16777619UL;
+        }
+        return Hash;
+    }
+
+    bool operator ==(const CUsbDkHideRuleBase &Other) const
+    {
+        return m_Hide == Other.m_Hide   &&
+               m_Class == Other.m_Class &&
+               m_VID == Other.m_VID     &&
+               m_PID == Other.m_PID     &&
+               m_BCD == Other.m_BCD;
+
+    }
+
+protected:
+    bool MatchCharacteristic(ULONG CharacteristicFilter, ULONG CharacteristicValue) const
+    {
+        return (CharacteristicFilter == USBDK_REG_HIDE_RULE_MATCH_ALL) ||
+               (CharacteristicValue == CharacteristicFilter);
+    }
+
+    bool    m_Hide;
+    ULONG   m_Class;
+    ULONG   m_VID;
+    ULONG   m_PID;
+    ULONG   m_BCD;
+};
+
+//Rule sets are checked layer by layer, decision of a later
+//layer overrides the one of an earlier layer. Ext layers match
+//classes of all interfaces and are checked if the device is
+//not hidden by default layers.
+class CUsbDkHideRulesLayers
+{
+public:
+    enum TLayer : ULONG
+    {
+        LAYER_DEFAULT,
+        LAYER_PERSISTENT,
+        LAYER_EXT,
+        LAYER_PERSISTENT_EXT,
+        NUM_LAYERS
+    };
+};
+
+//Walks rules of each layer in their original order, used when the
+//lookup engine cannot be built. TRuleSets::ForEach(Layer, Functor)
+//passes rules of the layer to Functor and stops when it returns false.
+template <typename TRuleSets>
+bool UsbDkShouldHideByRuleSets(TRuleSets &RuleSets, const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask)
+{
+    auto Hide = false;
+
+    const auto &HideVisitor = [&Descriptor, &Hide](const CUsbDkHideRuleBase &Rule) -> bool
+    {
+        if (Rule.Match(Descriptor))
+        {
+            Hide = Rule.ShouldHide();
+            return !Rule.ForceDecision();
+        }
+
+        return true;
+    };
+
+    const auto &HideVisitorExt = [&Descriptor, &Hide, UsbClassesBitmask](const CUsbDkHideRuleBase &Rule) -> bool
+    {
+        if (Rule.Match(UsbClassesBitmask, Descriptor))
+        {
+            Hide = Rule.ShouldHide();
+            return !Rule.ForceDecision();
+        }
+
+        return true;
+    };
+
+    RuleSets.ForEach(CUsbDkHideRulesLayers::LAYER_DEFAULT, HideVisitor);
+    RuleSets.ForEach(CUsbDkHideRulesLayers::LAYER_PERSISTENT, HideVisitor);
+
+    if (!Hide)
+    {
+        RuleSets.ForEach(CUsbDkHideRulesLayers::LAYER_EXT, HideVisitorExt);
+        RuleSets.ForEach(CUsbDkHideRulesLayers::LAYER_PERSISTENT_EXT, HideVisitorExt);
+    }
+
+    return Hide;
+}
+
+//Copy of a rule kept by CUsbDkHideRulesLookup, chained by index
+class CUsbDkHideRulesLookupEntry : public CUsbDkHideRuleBase
+{
+public:
+    CUsbDkHideRulesLookupEntry(const CUsbDkHideRuleBase &Rule, ULONG NextEntry)
+        : CUsbDkHideRuleBase(Rule)
+        , Next(NextEntry)
+    {}
+
+    ULONG Next;
+};
+
+//Immutable copy of all hide rules arranged for lookup,
+//rules with exact VID and PID are bucketed by them,
+//the rest are kept in a list in their original order.
+//Gives the same decisions as UsbDkShouldHideByRuleSets.
+//TAllocator provides allocate(NumEntries) and destroy(Entries)
+//of CUsbDkHideRulesLookupEntry storage.
+template <typename TAllocator>
+class CUsbDkHideRulesLookup : public CUsbDkHideRulesLayers
+{
+public:
+    CUsbDkHideRulesLookup()
+    {
+        for (ULONG Layer = 0; Layer < NUM_LAYERS; Layer++)
+        {
+            for (ULONG i = 0; i < NUM_BUCKETS; i++)
+            {
+                m_Buckets[Layer][i] = NO_ENTRY;
+            }
+            m_Wildcards[Layer] = NO_ENTRY;
+            m_WildcardsTail[Layer] = NO_ENTRY;
+        }
+    }
+
+    ~CUsbDkHideRulesLookup()
+    { TAllocator::destroy(m_Entries); }
+
+    //Allocates room for rules, called once before Add()
+    bool Reserve(size_t MaxRules)
+    {
+        if (MaxRules != 0)
+        {
+            m_Entries = TAllocator::allocate(MaxRules);
+            if (m_Entries == nullptr)
+            {
+                return false;
+            }
+        }
+
+        m_MaxRules = MaxRules;
+        return true;
+    }
+
+    //Returns false if the engine is full
+    bool Add(TLayer Layer, const CUsbDkHideRuleBase &Rule)
+    {
+        if (m_NumRules == m_MaxRules)
+        {
+            return false;
+        }
+
+        auto Index = static_cast<ULONG>(m_NumRules++);
+        //Entries are plain data, storage needs no construction
+        m_Entries[Index] = CUsbDkHideRulesLookupEntry(Rule, NO_ENTRY);
+
+        if ((Rule.VID() != USBDK_REG_HIDE_RULE_MATCH_ALL) &&
+            (Rule.PID() != USBDK_REG_HIDE_RULE_MATCH_ALL))
+        {
+            auto &Head = m_Buckets[Layer][Bucket(Rule.VID(), Rule.PID())];
+            m_Entries[Index].Next = Head;
+            Head = Index;
+        }
+        else
+        {
+            if (m_WildcardsTail[Layer] == NO_ENTRY)
+            {
+                m_Wildcards[Layer] = Index;
+            }
+            else
+            {
+                m_Entries[m_WildcardsTail[Layer]].Next = Index;
+            }
+            m_WildcardsTail[Layer] = Index;
+        }
+
+        return true;
+    }
+
+    bool ShouldHide(const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG UsbClassesBitmask) const
+    {
+        static const TLayer DefaultLayers[] = { LAYER_DEFAULT, LAYER_PERSISTENT };
+        static const TLayer ExtLayers[] = { LAYER_EXT, LAYER_PERSISTENT_EXT };
+
+        auto Hide = false;
+
+        for (auto Layer : DefaultLayers)
+        {
+            auto Decision = Evaluate(Layer, Descriptor,
+                                     [&Descriptor](const CUsbDkHideRuleBase &Rule) { return Rule.Match(Descriptor); });
+            if (Decision != DECISION_NONE)
+            {
+                Hide = (Decision == DECISION_HIDE);
+            }
+        }
+
+        if (!Hide)
+        {
+            for (auto Layer : ExtLayers)
+            {
+                auto Decision = Evaluate(Layer, Descriptor,
+                                         [&Descriptor, UsbClassesBitmask](const CUsbDkHideRuleBase &Rule)
+                                         { return Rule.Match(UsbClassesBitmask, Descriptor); });
+                if (Decision != DECISION_NONE)
+                {
+                    Hide = (Decision == DECISION_HIDE);
+                }
+            }
+        }
+
+        return Hide;
+    }
+
+    CUsbDkHideRulesLookup(const CUsbDkHideRulesLookup&) = delete;
+    CUsbDkHideRulesLookup& operator= (const CUsbDkHideRulesLookup&) = delete;
+
+private:
+    enum : ULONG
+    {
+        NUM_BUCKETS = 256,
+        NO_ENTRY = (ULONG) -1
+    };
+
+    enum TDecision
+    {
+        DECISION_NONE,
+        DECISION_HIDE,
+        DECISION_DONT_HIDE
+    };
+
+    static ULONG Bucket(ULONG VID, ULONG PID)
+    { return ((VID << 16) ^ PID ^ (PID >> 8)) % NUM_BUCKETS; }
+
+    template <typename TMatcher>
+    TDecision Evaluate(TLayer Layer, const USB_DEVICE_DESCRIPTOR &Descriptor, TMatcher Matcher) const
+    {
+        //Matching do-not-hide rule is terminal for its layer, otherwise
+        //any matching hide rule decides, so the result does not depend on
+        //the order exact and wildcard rules are checked in
+        auto Decision = DECISION_NONE;
+
+        auto Visit = [&Decision, &Matcher](const CUsbDkHideRuleBase &Rule) -> bool
+        {
+            if (!Matcher(Rule))
+            {
+                return true;
+            }
+
+            Decision = Rule.ShouldHide() ? DECISION_HIDE : DECISION_DONT_HIDE;
+            return !Rule.ForceDecision();
+        };
+
+        for (auto Index = m_Buckets[Layer][Bucket(Descriptor.idVendor, Descriptor.idProduct)];
+             Index != NO_ENTRY;
+             Index = m_Entries[Index].Next)
+        {
+            if (!Visit(m_Entries[Index]))
+            {
+                return Decision;
+            }
+        }
+
+        for (auto Index = m_Wildcards[Layer]; Index != NO_ENTRY; Index = m_Entries[Index].Next)
+        {
+            if (!Visit(m_Entries[Index]))
+            {
+                return Decision;
+            }
+        }
+
+        return Decision;
+    }
+
+    CUsbDkHideRulesLookupEntry *m_Entries = nullptr;
+    size_t m_MaxRules = 0;
+    size_t m_NumRules = 0;
+    ULONG m_Buckets[NUM_LAYERS][NUM_BUCKETS];
+    ULONG m_Wildcards[NUM_LAYERS];
+    ULONG m_WildcardsTail[NUM_LAYERS];
+};
@@ -0,0 +1,129 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+//Set of small non-negative numbers kept as a bitmap of ULONG words,
+//set bit means the number is in use. Allocate() takes the lowest free
+//number, so numbers released by Free() are re-used first. The bitmap
+//starts empty, owner calls Grow() when Allocate() finds it full.
+//Shared by the driver and user mode tests, so it only depends on
+//TAllocator providing allocate(NumWords) and destroy(Words).
+//Not thread safe, callers serialize access.
+template <typename TAllocator>
+class CUsbDkNumberBitmap
+{
+public:
+    static const ULONG NO_NUMBER = 0xFFFFFFFF;
+    static const ULONG BITS_PER_WORD = sizeof(ULONG) * 8;
+    static const ULONG INITIAL_WORDS = 2;
+
+    CUsbDkNumberBitmap()
+    {}
+    ~CUsbDkNumberBitmap()
+    { TAllocator::destroy(m_Words); }
+
+    //Returns the lowest free number and marks it in use,
+    //NO_NUMBER if all numbers of the bitmap are in use
+    ULONG Allocate()
+    {
+        //Words below m_FirstFreeWord are known to be full
+        for (; m_FirstFreeWord < m_NumWords; m_FirstFreeWord++)
+        {
+            auto &Word = m_Words[m_FirstFreeWord];
+            unsigned long Bit;
+            if (_BitScanForward(&Bit, ~Word))
+            {
+                Word |= (1UL << Bit);
+                return m_FirstFreeWord * BITS_PER_WORD + Bit;
+            }
+        }
+        return NO_NUMBER;
+    }
+
+    //Doubles the bitmap, numbers in use are kept
+    bool Grow()
+    {
+        auto NewNumWords = (m_NumWords != 0) ? m_NumWords * 2 : INITIAL_WORDS;
+        if ((NewNumWords < m_NumWords) || (NewNumWords > NO_NUMBER / BITS_PER_WORD))
+        {
+            return false;
+        }
+
+        auto NewWords = TAllocator::allocate(NewNumWords);
+        if (NewWords == nullptr)
+        {
+            return false;
+        }
+
+        for (ULONG i = 0; i < NewNumWords; i++)
+        {
+            NewWords[i] = (i < m_NumWords) ? m_Words[i] : 0;
+        }
+
+        TAllocator::destroy(m_Words);
+        m_Words = NewWords;
+        m_NumWords = NewNumWords;
+        return true;
+    }
+
+    //Marks a number taken outside of Allocate() as used,
+    //numbers beyond the bitmap size are ignored
+    void MarkUsed(ULONG Number)
+    {
+        if (Number < Size())
+        {
+            m_Words[Number / BITS_PER_WORD] |= (1UL << (Number % BITS_PER_WORD));
+        }
+    }
+
+    void Free(ULONG Number)
+    {
+        if (Number < Size())
+        {
+            auto Word = Number / BITS_PER_WORD;
+            m_Words[Word] &= ~(1UL << (Number % BITS_PER_WORD));
+            if (Word < m_FirstFreeWord)
+            {
+                m_FirstFreeWord = Word;
+            }
+        }
+    }
+
+    bool IsUsed(ULONG Number) const
+    {
+        return (Number < Size()) &&
+               ((m_Words[Number / BITS_PER_WORD] & (1UL << (Number % BITS_PER_WORD))) != 0);
+    }
+
+    ULONG Size() const
+    { return m_NumWords * BITS_PER_WORD; }
+
+    CUsbDkNumberBitmap(const CUsbDkNumberBitmap&) = delete;
+    CUsbDkNumberBitmap& operator= (const CUsbDkNumberBitmap&) = delete;
+
+private:
+    ULONG *m_Words = nullptr;
+    ULONG m_NumWords = 0;
+    ULONG m_FirstFreeWord = 0;
+};
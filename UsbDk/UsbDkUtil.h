@@ -75,14 +75,16 @@ public:
     CWdmExSpinLock()
     {}
 
-    void LockShared()
+    //Shared owners are many, so previous IRQL
+    //is kept by each of them, not in the lock
+    KIRQL LockShared()
     {
-        m_OldIrql = ExAcquireSpinLockShared(&m_Lock);
+        return ExAcquireSpinLockShared(&m_Lock);
     }
 
-    void UnlockShared()
+    void UnlockShared(KIRQL OldIrql)
     {
-        ExReleaseSpinLockShared(&m_Lock, m_OldIrql);
+        ExReleaseSpinLockShared(&m_Lock, OldIrql);
     }
 
     void LockExclusive()
@@ -111,12 +113,13 @@ private:
 class CWdmExSpinLock : public CWdmSpinLock
 {
 public:
-    void LockShared()
+    KIRQL LockShared()
     {
         Lock();
+        return PASSIVE_LEVEL;
     }
 
-    void UnlockShared()
+    void UnlockShared(KIRQL)
     {
         Unlock();
     }
@@ -135,7 +138,26 @@ public:
 #endif //TARGET_OS_WIN_XP
 
 template <typename T = CWdmExSpinLock>
-using CSharedLockedContext = CBaseLockedContext <T, &T::LockShared, &T::UnlockShared>;
+class CSharedLockedContext
+{
+public:
+    CSharedLockedContext(T &LockObject)
+        : m_LockObject(LockObject)
+        , m_OldIrql(LockObject.LockShared())
+    {}
+
+    ~CSharedLockedContext()
+    {
+        m_LockObject.UnlockShared(m_OldIrql);
+    }
+
+private:
+    T &m_LockObject;
+    KIRQL m_OldIrql;
+
+    CSharedLockedContext(const CSharedLockedContext&) = delete;
+    CSharedLockedContext& operator= (const CSharedLockedContext&) = delete;
+};
 
 template <typename T = CWdmExSpinLock>
 using CExclusiveLockedContext = CBaseLockedContext <T, &T::LockExclusive, &T::UnlockExclusive>;
@@ -201,12 +223,40 @@ public:
     static void destroy(CWdmRefCountingObject *Obj){ if (Obj != nullptr) { Obj->Release(); } }
 };
 
-using CLockedAccess = CWdmSpinLock;
+//Container access strategies, Lock/Unlock guard modifications,
+//LockShared/UnlockShared guard read-only traversals, IRQL returned
+//by LockShared goes back to UnlockShared of the same traversal
+class CLockedAccess
+{
+public:
+    void Lock() { m_Lock.Lock(); }
+    void Unlock() { m_Lock.Unlock(); }
+    KIRQL LockShared() { m_Lock.Lock(); return PASSIVE_LEVEL; }
+    void UnlockShared(KIRQL) { m_Lock.Unlock(); }
+private:
+    CWdmSpinLock m_Lock;
+};
+
+//Readers run concurrently, for containers
+//that are traversed much more often than modified
+class CRWLockedAccess
+{
+public:
+    void Lock() { m_Lock.LockExclusive(); }
+    void Unlock() { m_Lock.UnlockExclusive(); }
+    KIRQL LockShared() { return m_Lock.LockShared(); }
+    void UnlockShared(KIRQL OldIrql) { m_Lock.UnlockShared(OldIrql); }
+private:
+    CWdmExSpinLock m_Lock;
+};
+
 class CRawAccess
 {
 public:
     void Lock() { }
     void Unlock() { }
+    KIRQL LockShared() { return PASSIVE_LEVEL; }
+    void UnlockShared(KIRQL) { }
 };
 
 class CCountingObject
@@ -304,29 +354,30 @@ public:
     template <typename TPredicate, typename TFunctor>
     bool ForEachDetachedIf(TPredicate Predicate, TFunctor Functor)
     {
-        return ForEachPrepareIf(Predicate, [this](PLIST_ENTRY Entry){ Remove_LockLess(Entry); }, Functor);
+        return ForEachPrepareIf<CLockedContext<TAccessStrategy>>(Predicate, [this](PLIST_ENTRY Entry){ Remove_LockLess(Entry); }, Functor);
     }
 
+    //Read-only traversals, Functor must not modify the list
     template <typename TFunctor>
     bool ForEach(TFunctor Functor)
     {
-        return ForEachPrepareIf([](TEntryType*) { return true; }, [](PLIST_ENTRY){}, Functor);
+        return ForEachPrepareIf<CSharedLockedContext<TAccessStrategy>>([](TEntryType*) { return true; }, [](PLIST_ENTRY){}, Functor);
     }
 
     template <typename TPredicate, typename TFunctor>
     bool ForEachIf(TPredicate Predicate, TFunctor Functor)
     {
-        return ForEachPrepareIf(Predicate, [](PLIST_ENTRY){}, Functor);
+        return ForEachPrepareIf<CSharedLockedContext<TAccessStrategy>>(Predicate, [](PLIST_ENTRY){}, Functor);
     }
 
     CWdmList(const CWdmList&) = delete;
     CWdmList& operator= (const CWdmList&) = delete;
 
 private:
-    template <typename TPredicate, typename TPrepareFunctor, typename TFunctor>
+    template <typename TLockedContext, typename TPredicate, typename TPrepareFunctor, typename TFunctor>
     bool ForEachPrepareIf(TPredicate Predicate, TPrepareFunctor Prepare, TFunctor Functor)
     {
-        CLockedContext<TAccessStrategy> LockedContext(*this);
+        TLockedContext LockedContext(*this);
 
         PLIST_ENTRY NextEntry = nullptr;
 
@@ -386,6 +437,14 @@ public:
         return false;
     }
 
+    //Caller guarantees the entry is not in the set yet
+    void AddUnchecked(TEntryType *NewEntry)
+    {
+        CLockedContext<TAccessStrategy> LockedContext(*this);
+        m_Objects.PushBack(NewEntry);
+        CounterIncrement();
+    }
+
     template <typename TEntryId>
     bool Delete(TEntryId *Id)
     {
@@ -401,14 +460,14 @@ public:
 
     void Dump()
     {
-        CLockedContext<TAccessStrategy> LockedContext(*this);
+        CSharedLockedContext<TAccessStrategy> LockedContext(*this);
         m_Objects.ForEach([](TEntryType *Entry) { Entry->Dump(); return true; });
     }
 
     template <typename TEntryId>
     bool Contains(TEntryId *Id)
     {
-        CLockedContext<TAccessStrategy> LockedContext(*this);
+        CSharedLockedContext<TAccessStrategy> LockedContext(*this);
         return Contains_LockLess(Id);
     }
 
@@ -431,7 +490,7 @@ public:
     template <typename TFunctor>
     bool ForEach(TFunctor Functor)
     {
-        CLockedContext<TAccessStrategy> LockedContext(*this);
+        CSharedLockedContext<TAccessStrategy> LockedContext(*this);
         return m_Objects.ForEach(Functor);
     }
 
@@ -455,9 +514,17 @@ public:
     /* Move from this Set to the other Set */
     void MoveList(CWdmSet &OtherList)
     {
+        //Entries replaced in the other set are destroyed
+        //after both locks are released, see Clear()
+        TInternalList ReplacedList;
+
         CLockedContext<TAccessStrategy> LockedContextOther(OtherList);
         TInternalList &OtherInternalList = OtherList.m_Objects;
-        OtherInternalList.Clear();
+        OtherInternalList.ForEachDetached([&ReplacedList](TEntryType *ExistingEntry)
+                                          {
+                                              ReplacedList.PushBack(ExistingEntry);
+                                              return true;
+                                          });
         OtherList.ResetCount();
 
         CLockedContext<TAccessStrategy> LockedContextThis(*this);
@@ -514,6 +581,8 @@ private:
     TInternalList m_Objects;
 };
 
+#include "UsbDkHashTable.h"
+
 class CWdmEvent : public CAllocatable<USBDK_NON_PAGED_POOL, 'VEHR'>
 {
 public:
@@ -528,6 +597,8 @@ public:
     { KeClearEvent(&m_Event); }
     bool Reset()
     { return KeResetEvent(&m_Event) ? true : false; }
+    bool IsSet() const
+    { return KeReadStateEvent(const_cast<PRKEVENT>(&m_Event)) != 0; }
 
     operator PKEVENT () { return &m_Event; }
 
@@ -137,13 +137,13 @@ public:
     {
     public:
         void NoLock() {};
-        void LockShared() { CWdmExSpinLock::LockShared(); }
-        void UnlockShared() { CWdmExSpinLock::UnlockShared(); }
+        KIRQL LockShared() { return CWdmExSpinLock::LockShared(); }
+        void UnlockShared(KIRQL OldIrql) { CWdmExSpinLock::UnlockShared(OldIrql); }
         void LockExclusive() { CWdmExSpinLock::LockExclusive(); }
         void UnlockExclusive() { CWdmExSpinLock::UnlockExclusive(); }
     };
 
-    using SharedLock = CBaseLockedContext < Lock, &Lock::LockShared, &Lock::UnlockShared >;
+    using SharedLock = CSharedLockedContext < Lock >;
     using ExclusiveLock = CBaseLockedContext < Lock, &Lock::LockExclusive, &Lock::UnlockExclusive > ;
     using NeitherLock = CBaseLockedContext < Lock, &Lock::NoLock, &Lock::NoLock >;
 
@@ -0,0 +1,93 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "ConfigDescriptorCache.h"
+
+UsbDkConfigDescriptorCache& UsbDkConfigDescriptorCache::Instance()
+{
+    static UsbDkConfigDescriptorCache Cache;
+    return Cache;
+}
+
+UsbDkConfigDescriptorCache::TKey UsbDkConfigDescriptorCache::MakeKey(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request)
+{
+    return TKey(wstring(Request.ID.DeviceID, wcsnlen(Request.ID.DeviceID, MAX_DEVICE_ID_LEN)),
+                wstring(Request.ID.InstanceID, wcsnlen(Request.ID.InstanceID, MAX_DEVICE_ID_LEN)),
+                Request.Index);
+}
+
+bool UsbDkConfigDescriptorCache::Lookup(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request,
+                                        ULONG64 Generation,
+                                        vector<BYTE> &Descriptor)
+{
+    UsbDkLockedContext Ctx(m_Lock);
+
+    // Device may have been replugged with different descriptors
+    // since the entry was cached, so the hit has to be current
+    ValidateLocked(Generation);
+
+    auto Entry = m_Descriptors.find(MakeKey(Request));
+    if (Entry == m_Descriptors.end())
+    {
+        m_Misses++;
+        return false;
+    }
+
+    m_Hits++;
+    Descriptor = Entry->second;
+    return true;
+}
+
+void UsbDkConfigDescriptorCache::Insert(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request,
+                                        ULONG64 Generation,
+                                        const vector<BYTE> &Descriptor)
+{
+    UsbDkLockedContext Ctx(m_Lock);
+
+    ValidateLocked(Generation);
+    m_Descriptors[MakeKey(Request)] = Descriptor;
+}
+
+void UsbDkConfigDescriptorCache::Validate(ULONG64 Generation)
+{
+    UsbDkLockedContext Ctx(m_Lock);
+    ValidateLocked(Generation);
+}
+
+void UsbDkConfigDescriptorCache::ValidateLocked(ULONG64 Generation)
+{
+    // Generation may also go backwards if the driver was reloaded
+    if (Generation != m_Generation)
+    {
+        m_Descriptors.clear();
+        m_Generation = Generation;
+    }
+}
+
+void UsbDkConfigDescriptorCache::GetStatistics(ULONG64 &Hits, ULONG64 &Misses)
+{
+    UsbDkLockedContext Ctx(m_Lock);
+    Hits = m_Hits;
+    Misses = m_Misses;
+}
@@ -0,0 +1,67 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+#include "UsbDkData.h"
+
+#include <map>
+#include <tuple>
+
+// Process-wide cache of configuration descriptors fetched from the driver.
+// Entries are keyed by (DeviceID, InstanceID, configuration index) and belong
+// to the driver enumeration generation they were read at. Lookups pass current
+// generation of the driver, whenever a different generation is observed
+// (on lookup, insertion or enumeration) the cache is flushed.
+class UsbDkConfigDescriptorCache
+{
+public:
+    static UsbDkConfigDescriptorCache& Instance();
+
+    bool Lookup(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request, ULONG64 Generation, vector<BYTE> &Descriptor);
+    void Insert(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request, ULONG64 Generation, const vector<BYTE> &Descriptor);
+    void Validate(ULONG64 Generation);
+
+    void GetStatistics(ULONG64 &Hits, ULONG64 &Misses);
+
+    UsbDkConfigDescriptorCache(const UsbDkConfigDescriptorCache&) = delete;
+    UsbDkConfigDescriptorCache& operator= (const UsbDkConfigDescriptorCache&) = delete;
+
+private:
+    UsbDkConfigDescriptorCache()
+    { InitializeCriticalSection(&m_Lock); }
+
+    ~UsbDkConfigDescriptorCache()
+    { DeleteCriticalSection(&m_Lock); }
+
+    void ValidateLocked(ULONG64 Generation);
+
+    typedef tuple<wstring, wstring, ULONG64> TKey;
+    static TKey MakeKey(const USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request);
+
+    map<TKey, vector<BYTE>> m_Descriptors;
+    ULONG64 m_Generation = 0;
+    ULONG64 m_Hits = 0;
+    ULONG64 m_Misses = 0;
+    CRITICAL_SECTION m_Lock;
+};
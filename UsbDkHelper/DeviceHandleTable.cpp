@@ -0,0 +1,194 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "DeviceHandleTable.h"
+
+UsbDkDeviceHandleTable& UsbDkDeviceHandleTable::Instance()
+{
+    static UsbDkDeviceHandleTable Table;
+    return Table;
+}
+
+UsbDkDeviceHandleTable::UsbDkDeviceHandleTable()
+{
+    for (auto &Chunk : m_Chunks)
+    {
+        Chunk.store(nullptr, memory_order_relaxed);
+    }
+    InitializeCriticalSection(&m_Lock);
+}
+
+UsbDkDeviceHandleTable::~UsbDkDeviceHandleTable()
+{
+    // Handles not closed by client are leaked intentionally,
+    // redirector handles are closed by the system on process exit
+    for (auto &Chunk : m_Chunks)
+    {
+        delete[] Chunk.load(memory_order_relaxed);
+    }
+    DeleteCriticalSection(&m_Lock);
+}
+
+ULONG UsbDkDeviceHandleTable::AllocateSlot()
+{
+    UsbDkLockedContext Ctx(m_Lock);
+
+    if (!m_FreeSlots.empty())
+    {
+        auto Index = m_FreeSlots.back();
+        m_FreeSlots.pop_back();
+        return Index;
+    }
+
+    if (m_NumSlots == SLOTS_PER_CHUNK * MAX_CHUNKS)
+    {
+        throw UsbDkException(TEXT("Too many redirected device handles"));
+    }
+
+    auto Index = m_NumSlots;
+    if (Index % SLOTS_PER_CHUNK == 0)
+    {
+        m_FreeSlots.reserve(Index + SLOTS_PER_CHUNK);
+
+        auto Chunk = new CSlot[SLOTS_PER_CHUNK];
+        for (ULONG i = 0; i < SLOTS_PER_CHUNK; i++)
+        {
+            Chunk[i].State.store(MakeSlotState(1, 0), memory_order_relaxed);
+            Chunk[i].Device = nullptr;
+            Chunk[i].Index = Index + i;
+        }
+        m_Chunks[Index / SLOTS_PER_CHUNK].store(Chunk, memory_order_release);
+    }
+
+    m_NumSlots++;
+    return Index;
+}
+
+HANDLE UsbDkDeviceHandleTable::Insert(unique_ptr<REDIRECTED_DEVICE_HANDLE> Device)
+{
+    auto Index = AllocateSlot();
+    auto &Slot = m_Chunks[Index / SLOTS_PER_CHUNK].load(memory_order_relaxed)[Index % SLOTS_PER_CHUNK];
+    auto Generation = SlotGeneration(Slot.State.load(memory_order_relaxed));
+
+    Slot.Device = Device.release();
+    Slot.State.store(MakeSlotState(Generation, SLOT_LIVE | 1), memory_order_release);
+
+    return reinterpret_cast<HANDLE>((static_cast<ULONG_PTR>(Generation) << INDEX_BITS) | (Index + 1));
+}
+
+UsbDkDeviceHandleTable::CSlot *UsbDkDeviceHandleTable::LookupSlot(HANDLE Handle, ULONG64 &Generation) noexcept
+{
+    if (!Handle || Handle == INVALID_HANDLE_VALUE)
+    {
+        return nullptr;
+    }
+
+    auto Value = reinterpret_cast<ULONG_PTR>(Handle);
+    auto Index = static_cast<ULONG>(Value & ((ULONG_PTR(1) << INDEX_BITS) - 1));
+    if ((Index == 0) || (Index > SLOTS_PER_CHUNK * MAX_CHUNKS))
+    {
+        return nullptr;
+    }
+    Index--;
+
+    auto Chunk = m_Chunks[Index / SLOTS_PER_CHUNK].load(memory_order_acquire);
+    if (Chunk == nullptr)
+    {
+        return nullptr;
+    }
+
+    Generation = Value >> INDEX_BITS;
+    return &Chunk[Index % SLOTS_PER_CHUNK];
+}
+
+bool UsbDkDeviceHandleTable::HandleGenerationMatches(ULONG64 State, ULONG64 Generation) noexcept
+{
+    // On 32-bit platforms handle carries only lower bits of the generation
+    const auto HandleGenerationMask = static_cast<ULONG64>(ULONG_PTR(-1) >> INDEX_BITS);
+    return (SlotGeneration(State) & HandleGenerationMask) == Generation;
+}
+
+UsbDkDeviceHandleTable::CReference UsbDkDeviceHandleTable::Reference(HANDLE Handle) noexcept
+{
+    ULONG64 Generation;
+    auto Slot = LookupSlot(Handle, Generation);
+    if (Slot == nullptr)
+    {
+        return CReference();
+    }
+
+    auto State = Slot->State.load(memory_order_acquire);
+    do
+    {
+        if (!(State & SLOT_LIVE) || !HandleGenerationMatches(State, Generation))
+        {
+            return CReference();
+        }
+    } while (!Slot->State.compare_exchange_weak(State, State + 1, memory_order_acquire));
+
+    return CReference(this, Slot);
+}
+
+bool UsbDkDeviceHandleTable::Close(HANDLE Handle) noexcept
+{
+    ULONG64 Generation;
+    auto Slot = LookupSlot(Handle, Generation);
+    if (Slot == nullptr)
+    {
+        return false;
+    }
+
+    auto State = Slot->State.load(memory_order_acquire);
+    do
+    {
+        if (!(State & SLOT_LIVE) || !HandleGenerationMatches(State, Generation))
+        {
+            return false;
+        }
+    } while (!Slot->State.compare_exchange_weak(State, State & ~SLOT_LIVE, memory_order_acq_rel));
+
+    // Drop the reference held by live slot
+    Release(*Slot);
+    return true;
+}
+
+void UsbDkDeviceHandleTable::Release(CSlot &Slot) noexcept
+{
+    auto State = Slot.State.fetch_sub(1, memory_order_acq_rel);
+    if ((State & SLOT_REFS_MASK) != 1)
+    {
+        return;
+    }
+
+    // Last reference of a closed slot, nobody can reference it anymore
+    auto Device = Slot.Device;
+    Slot.Device = nullptr;
+    Slot.State.store(MakeSlotState(SlotGeneration(State) + 1, 0), memory_order_release);
+
+    delete Device;
+
+    // Cannot throw, capacity for all slots is reserved on slot creation
+    UsbDkLockedContext Ctx(m_Lock);
+    m_FreeSlots.push_back(Slot.Index);
+}
@@ -0,0 +1,131 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+#include "UsbDkData.h"
+#include "RedirectorAccess.h"
+#include "TransferBufferPool.h"
+
+#include <atomic>
+
+typedef struct tag_REDIRECTED_DEVICE_HANDLE
+{
+    USB_DK_DEVICE_ID DeviceID;
+    UsbDkTransferBufferPool BufferPool;
+    unique_ptr<UsbDkRedirectorAccess> RedirectorAccess;
+} REDIRECTED_DEVICE_HANDLE, *PREDIRECTED_DEVICE_HANDLE;
+
+// Process-wide table of redirected devices handed out to clients.
+// Client handle encodes slot index and slot generation, the generation
+// is bumped each time slot is released so stale and forged handles are
+// rejected. Every API call holds a slot reference for its duration,
+// closing the handle only marks slot as dead and the device object is
+// destroyed when the last in-flight call drops its reference.
+// Referencing and dereferencing of live slots is lock-free.
+class UsbDkDeviceHandleTable
+{
+private:
+    struct CSlot
+    {
+        // Bits 63..32 - generation, bit 31 - slot is live,
+        // bits 30..0 - number of references (live slot holds one)
+        atomic<ULONG64> State;
+        PREDIRECTED_DEVICE_HANDLE Device;
+        ULONG Index;
+    };
+
+public:
+    static UsbDkDeviceHandleTable& Instance();
+
+    class CReference
+    {
+    public:
+        CReference()
+        {}
+        CReference(CReference &&Other)
+            : m_Table(Other.m_Table)
+            , m_Slot(Other.m_Slot)
+        { Other.m_Slot = nullptr; }
+        ~CReference()
+        {
+            if (m_Slot != nullptr)
+            {
+                m_Table->Release(*m_Slot);
+            }
+        }
+
+        explicit operator bool() const
+        { return m_Slot != nullptr; }
+        PREDIRECTED_DEVICE_HANDLE operator->() const
+        { return m_Slot->Device; }
+
+        CReference(const CReference&) = delete;
+        CReference& operator= (const CReference&) = delete;
+        CReference& operator= (CReference&&) = delete;
+
+    private:
+        CReference(UsbDkDeviceHandleTable *Table, CSlot *Slot)
+            : m_Table(Table)
+            , m_Slot(Slot)
+        {}
+
+        UsbDkDeviceHandleTable *m_Table = nullptr;
+        CSlot *m_Slot = nullptr;
+
+        friend class UsbDkDeviceHandleTable;
+    };
+
+    HANDLE Insert(unique_ptr<REDIRECTED_DEVICE_HANDLE> Device);
+    CReference Reference(HANDLE Handle) noexcept;
+    bool Close(HANDLE Handle) noexcept;
+
+    UsbDkDeviceHandleTable(const UsbDkDeviceHandleTable&) = delete;
+    UsbDkDeviceHandleTable& operator= (const UsbDkDeviceHandleTable&) = delete;
+
+private:
+    UsbDkDeviceHandleTable();
+    ~UsbDkDeviceHandleTable();
+
+    static const ULONG SLOTS_PER_CHUNK = 256;
+    static const ULONG MAX_CHUNKS = 64;
+    static const ULONG INDEX_BITS = 16;
+
+    static const ULONG64 SLOT_LIVE = 0x80000000;
+    static const ULONG64 SLOT_REFS_MASK = SLOT_LIVE - 1;
+
+    static ULONG64 SlotGeneration(ULONG64 State)
+    { return State >> 32; }
+    static ULONG64 MakeSlotState(ULONG64 Generation, ULONG64 Flags)
+    { return (Generation << 32) | Flags; }
+
+    ULONG AllocateSlot();
+    CSlot *LookupSlot(HANDLE Handle, ULONG64 &Generation) noexcept;
+    static bool HandleGenerationMatches(ULONG64 State, ULONG64 Generation) noexcept;
+    void Release(CSlot &Slot) noexcept;
+
+    atomic<CSlot*> m_Chunks[MAX_CHUNKS];
+    vector<ULONG> m_FreeSlots;
+    ULONG m_NumSlots = 0;
+    CRITICAL_SECTION m_Lock;
+};
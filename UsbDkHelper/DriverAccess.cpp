@@ -23,12 +23,80 @@
 
 #include "stdafx.h"
 #include "DriverAccess.h"
+#include "ConfigDescriptorCache.h"
 #include "Public.h"
 
+// Most configuration descriptors fit into this size,
+// so these are fetched by a single driver round trip
+#define CONFIG_DESCRIPTOR_INITIAL_FETCH_SIZE (1024)
 
-void UsbDkDriverAccess::GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber)
+// Initial compact device list buffer size, enough for
+// a few dozens of devices with typical ID strings
+#define ENUM_COMPACT_INITIAL_SIZE (8 * 1024)
+
+// Initial snapshot buffer size, enough for a typical
+// set of devices with a few short descriptors each
+#define DESCRIPTORS_SNAPSHOT_INITIAL_SIZE (64 * 1024)
+
+
+unique_ptr<BYTE[]> UsbDkDriverAccess::EnumerateDevicesCompact(const USB_DK_DEVICE_FILTER *Filter, DWORD &BytesReturned)
+{
+    unique_ptr<BYTE[]> Buffer;
+    ULONG Length = ENUM_COMPACT_INITIAL_SIZE;
+
+    for (;;)
+    {
+        Buffer.reset(new BYTE[Length]);
+
+        auto Fetched = (Filter != nullptr)
+            ? Ioctl(IOCTL_USBDK_ENUM_DEVICES_FILTERED, true, const_cast<PUSB_DK_DEVICE_FILTER>(Filter), sizeof(*Filter),
+                    Buffer.get(), Length, &BytesReturned)
+            : Ioctl(IOCTL_USBDK_ENUM_DEVICES_COMPACT, true, nullptr, 0,
+                    Buffer.get(), Length, &BytesReturned);
+
+        if (BytesReturned < sizeof(USB_DK_COMPACT_ENUM_HEADER))
+        {
+            throw UsbDkDriverAccessException(TEXT("Device list is too short"), ERROR_INVALID_DATA);
+        }
+
+        auto Header = reinterpret_cast<PUSB_DK_COMPACT_ENUM_HEADER>(Buffer.get());
+        if (Header->Version != USB_DK_COMPACT_ENUM_VERSION)
+        {
+            throw UsbDkDriverAccessException(TEXT("Unsupported device list version"), ERROR_REVISION_MISMATCH);
+        }
+
+        if (Fetched)
+        {
+            return Buffer;
+        }
+
+        // Buffer was too short, driver reported the size needed
+        Length = Header->Length;
+    }
+}
+
+static PCWCHAR CompactEnumString(const USB_DK_COMPACT_ENUM_HEADER *Header, ULONG Offset)
+{
+    auto Strings = reinterpret_cast<const BYTE*>(Header) + Header->StringsOffset;
+    size_t MaxChars = (Offset < Header->StringsLength) ? (Header->StringsLength - Offset) / sizeof(WCHAR) : 0;
+    auto String = reinterpret_cast<PCWCHAR>(Strings + Offset);
+
+    // String must be terminated inside of the table and fit into USB_DK_DEVICE_ID
+    if (MaxChars > MAX_DEVICE_ID_LEN)
+    {
+        MaxChars = MAX_DEVICE_ID_LEN;
+    }
+
+    if (wcsnlen(String, MaxChars) >= MaxChars)
+    {
+        throw UsbDkDriverAccessException(TEXT("Device list string is malformed"), ERROR_INVALID_DATA);
+    }
+
+    return String;
+}
+
+void UsbDkDriverAccess::GetDevicesListLegacy(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber)
 {
-    DevicesArray = nullptr;
     DWORD   bytesReturned;
 
     unique_ptr<USB_DK_DEVICE_INFO[]> Result;
@@ -56,6 +124,178 @@ void UsbDkDriverAccess::GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG
     DevicesArray = Result.release();
 }
 
+void UsbDkDriverAccess::ParseCompactDevicesList(const BYTE *Buffer, DWORD Length,
+                                                PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber)
+{
+    DevicesArray = nullptr;
+
+    if (Length < sizeof(USB_DK_COMPACT_ENUM_HEADER))
+    {
+        throw UsbDkDriverAccessException(TEXT("Device list is too short"), ERROR_INVALID_DATA);
+    }
+
+    auto Header = reinterpret_cast<const USB_DK_COMPACT_ENUM_HEADER*>(Buffer);
+    if (Header->Version != USB_DK_COMPACT_ENUM_VERSION)
+    {
+        throw UsbDkDriverAccessException(TEXT("Unsupported device list version"), ERROR_REVISION_MISMATCH);
+    }
+
+    if ((Header->DeviceRecordSize < sizeof(USB_DK_COMPACT_DEVICE_INFO)) ||
+        (static_cast<ULONG64>(Header->DevicesOffset) + static_cast<ULONG64>(Header->NumDevices) * Header->DeviceRecordSize > Length) ||
+        (static_cast<ULONG64>(Header->StringsOffset) + Header->StringsLength > Length))
+    {
+        throw UsbDkDriverAccessException(TEXT("Device list is malformed"), ERROR_INVALID_DATA);
+    }
+
+    DeviceNumber = Header->NumDevices;
+    if (DeviceNumber == 0)
+    {
+        return;
+    }
+
+    // Convert to the fixed size records of the public API
+    unique_ptr<USB_DK_DEVICE_INFO[]> Result(new USB_DK_DEVICE_INFO[DeviceNumber]);
+    auto Record = Buffer + Header->DevicesOffset;
+
+    for (ULONG i = 0; i < DeviceNumber; i++, Record += Header->DeviceRecordSize)
+    {
+        auto Device = reinterpret_cast<const USB_DK_COMPACT_DEVICE_INFO*>(Record);
+
+        UsbDkFillIDStruct(&Result[i].ID,
+                          CompactEnumString(Header, Device->DeviceIDOffset),
+                          CompactEnumString(Header, Device->InstanceIDOffset));
+        Result[i].FilterID = Device->FilterID;
+        Result[i].Port = Device->Port;
+        Result[i].Speed = Device->Speed;
+        Result[i].DeviceDescriptor = Device->DeviceDescriptor;
+    }
+
+    DevicesArray = Result.release();
+}
+
+void UsbDkDriverAccess::GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber,
+                                       const USB_DK_DEVICE_FILTER *Filter)
+{
+    DevicesArray = nullptr;
+
+    unique_ptr<BYTE[]> Buffer;
+    DWORD Length;
+    try
+    {
+        Buffer = EnumerateDevicesCompact(Filter, Length);
+    }
+    catch (const UsbDkNumErrorException &e)
+    {
+        // Driver that predates compact enumeration rejects the IOCTL,
+        // unfiltered list can still be fetched the old way
+        auto Error = e.GetErrorCode();
+        if ((Filter != nullptr) || ((Error != ERROR_INVALID_FUNCTION) && (Error != ERROR_NOT_SUPPORTED)))
+        {
+            throw;
+        }
+
+        GetDevicesListLegacy(DevicesArray, DeviceNumber);
+        return;
+    }
+
+    ParseCompactDevicesList(Buffer.get(), Length, DevicesArray, DeviceNumber);
+
+    // Generation is sampled by the driver before the enumeration, so cached
+    // descriptors are never considered newer than the device list returned
+    auto Header = reinterpret_cast<PUSB_DK_COMPACT_ENUM_HEADER>(Buffer.get());
+    UsbDkConfigDescriptorCache::Instance().Validate(Header->Generation);
+}
+
+PUSB_DK_DESCRIPTORS_SNAPSHOT UsbDkDriverAccess::GetDescriptorsSnapshot()
+{
+    unique_ptr<BYTE[]> Buffer;
+    ULONG64 Length = DESCRIPTORS_SNAPSHOT_INITIAL_SIZE;
+
+    for (;;)
+    {
+        if (Length > MAXDWORD)
+        {
+            throw UsbDkDriverAccessException(TEXT("Descriptors snapshot is too large"), ERROR_BUFFER_OVERFLOW);
+        }
+
+        Buffer.reset(new BYTE[static_cast<size_t>(Length)]);
+
+        DWORD BytesReturned;
+        auto Fetched = Ioctl(IOCTL_USBDK_GET_DESCRIPTORS_SNAPSHOT, true, nullptr, 0,
+                             Buffer.get(), static_cast<DWORD>(Length), &BytesReturned);
+
+        if (BytesReturned < sizeof(USB_DK_DESCRIPTORS_SNAPSHOT))
+        {
+            throw UsbDkDriverAccessException(TEXT("Descriptors snapshot is too short"), ERROR_INVALID_DATA);
+        }
+
+        auto Snapshot = reinterpret_cast<PUSB_DK_DESCRIPTORS_SNAPSHOT>(Buffer.get());
+        if (Fetched)
+        {
+            break;
+        }
+
+        // Buffer was too short, driver reported the size needed
+        Length = Snapshot->Length;
+    }
+
+    auto Snapshot = reinterpret_cast<PUSB_DK_DESCRIPTORS_SNAPSHOT>(Buffer.get());
+
+    // Descriptors are already here, let the cache serve
+    // further UsbDk_GetConfigurationDescriptor calls
+    auto &Cache = UsbDkConfigDescriptorCache::Instance();
+    for (ULONG64 i = 0; i < Snapshot->NumDevices; i++)
+    {
+        auto Device = GetSnapshotDevice(Snapshot, i);
+
+        USB_DK_CONFIG_DESCRIPTOR_REQUEST Request;
+        Request.ID = Device->Info.ID;
+
+        for (Request.Index = 0; Request.Index < Device->NumConfigurations; Request.Index++)
+        {
+            ULONG DescriptorLength;
+            auto Descriptor = reinterpret_cast<PBYTE>(GetSnapshotConfigurationDescriptor(Snapshot, i, Request.Index, DescriptorLength));
+            Cache.Insert(Request, Snapshot->Generation, vector<BYTE>(Descriptor, Descriptor + DescriptorLength));
+        }
+    }
+
+    return reinterpret_cast<PUSB_DK_DESCRIPTORS_SNAPSHOT>(Buffer.release());
+}
+
+void UsbDkDriverAccess::ReleaseDescriptorsSnapshot(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot)
+{
+    delete[] reinterpret_cast<PBYTE>(Snapshot);
+}
+
+PUSB_DK_SNAPSHOT_DEVICE UsbDkDriverAccess::GetSnapshotDevice(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot, ULONG64 DeviceIndex)
+{
+    if (DeviceIndex >= Snapshot->NumDevices)
+    {
+        throw UsbDkDriverAccessException(TEXT("Snapshot device index is out of range"), ERROR_INVALID_PARAMETER);
+    }
+
+    auto Devices = reinterpret_cast<PUSB_DK_SNAPSHOT_DEVICE>(reinterpret_cast<PBYTE>(Snapshot) + Snapshot->DevicesOffset);
+    return &Devices[DeviceIndex];
+}
+
+PUSB_CONFIGURATION_DESCRIPTOR UsbDkDriverAccess::GetSnapshotConfigurationDescriptor(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot,
+                                                                                    ULONG64 DeviceIndex,
+                                                                                    ULONG64 ConfigurationIndex,
+                                                                                    ULONG &Length)
+{
+    auto Device = GetSnapshotDevice(Snapshot, DeviceIndex);
+    if (ConfigurationIndex >= Device->NumConfigurations)
+    {
+        throw UsbDkDriverAccessException(TEXT("Snapshot configuration index is out of range"), ERROR_INVALID_PARAMETER);
+    }
+
+    auto Base = reinterpret_cast<PBYTE>(Snapshot);
+    auto Configs = reinterpret_cast<PUSB_DK_SNAPSHOT_CONFIG>(Base + Device->ConfigsOffset);
+
+    Length = static_cast<ULONG>(Configs[ConfigurationIndex].Length);
+    return reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(Base + Configs[ConfigurationIndex].Offset);
+}
+
 void UsbDkDriverAccess::ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Descriptor)
 {
     delete[] Descriptor;
@@ -66,21 +306,67 @@ void UsbDkDriverAccess::ReleaseDevicesList(PUSB_DK_DEVICE_INFO DevicesArray)
     delete[] DevicesArray;
 }
 
+ULONG64 UsbDkDriverAccess::GetEnumerationGeneration()
+{
+    ULONG64 Generation;
+    Ioctl(IOCTL_USBDK_GET_ENUM_GENERATION, false, nullptr, 0, &Generation, sizeof(Generation));
+    return Generation;
+}
+
+void UsbDkDriverAccess::FetchConfigurationDescriptor(USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request,
+                                                     vector<BYTE> &Descriptor,
+                                                     ULONG64 &Generation)
+{
+    vector<BYTE> Buffer(sizeof(USB_DK_CONFIG_DESCRIPTOR_RESULT) + CONFIG_DESCRIPTOR_INITIAL_FETCH_SIZE);
+
+    for (;;)
+    {
+        DWORD BytesReturned;
+        auto Fetched = Ioctl(IOCTL_USBDK_GET_CONFIG_DESCRIPTOR_EX, true, &Request, sizeof(Request),
+                             Buffer.data(), static_cast<DWORD>(Buffer.size()), &BytesReturned);
+
+        if (BytesReturned < sizeof(USB_DK_CONFIG_DESCRIPTOR_RESULT))
+        {
+            throw UsbDkDriverAccessException(TEXT("Configuration descriptor result is too short"), ERROR_INVALID_DATA);
+        }
+
+        auto Result = reinterpret_cast<PUSB_DK_CONFIG_DESCRIPTOR_RESULT>(Buffer.data());
+        if (Fetched)
+        {
+            auto Data = Buffer.data() + sizeof(*Result);
+            Descriptor.assign(Data, Data + static_cast<size_t>(Result->Length));
+            Generation = Result->Generation;
+            return;
+        }
+
+        // Buffer was too short, driver reported the size needed
+        Buffer.resize(sizeof(*Result) + static_cast<size_t>(Result->Length));
+    }
+}
+
 PUSB_CONFIGURATION_DESCRIPTOR UsbDkDriverAccess::GetConfigurationDescriptor(USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request, ULONG &Length)
 {
-    USB_CONFIGURATION_DESCRIPTOR ShortDescriptor;
+    auto &Cache = UsbDkConfigDescriptorCache::Instance();
+    vector<BYTE> Descriptor;
 
-    Ioctl(IOCTL_USBDK_GET_CONFIG_DESCRIPTOR, true, &Request, sizeof(Request),
-          &ShortDescriptor, sizeof(ShortDescriptor));
+    if (!Cache.Lookup(Request, GetEnumerationGeneration(), Descriptor))
+    {
+        ULONG64 Generation;
+        FetchConfigurationDescriptor(Request, Descriptor, Generation);
+        Cache.Insert(Request, Generation, Descriptor);
+    }
 
-    Length = ShortDescriptor.wTotalLength;
+    Length = static_cast<ULONG>(Descriptor.size());
 
-    auto FullDescriptor = reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(new BYTE[Length]);
+    auto FullDescriptor = new BYTE[Length];
+    memcpy(FullDescriptor, Descriptor.data(), Length);
 
-    Ioctl(IOCTL_USBDK_GET_CONFIG_DESCRIPTOR, false, &Request, sizeof(Request),
-          FullDescriptor, Length);
+    return reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(FullDescriptor);
+}
 
-    return FullDescriptor;
+void UsbDkDriverAccess::GetConfigurationDescriptorCacheStatistics(ULONG64 &Hits, ULONG64 &Misses)
+{
+    UsbDkConfigDescriptorCache::Instance().GetStatistics(Hits, Misses);
 }
 
 void UsbDkDriverAccess::UpdateRegistryParameters()
@@ -95,11 +381,57 @@ HANDLE UsbDkDriverAccess::AddRedirect(USB_DK_DEVICE_ID &DeviceID)
     return reinterpret_cast<HANDLE>(RedirectorHandle);
 }
 
+TransferResult UsbDkDriverAccess::AddRedirectAsync(USB_DK_DEVICE_ID &DeviceID, ULONG64 &RedirectorHandle, LPOVERLAPPED Overlapped)
+{
+    // Output buffer is filled on completion, so RedirectorHandle
+    // must stay valid until FinishAddRedirect returns
+    return Ioctl(IOCTL_USBDK_ADD_REDIRECT, false, &DeviceID, sizeof(DeviceID),
+                 &RedirectorHandle, sizeof(RedirectorHandle), nullptr, Overlapped);
+}
+
+HANDLE UsbDkDriverAccess::FinishAddRedirect(ULONG64 &RedirectorHandle, LPOVERLAPPED Overlapped)
+{
+    // Handle is opened for this acquisition only, so waiting on it
+    // when Overlapped has no event is not woken by other requests
+    DWORD BytesReturned;
+    if (!GetOverlappedResult(m_hDriver, Overlapped, &BytesReturned, TRUE))
+    {
+        throw UsbDkDriverAccessException(TEXT("Asynchronous redirection failed"), GetLastError());
+    }
+
+    if (BytesReturned != sizeof(RedirectorHandle))
+    {
+        throw UsbDkDriverAccessException(TEXT("Asynchronous redirection returned no handle"), ERROR_INVALID_DATA);
+    }
+
+    return reinterpret_cast<HANDLE>(RedirectorHandle);
+}
+
+void UsbDkDriverAccess::CancelAddRedirect(LPOVERLAPPED Overlapped)
+{
+    if (!CancelIoEx(m_hDriver, Overlapped) && (GetLastError() != ERROR_NOT_FOUND))
+    {
+        throw UsbDkDriverAccessException(TEXT("Failed to cancel redirection"), GetLastError());
+    }
+}
+
 void UsbDkHiderAccess::AddHideRule(const USB_DK_HIDE_RULE &Rule)
 {
     Ioctl(IOCTL_USBDK_ADD_HIDE_RULE, false, const_cast<PUSB_DK_HIDE_RULE>(&Rule), sizeof(Rule));
 }
 
+void UsbDkHiderAccess::AddHideRules(const USB_DK_HIDE_RULE *Rules, ULONG NumRules, ULONG Flags)
+{
+    vector<BYTE> Buffer(sizeof(USB_DK_HIDE_RULES_HEADER) + NumRules * sizeof(USB_DK_HIDE_RULE));
+
+    auto Header = reinterpret_cast<PUSB_DK_HIDE_RULES_HEADER>(Buffer.data());
+    Header->Flags = Flags;
+    Header->NumRules = NumRules;
+    memcpy(Header + 1, Rules, NumRules * sizeof(USB_DK_HIDE_RULE));
+
+    Ioctl(IOCTL_USBDK_ADD_HIDE_RULES, false, Buffer.data(), static_cast<DWORD>(Buffer.size()));
+}
+
 void UsbDkHiderAccess::ClearHideRules()
 {
     Ioctl(IOCTL_USBDK_CLEAR_HIDE_RULES);
@@ -42,19 +42,42 @@ public:
 class UsbDkDriverAccess : public UsbDkDriverFile
 {
 public:
-    UsbDkDriverAccess()
-        : UsbDkDriverFile(USBDK_USERMODE_NAME)
+    UsbDkDriverAccess(bool bOverlapped = false)
+        : UsbDkDriverFile(USBDK_USERMODE_NAME, bOverlapped)
     {}
 
-    void GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &NumberDevice);
+    void GetDevicesList(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &NumberDevice,
+                        const USB_DK_DEVICE_FILTER *Filter = nullptr);
+    PUSB_DK_DESCRIPTORS_SNAPSHOT GetDescriptorsSnapshot();
+    static void ReleaseDescriptorsSnapshot(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot);
+    static PUSB_DK_SNAPSHOT_DEVICE GetSnapshotDevice(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot, ULONG64 DeviceIndex);
+    static PUSB_CONFIGURATION_DESCRIPTOR GetSnapshotConfigurationDescriptor(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot,
+                                                                            ULONG64 DeviceIndex,
+                                                                            ULONG64 ConfigurationIndex,
+                                                                            ULONG &Length);
     PUSB_CONFIGURATION_DESCRIPTOR GetConfigurationDescriptor(USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request, ULONG &Length);
     void UpdateRegistryParameters();
     static void ReleaseDevicesList(PUSB_DK_DEVICE_INFO DevicesArray);
     static void ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Descriptor);
 
     HANDLE AddRedirect(USB_DK_DEVICE_ID &DeviceID);
+    TransferResult AddRedirectAsync(USB_DK_DEVICE_ID &DeviceID, ULONG64 &RedirectorHandle, LPOVERLAPPED Overlapped);
+    HANDLE FinishAddRedirect(ULONG64 &RedirectorHandle, LPOVERLAPPED Overlapped);
+    void CancelAddRedirect(LPOVERLAPPED Overlapped);
+
+    static void GetConfigurationDescriptorCacheStatistics(ULONG64 &Hits, ULONG64 &Misses);
+
+    // Validates IOCTL_USBDK_ENUM_DEVICES_COMPACT output and converts it
+    // to the array of USB_DK_DEVICE_INFO, released by ReleaseDevicesList()
+    static void ParseCompactDevicesList(const BYTE *Buffer, DWORD Length,
+                                        PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber);
 
 private:
+    unique_ptr<BYTE[]> EnumerateDevicesCompact(const USB_DK_DEVICE_FILTER *Filter, DWORD &BytesReturned);
+    void GetDevicesListLegacy(PUSB_DK_DEVICE_INFO &DevicesArray, ULONG &DeviceNumber);
+    ULONG64 GetEnumerationGeneration();
+    void FetchConfigurationDescriptor(USB_DK_CONFIG_DESCRIPTOR_REQUEST &Request, vector<BYTE> &Descriptor, ULONG64 &Generation);
+
     template <typename TOutputObj = char>
     void SendIoctlWithDeviceId(DWORD ControlCode, USB_DK_DEVICE_ID &Id, TOutputObj* Output = nullptr)
     {
@@ -71,5 +94,6 @@ public:
     {}
 
     void AddHideRule(const USB_DK_HIDE_RULE &Rule);
+    void AddHideRules(const USB_DK_HIDE_RULE *Rules, ULONG NumRules, ULONG Flags);
     void ClearHideRules();
 };
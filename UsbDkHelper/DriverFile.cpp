@@ -77,6 +77,25 @@ TransferResult UsbDkDriverFile::Ioctl(DWORD Code,
     return TransferSuccess;
 }
 
+DWORD UsbDkDriverFile::IoctlNoThrow(DWORD Code,
+                                    LPVOID InBuffer,
+                                    DWORD InBufferSize,
+                                    LPVOID OutBuffer,
+                                    DWORD OutBufferSize,
+                                    LPOVERLAPPED Overlapped) noexcept
+{
+    DWORD BytesReturned;
+    if (!DeviceIoControl(m_hDriver, Code,
+                         InBuffer, InBufferSize,
+                         OutBuffer, OutBufferSize,
+                         &BytesReturned, Overlapped))
+    {
+        return GetLastError();
+    }
+
+    return ERROR_SUCCESS;
+}
+
 TransferResult UsbDkDriverFile::Read(LPVOID Buffer,
                            DWORD BufferSize,
                            LPDWORD BytesRead,
@@ -55,6 +55,15 @@ public:
                LPDWORD BytesReturned = nullptr,
                LPOVERLAPPED Overlapped = nullptr);
 
+    // Same as Ioctl() but reports failures as Win32 error code instead of
+    // exception, ERROR_IO_PENDING is returned for pending overlapped I/O
+    DWORD IoctlNoThrow(DWORD Code,
+                       LPVOID InBuffer,
+                       DWORD InBufferSize,
+                       LPVOID OutBuffer,
+                       DWORD OutBufferSize,
+                       LPOVERLAPPED Overlapped) noexcept;
+
     TransferResult Read(LPVOID Buffer,
               DWORD BufferSize,
               LPDWORD BytesRead,
@@ -29,14 +29,12 @@ TransferResult UsbDkRedirectorAccess::TransactPipe(USB_DK_TRANSFER_REQUEST &Requ
                                                    DWORD OpCode,
                                                    LPOVERLAPPED Overlapped)
 {
-    static DWORD BytesTransferredDummy;
-
-    auto res = Ioctl(OpCode, false,
-                     &Request, sizeof(Request),
-                     &Request.Result.GenResult, sizeof(Request.Result.GenResult),
-                     &BytesTransferredDummy, Overlapped);
-
-    return res;
+    // Transfer results are returned in the request itself, bytes returned
+    // by DeviceIoControl go to per-call storage of Ioctl()
+    return Ioctl(OpCode, false,
+                 &Request, sizeof(Request),
+                 &Request.Result.GenResult, sizeof(Request.Result.GenResult),
+                 nullptr, Overlapped);
 }
 
 TransferResult UsbDkRedirectorAccess::ReadPipe(USB_DK_TRANSFER_REQUEST &Request,
@@ -51,6 +49,28 @@ TransferResult UsbDkRedirectorAccess::WritePipe(USB_DK_TRANSFER_REQUEST &Request
     return TransactPipe(Request, IOCTL_USBDK_DEVICE_WRITE_PIPE, Overlapped);
 }
 
+DWORD UsbDkRedirectorAccess::TransactPipeNoThrow(USB_DK_TRANSFER_REQUEST &Request,
+                                                DWORD OpCode,
+                                                LPOVERLAPPED Overlapped) noexcept
+{
+    return IoctlNoThrow(OpCode,
+                        &Request, sizeof(Request),
+                        &Request.Result.GenResult, sizeof(Request.Result.GenResult),
+                        Overlapped);
+}
+
+DWORD UsbDkRedirectorAccess::ReadPipeNoThrow(USB_DK_TRANSFER_REQUEST &Request,
+                                            LPOVERLAPPED Overlapped) noexcept
+{
+    return TransactPipeNoThrow(Request, IOCTL_USBDK_DEVICE_READ_PIPE, Overlapped);
+}
+
+DWORD UsbDkRedirectorAccess::WritePipeNoThrow(USB_DK_TRANSFER_REQUEST &Request,
+                                             LPOVERLAPPED Overlapped) noexcept
+{
+    return TransactPipeNoThrow(Request, IOCTL_USBDK_DEVICE_WRITE_PIPE, Overlapped);
+}
+
 void UsbDkRedirectorAccess::AbortPipe(ULONG64 PipeAddress)
 {
     IoctlSync(IOCTL_USBDK_DEVICE_ABORT_PIPE, false, &PipeAddress, sizeof(PipeAddress));
@@ -89,8 +109,10 @@ bool UsbDkRedirectorAccess::IoctlSync(DWORD Code,
         throw UsbDkDriverFileException(TEXT("CreateEvent failed"));
     }
 
-    OVERLAPPED Overlapped;
-    Overlapped.hEvent = Event;
+    // Low bit of the event handle keeps the completion from being queued
+    // to a completion port the redirector handle may be associated with
+    OVERLAPPED Overlapped = {};
+    Overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(static_cast<HANDLE>(Event)) | 1);
     auto res = Ioctl(Code, ShortBufferOk, InBuffer, InBufferSize, OutBuffer, OutBufferSize, BytesReturned, &Overlapped);
 
     switch (res)
@@ -47,6 +47,8 @@ public:
 
     TransferResult ReadPipe(USB_DK_TRANSFER_REQUEST &Request, LPOVERLAPPED Overlapped);
     TransferResult WritePipe(USB_DK_TRANSFER_REQUEST &Request, LPOVERLAPPED Overlapped);
+    DWORD ReadPipeNoThrow(USB_DK_TRANSFER_REQUEST &Request, LPOVERLAPPED Overlapped) noexcept;
+    DWORD WritePipeNoThrow(USB_DK_TRANSFER_REQUEST &Request, LPOVERLAPPED Overlapped) noexcept;
     void AbortPipe(ULONG64 PipeAddress);
     void ResetPipe(ULONG64 PipeAddress);
     void SetAltsetting(ULONG64 InterfaceIdx, ULONG64 AltSettingIdx);
@@ -61,6 +63,10 @@ private:
                                 DWORD OpCode,
                                 LPOVERLAPPED Overlapped);
 
+    DWORD TransactPipeNoThrow(USB_DK_TRANSFER_REQUEST &Request,
+                              DWORD OpCode,
+                              LPOVERLAPPED Overlapped) noexcept;
+
     bool IoctlSync(DWORD Code,
                    bool ShortBufferOk = false,
                    LPVOID InBuffer = nullptr,
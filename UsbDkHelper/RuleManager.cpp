@@ -1,10 +1,10 @@
 #include "stdafx.h"
+#include <algorithm>
 #include "UsbDkDataHider.h"
 #include "UsbDkNames.h"
 #include "HideRulesRegPublic.h"
 #include "RegAccess.h"
 #include "RuleManager.h"
-#include "GuidGen.h"
 
 CRulesManager::CRulesManager()
     : m_RegAccess(HKEY_LOCAL_MACHINE, USBDK_HIDE_RULES_PATH)
@@ -33,15 +33,6 @@ DWORD CRulesManager::ReadDword(LPCTSTR RuleName, LPCTSTR ValueName) const
     return RawValue;
 }
 
-void CRulesManager::WriteDword(const tstring &RuleName, LPCTSTR ValueName, ULONG Value)
-{
-    if (!m_RegAccess.WriteValue(ValueName, Value, RuleName.c_str()))
-    {
-        tstring ErrorText = tstring(TEXT("Failed to write rule ")) + ValueName;
-        throw UsbDkRuleManagerException(ErrorText, ERROR_FUNCTION_FAILED);
-    }
-}
-
 ULONG64 CRulesManager::ReadDwordMask(LPCTSTR RuleName, LPCTSTR ValueName) const
 {
     return HideRuleUlongMaskFromRegistry(ReadDword(RuleName, ValueName));
@@ -62,21 +53,84 @@ void CRulesManager::ReadRule(LPCTSTR RuleName, USB_DK_HIDE_RULE &Rule) const
     Rule.Class = ReadDwordMask(RuleName, USBDK_HIDE_RULE_CLASS);
 }
 
-template <typename TFunctor>
-bool CRulesManager::FindRule(const USB_DK_HIDE_RULE &Rule, TFunctor Functor)
+bool CRulesManager::ReadBlob(TRulesArray &Rules)
+{
+    DWORD Type;
+    DWORD Size;
+
+    if (!m_RegAccess.GetValueInfo(USBDK_HIDE_RULES_BLOB, &Type, &Size))
+    {
+        return false;
+    }
+
+    vector<BYTE> Blob(Size);
+    if ((Type != REG_BINARY) ||
+        (Size == 0) ||
+        (m_RegAccess.ReadBinary(USBDK_HIDE_RULES_BLOB, Blob.data(), Size) != Size))
+    {
+        throw UsbDkRuleManagerException(TEXT("Failed to read rules blob"), ERROR_INVALID_DATA);
+    }
+
+    DWORD NumRules;
+    auto RegRules = HideRulesFromRegistryBlob(Blob.data(), Blob.size(), NumRules);
+    if (RegRules == nullptr)
+    {
+        throw UsbDkRuleManagerException(TEXT("Rules blob is corrupted or of unknown version"), ERROR_INVALID_DATA);
+    }
+
+    for (DWORD i = 0; i < NumRules; i++)
+    {
+        USB_DK_HIDE_RULE Rule;
+        HideRuleFromRegistry(RegRules[i], Rule);
+        Rules.push_back(Rule);
+    }
+
+    return true;
+}
+
+void CRulesManager::WriteBlob(const TRulesArray &Rules)
+{
+    auto NumRules = static_cast<DWORD>(Rules.size());
+    vector<BYTE> Blob(HideRulesBlobSize(NumRules));
+
+    auto Header = reinterpret_cast<PUSBDK_REG_HIDE_RULES_HEADER>(Blob.data());
+    auto RegRules = reinterpret_cast<PUSBDK_REG_HIDE_RULE>(Header + 1);
+
+    for (DWORD i = 0; i < NumRules; i++)
+    {
+        HideRuleToRegistry(Rules[i], RegRules[i]);
+    }
+
+    Header->Signature = USBDK_HIDE_RULES_BLOB_SIGNATURE;
+    Header->Version = USBDK_HIDE_RULES_BLOB_VERSION;
+    Header->NumRules = NumRules;
+    Header->Checksum = HideRulesBlobChecksum(RegRules, NumRules);
+
+    if (!m_RegAccess.WriteBinary(USBDK_HIDE_RULES_BLOB, Blob.data(), static_cast<DWORD>(Blob.size())))
+    {
+        throw UsbDkRuleManagerException(TEXT("Failed to write rules blob"), ERROR_FUNCTION_FAILED);
+    }
+}
+
+void CRulesManager::ReadRules(TRulesArray &Rules, vector<tstring> &LegacyRules)
 {
+    ReadBlob(Rules);
+
+    //Rules written by older versions as subkey per rule,
+    //they get migrated into the blob on the next modification
     for (const auto &SubKey : m_RegAccess)
     {
         try
         {
-            USB_DK_HIDE_RULE ExistingRule;
-            ReadRule(SubKey, ExistingRule);
+            USB_DK_HIDE_RULE LegacyRule;
+            ReadRule(SubKey, LegacyRule);
 
-            if (Rule == ExistingRule)
+            if (find(Rules.begin(), Rules.end(), LegacyRule) == Rules.end())
             {
-                Functor(SubKey);
-                return true;
+                Rules.push_back(LegacyRule);
             }
+
+            LegacyRules.push_back(SubKey);
         }
         catch (const UsbDkRuleManagerException &e)
         {
@@ -85,47 +139,52 @@ bool CRulesManager::FindRule(const USB_DK_HIDE_RULE &Rule, TFunctor Functor)
             OutputDebugString(ErrorText.c_str());
         }
     }
-
-    return false;
 }
 
-bool CRulesManager::RuleExists(const USB_DK_HIDE_RULE &Rule)
+void CRulesManager::DeleteLegacyRules(const vector<tstring> &LegacyRules)
 {
-    return FindRule(Rule, [](LPCTSTR){});
+    for (const auto &RuleName : LegacyRules)
+    {
+        if (!m_RegAccess.DeleteKey(RuleName.c_str()))
+        {
+            auto ErrorText = tstring(TEXT("Failed to delete migrated rule ")) + RuleName;
+            OutputDebugString(ErrorText.c_str());
+        }
+    }
 }
 
 void CRulesManager::AddRule(const USB_DK_HIDE_RULE &Rule)
 {
-    if (RuleExists(Rule))
-    {
-        throw UsbDkRuleManagerException(TEXT("Rule already exists"), ERROR_FILE_EXISTS);
-    }
+    TRulesArray Rules;
+    vector<tstring> LegacyRules;
 
-    CGuid RuleName;
+    ReadRules(Rules, LegacyRules);
 
-    if (!m_RegAccess.AddKey(RuleName))
+    if (find(Rules.begin(), Rules.end(), Rule) != Rules.end())
     {
-        throw UsbDkRuleManagerException(TEXT("Failed to create rule key"), ERROR_FUNCTION_FAILED);
+        throw UsbDkRuleManagerException(TEXT("Rule already exists"), ERROR_FILE_EXISTS);
     }
 
-    WriteDword(RuleName, USBDK_HIDE_RULE_TYPE, static_cast<ULONG>(Rule.Type));
-    WriteDword(RuleName, USBDK_HIDE_RULE_SHOULD_HIDE, static_cast<ULONG>(Rule.Hide));
-    WriteDword(RuleName, USBDK_HIDE_RULE_VID, static_cast<ULONG>(Rule.VID));
-    WriteDword(RuleName, USBDK_HIDE_RULE_PID, static_cast<ULONG>(Rule.PID));
-    WriteDword(RuleName, USBDK_HIDE_RULE_BCD, static_cast<ULONG>(Rule.BCD));
-    WriteDword(RuleName, USBDK_HIDE_RULE_CLASS, static_cast<ULONG>(Rule.Class));
+    Rules.push_back(Rule);
+
+    WriteBlob(Rules);
+    DeleteLegacyRules(LegacyRules);
 }
 
 void CRulesManager::DeleteRule(const USB_DK_HIDE_RULE &Rule)
 {
-    tstring RuleName;
+    TRulesArray Rules;
+    vector<tstring> LegacyRules;
 
-    if (FindRule(Rule, [&RuleName](LPCTSTR Name){ RuleName = Name; }))
+    ReadRules(Rules, LegacyRules);
+
+    auto Existing = find(Rules.begin(), Rules.end(), Rule);
+    if (Existing != Rules.end())
     {
-        if (!m_RegAccess.DeleteKey(RuleName.c_str()))
-        {
-            throw UsbDkRuleManagerException(TEXT("Failed to delete rule key"), ERROR_FUNCTION_FAILED);
-        }
+        Rules.erase(Existing);
+
+        WriteBlob(Rules);
+        DeleteLegacyRules(LegacyRules);
     }
 }
 
@@ -135,6 +194,33 @@ ULONG CRulesManager::DeleteAllRules(ULONG& notDeleted)
     notDeleted = 0;
     vector<wstring> subkeys;
 
+    TRulesArray Rules;
+    bool BlobExists;
+
+    try
+    {
+        BlobExists = ReadBlob(Rules);
+    }
+    catch (const UsbDkRuleManagerException &e)
+    {
+        //Corrupted blob is dropped as well
+        OutputDebugString(string2tstring(e.what()).c_str());
+        BlobExists = true;
+    }
+
+    if (BlobExists)
+    {
+        auto NumRules = static_cast<ULONG>(Rules.size());
+        if (m_RegAccess.DeleteValue(USBDK_HIDE_RULES_BLOB))
+        {
+            deleted += NumRules;
+        }
+        else
+        {
+            notDeleted += NumRules;
+        }
+    }
+
     for (const auto &SubKey : m_RegAccess)
         subkeys.push_back(SubKey);
 
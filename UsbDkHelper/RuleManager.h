@@ -20,14 +20,16 @@ public:
     void DeleteRule(const USB_DK_HIDE_RULE &Rule);
     ULONG DeleteAllRules(ULONG& notDeleted);
 private:
-    template <typename TFunctor>
-    bool FindRule(const USB_DK_HIDE_RULE &Rule, TFunctor Functor);
-    bool RuleExists(const USB_DK_HIDE_RULE &Rule);
+    typedef vector<USB_DK_HIDE_RULE> TRulesArray;
+
+    void ReadRules(TRulesArray &Rules, vector<tstring> &LegacyRules);
+    bool ReadBlob(TRulesArray &Rules);
+    void WriteBlob(const TRulesArray &Rules);
+    void DeleteLegacyRules(const vector<tstring> &LegacyRules);
 
     DWORD ReadDword(LPCTSTR RuleName, LPCTSTR ValueName) const;
     ULONG64 ReadDwordMask(LPCTSTR RuleName, LPCTSTR ValueName) const;
     ULONG64 ReadBool(LPCTSTR RuleName, LPCTSTR ValueName) const;
-    void WriteDword(const tstring &RuleName, LPCTSTR ValueName, ULONG Value);
 
     void ReadRule(LPCTSTR RuleName, USB_DK_HIDE_RULE &Rule) const;
 
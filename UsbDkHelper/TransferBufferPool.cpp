@@ -0,0 +1,131 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "TransferBufferPool.h"
+
+UsbDkTransferBufferPool::~UsbDkTransferBufferPool()
+{
+    for (auto &Buffer : m_Buffers)
+    {
+        if (Buffer.second == LARGE_BUFFER)
+        {
+            VirtualFree(Buffer.first, 0, MEM_RELEASE);
+        }
+    }
+
+    for (auto Slab : m_Slabs)
+    {
+        VirtualFree(Slab, 0, MEM_RELEASE);
+    }
+
+    DeleteCriticalSection(&m_Lock);
+}
+
+void UsbDkTransferBufferPool::AddSlab(ULONG SizeClass)
+{
+    auto BufferSize = ClassSize(SizeClass);
+    auto SlabSize = (BufferSize > SLAB_SIZE) ? BufferSize : SLAB_SIZE;
+
+    m_Slabs.reserve(m_Slabs.size() + 1);
+    m_FreeBuffers[SizeClass].reserve(m_FreeBuffers[SizeClass].size() + SlabSize / BufferSize);
+
+    auto Slab = static_cast<PBYTE>(VirtualAlloc(nullptr, SlabSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (Slab == nullptr)
+    {
+        throw UsbDkW32ErrorException(TEXT("Failed to allocate transfer buffers slab"));
+    }
+    m_Slabs.push_back(Slab);
+
+    for (auto Offset = SlabSize; Offset != 0; Offset -= BufferSize)
+    {
+        m_FreeBuffers[SizeClass].push_back(Slab + Offset - BufferSize);
+    }
+}
+
+PVOID UsbDkTransferBufferPool::Alloc(SIZE_T Size)
+{
+    ULONG SizeClass = 0;
+    while ((SizeClass < NUM_SIZE_CLASSES) && (ClassSize(SizeClass) < Size))
+    {
+        SizeClass++;
+    }
+
+    UsbDkLockedContext Ctx(m_Lock);
+
+    if (SizeClass == LARGE_BUFFER)
+    {
+        auto Buffer = VirtualAlloc(nullptr, Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (Buffer == nullptr)
+        {
+            throw UsbDkW32ErrorException(TEXT("Failed to allocate transfer buffer"));
+        }
+
+        try
+        {
+            m_Buffers.emplace(Buffer, LARGE_BUFFER);
+        }
+        catch (...)
+        {
+            VirtualFree(Buffer, 0, MEM_RELEASE);
+            throw;
+        }
+        return Buffer;
+    }
+
+    auto &FreeBuffers = m_FreeBuffers[SizeClass];
+    if (FreeBuffers.empty())
+    {
+        AddSlab(SizeClass);
+    }
+
+    auto Buffer = FreeBuffers.back();
+    m_Buffers.emplace(Buffer, SizeClass);
+    FreeBuffers.pop_back();
+    return Buffer;
+}
+
+bool UsbDkTransferBufferPool::Free(PVOID Buffer)
+{
+    UsbDkLockedContext Ctx(m_Lock);
+
+    auto Entry = m_Buffers.find(Buffer);
+    if (Entry == m_Buffers.end())
+    {
+        return false;
+    }
+
+    auto SizeClass = Entry->second;
+    m_Buffers.erase(Entry);
+
+    if (SizeClass == LARGE_BUFFER)
+    {
+        VirtualFree(Buffer, 0, MEM_RELEASE);
+    }
+    else
+    {
+        // Capacity for all buffers of the class is reserved by AddSlab()
+        m_FreeBuffers[SizeClass].push_back(Buffer);
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+#include <unordered_map>
+
+// Per-device pool of page aligned transfer buffers.
+// Requests are rounded up to power of two size classes from 4K to 1M,
+// buffers of a class are carved from 64K slabs (or occupy whole slab
+// when larger) and recycled on free, so the same pages are reused by
+// subsequent transfers. Bigger requests are served from the system
+// directly. All memory is returned to the system when pool is destroyed.
+class UsbDkTransferBufferPool
+{
+public:
+    UsbDkTransferBufferPool()
+    { InitializeCriticalSection(&m_Lock); }
+    ~UsbDkTransferBufferPool();
+
+    PVOID Alloc(SIZE_T Size);
+    bool Free(PVOID Buffer);
+
+    UsbDkTransferBufferPool(const UsbDkTransferBufferPool&) = delete;
+    UsbDkTransferBufferPool& operator= (const UsbDkTransferBufferPool&) = delete;
+
+private:
+    static const ULONG NUM_SIZE_CLASSES = 9;
+    static const ULONG LARGE_BUFFER = NUM_SIZE_CLASSES;
+    static const SIZE_T MIN_CLASS_SIZE = 4096;
+    static const SIZE_T SLAB_SIZE = 64 * 1024;
+
+    static SIZE_T ClassSize(ULONG SizeClass)
+    { return MIN_CLASS_SIZE << SizeClass; }
+
+    void AddSlab(ULONG SizeClass);
+
+    vector<PVOID> m_Slabs;
+    vector<PVOID> m_FreeBuffers[NUM_SIZE_CLASSES];
+    unordered_map<PVOID, ULONG> m_Buffers;
+    CRITICAL_SECTION m_Lock;
+};
@@ -30,14 +30,28 @@
 #include "Installer.h"
 #include "DriverAccess.h"
 #include "RedirectorAccess.h"
+#include "DeviceHandleTable.h"
 #include "RuleManager.h"
+#include "RegAccess.h"
+#include "HideRulesRegPublic.h"
 
 
-typedef struct tag_REDIRECTED_DEVICE_HANDLE
+typedef struct tag_PENDING_REDIRECT_HANDLE
 {
     USB_DK_DEVICE_ID DeviceID;
-    unique_ptr<UsbDkRedirectorAccess> RedirectorAccess;
-} REDIRECTED_DEVICE_HANDLE, *PREDIRECTED_DEVICE_HANDLE;
+    unique_ptr<UsbDkDriverAccess> DriverAccess;
+    LPOVERLAPPED Overlapped;
+    ULONG64 RedirectorHandle;
+} PENDING_REDIRECT_HANDLE, *PPENDING_REDIRECT_HANDLE;
+
+typedef struct tag_REDIRECT_CALLBACK_CONTEXT
+{
+    OVERLAPPED Overlapped;
+    HANDLE PendingRedirect;
+    HANDLE Wait;
+    USBDK_REDIRECT_CALLBACK Callback;
+    PVOID Context;
+} REDIRECT_CALLBACK_CONTEXT, *PREDIRECT_CALLBACK_CONTEXT;
 
 static void printExceptionString(const char *errorStr)
 {
@@ -55,6 +69,16 @@ static T* unpackHandle(HANDLE handle)
     return reinterpret_cast<T*>(handle);
 }
 
+static UsbDkDeviceHandleTable::CReference referenceDevice(HANDLE DeviceHandle)
+{
+    auto deviceHandle = UsbDkDeviceHandleTable::Instance().Reference(DeviceHandle);
+    if (!deviceHandle)
+    {
+        throw UsbDkDriverFileException(TEXT("Invalid handle value"));
+    }
+    return deviceHandle;
+}
+
 InstallResult UsbDk_InstallDriver(void)
 {
     bool NeedRollBack = false;
@@ -124,6 +148,76 @@ DLL void UsbDk_ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Desc
     }
 }
 
+DLL BOOL UsbDk_GetConfigurationDescriptorCacheStatistics(PULONG64 Hits, PULONG64 Misses)
+{
+    try
+    {
+        UsbDkDriverAccess::GetConfigurationDescriptorCacheStatistics(*Hits, *Misses);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+DLL BOOL UsbDk_GetDescriptorsSnapshot(PUSB_DK_DESCRIPTORS_SNAPSHOT *Snapshot)
+{
+    try
+    {
+        UsbDkDriverAccess driver;
+        *Snapshot = driver.GetDescriptorsSnapshot();
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+DLL void UsbDk_ReleaseDescriptorsSnapshot(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot)
+{
+    try
+    {
+        UsbDkDriverAccess::ReleaseDescriptorsSnapshot(Snapshot);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+    }
+}
+
+DLL PUSB_DK_SNAPSHOT_DEVICE UsbDk_GetSnapshotDevice(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot, ULONG64 DeviceIndex)
+{
+    try
+    {
+        return UsbDkDriverAccess::GetSnapshotDevice(Snapshot, DeviceIndex);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return nullptr;
+    }
+}
+
+DLL PUSB_CONFIGURATION_DESCRIPTOR UsbDk_GetSnapshotConfigurationDescriptor(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot,
+                                                                           ULONG64 DeviceIndex,
+                                                                           ULONG64 ConfigurationIndex,
+                                                                           PULONG Length)
+{
+    try
+    {
+        return UsbDkDriverAccess::GetSnapshotConfigurationDescriptor(Snapshot, DeviceIndex, ConfigurationIndex, *Length);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return nullptr;
+    }
+}
+
 BOOL UsbDk_GetDevicesList(PUSB_DK_DEVICE_INFO *DevicesArray, PULONG NumberDevices)
 {
     try
@@ -139,6 +233,21 @@ BOOL UsbDk_GetDevicesList(PUSB_DK_DEVICE_INFO *DevicesArray, PULONG NumberDevice
     }
 }
 
+BOOL UsbDk_GetDevicesListFiltered(PUSB_DK_DEVICE_FILTER Filter, PUSB_DK_DEVICE_INFO *DevicesArray, PULONG NumberDevices)
+{
+    try
+    {
+        UsbDkDriverAccess driver;
+        driver.GetDevicesList(*DevicesArray, *NumberDevices, Filter);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
 void UsbDk_ReleaseDevicesList(PUSB_DK_DEVICE_INFO DevicesArray)
 {
     try
@@ -160,7 +269,7 @@ HANDLE UsbDk_StartRedirect(PUSB_DK_DEVICE_ID DeviceID)
 
         UsbDkDriverAccess driverAccess;
         deviceHandle->RedirectorAccess.reset(new UsbDkRedirectorAccess(driverAccess.AddRedirect(*DeviceID)));
-        return reinterpret_cast<HANDLE>(deviceHandle.release());
+        return UsbDkDeviceHandleTable::Instance().Insert(move(deviceHandle));
     }
     catch (const exception &e)
     {
@@ -169,6 +278,289 @@ HANDLE UsbDk_StartRedirect(PUSB_DK_DEVICE_ID DeviceID)
     }
 }
 
+static unique_ptr<PENDING_REDIRECT_HANDLE> createPendingRedirect(PUSB_DK_DEVICE_ID DeviceID, LPOVERLAPPED Overlapped)
+{
+    unique_ptr<PENDING_REDIRECT_HANDLE> pendingHandle(new PENDING_REDIRECT_HANDLE);
+    pendingHandle->DeviceID = *DeviceID;
+    pendingHandle->Overlapped = Overlapped;
+    pendingHandle->RedirectorHandle = 0;
+
+    // Every acquisition has its own driver handle, so completion of one
+    // is never mistaken for another and the control device is not held
+    // by a handle shared between acquisitions
+    pendingHandle->DriverAccess.reset(new UsbDkDriverAccess(true));
+    return pendingHandle;
+}
+
+static HANDLE startRedirectAsync(PUSB_DK_DEVICE_ID DeviceID, LPOVERLAPPED Overlapped)
+{
+    auto pendingHandle = createPendingRedirect(DeviceID, Overlapped);
+    pendingHandle->DriverAccess->AddRedirectAsync(pendingHandle->DeviceID, pendingHandle->RedirectorHandle, Overlapped);
+    return reinterpret_cast<HANDLE>(pendingHandle.release());
+}
+
+static HANDLE finishRedirect(HANDLE PendingRedirect)
+{
+    unique_ptr<PENDING_REDIRECT_HANDLE> pendingHandle(unpackHandle<PENDING_REDIRECT_HANDLE>(PendingRedirect));
+    unique_ptr<REDIRECTED_DEVICE_HANDLE> deviceHandle(new REDIRECTED_DEVICE_HANDLE);
+    deviceHandle->DeviceID = pendingHandle->DeviceID;
+
+    auto &driverAccess = pendingHandle->DriverAccess;
+    deviceHandle->RedirectorAccess.reset(new UsbDkRedirectorAccess(driverAccess->FinishAddRedirect(pendingHandle->RedirectorHandle,
+                                                                                                   pendingHandle->Overlapped)));
+    return UsbDkDeviceHandleTable::Instance().Insert(move(deviceHandle));
+}
+
+HANDLE UsbDk_StartRedirectAsync(PUSB_DK_DEVICE_ID DeviceID, LPOVERLAPPED Overlapped)
+{
+    try
+    {
+        return startRedirectAsync(DeviceID, Overlapped);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return INVALID_HANDLE_VALUE;
+    }
+}
+
+HANDLE UsbDk_FinishRedirect(HANDLE PendingRedirect)
+{
+    try
+    {
+        return finishRedirect(PendingRedirect);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return INVALID_HANDLE_VALUE;
+    }
+}
+
+static VOID CALLBACK redirectCallbackWorker(PVOID Context, BOOLEAN TimedOut)
+{
+    UNREFERENCED_PARAMETER(TimedOut);
+
+    unique_ptr<REDIRECT_CALLBACK_CONTEXT> callbackContext(static_cast<PREDIRECT_CALLBACK_CONTEXT>(Context));
+
+    // Non-blocking unregistration is allowed from the wait callback
+    UnregisterWait(callbackContext->Wait);
+
+    auto deviceHandle = INVALID_HANDLE_VALUE;
+    DWORD error = ERROR_SUCCESS;
+    try
+    {
+        deviceHandle = finishRedirect(callbackContext->PendingRedirect);
+    }
+    catch (const UsbDkNumErrorException &e)
+    {
+        printExceptionString(e.what());
+        error = e.GetErrorCode();
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        error = ERROR_GEN_FAILURE;
+    }
+
+    CloseHandle(callbackContext->Overlapped.hEvent);
+    callbackContext->Callback(callbackContext->Context, deviceHandle, error);
+}
+
+BOOL UsbDk_StartRedirectWithCallback(PUSB_DK_DEVICE_ID DeviceID, USBDK_REDIRECT_CALLBACK Callback, PVOID Context)
+{
+    try
+    {
+        if (Callback == nullptr)
+        {
+            throw UsbDkException(TEXT("Redirection callback is not set"));
+        }
+
+        unique_ptr<REDIRECT_CALLBACK_CONTEXT> callbackContext(new REDIRECT_CALLBACK_CONTEXT());
+        callbackContext->Callback = Callback;
+        callbackContext->Context = Context;
+
+        callbackContext->Overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (callbackContext->Overlapped.hEvent == nullptr)
+        {
+            throw UsbDkW32ErrorException(TEXT("Failed to create redirection completion event"));
+        }
+
+        try
+        {
+            auto pendingHandle = createPendingRedirect(DeviceID, &callbackContext->Overlapped);
+            callbackContext->PendingRedirect = reinterpret_cast<HANDLE>(pendingHandle.get());
+
+            // Wait is registered before the request is sent, so the
+            // context is complete by the time the callback runs
+            if (!RegisterWaitForSingleObject(&callbackContext->Wait, callbackContext->Overlapped.hEvent,
+                                             redirectCallbackWorker, callbackContext.get(),
+                                             INFINITE, WT_EXECUTEONLYONCE))
+            {
+                throw UsbDkW32ErrorException(TEXT("Failed to register redirection completion wait"));
+            }
+
+            try
+            {
+                pendingHandle->DriverAccess->AddRedirectAsync(pendingHandle->DeviceID, pendingHandle->RedirectorHandle,
+                                                              &callbackContext->Overlapped);
+            }
+            catch (...)
+            {
+                // Request was not sent, so the event is never signaled
+                UnregisterWaitEx(callbackContext->Wait, INVALID_HANDLE_VALUE);
+                throw;
+            }
+
+            // Pending handle and context are owned by the callback from now
+            // on, it may have already run and freed them
+            pendingHandle.release();
+        }
+        catch (...)
+        {
+            CloseHandle(callbackContext->Overlapped.hEvent);
+            throw;
+        }
+
+        callbackContext.release();
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+BOOL UsbDk_StartRedirectMany(PUSB_DK_DEVICE_ID *DeviceIDs, ULONG Count, HANDLE *DeviceHandles,
+                             PDWORD Errors, PULONG ElapsedMilliseconds)
+{
+    auto startTime = GetTickCount();
+    ULONG acquired = 0;
+
+    try
+    {
+        vector<OVERLAPPED> overlapped(Count);
+        vector<HANDLE> pending(Count, INVALID_HANDLE_VALUE);
+        vector<DWORD> errors(Count, ERROR_SUCCESS);
+
+        // All requests are issued before waiting for any of them,
+        // so driver resets and re-enumerates devices concurrently
+        for (ULONG i = 0; i < Count; i++)
+        {
+            DeviceHandles[i] = INVALID_HANDLE_VALUE;
+
+            overlapped[i].hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+            if (overlapped[i].hEvent == nullptr)
+            {
+                errors[i] = GetLastError();
+                continue;
+            }
+
+            try
+            {
+                pending[i] = startRedirectAsync(DeviceIDs[i], &overlapped[i]);
+            }
+            catch (const UsbDkNumErrorException &e)
+            {
+                printExceptionString(e.what());
+                errors[i] = e.GetErrorCode();
+            }
+            catch (const exception &e)
+            {
+                printExceptionString(e.what());
+                errors[i] = ERROR_GEN_FAILURE;
+            }
+        }
+
+        for (ULONG i = 0; i < Count; i++)
+        {
+            if (pending[i] != INVALID_HANDLE_VALUE)
+            {
+                try
+                {
+                    DeviceHandles[i] = finishRedirect(pending[i]);
+                    acquired++;
+                }
+                catch (const UsbDkNumErrorException &e)
+                {
+                    printExceptionString(e.what());
+                    errors[i] = e.GetErrorCode();
+                }
+                catch (const exception &e)
+                {
+                    printExceptionString(e.what());
+                    errors[i] = ERROR_GEN_FAILURE;
+                }
+            }
+
+            if (overlapped[i].hEvent != nullptr)
+            {
+                CloseHandle(overlapped[i].hEvent);
+            }
+
+            if (Errors != nullptr)
+            {
+                Errors[i] = errors[i];
+            }
+        }
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+
+    if (ElapsedMilliseconds != nullptr)
+    {
+        *ElapsedMilliseconds = GetTickCount() - startTime;
+    }
+
+    return (acquired == Count) ? TRUE : FALSE;
+}
+
+BOOL UsbDk_CancelRedirect(HANDLE PendingRedirect)
+{
+    try
+    {
+        auto pendingHandle = unpackHandle<PENDING_REDIRECT_HANDLE>(PendingRedirect);
+        pendingHandle->DriverAccess->CancelAddRedirect(pendingHandle->Overlapped);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
+InstallResult UsbDk_SetRedirectionParkTimeout(ULONG Seconds)
+{
+    try
+    {
+        UsbDkRegAccess regAccess(HKEY_LOCAL_MACHINE, USBDK_PARAMS_PATH);
+        if (!regAccess.WriteValue(USBDK_REDIRECTION_PARK_TIMEOUT, Seconds))
+        {
+            throw UsbDkW32ErrorException(TEXT("Failed to write redirection park timeout"));
+        }
+
+        UsbDkDriverAccess driver;
+        driver.UpdateRegistryParameters();
+
+        return InstallSuccess;
+    }
+    catch (const UsbDkDriverFileException &e)
+    {
+        printExceptionString(e.what());
+        return InstallSuccessNeedReboot;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return InstallFailure;
+    }
+}
+
 BOOL UsbDk_StopRedirect(HANDLE DeviceHandle)
 {
     try
@@ -178,8 +570,13 @@ BOOL UsbDk_StopRedirect(HANDLE DeviceHandle)
         // for now we leave it as is with TODO to investigate it in corner case flow
         // (for example UsbDk uninstall when there is active redirection)
         UsbDkDriverAccess checkDriverAccess;
-        unique_ptr<REDIRECTED_DEVICE_HANDLE> deviceHandle(unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle));
-        deviceHandle->RedirectorAccess.reset();
+
+        // Redirector is released when transfers in flight on other threads
+        // drop their references to the handle
+        if (!UsbDkDeviceHandleTable::Instance().Close(DeviceHandle))
+        {
+            throw UsbDkDriverFileException(TEXT("Invalid handle value"));
+        }
         return TRUE;
     }
     catch (const exception &e)
@@ -193,7 +590,7 @@ TransferResult UsbDk_WritePipe(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Req
 {
     try
     {
-        auto deviceHandle = unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle);
+        auto deviceHandle = referenceDevice(DeviceHandle);
         return deviceHandle->RedirectorAccess->WritePipe(*Request, Overlapped);
     }
     catch (const exception &e)
@@ -207,7 +604,7 @@ TransferResult UsbDk_ReadPipe(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Requ
 {
     try
     {
-        auto deviceHandle= unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle);
+        auto deviceHandle = referenceDevice(DeviceHandle);
         return deviceHandle->RedirectorAccess->ReadPipe(*Request, Overlapped);
     }
     catch (const exception &e)
@@ -217,11 +614,71 @@ TransferResult UsbDk_ReadPipe(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Requ
     }
 }
 
+DWORD UsbDk_WritePipeEx(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Request, LPOVERLAPPED Overlapped)
+{
+    auto deviceHandle = UsbDkDeviceHandleTable::Instance().Reference(DeviceHandle);
+    if (!deviceHandle)
+    {
+        return ERROR_INVALID_HANDLE;
+    }
+    if (Request == nullptr)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    return deviceHandle->RedirectorAccess->WritePipeNoThrow(*Request, Overlapped);
+}
+
+DWORD UsbDk_ReadPipeEx(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Request, LPOVERLAPPED Overlapped)
+{
+    auto deviceHandle = UsbDkDeviceHandleTable::Instance().Reference(DeviceHandle);
+    if (!deviceHandle)
+    {
+        return ERROR_INVALID_HANDLE;
+    }
+    if (Request == nullptr)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    return deviceHandle->RedirectorAccess->ReadPipeNoThrow(*Request, Overlapped);
+}
+
+PVOID UsbDk_AllocTransferBuffer(HANDLE DeviceHandle, SIZE_T Size)
+{
+    try
+    {
+        auto deviceHandle = referenceDevice(DeviceHandle);
+        return deviceHandle->BufferPool.Alloc(Size);
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return nullptr;
+    }
+}
+
+BOOL UsbDk_FreeTransferBuffer(HANDLE DeviceHandle, PVOID Buffer)
+{
+    try
+    {
+        auto deviceHandle = referenceDevice(DeviceHandle);
+        if (!deviceHandle->BufferPool.Free(Buffer))
+        {
+            throw UsbDkException(TEXT("Buffer was not allocated by UsbDk_AllocTransferBuffer"));
+        }
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
 BOOL UsbDk_AbortPipe(HANDLE DeviceHandle, ULONG64 PipeAddress)
 {
     try
     {
-        auto deviceHandle = unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle);
+        auto deviceHandle = referenceDevice(DeviceHandle);
         deviceHandle->RedirectorAccess->AbortPipe(PipeAddress);
         return TRUE;
     }
@@ -236,7 +693,7 @@ BOOL UsbDk_ResetPipe(HANDLE DeviceHandle, ULONG64 PipeAddress)
 {
     try
     {
-        auto deviceHandle = unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle);
+        auto deviceHandle = referenceDevice(DeviceHandle);
         deviceHandle->RedirectorAccess->ResetPipe(PipeAddress);
         return TRUE;
     }
@@ -251,7 +708,7 @@ BOOL UsbDk_SetAltsetting(HANDLE DeviceHandle, ULONG64 InterfaceIdx, ULONG64 AltS
 {
     try
     {
-        auto deviceHandle = unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle);
+        auto deviceHandle = referenceDevice(DeviceHandle);
         deviceHandle->RedirectorAccess->SetAltsetting(InterfaceIdx, AltSettingIdx);
         return TRUE;
     }
@@ -266,7 +723,7 @@ DLL BOOL UsbDk_ResetDevice(HANDLE DeviceHandle)
 {
     try
     {
-        auto deviceHandle = unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle);
+        auto deviceHandle = referenceDevice(DeviceHandle);
         deviceHandle->RedirectorAccess->ResetDevice();
         return TRUE;
     }
@@ -281,7 +738,7 @@ HANDLE UsbDk_GetRedirectorSystemHandle(HANDLE DeviceHandle)
 {
     try
     {
-        auto deviceHandle = unpackHandle<REDIRECTED_DEVICE_HANDLE>(DeviceHandle);
+        auto deviceHandle = referenceDevice(DeviceHandle);
         return deviceHandle->RedirectorAccess->GetSystemHandle();
     }
     catch (const exception &e)
@@ -326,6 +783,28 @@ BOOL UsbDk_AddHideRule(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_PUBLIC PublicRule)
     return UsbDk_AddExtendedHideRule(HiderHandle, PublicRule, USBDK_HIDER_RULE_DEFAULT);
 }
 
+BOOL UsbDk_AddHideRules(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_PUBLIC PublicRules, const ULONG *Types, ULONG NumRules, ULONG Flags)
+{
+    try
+    {
+        vector<USB_DK_HIDE_RULE> Rules;
+        Rules.reserve(NumRules);
+        for (ULONG i = 0; i < NumRules; i++)
+        {
+            Rules.emplace_back(&PublicRules[i], (Types != nullptr) ? Types[i] : USBDK_HIDER_RULE_DEFAULT);
+        }
+
+        auto HiderAccess = unpackHandle<UsbDkHiderAccess>(HiderHandle);
+        HiderAccess->AddHideRules(Rules.data(), NumRules, Flags);
+        return TRUE;
+    }
+    catch (const exception &e)
+    {
+        printExceptionString(e.what());
+        return FALSE;
+    }
+}
+
 BOOL UsbDk_ClearHideRules(HANDLE HiderHandle)
 {
     try
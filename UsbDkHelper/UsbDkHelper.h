@@ -91,7 +91,27 @@ extern "C" {
     */
     DLL BOOL             UsbDk_GetDevicesList(PUSB_DK_DEVICE_INFO *DevicesArray, PULONG NumberDevices);
 
-    /* Release deviceArray list returned by UsbDk_GetDevicesList
+    /* List USB devices attached to the system that match given filter
+    *
+    * @params
+    *    IN  - Filter        devices filter, fields set to USB_DK_DEVICE_FILTER_MATCH_ALL
+    *                        match any value
+    *    OUT - DevicesArray  pointer to array where devices will be stored
+               NumberDevices amount of returned devices
+    *
+    * @return
+    *  TRUE if function succeeds
+    * @note
+    *  Filter is evaluated by the driver, only matching devices are returned.
+    *  It is caller's responsibility to release device list by
+    *  using UsbDk_ReleaseDevicesList
+    *
+    */
+    DLL BOOL             UsbDk_GetDevicesListFiltered(PUSB_DK_DEVICE_FILTER Filter,
+                                                      PUSB_DK_DEVICE_INFO *DevicesArray,
+                                                      PULONG NumberDevices);
+
+    /* Release deviceArray list returned by UsbDk_GetDevicesList or UsbDk_GetDevicesListFiltered
     *
     * @params
     *    IN  - DevicesArray  pointer to  device list to be released
@@ -131,6 +151,84 @@ extern "C" {
     */
     DLL void             UsbDk_ReleaseConfigurationDescriptor(PUSB_CONFIGURATION_DESCRIPTOR Descriptor);
 
+    /* Retrieve statistics of configuration descriptors cache
+    *
+    * @params
+    *    IN  - None
+    *    OUT - Hits      number of descriptors served from the cache
+    *        - Misses    number of descriptors fetched from the driver
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    *  Configuration descriptors returned by UsbDk_GetConfigurationDescriptor
+    *  are cached by the library per process, the cache is flushed when the
+    *  set of USB devices attached to the system changes
+    *
+    */
+    DLL BOOL             UsbDk_GetConfigurationDescriptorCacheStatistics(PULONG64 Hits, PULONG64 Misses);
+
+    /* Retrieve device and configuration descriptors of all USB devices
+    *  attached to the system by a single driver request
+    *
+    * @params
+    *    IN  - None
+    *    OUT - Snapshot     pointer where descriptors snapshot will be stored
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    *  Use UsbDk_GetSnapshotDevice and UsbDk_GetSnapshotConfigurationDescriptor
+    *  to walk the snapshot. It is caller's responsibility to release
+    *  the snapshot by using UsbDk_ReleaseDescriptorsSnapshot
+    *
+    */
+    DLL BOOL             UsbDk_GetDescriptorsSnapshot(PUSB_DK_DESCRIPTORS_SNAPSHOT *Snapshot);
+
+    /* Release descriptors snapshot returned by UsbDk_GetDescriptorsSnapshot
+    *
+    * @params
+    *    IN  - Snapshot     pointer to snapshot to be released
+    *    OUT - None
+    *
+    * @return
+    *  None
+    *
+    */
+    DLL void             UsbDk_ReleaseDescriptorsSnapshot(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot);
+
+    /* Retrieve device entry of descriptors snapshot
+    *
+    * @params
+    *    IN  - Snapshot     pointer to snapshot returned by UsbDk_GetDescriptorsSnapshot
+    *        - DeviceIndex  index of device, less than Snapshot->NumDevices
+    *    OUT - None
+    *
+    * @return
+    *  pointer to device entry inside of the snapshot or NULL on failure
+    *
+    */
+    DLL PUSB_DK_SNAPSHOT_DEVICE UsbDk_GetSnapshotDevice(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot, ULONG64 DeviceIndex);
+
+    /* Retrieve configuration descriptor of device from descriptors snapshot
+    *
+    * @params
+    *    IN  - Snapshot           pointer to snapshot returned by UsbDk_GetDescriptorsSnapshot
+    *        - DeviceIndex        index of device, less than Snapshot->NumDevices
+    *        - ConfigurationIndex index of configuration, less than device NumConfigurations
+    *    OUT - Length             length of full descriptor
+    *
+    * @return
+    *  pointer to configuration descriptor inside of the snapshot or NULL on failure
+    *
+    */
+    DLL PUSB_CONFIGURATION_DESCRIPTOR UsbDk_GetSnapshotConfigurationDescriptor(PUSB_DK_DESCRIPTORS_SNAPSHOT Snapshot,
+                                                                               ULONG64 DeviceIndex,
+                                                                               ULONG64 ConfigurationIndex,
+                                                                               PULONG Length);
+
     /* Detach USB device from Windows and acquire it for exclusive access
     *
     * @params
@@ -146,6 +244,119 @@ extern "C" {
     */
     DLL HANDLE           UsbDk_StartRedirect(PUSB_DK_DEVICE_ID DeviceID);
 
+    /* Start acquisition of USB device without waiting for it to complete
+    *
+    * @params
+    *    IN  - DeviceID   id of device to be acquired
+    *        - Overlapped asynchronous I/O definition, hEvent is signaled on completion
+    *    OUT - None
+    *
+    * @return
+    *  Handle of pending acquisition or INVALID_HANDLE_VALUE on failure
+    *
+    * @note
+    *  Overlapped must stay valid until UsbDk_FinishRedirect is called.
+    *  Any number of acquisitions may be pending at once, each of them
+    *  holds its own driver handle until UsbDk_FinishRedirect is called.
+    *
+    */
+    DLL HANDLE           UsbDk_StartRedirectAsync(PUSB_DK_DEVICE_ID DeviceID, LPOVERLAPPED Overlapped);
+
+    /* Wait for acquisition started by UsbDk_StartRedirectAsync to complete
+    *
+    * @params
+    *    IN  - PendingRedirect  handle returned by UsbDk_StartRedirectAsync
+    *    OUT - None
+    *
+    * @return
+    *  Handle to acquired device or INVALID_HANDLE_VALUE on failure
+    *
+    * @note
+    *  Must be called exactly once for each pending acquisition, PendingRedirect
+    *  is not valid after the call
+    *
+    */
+    DLL HANDLE           UsbDk_FinishRedirect(HANDLE PendingRedirect);
+
+    /* Cancel acquisition started by UsbDk_StartRedirectAsync
+    *
+    * @params
+    *    IN  - PendingRedirect  handle returned by UsbDk_StartRedirectAsync
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    *  Device is returned to system, UsbDk_FinishRedirect still must be called
+    *
+    */
+    DLL BOOL             UsbDk_CancelRedirect(HANDLE PendingRedirect);
+
+    typedef VOID (CALLBACK *USBDK_REDIRECT_CALLBACK)(PVOID Context, HANDLE DeviceHandle, DWORD Error);
+
+    /* Start acquisition of USB device and report its result to a callback
+    *
+    * @params
+    *    IN  - DeviceID   id of device to be acquired
+    *        - Callback   function called once acquisition is finished
+    *        - Context    value passed to Callback
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if acquisition was started, Callback is not called otherwise
+    *
+    * @note
+    *  Callback runs on a thread pool thread and receives handle to acquired
+    *  device and ERROR_SUCCESS, or INVALID_HANDLE_VALUE and Win32 error code.
+    *
+    */
+    DLL BOOL             UsbDk_StartRedirectWithCallback(PUSB_DK_DEVICE_ID DeviceID, USBDK_REDIRECT_CALLBACK Callback,
+                                                         PVOID Context);
+
+    /* Acquire a number of USB devices at once
+    *
+    * @params
+    *    IN  - DeviceIDs           array of ids of devices to be acquired
+    *        - Count               number of entries in DeviceIDs
+    *    OUT - DeviceHandles       array of Count handles to acquired devices,
+    *                              INVALID_HANDLE_VALUE for devices not acquired
+    *        - Errors              optional array of Count Win32 error codes,
+    *                              ERROR_SUCCESS for devices acquired
+    *        - ElapsedMilliseconds optional wall-clock time of the whole operation
+    *
+    * @return
+    *  TRUE if all devices were acquired
+    *
+    * @note
+    *  Devices are reset and re-enumerated concurrently, so the operation
+    *  takes about as long as acquisition of the slowest device.
+    *  Devices acquired are kept even if others failed.
+    *
+    */
+    DLL BOOL             UsbDk_StartRedirectMany(PUSB_DK_DEVICE_ID *DeviceIDs, ULONG Count, HANDLE *DeviceHandles,
+                                                 PDWORD Errors, PULONG ElapsedMilliseconds);
+
+    /* Set time to keep USB device redirected after its handle is closed
+    *
+    * @params
+    *    IN  - Seconds  idle time before parked device is returned to system,
+    *                   0 disables parking
+    *    OUT - None
+    *
+    * @return
+    *  Setting installation status
+    *
+    * @note
+    *  Parked device is not re-enumerated on close, UsbDk_StartRedirect
+    *  for it reattaches to the resident redirector in milliseconds.
+    *  Only the process that closed the handle can reattach, requests of
+    *  other processes fail until the device is returned to system.
+    *  The setting is persistent and applies to handles closed after the call.
+    *
+    */
+    DLL InstallResult    UsbDk_SetRedirectionParkTimeout(ULONG Seconds);
+
     /* Return USB device to system
     *
     * @params
@@ -155,6 +366,11 @@ extern "C" {
     * @return
     * TRUE if function succeeds
     *
+    * @note
+    *  May be called while other threads use the handle, the handle becomes
+    *  invalid immediately and the device is returned to system once calls
+    *  in progress on it are finished.
+    *
     */
     DLL BOOL             UsbDk_StopRedirect(HANDLE DeviceHandle);
 
@@ -186,6 +402,77 @@ extern "C" {
     */
     DLL TransferResult   UsbDk_ReadPipe(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Request, LPOVERLAPPED Overlapped);
 
+    /* Write to USB device pipe, error code variant
+    *
+    * @params
+    *    IN  - DeviceHandle - handle of target USB device
+    *        - Request      - write request
+    *        - Overlapped   - asynchronous I/O definition
+    *    OUT - None
+    *
+    * @return
+    *  ERROR_SUCCESS if transfer completed, ERROR_IO_PENDING if it was
+    *  queued for asynchronous completion, Win32 error code otherwise
+    *
+    * @note
+    *  Unlike UsbDk_WritePipe this function neither throws internally
+    *  nor allocates memory or emits debug output on failure, so it is
+    *  suitable for error-heavy paths like interrupt endpoint polling.
+    *  USBD status of completed transfer is in Request->Result.GenResult.UsbdStatus.
+    *
+    */
+    DLL DWORD            UsbDk_WritePipeEx(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Request, LPOVERLAPPED Overlapped);
+
+    /* Read from USB device pipe, error code variant
+    *
+    * @params
+    *    IN  - DeviceHandle - handle of target USB device
+    *        - Request      - read request
+    *        - Overlapped   - asynchronous I/O definition
+    *    OUT - None
+    *
+    * @return
+    *  ERROR_SUCCESS if transfer completed, ERROR_IO_PENDING if it was
+    *  queued for asynchronous completion, Win32 error code otherwise
+    *
+    * @note
+    *  See UsbDk_WritePipeEx.
+    *
+    */
+    DLL DWORD            UsbDk_ReadPipeEx(HANDLE DeviceHandle, PUSB_DK_TRANSFER_REQUEST Request, LPOVERLAPPED Overlapped);
+
+    /* Allocate buffer for transfers on USB device
+    *
+    * @params
+    *    IN  - DeviceHandle - handle of target USB device
+    *        - Size         - buffer size in bytes
+    *    OUT - None
+    *
+    * @return
+    *  Page aligned buffer or NULL on failure
+    *
+    * @note
+    *  Buffers are recycled by the device handle, repeated allocations of
+    *  similar size reuse the same memory pages. All buffers of the device
+    *  are released by UsbDk_StopRedirect, so they must not be used for
+    *  transfers in progress at that time.
+    *
+    */
+    DLL PVOID            UsbDk_AllocTransferBuffer(HANDLE DeviceHandle, SIZE_T Size);
+
+    /* Release buffer allocated by UsbDk_AllocTransferBuffer
+    *
+    * @params
+    *    IN  - DeviceHandle - handle of USB device the buffer was allocated for
+    *        - Buffer       - buffer to release
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    */
+    DLL BOOL             UsbDk_FreeTransferBuffer(HANDLE DeviceHandle, PVOID Buffer);
+
     /* Issue an USB abort pipe request
     *
     * @params
@@ -0,0 +1,359 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+// UsbDkHelper C++20 coroutine interface (header only)
+//
+// Awaitable transfers on top of UsbDkHelper C-interface. Transfers are
+// submitted with UsbDk_ReadPipeEx/UsbDk_WritePipeEx and completed through
+// an I/O completion port, awaiting coroutine is resumed on the thread
+// that runs UsbDkIoService::Run(). Per-transfer state (OVERLAPPED,
+// transfer request, cancellation registration) lives in the awaiter,
+// i.e. in the frame of awaiting coroutine, so transfers do not allocate.
+//
+// Usage:
+//
+//    UsbDkIoService Service;
+//    UsbDkCoDevice Device(Service, UsbDk_StartRedirect(&ID));
+//    ...
+//    // in a coroutine
+//    auto Result = co_await Device.Read(0x81, Buffer, sizeof(Buffer), BulkTransferType);
+//    if (Result.Error == ERROR_SUCCESS) { ... Result.BytesTransferred ... }
+
+#if (__cplusplus >= 202002L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 202002L))
+
+#include <windows.h>
+#include <coroutine>
+#include <atomic>
+
+#include "UsbDkHelper.h"
+
+struct UsbDkCoTransferResult
+{
+    DWORD Error;                // Win32 error code, ERROR_SUCCESS if transfer completed
+    ULONG64 BytesTransferred;
+    ULONG64 UsbdStatus;         // USBD_STATUS code
+};
+
+class UsbDkCoTransfer;
+
+// Cancellation source for a group of transfers, Cancel() aborts
+// all transfers registered at the moment and fails new ones
+class UsbDkCancellationToken
+{
+public:
+    UsbDkCancellationToken()
+    { InitializeSRWLock(&m_Lock); }
+
+    UsbDkCancellationToken(const UsbDkCancellationToken&) = delete;
+    UsbDkCancellationToken& operator= (const UsbDkCancellationToken&) = delete;
+
+    inline void Cancel();
+
+    bool IsCancelled() const
+    { return m_Cancelled.load(std::memory_order_acquire); }
+
+private:
+    inline void Register(UsbDkCoTransfer &Transfer);
+    inline void Unregister(UsbDkCoTransfer &Transfer);
+
+    std::atomic<bool> m_Cancelled = false;
+    UsbDkCoTransfer *m_Transfers = nullptr;
+    SRWLOCK m_Lock;
+
+    friend class UsbDkCoTransfer;
+};
+
+// Completion port dispatching transfer completions to awaiting coroutines
+class UsbDkIoService
+{
+public:
+    UsbDkIoService()
+        : m_Port(CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0))
+    {}
+    ~UsbDkIoService()
+    {
+        if (m_Port != nullptr)
+        {
+            CloseHandle(m_Port);
+        }
+    }
+
+    UsbDkIoService(const UsbDkIoService&) = delete;
+    UsbDkIoService& operator= (const UsbDkIoService&) = delete;
+
+    bool IsValid() const
+    { return m_Port != nullptr; }
+
+    // Associates redirected device with the port. After this call every
+    // overlapped transfer on the device completes through the port, so all
+    // of them have to be issued via UsbDkCoDevice. Synchronous helper calls
+    // on the device (UsbDk_AbortPipe, UsbDk_ResetPipe etc.) do not queue
+    // completion packets and remain usable.
+    bool Attach(HANDLE DeviceHandle)
+    {
+        auto SystemHandle = UsbDk_GetRedirectorSystemHandle(DeviceHandle);
+        return (SystemHandle != INVALID_HANDLE_VALUE) &&
+               (CreateIoCompletionPort(SystemHandle, m_Port, 0, 0) == m_Port);
+    }
+
+    // Dequeues one completion and resumes its coroutine,
+    // returns false on timeout or after Stop()
+    inline bool RunOne(DWORD Timeout = INFINITE);
+
+    // Dispatches completions until Stop(), may be called by several threads
+    void Run()
+    {
+        while (RunOne())
+        {}
+    }
+
+    // Wakes up one thread blocked in Run(), call once per thread
+    void Stop()
+    { PostQueuedCompletionStatus(m_Port, 0, STOP_KEY, nullptr); }
+
+private:
+    static const ULONG_PTR STOP_KEY = 1;
+
+    HANDLE m_Port;
+};
+
+// Awaitable transfer, produced by UsbDkCoDevice methods
+class UsbDkCoTransfer
+{
+public:
+    UsbDkCoTransfer(HANDLE DeviceHandle, bool Read, const USB_DK_TRANSFER_REQUEST &Request,
+                    UsbDkCancellationToken *Token)
+        : m_DeviceHandle(DeviceHandle)
+        , m_Read(Read)
+        , m_Request(Request)
+        , m_Token(Token)
+    {}
+
+    UsbDkCoTransfer(const UsbDkCoTransfer&) = delete;
+    UsbDkCoTransfer& operator= (const UsbDkCoTransfer&) = delete;
+
+    bool await_ready() const noexcept
+    { return false; }
+
+    bool await_suspend(std::coroutine_handle<> Continuation) noexcept
+    {
+        m_Continuation = Continuation;
+        m_SystemHandle = UsbDk_GetRedirectorSystemHandle(m_DeviceHandle);
+        ZeroMemory(&m_Overlapped, sizeof(m_Overlapped));
+
+        if (m_Token != nullptr)
+        {
+            m_Token->Register(*this);
+        }
+
+        // Submission runs under the token lock, so Cancel() either sees the
+        // transfer in flight or it is seen as cancelled here. This awaiter
+        // must not be touched once the transfer is submitted, the coroutine
+        // may be resumed and the awaiter destroyed on another thread.
+        auto Token = m_Token;
+        if (Token != nullptr)
+        {
+            AcquireSRWLockShared(&Token->m_Lock);
+            if (Token->IsCancelled())
+            {
+                ReleaseSRWLockShared(&Token->m_Lock);
+                Token->Unregister(*this);
+                m_Error = ERROR_OPERATION_ABORTED;
+                return false;
+            }
+        }
+
+        auto Error = m_Read ? UsbDk_ReadPipeEx(m_DeviceHandle, &m_Request, &m_Overlapped)
+                            : UsbDk_WritePipeEx(m_DeviceHandle, &m_Request, &m_Overlapped);
+
+        if ((Error != ERROR_SUCCESS) && (Error != ERROR_IO_PENDING))
+        {
+            // Failed synchronously, no completion packet will be queued
+            if (Token != nullptr)
+            {
+                ReleaseSRWLockShared(&Token->m_Lock);
+                Token->Unregister(*this);
+            }
+            m_Error = Error;
+            return false;
+        }
+
+        if (Token != nullptr)
+        {
+            ReleaseSRWLockShared(&Token->m_Lock);
+        }
+        return true;
+    }
+
+    UsbDkCoTransferResult await_resume() noexcept
+    {
+        return { m_Error,
+                 (m_Error == ERROR_SUCCESS) ? m_Request.Result.GenResult.BytesTransferred : 0,
+                 m_Request.Result.GenResult.UsbdStatus };
+    }
+
+private:
+    void Complete(DWORD Error) noexcept
+    {
+        if (m_Token != nullptr)
+        {
+            m_Token->Unregister(*this);
+        }
+        m_Error = Error;
+        m_Continuation.resume();
+    }
+
+    static UsbDkCoTransfer *FromOverlapped(LPOVERLAPPED Overlapped)
+    { return CONTAINING_RECORD(Overlapped, UsbDkCoTransfer, m_Overlapped); }
+
+    OVERLAPPED m_Overlapped;
+    HANDLE m_DeviceHandle;
+    HANDLE m_SystemHandle = INVALID_HANDLE_VALUE;
+    bool m_Read;
+    USB_DK_TRANSFER_REQUEST m_Request;
+    DWORD m_Error = ERROR_SUCCESS;
+    std::coroutine_handle<> m_Continuation;
+
+    UsbDkCancellationToken *m_Token;
+    UsbDkCoTransfer *m_Prev = nullptr;
+    UsbDkCoTransfer *m_Next = nullptr;
+
+    friend class UsbDkIoService;
+    friend class UsbDkCancellationToken;
+};
+
+// Redirected device issuing awaitable transfers
+class UsbDkCoDevice
+{
+public:
+    UsbDkCoDevice(UsbDkIoService &Service, HANDLE DeviceHandle)
+        : m_DeviceHandle(DeviceHandle)
+        , m_Attached(Service.Attach(DeviceHandle))
+    {}
+
+    bool IsValid() const
+    { return m_Attached; }
+
+    HANDLE GetHandle() const
+    { return m_DeviceHandle; }
+
+    UsbDkCoTransfer Read(ULONG64 EndpointAddress, PVOID Buffer, ULONG64 Length,
+                         USB_DK_TRANSFER_TYPE Type, UsbDkCancellationToken *Token = nullptr)
+    { return UsbDkCoTransfer(m_DeviceHandle, true, MakeRequest(EndpointAddress, Buffer, Length, Type), Token); }
+
+    UsbDkCoTransfer Write(ULONG64 EndpointAddress, PVOID Buffer, ULONG64 Length,
+                          USB_DK_TRANSFER_TYPE Type, UsbDkCancellationToken *Token = nullptr)
+    { return UsbDkCoTransfer(m_DeviceHandle, false, MakeRequest(EndpointAddress, Buffer, Length, Type), Token); }
+
+    // Buffer starts with 8 bytes setup packet followed by data stage,
+    // direction is taken from bmRequestType of the setup packet
+    UsbDkCoTransfer Control(PVOID Buffer, ULONG64 Length, UsbDkCancellationToken *Token = nullptr)
+    {
+        auto DeviceToHost = (static_cast<PUCHAR>(Buffer)[0] & 0x80) != 0;
+        return UsbDkCoTransfer(m_DeviceHandle, DeviceToHost, MakeRequest(0, Buffer, Length, ControlTransferType), Token);
+    }
+
+private:
+    static USB_DK_TRANSFER_REQUEST MakeRequest(ULONG64 EndpointAddress, PVOID Buffer, ULONG64 Length,
+                                               USB_DK_TRANSFER_TYPE Type)
+    {
+        USB_DK_TRANSFER_REQUEST Request = {};
+        Request.EndpointAddress = EndpointAddress;
+        Request.Buffer = Buffer;
+        Request.BufferLength = Length;
+        Request.TransferType = Type;
+        return Request;
+    }
+
+    HANDLE m_DeviceHandle;
+    bool m_Attached;
+};
+
+bool UsbDkIoService::RunOne(DWORD Timeout)
+{
+    DWORD BytesTransferred;
+    ULONG_PTR Key;
+    LPOVERLAPPED Overlapped;
+
+    auto Success = GetQueuedCompletionStatus(m_Port, &BytesTransferred, &Key, &Overlapped, Timeout);
+    if (Overlapped == nullptr)
+    {
+        // Timeout, port closed or Stop()
+        return false;
+    }
+
+    UsbDkCoTransfer::FromOverlapped(Overlapped)->Complete(Success ? ERROR_SUCCESS : GetLastError());
+    return true;
+}
+
+void UsbDkCancellationToken::Cancel()
+{
+    m_Cancelled.store(true, std::memory_order_release);
+
+    // Exclusive to wait for submissions in progress, transfers stay
+    // registered until their completion packets are dequeued
+    AcquireSRWLockExclusive(&m_Lock);
+    for (auto Transfer = m_Transfers; Transfer != nullptr; Transfer = Transfer->m_Next)
+    {
+        if (Transfer->m_SystemHandle != INVALID_HANDLE_VALUE)
+        {
+            CancelIoEx(Transfer->m_SystemHandle, &Transfer->m_Overlapped);
+        }
+    }
+    ReleaseSRWLockExclusive(&m_Lock);
+}
+
+void UsbDkCancellationToken::Register(UsbDkCoTransfer &Transfer)
+{
+    AcquireSRWLockExclusive(&m_Lock);
+    Transfer.m_Prev = nullptr;
+    Transfer.m_Next = m_Transfers;
+    if (m_Transfers != nullptr)
+    {
+        m_Transfers->m_Prev = &Transfer;
+    }
+    m_Transfers = &Transfer;
+    ReleaseSRWLockExclusive(&m_Lock);
+}
+
+void UsbDkCancellationToken::Unregister(UsbDkCoTransfer &Transfer)
+{
+    AcquireSRWLockExclusive(&m_Lock);
+    if (Transfer.m_Prev != nullptr)
+    {
+        Transfer.m_Prev->m_Next = Transfer.m_Next;
+    }
+    else
+    {
+        m_Transfers = Transfer.m_Next;
+    }
+    if (Transfer.m_Next != nullptr)
+    {
+        Transfer.m_Next->m_Prev = Transfer.m_Prev;
+    }
+    ReleaseSRWLockExclusive(&m_Lock);
+}
+
+#endif
@@ -103,6 +103,31 @@ extern "C" {
     */
     DLL BOOL             UsbDk_AddExtendedHideRule(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_PUBLIC Rule, ULONG Type);
 
+    /* Add a batch of hide rules in one call
+    *  The rule definition is the same as for UsbDk_AddExtendedHideRule
+    *
+    *  Duplicate rules are dropped, the batch is applied atomically,
+    *  i.e. either all rules are added or none
+    *
+    * @params
+    *    IN  - HiderHandle  Handle to UsbDk driver
+    *        - Rules - array of NumRules hide rules
+    *        - Types - array of NumRules rule types, NULL for default type of all rules
+    *        - NumRules - number of rules
+    *        - Flags - USBDK_HIDE_RULES_REPLACE_ALL to replace all rules
+    *                  added by this handle instead of adding to them
+    *    OUT - None
+    *
+    * @return
+    *  TRUE if function succeeds
+    *
+    * @note
+    * Hide rules stay until HiderHandle is closed, client process exits or
+    * UsbDk_ClearHideRules() called
+    *
+    */
+    DLL BOOL             UsbDk_AddHideRules(HANDLE HiderHandle, PUSB_DK_HIDE_RULE_PUBLIC Rules, const ULONG *Types, ULONG NumRules, ULONG Flags);
+
     /* Clear all hider rules
     *
     * @params
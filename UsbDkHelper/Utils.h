@@ -46,3 +46,18 @@ private:
     void Close();
     HandleT m_Handle;
 };
+
+class UsbDkLockedContext
+{
+public:
+    UsbDkLockedContext(CRITICAL_SECTION &Lock)
+        : m_Lock(Lock)
+    { EnterCriticalSection(&m_Lock); }
+    ~UsbDkLockedContext()
+    { LeaveCriticalSection(&m_Lock); }
+
+    UsbDkLockedContext(const UsbDkLockedContext&) = delete;
+    UsbDkLockedContext& operator= (const UsbDkLockedContext&) = delete;
+private:
+    CRITICAL_SECTION &m_Lock;
+};
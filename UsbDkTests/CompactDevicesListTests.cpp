@@ -0,0 +1,298 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "DriverAccess.h"
+
+#include <map>
+
+struct CCompactTestDevice
+{
+    PCWCHAR DeviceID;
+    PCWCHAR InstanceID;
+    ULONG Port;
+};
+
+// Lays out IOCTL_USBDK_ENUM_DEVICES_COMPACT output the way the driver does:
+// header, device records of RecordSize bytes each, deduplicated strings
+static vector<BYTE> BuildCompactList(const vector<CCompactTestDevice> &Devices,
+                                     ULONG RecordSize = sizeof(USB_DK_COMPACT_DEVICE_INFO))
+{
+    map<wstring, ULONG> StringOffsets;
+    vector<BYTE> Strings;
+    auto AddString = [&StringOffsets, &Strings](PCWCHAR String)
+    {
+        auto Entry = StringOffsets.find(String);
+        if (Entry != StringOffsets.end())
+        {
+            return Entry->second;
+        }
+
+        auto Offset = static_cast<ULONG>(Strings.size());
+        auto Bytes = reinterpret_cast<const BYTE*>(String);
+        Strings.insert(Strings.end(), Bytes, Bytes + (wcslen(String) + 1) * sizeof(WCHAR));
+        StringOffsets[String] = Offset;
+        return Offset;
+    };
+
+    auto DevicesOffset = static_cast<ULONG>(sizeof(USB_DK_COMPACT_ENUM_HEADER));
+    auto StringsOffset = DevicesOffset + static_cast<ULONG>(Devices.size()) * RecordSize;
+    vector<BYTE> Buffer(StringsOffset);
+
+    for (size_t i = 0; i < Devices.size(); i++)
+    {
+        auto Record = reinterpret_cast<PUSB_DK_COMPACT_DEVICE_INFO>(&Buffer[DevicesOffset + i * RecordSize]);
+        Record->DeviceIDOffset = AddString(Devices[i].DeviceID);
+        Record->InstanceIDOffset = AddString(Devices[i].InstanceID);
+        Record->FilterID = 7;
+        Record->Port = Devices[i].Port;
+        Record->Speed = 3;
+        Record->DeviceDescriptor.bLength = sizeof(USB_DEVICE_DESCRIPTOR);
+        Record->DeviceDescriptor.idVendor = 0x1234;
+        Record->DeviceDescriptor.idProduct = static_cast<USHORT>(Devices[i].Port);
+    }
+
+    Buffer.insert(Buffer.end(), Strings.begin(), Strings.end());
+
+    auto Header = reinterpret_cast<PUSB_DK_COMPACT_ENUM_HEADER>(Buffer.data());
+    Header->Version = USB_DK_COMPACT_ENUM_VERSION;
+    Header->Length = static_cast<ULONG>(Buffer.size());
+    Header->NumDevices = static_cast<ULONG>(Devices.size());
+    Header->DevicesOffset = DevicesOffset;
+    Header->DeviceRecordSize = RecordSize;
+    Header->StringsOffset = StringsOffset;
+    Header->StringsLength = static_cast<ULONG>(Strings.size());
+    Header->Generation = 42;
+
+    return Buffer;
+}
+
+static PUSB_DK_COMPACT_ENUM_HEADER CompactHeader(vector<BYTE> &Buffer)
+{
+    return reinterpret_cast<PUSB_DK_COMPACT_ENUM_HEADER>(Buffer.data());
+}
+
+// Returns Win32 error code parsing failed with, ERROR_SUCCESS if parsed
+static DWORD ParseCompactListError(const vector<BYTE> &Buffer, DWORD Length)
+{
+    try
+    {
+        PUSB_DK_DEVICE_INFO Devices;
+        ULONG NumDevices;
+        UsbDkDriverAccess::ParseCompactDevicesList(Buffer.data(), Length, Devices, NumDevices);
+        UsbDkDriverAccess::ReleaseDevicesList(Devices);
+        return ERROR_SUCCESS;
+    }
+    catch (const UsbDkNumErrorException &e)
+    {
+        return e.GetErrorCode();
+    }
+}
+
+static DWORD ParseCompactListError(const vector<BYTE> &Buffer)
+{
+    return ParseCompactListError(Buffer, static_cast<DWORD>(Buffer.size()));
+}
+
+USBDK_TEST(CompactDevicesList_ParsesRecords)
+{
+    auto Buffer = BuildCompactList({ { L"USB\\VID_1234&PID_0001", L"SN0001", 1 },
+                                     { L"USB\\VID_1234&PID_0001", L"SN0002", 2 },
+                                     { L"USB\\VID_1234&PID_0003", L"SN0001", 3 } });
+
+    PUSB_DK_DEVICE_INFO Devices;
+    ULONG NumDevices;
+    UsbDkDriverAccess::ParseCompactDevicesList(Buffer.data(), static_cast<DWORD>(Buffer.size()), Devices, NumDevices);
+    unique_ptr<USB_DK_DEVICE_INFO[]> Holder(Devices);
+
+    USBDK_CHECK(NumDevices == 3);
+    USBDK_CHECK(wcscmp(Devices[0].ID.DeviceID, L"USB\\VID_1234&PID_0001") == 0);
+    USBDK_CHECK(wcscmp(Devices[0].ID.InstanceID, L"SN0001") == 0);
+    USBDK_CHECK(wcscmp(Devices[1].ID.DeviceID, L"USB\\VID_1234&PID_0001") == 0);
+    USBDK_CHECK(wcscmp(Devices[1].ID.InstanceID, L"SN0002") == 0);
+    USBDK_CHECK(wcscmp(Devices[2].ID.DeviceID, L"USB\\VID_1234&PID_0003") == 0);
+    USBDK_CHECK(wcscmp(Devices[2].ID.InstanceID, L"SN0001") == 0);
+
+    for (ULONG i = 0; i < NumDevices; i++)
+    {
+        USBDK_CHECK(Devices[i].FilterID == 7);
+        USBDK_CHECK(Devices[i].Port == i + 1);
+        USBDK_CHECK(Devices[i].Speed == 3);
+        USBDK_CHECK(Devices[i].DeviceDescriptor.idVendor == 0x1234);
+        USBDK_CHECK(Devices[i].DeviceDescriptor.idProduct == i + 1);
+    }
+}
+
+USBDK_TEST(CompactDevicesList_UsesRecordSizeAsStride)
+{
+    // Records of later versions may be longer than known ones
+    auto Buffer = BuildCompactList({ { L"USB\\VID_1234&PID_0001", L"SN0001", 1 },
+                                     { L"USB\\VID_1234&PID_0002", L"SN0002", 2 } },
+                                   sizeof(USB_DK_COMPACT_DEVICE_INFO) + 24);
+
+    PUSB_DK_DEVICE_INFO Devices;
+    ULONG NumDevices;
+    UsbDkDriverAccess::ParseCompactDevicesList(Buffer.data(), static_cast<DWORD>(Buffer.size()), Devices, NumDevices);
+    unique_ptr<USB_DK_DEVICE_INFO[]> Holder(Devices);
+
+    USBDK_CHECK(NumDevices == 2);
+    USBDK_CHECK(Devices[1].Port == 2);
+    USBDK_CHECK(wcscmp(Devices[1].ID.InstanceID, L"SN0002") == 0);
+}
+
+USBDK_TEST(CompactDevicesList_ParsesEmptyList)
+{
+    auto Buffer = BuildCompactList({});
+
+    PUSB_DK_DEVICE_INFO Devices;
+    ULONG NumDevices;
+    UsbDkDriverAccess::ParseCompactDevicesList(Buffer.data(), static_cast<DWORD>(Buffer.size()), Devices, NumDevices);
+
+    USBDK_CHECK(NumDevices == 0);
+    USBDK_CHECK(Devices == nullptr);
+}
+
+USBDK_TEST(CompactDevicesList_RejectsShortOrForeignHeader)
+{
+    auto Buffer = BuildCompactList({ { L"USB\\VID_1234&PID_0001", L"SN0001", 1 } });
+
+    USBDK_CHECK(ParseCompactListError(Buffer, sizeof(USB_DK_COMPACT_ENUM_HEADER) - 1) == ERROR_INVALID_DATA);
+
+    CompactHeader(Buffer)->Version = USB_DK_COMPACT_ENUM_VERSION + 1;
+    USBDK_CHECK(ParseCompactListError(Buffer) == ERROR_REVISION_MISMATCH);
+}
+
+USBDK_TEST(CompactDevicesList_RejectsRecordsOutOfBuffer)
+{
+    auto Buffer = BuildCompactList({ { L"USB\\VID_1234&PID_0001", L"SN0001", 1 } });
+    USBDK_CHECK(ParseCompactListError(Buffer) == ERROR_SUCCESS);
+
+    // Returned length is checked rather than length claimed by the header
+    auto Truncated = static_cast<DWORD>(CompactHeader(Buffer)->StringsOffset - 1);
+    USBDK_CHECK(ParseCompactListError(Buffer, Truncated) == ERROR_INVALID_DATA);
+
+    auto TooMany = Buffer;
+    CompactHeader(TooMany)->NumDevices = 0x10000000;
+    USBDK_CHECK(ParseCompactListError(TooMany) == ERROR_INVALID_DATA);
+
+    auto ShortRecords = Buffer;
+    CompactHeader(ShortRecords)->DeviceRecordSize = sizeof(USB_DK_COMPACT_DEVICE_INFO) - 1;
+    USBDK_CHECK(ParseCompactListError(ShortRecords) == ERROR_INVALID_DATA);
+
+    auto LongStrings = Buffer;
+    CompactHeader(LongStrings)->StringsLength += 2;
+    USBDK_CHECK(ParseCompactListError(LongStrings) == ERROR_INVALID_DATA);
+}
+
+USBDK_TEST(CompactDevicesList_RejectsMalformedStrings)
+{
+    auto Buffer = BuildCompactList({ { L"USB\\VID_1234&PID_0001", L"SN0001", 1 } });
+    auto Header = CompactHeader(Buffer);
+
+    // Offset beyond the string table
+    auto BadOffset = Buffer;
+    reinterpret_cast<PUSB_DK_COMPACT_DEVICE_INFO>(BadOffset.data() + Header->DevicesOffset)->InstanceIDOffset =
+        Header->StringsLength;
+    USBDK_CHECK(ParseCompactListError(BadOffset) == ERROR_INVALID_DATA);
+
+    // Last string not terminated inside of the table
+    auto Unterminated = Buffer;
+    Unterminated.back() = 1;
+    Unterminated[Unterminated.size() - 2] = 1;
+    USBDK_CHECK(ParseCompactListError(Unterminated) == ERROR_INVALID_DATA);
+
+    // String does not fit into USB_DK_DEVICE_ID
+    wstring LongID(MAX_DEVICE_ID_LEN, L'A');
+    auto TooLong = BuildCompactList({ { LongID.c_str(), L"SN0001", 1 } });
+    USBDK_CHECK(ParseCompactListError(TooLong) == ERROR_INVALID_DATA);
+}
+
+// Enumeration of 500 devices of 50 models in compact and in fixed record
+// format. Each enumeration copies the driver output twice, into the system
+// buffer of METHOD_BUFFERED request and from it to the caller, compact
+// list is then converted to USB_DK_DEVICE_INFO array for the public API.
+
+static const ULONG BENCHMARK_NUM_DEVICES = 500;
+static const ULONG BENCHMARK_NUM_MODELS = 50;
+static const ULONG BENCHMARK_NUM_ENUMERATIONS = 1000;
+
+USBDK_BENCHMARK(CompactDevicesList_Enumeration)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    vector<wstring> IDs;
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        wstringstream DeviceID;
+        DeviceID << L"USB\\VID_1234&PID_" << hex << setw(4) << setfill(L'0') << (i % BENCHMARK_NUM_MODELS);
+        IDs.push_back(DeviceID.str());
+
+        wstringstream InstanceID;
+        InstanceID << L"5&2c4d3b1e&0&" << dec << (i + 1);
+        IDs.push_back(InstanceID.str());
+    }
+
+    vector<CCompactTestDevice> Devices;
+    vector<USB_DK_DEVICE_INFO> DriverRecords(BENCHMARK_NUM_DEVICES);
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        Devices.push_back({ IDs[2 * i].c_str(), IDs[2 * i + 1].c_str(), i });
+        ZeroMemory(&DriverRecords[i], sizeof(DriverRecords[i]));
+        UsbDkFillIDStruct(&DriverRecords[i].ID, IDs[2 * i].c_str(), IDs[2 * i + 1].c_str());
+        DriverRecords[i].Port = i;
+    }
+    auto DriverCompact = BuildCompactList(Devices);
+
+    auto RecordsLength = DriverRecords.size() * sizeof(USB_DK_DEVICE_INFO);
+    auto CompactLength = DriverCompact.size();
+
+    vector<BYTE> SystemBuffer(RecordsLength);
+    vector<BYTE> CallerBuffer(RecordsLength);
+
+    UsbDkBenchmarkTimer RecordsTimer;
+    for (ULONG i = 0; i < BENCHMARK_NUM_ENUMERATIONS; i++)
+    {
+        memcpy(SystemBuffer.data(), DriverRecords.data(), RecordsLength);
+        memcpy(CallerBuffer.data(), SystemBuffer.data(), RecordsLength);
+    }
+    auto RecordsTime = RecordsTimer.ElapsedMicroseconds();
+
+    UsbDkBenchmarkTimer CompactTimer;
+    for (ULONG i = 0; i < BENCHMARK_NUM_ENUMERATIONS; i++)
+    {
+        memcpy(SystemBuffer.data(), DriverCompact.data(), CompactLength);
+        memcpy(CallerBuffer.data(), SystemBuffer.data(), CompactLength);
+
+        PUSB_DK_DEVICE_INFO Parsed;
+        ULONG NumParsed;
+        UsbDkDriverAccess::ParseCompactDevicesList(CallerBuffer.data(), static_cast<DWORD>(CompactLength), Parsed, NumParsed);
+        unique_ptr<USB_DK_DEVICE_INFO[]> Holder(Parsed);
+        USBDK_CHECK(NumParsed == BENCHMARK_NUM_DEVICES);
+    }
+    auto CompactTime = CompactTimer.ElapsedMicroseconds();
+
+    tcout << BENCHMARK_NUM_DEVICES << TEXT(" devices, ") << BENCHMARK_NUM_ENUMERATIONS << TEXT(" enumerations:") << endl
+          << TEXT("  fixed records ") << RecordsLength << TEXT(" bytes per copy, ") << RecordsTime << TEXT(" us") << endl
+          << TEXT("  compact list ") << CompactLength << TEXT(" bytes per copy, ") << CompactTime
+          << TEXT(" us including conversion") << endl;
+}
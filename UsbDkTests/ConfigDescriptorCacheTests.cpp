@@ -0,0 +1,125 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "ConfigDescriptorCache.h"
+
+static USB_DK_CONFIG_DESCRIPTOR_REQUEST MakeRequest(PCWCHAR DeviceID, PCWCHAR InstanceID, ULONG64 Index)
+{
+    USB_DK_CONFIG_DESCRIPTOR_REQUEST Request = {};
+    UsbDkFillIDStruct(&Request.ID, DeviceID, InstanceID);
+    Request.Index = Index;
+    return Request;
+}
+
+// Cache is process-wide, so each test starts at a generation
+// never seen before and works on its own descriptors only
+static ULONG64 FreshGeneration()
+{
+    static ULONG64 Generation = 1000;
+    Generation += 1000;
+
+    UsbDkConfigDescriptorCache::Instance().Validate(Generation);
+    return Generation;
+}
+
+USBDK_TEST(ConfigDescriptorCache_HitsWithinGeneration)
+{
+    auto &Cache = UsbDkConfigDescriptorCache::Instance();
+    auto Generation = FreshGeneration();
+
+    auto Request = MakeRequest(L"USB\\VID_1234&PID_0001", L"SN0001", 0);
+    auto OtherConfig = MakeRequest(L"USB\\VID_1234&PID_0001", L"SN0001", 1);
+    auto OtherDevice = MakeRequest(L"USB\\VID_1234&PID_0001", L"SN0002", 0);
+    const vector<BYTE> Descriptor = { 9, 2, 9, 0, 0, 1, 0, 0x80, 50 };
+
+    ULONG64 Hits, Misses;
+    Cache.GetStatistics(Hits, Misses);
+
+    vector<BYTE> Cached;
+    USBDK_CHECK(!Cache.Lookup(Request, Generation, Cached));
+
+    Cache.Insert(Request, Generation, Descriptor);
+    USBDK_CHECK(Cache.Lookup(Request, Generation, Cached));
+    USBDK_CHECK(Cached == Descriptor);
+
+    // Key includes instance ID and configuration index
+    USBDK_CHECK(!Cache.Lookup(OtherConfig, Generation, Cached));
+    USBDK_CHECK(!Cache.Lookup(OtherDevice, Generation, Cached));
+
+    ULONG64 NewHits, NewMisses;
+    Cache.GetStatistics(NewHits, NewMisses);
+    USBDK_CHECK(NewHits - Hits == 1);
+    USBDK_CHECK(NewMisses - Misses == 3);
+}
+
+USBDK_TEST(ConfigDescriptorCache_LookupFlushesOnNewGeneration)
+{
+    auto &Cache = UsbDkConfigDescriptorCache::Instance();
+    auto Generation = FreshGeneration();
+
+    auto Request = MakeRequest(L"USB\\VID_1234&PID_0002", L"SN0001", 0);
+    Cache.Insert(Request, Generation, vector<BYTE>(9, 1));
+
+    // Device was replugged, entry of the old generation must not be served
+    vector<BYTE> Cached;
+    USBDK_CHECK(!Cache.Lookup(Request, Generation + 1, Cached));
+
+    // ...nor after the generation observed goes back
+    USBDK_CHECK(!Cache.Lookup(Request, Generation, Cached));
+}
+
+USBDK_TEST(ConfigDescriptorCache_EnumerationFlushesOnNewGeneration)
+{
+    auto &Cache = UsbDkConfigDescriptorCache::Instance();
+    auto Generation = FreshGeneration();
+
+    auto Request = MakeRequest(L"USB\\VID_1234&PID_0003", L"SN0001", 0);
+    Cache.Insert(Request, Generation, vector<BYTE>(9, 2));
+
+    // Enumeration at the same generation keeps the entries
+    Cache.Validate(Generation);
+    vector<BYTE> Cached;
+    USBDK_CHECK(Cache.Lookup(Request, Generation, Cached));
+
+    Cache.Validate(Generation + 1);
+    USBDK_CHECK(!Cache.Lookup(Request, Generation + 1, Cached));
+}
+
+USBDK_TEST(ConfigDescriptorCache_InsertFlushesOnNewGeneration)
+{
+    auto &Cache = UsbDkConfigDescriptorCache::Instance();
+    auto Generation = FreshGeneration();
+
+    auto Request = MakeRequest(L"USB\\VID_1234&PID_0004", L"SN0001", 0);
+    auto OtherRequest = MakeRequest(L"USB\\VID_1234&PID_0004", L"SN0002", 0);
+    Cache.Insert(Request, Generation, vector<BYTE>(9, 3));
+
+    // Descriptor fetched at a newer generation replaces the whole cache
+    Cache.Insert(OtherRequest, Generation + 1, vector<BYTE>(9, 4));
+
+    vector<BYTE> Cached;
+    USBDK_CHECK(Cache.Lookup(OtherRequest, Generation + 1, Cached));
+    USBDK_CHECK(Cached == vector<BYTE>(9, 4));
+    USBDK_CHECK(!Cache.Lookup(Request, Generation + 1, Cached));
+}
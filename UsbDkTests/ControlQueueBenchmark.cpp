@@ -0,0 +1,255 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkData.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Enumeration latency seen by many clients of the control device while
+// redirects are being added. With a single sequential queue enumerations
+// wait for the whole ADD_REDIRECT, which blocks until the device is reset
+// and attached again. With the parallel queue they only contend with the
+// short state update of a redirect, which is still run by the sequential
+// queue. Handlers are simulated, timings of the reset are made up.
+
+static const ULONG BENCHMARK_NUM_DEVICES = 50;
+static const ULONG BENCHMARK_NUM_CLIENTS = 8;
+static const ULONG BENCHMARK_ENUMERATIONS_PER_CLIENT = 100;
+static const ULONG BENCHMARK_CLIENT_PAUSE_US = 500;
+static const ULONG BENCHMARK_REDIRECT_ATTACH_US = 5000;
+
+// WdfIoQueueDispatchSequential: requests are run one by one by the
+// dispatcher thread, submitter waits for completion of its request
+class CSimSequentialQueue
+{
+public:
+    CSimSequentialQueue()
+        : m_Dispatcher([this]() { Dispatch(); })
+    {}
+
+    ~CSimSequentialQueue()
+    {
+        {
+            lock_guard<mutex> Lock(m_Lock);
+            m_Stopped = true;
+        }
+        m_Posted.notify_one();
+        m_Dispatcher.join();
+    }
+
+    void Submit(const function<void()> &Handler)
+    {
+        CRequest Request = { Handler, false };
+
+        unique_lock<mutex> Lock(m_Lock);
+        m_Requests.push_back(&Request);
+        m_Posted.notify_one();
+        m_Completed.wait(Lock, [&Request]() { return Request.Done; });
+    }
+
+    CSimSequentialQueue(const CSimSequentialQueue&) = delete;
+    CSimSequentialQueue& operator= (const CSimSequentialQueue&) = delete;
+
+private:
+    struct CRequest
+    {
+        const function<void()> &Handler;
+        bool Done;
+    };
+
+    void Dispatch()
+    {
+        unique_lock<mutex> Lock(m_Lock);
+        for (;;)
+        {
+            m_Posted.wait(Lock, [this]() { return m_Stopped || !m_Requests.empty(); });
+            if (m_Requests.empty())
+            {
+                return;
+            }
+
+            auto Request = m_Requests.front();
+            m_Requests.pop_front();
+
+            Lock.unlock();
+            Request->Handler();
+            Lock.lock();
+
+            Request->Done = true;
+            m_Completed.notify_all();
+        }
+    }
+
+    mutex m_Lock;
+    condition_variable m_Posted;
+    condition_variable m_Completed;
+    deque<CRequest *> m_Requests;
+    bool m_Stopped = false;
+    thread m_Dispatcher;
+};
+
+class CSimControlDevice
+{
+public:
+    CSimControlDevice()
+        : m_Devices(BENCHMARK_NUM_DEVICES)
+    {
+        InitializeSRWLock(&m_Lock);
+        for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+        {
+            ZeroMemory(&m_Devices[i], sizeof(m_Devices[i]));
+            UsbDkFillIDStruct(&m_Devices[i].ID, L"USB\\VID_1234&PID_0001", L"SN0001");
+            m_Devices[i].Port = i;
+        }
+    }
+
+    size_t EnumerateDevices(vector<USB_DK_DEVICE_INFO> &Devices)
+    {
+        AcquireSRWLockShared(&m_Lock);
+        Devices = m_Devices;
+        ReleaseSRWLockShared(&m_Lock);
+        return Devices.size();
+    }
+
+    // Redirection is recorded under the lock, then the handler
+    // waits for the device to reset and attach to the redirector
+    void AddRedirect()
+    {
+        AcquireSRWLockExclusive(&m_Lock);
+        m_Redirections++;
+        ReleaseSRWLockExclusive(&m_Lock);
+
+        this_thread::sleep_for(chrono::microseconds(BENCHMARK_REDIRECT_ATTACH_US));
+    }
+
+    ULONG Redirections() const
+    { return m_Redirections; }
+
+private:
+    vector<USB_DK_DEVICE_INFO> m_Devices;
+    ULONG m_Redirections = 0;
+    SRWLOCK m_Lock;
+};
+
+struct CEnumerationLatencies
+{
+    ULONG64 Median;
+    ULONG64 P99;
+    ULONG64 Max;
+    ULONG Redirections;
+};
+
+static CEnumerationLatencies RunClients(bool ParallelEnumeration)
+{
+    CSimControlDevice Device;
+    CSimSequentialQueue SequentialQueue;
+
+    atomic<bool> ClientsDone(false);
+    thread Redirector([&Device, &SequentialQueue, &ClientsDone]()
+                      {
+                          function<void()> AddRedirect = [&Device]() { Device.AddRedirect(); };
+                          while (!ClientsDone)
+                          {
+                              SequentialQueue.Submit(AddRedirect);
+                          }
+                      });
+
+    atomic<ULONG> Failures(0);
+    vector<vector<ULONG64>> ClientLatencies(BENCHMARK_NUM_CLIENTS);
+    vector<thread> Clients;
+    for (ULONG i = 0; i < BENCHMARK_NUM_CLIENTS; i++)
+    {
+        auto &Latencies = ClientLatencies[i];
+        Clients.emplace_back([ParallelEnumeration, &Device, &SequentialQueue, &Latencies, &Failures]()
+                             {
+                                 vector<USB_DK_DEVICE_INFO> Devices;
+                                 size_t NumDevices = 0;
+                                 function<void()> Enumerate = [&Device, &Devices, &NumDevices]()
+                                                              { NumDevices = Device.EnumerateDevices(Devices); };
+
+                                 for (ULONG j = 0; j < BENCHMARK_ENUMERATIONS_PER_CLIENT; j++)
+                                 {
+                                     UsbDkBenchmarkTimer Timer;
+                                     if (ParallelEnumeration)
+                                     {
+                                         Enumerate();
+                                     }
+                                     else
+                                     {
+                                         SequentialQueue.Submit(Enumerate);
+                                     }
+                                     Latencies.push_back(Timer.ElapsedMicroseconds());
+
+                                     if (NumDevices != BENCHMARK_NUM_DEVICES)
+                                     {
+                                         Failures++;
+                                     }
+                                     this_thread::sleep_for(chrono::microseconds(BENCHMARK_CLIENT_PAUSE_US));
+                                 }
+                             });
+    }
+
+    for (auto &Client : Clients)
+    {
+        Client.join();
+    }
+    ClientsDone = true;
+    Redirector.join();
+
+    USBDK_CHECK(Failures == 0);
+
+    vector<ULONG64> Latencies;
+    for (const auto &Client : ClientLatencies)
+    {
+        Latencies.insert(Latencies.end(), Client.begin(), Client.end());
+    }
+    sort(Latencies.begin(), Latencies.end());
+
+    return { Latencies[Latencies.size() / 2],
+             Latencies[Latencies.size() * 99 / 100],
+             Latencies.back(),
+             Device.Redirections() };
+}
+
+USBDK_BENCHMARK(ControlQueue_EnumerationDuringRedirects)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    auto Sequential = RunClients(false);
+    auto Parallel = RunClients(true);
+
+    tcout << BENCHMARK_NUM_CLIENTS << TEXT(" clients x ") << BENCHMARK_ENUMERATIONS_PER_CLIENT
+          << TEXT(" enumerations during redirects of ") << BENCHMARK_REDIRECT_ATTACH_US << TEXT(" us:") << endl
+          << TEXT("  sequential queue: median ") << Sequential.Median << TEXT(" us, p99 ") << Sequential.P99
+          << TEXT(" us, max ") << Sequential.Max << TEXT(" us, ") << Sequential.Redirections << TEXT(" redirects") << endl
+          << TEXT("  parallel queue: median ") << Parallel.Median << TEXT(" us, p99 ") << Parallel.P99
+          << TEXT(" us, max ") << Parallel.Max << TEXT(" us, ") << Parallel.Redirections << TEXT(" redirects") << endl;
+}
@@ -0,0 +1,305 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkHelper.h"
+#include "UsbDkHelperCoro.h"
+
+// Transfer rate of UsbDkHelperCoro.h coroutines compared with the callback
+// style they replace, i.e. OVERLAPPED state machines completed by thread
+// pool I/O callbacks. Both run GET_DESCRIPTOR(DEVICE) control transfers
+// against a real device, so results do not depend on device function.
+//
+// Arguments: VID PID [TRANSFERS], VID and PID are hexadecimal.
+// Device is detached from its driver while the benchmark runs.
+
+// Same condition as in UsbDkHelperCoro.h, benchmark is not
+// registered by compilers without C++20 coroutines
+#if (__cplusplus >= 202002L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 202002L))
+
+static const ULONG BENCHMARK_DEFAULT_TRANSFERS = 10000;
+static const ULONG BENCHMARK_QUEUE_DEPTH = 4;
+static const ULONG BENCHMARK_REDIRECT_ATTEMPTS = 20;
+
+static const ULONG SETUP_PACKET_SIZE = 8;
+static const ULONG GET_DESCRIPTOR_BUFFER_SIZE = SETUP_PACKET_SIZE + sizeof(USB_DEVICE_DESCRIPTOR);
+
+static void FillGetDeviceDescriptor(PBYTE Buffer)
+{
+    BYTE Setup[SETUP_PACKET_SIZE] = { 0x80,                                 // bmRequestType: device to host
+                                      USB_REQUEST_GET_DESCRIPTOR,
+                                      0, USB_DEVICE_DESCRIPTOR_TYPE,        // wValue
+                                      0, 0,                                 // wIndex
+                                      sizeof(USB_DEVICE_DESCRIPTOR), 0 };   // wLength
+    memcpy(Buffer, Setup, sizeof(Setup));
+}
+
+// Device re-enumerates after each redirection, so it is waited for
+static HANDLE RedirectDevice(USHORT VendorID, USHORT ProductID)
+{
+    for (ULONG Attempt = 0; Attempt < BENCHMARK_REDIRECT_ATTEMPTS; Attempt++)
+    {
+        PUSB_DK_DEVICE_INFO Devices;
+        ULONG NumDevices;
+        if (UsbDk_GetDevicesList(&Devices, &NumDevices))
+        {
+            HANDLE Handle = INVALID_HANDLE_VALUE;
+            for (ULONG i = 0; i < NumDevices; i++)
+            {
+                if ((Devices[i].DeviceDescriptor.idVendor == VendorID) &&
+                    (Devices[i].DeviceDescriptor.idProduct == ProductID))
+                {
+                    Handle = UsbDk_StartRedirect(&Devices[i].ID);
+                    break;
+                }
+            }
+            UsbDk_ReleaseDevicesList(Devices);
+
+            if (Handle != INVALID_HANDLE_VALUE)
+            {
+                return Handle;
+            }
+        }
+
+        Sleep(500);
+    }
+
+    return INVALID_HANDLE_VALUE;
+}
+
+struct CCoroutineTask
+{
+    struct promise_type
+    {
+        CCoroutineTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+struct CCoroutineState
+{
+    ULONG Running = 0;
+    bool Failed = false;
+};
+
+static CCoroutineTask CoroutineWorker(UsbDkCoDevice &Device, ULONG NumTransfers, CCoroutineState &State)
+{
+    BYTE Buffer[GET_DESCRIPTOR_BUFFER_SIZE];
+
+    for (ULONG i = 0; (i < NumTransfers) && !State.Failed; i++)
+    {
+        FillGetDeviceDescriptor(Buffer);
+
+        auto Result = co_await Device.Control(Buffer, sizeof(Buffer));
+        if ((Result.Error != ERROR_SUCCESS) || (Result.BytesTransferred == 0))
+        {
+            State.Failed = true;
+        }
+    }
+
+    State.Running--;
+}
+
+static ULONG64 RunCoroutineTransfers(HANDLE DeviceHandle, ULONG NumTransfers)
+{
+    UsbDkIoService Service;
+    USBDK_CHECK(Service.IsValid());
+
+    UsbDkCoDevice Device(Service, DeviceHandle);
+    USBDK_CHECK(Device.IsValid());
+
+    UsbDkBenchmarkTimer Timer;
+
+    // Completions are dispatched by this thread only
+    CCoroutineState State;
+    State.Running = BENCHMARK_QUEUE_DEPTH;
+    for (ULONG i = 0; i < BENCHMARK_QUEUE_DEPTH; i++)
+    {
+        CoroutineWorker(Device, NumTransfers / BENCHMARK_QUEUE_DEPTH, State);
+    }
+
+    while (State.Running != 0)
+    {
+        USBDK_CHECK(Service.RunOne());
+    }
+
+    auto Elapsed = Timer.ElapsedMicroseconds();
+    USBDK_CHECK(!State.Failed);
+    return Elapsed;
+}
+
+struct CCallbackState;
+
+struct CCallbackWorker
+{
+    OVERLAPPED Overlapped;
+    USB_DK_TRANSFER_REQUEST Request;
+    BYTE Buffer[GET_DESCRIPTOR_BUFFER_SIZE];
+    ULONG Remaining;
+    CCallbackState *State;
+};
+
+struct CCallbackState
+{
+    HANDLE DeviceHandle;
+    PTP_IO Io;
+    HANDLE Done;
+    LONG Running;
+    LONG Failed;
+};
+
+static void CallbackWorkerFinish(CCallbackWorker &Worker, bool Failed)
+{
+    if (Failed)
+    {
+        InterlockedExchange(&Worker.State->Failed, TRUE);
+    }
+
+    if (InterlockedDecrement(&Worker.State->Running) == 0)
+    {
+        SetEvent(Worker.State->Done);
+    }
+}
+
+static void CallbackWorkerSubmit(CCallbackWorker &Worker)
+{
+    ZeroMemory(&Worker.Overlapped, sizeof(Worker.Overlapped));
+    ZeroMemory(&Worker.Request, sizeof(Worker.Request));
+    FillGetDeviceDescriptor(Worker.Buffer);
+    Worker.Request.Buffer = Worker.Buffer;
+    Worker.Request.BufferLength = sizeof(Worker.Buffer);
+    Worker.Request.TransferType = ControlTransferType;
+
+    StartThreadpoolIo(Worker.State->Io);
+
+    auto Error = UsbDk_ReadPipeEx(Worker.State->DeviceHandle, &Worker.Request, &Worker.Overlapped);
+    if ((Error != ERROR_SUCCESS) && (Error != ERROR_IO_PENDING))
+    {
+        // Failed synchronously, no completion callback will be called
+        CancelThreadpoolIo(Worker.State->Io);
+        CallbackWorkerFinish(Worker, true);
+    }
+}
+
+static VOID CALLBACK CallbackWorkerComplete(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PVOID Overlapped,
+                                            ULONG IoResult, ULONG_PTR BytesTransferred, PTP_IO Io)
+{
+    UNREFERENCED_PARAMETER(Instance);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(BytesTransferred);
+    UNREFERENCED_PARAMETER(Io);
+
+    auto &Worker = *CONTAINING_RECORD(Overlapped, CCallbackWorker, Overlapped);
+
+    if ((IoResult != NO_ERROR) || (Worker.Request.Result.GenResult.BytesTransferred == 0))
+    {
+        CallbackWorkerFinish(Worker, true);
+    }
+    else if ((--Worker.Remaining == 0) || (Worker.State->Failed != FALSE))
+    {
+        CallbackWorkerFinish(Worker, false);
+    }
+    else
+    {
+        CallbackWorkerSubmit(Worker);
+    }
+}
+
+static ULONG64 RunCallbackTransfers(HANDLE DeviceHandle, ULONG NumTransfers)
+{
+    CCallbackState State = {};
+    State.DeviceHandle = DeviceHandle;
+    State.Running = BENCHMARK_QUEUE_DEPTH;
+
+    unique_ptr<void, decltype(&CloseHandle)> Done(CreateEvent(nullptr, TRUE, FALSE, nullptr), &CloseHandle);
+    USBDK_CHECK(Done);
+    State.Done = Done.get();
+
+    State.Io = CreateThreadpoolIo(UsbDk_GetRedirectorSystemHandle(DeviceHandle), CallbackWorkerComplete, nullptr, nullptr);
+    USBDK_CHECK(State.Io != nullptr);
+
+    CCallbackWorker Workers[BENCHMARK_QUEUE_DEPTH];
+
+    UsbDkBenchmarkTimer Timer;
+
+    for (auto &Worker : Workers)
+    {
+        Worker.Remaining = NumTransfers / BENCHMARK_QUEUE_DEPTH;
+        Worker.State = &State;
+        CallbackWorkerSubmit(Worker);
+    }
+
+    WaitForSingleObject(State.Done, INFINITE);
+    auto Elapsed = Timer.ElapsedMicroseconds();
+
+    WaitForThreadpoolIoCallbacks(State.Io, FALSE);
+    CloseThreadpoolIo(State.Io);
+
+    USBDK_CHECK(State.Failed == FALSE);
+    return Elapsed;
+}
+
+template <typename TRunTransfers>
+static ULONG64 RunRedirected(USHORT VendorID, USHORT ProductID, ULONG NumTransfers, TRunTransfers RunTransfers)
+{
+    auto DeviceHandle = RedirectDevice(VendorID, ProductID);
+    USBDK_CHECK(DeviceHandle != INVALID_HANDLE_VALUE);
+
+    // Redirection ends on failure as well
+    struct CStopRedirect
+    {
+        ~CStopRedirect() { UsbDk_StopRedirect(Handle); }
+        HANDLE Handle;
+    } StopRedirect = { DeviceHandle };
+
+    return RunTransfers(DeviceHandle, NumTransfers);
+}
+
+USBDK_BENCHMARK(Coroutine_ControlTransfers)
+{
+    if (Arguments.size() < 2)
+    {
+        tcout << TEXT("Skipped, no device VID and PID given") << endl;
+        return;
+    }
+
+    auto VendorID = static_cast<USHORT>(_tcstoul(Arguments[0].c_str(), nullptr, 16));
+    auto ProductID = static_cast<USHORT>(_tcstoul(Arguments[1].c_str(), nullptr, 16));
+    auto NumTransfers = (Arguments.size() > 2) ? _tcstoul(Arguments[2].c_str(), nullptr, 10)
+                                               : BENCHMARK_DEFAULT_TRANSFERS;
+    NumTransfers -= NumTransfers % BENCHMARK_QUEUE_DEPTH;
+    USBDK_CHECK(NumTransfers != 0);
+
+    // Each style gets own redirection, a handle cannot be
+    // bound to thread pool and completion port at once
+    auto CallbackTime = RunRedirected(VendorID, ProductID, NumTransfers, RunCallbackTransfers);
+    auto CoroutineTime = RunRedirected(VendorID, ProductID, NumTransfers, RunCoroutineTransfers);
+
+    tcout << NumTransfers << TEXT(" control transfers, queue depth ") << BENCHMARK_QUEUE_DEPTH
+          << TEXT(": callbacks ") << CallbackTime << TEXT(" us, coroutines ") << CoroutineTime << TEXT(" us") << endl;
+}
+
+#endif
@@ -0,0 +1,174 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "DeviceHandleTable.h"
+
+#include <thread>
+
+static unique_ptr<REDIRECTED_DEVICE_HANDLE> MakeDevice(PCWCHAR InstanceID)
+{
+    unique_ptr<REDIRECTED_DEVICE_HANDLE> Device(new REDIRECTED_DEVICE_HANDLE);
+    UsbDkFillIDStruct(&Device->DeviceID, L"USB\\VID_1234&PID_0001", InstanceID);
+    return Device;
+}
+
+// Slot index part of the handle, see UsbDkDeviceHandleTable::Insert()
+static ULONG_PTR HandleSlot(HANDLE Handle)
+{
+    return reinterpret_cast<ULONG_PTR>(Handle) & 0xFFFF;
+}
+
+USBDK_TEST(DeviceHandleTable_ReferencesLiveHandle)
+{
+    auto &Table = UsbDkDeviceHandleTable::Instance();
+
+    auto Handle = Table.Insert(MakeDevice(L"SN0001"));
+    {
+        auto Device = Table.Reference(Handle);
+        USBDK_CHECK(Device);
+        USBDK_CHECK(wcscmp(Device->DeviceID.InstanceID, L"SN0001") == 0);
+    }
+
+    USBDK_CHECK(Table.Close(Handle));
+    USBDK_CHECK(!Table.Reference(Handle));
+    USBDK_CHECK(!Table.Close(Handle));
+}
+
+USBDK_TEST(DeviceHandleTable_RejectsStaleHandle)
+{
+    auto &Table = UsbDkDeviceHandleTable::Instance();
+
+    auto Stale = Table.Insert(MakeDevice(L"SN0001"));
+    USBDK_CHECK(Table.Close(Stale));
+
+    // Slot is re-used with the next generation
+    auto Handle = Table.Insert(MakeDevice(L"SN0002"));
+    USBDK_CHECK(HandleSlot(Handle) == HandleSlot(Stale));
+    USBDK_CHECK(Handle != Stale);
+
+    USBDK_CHECK(!Table.Reference(Stale));
+    USBDK_CHECK(!Table.Close(Stale));
+
+    {
+        auto Device = Table.Reference(Handle);
+        USBDK_CHECK(Device);
+        USBDK_CHECK(wcscmp(Device->DeviceID.InstanceID, L"SN0002") == 0);
+    }
+
+    USBDK_CHECK(Table.Close(Handle));
+}
+
+USBDK_TEST(DeviceHandleTable_RejectsForgedHandles)
+{
+    auto &Table = UsbDkDeviceHandleTable::Instance();
+
+    auto Handle = Table.Insert(MakeDevice(L"SN0001"));
+    auto Value = reinterpret_cast<ULONG_PTR>(Handle);
+
+    auto Generation = Value & ~ULONG_PTR(0xFFFF);
+
+    HANDLE Forged[] = { nullptr,
+                        INVALID_HANDLE_VALUE,
+                        // Slot index 0
+                        reinterpret_cast<HANDLE>(Generation),
+                        // Slot index out of range
+                        reinterpret_cast<HANDLE>(Generation | 0xFFFF),
+                        // Last slot of the last chunk, never allocated here
+                        reinterpret_cast<HANDLE>(Generation | 0x4000),
+                        // Generation not issued yet
+                        reinterpret_cast<HANDLE>(Value + 0x10000) };
+
+    for (auto Bad : Forged)
+    {
+        USBDK_CHECK(!Table.Reference(Bad));
+        USBDK_CHECK(!Table.Close(Bad));
+    }
+
+    USBDK_CHECK(Table.Reference(Handle));
+    USBDK_CHECK(Table.Close(Handle));
+}
+
+USBDK_TEST(DeviceHandleTable_KeepsDeviceWhileReferenced)
+{
+    auto &Table = UsbDkDeviceHandleTable::Instance();
+
+    auto Handle = Table.Insert(MakeDevice(L"SN0001"));
+    {
+        auto Device = Table.Reference(Handle);
+        USBDK_CHECK(Device);
+
+        // Closed handle cannot be referenced anymore, but the call
+        // in flight still uses the device and its slot is not re-used
+        USBDK_CHECK(Table.Close(Handle));
+        USBDK_CHECK(!Table.Reference(Handle));
+        USBDK_CHECK(wcscmp(Device->DeviceID.InstanceID, L"SN0001") == 0);
+
+        auto Other = Table.Insert(MakeDevice(L"SN0002"));
+        USBDK_CHECK(HandleSlot(Other) != HandleSlot(Handle));
+        USBDK_CHECK(Table.Close(Other));
+    }
+
+    // Last reference is gone, so is the device
+    auto Next = Table.Insert(MakeDevice(L"SN0003"));
+    USBDK_CHECK(HandleSlot(Next) == HandleSlot(Handle));
+    USBDK_CHECK(Table.Close(Next));
+}
+
+USBDK_TEST(DeviceHandleTable_ClosesUnderConcurrentReferences)
+{
+    auto &Table = UsbDkDeviceHandleTable::Instance();
+    const ULONG NumThreads = 4;
+    const ULONG NumRounds = 200;
+
+    for (ULONG Round = 0; Round < NumRounds; Round++)
+    {
+        auto Handle = Table.Insert(MakeDevice(L"SN0001"));
+
+        vector<thread> Threads;
+        for (ULONG i = 0; i < NumThreads; i++)
+        {
+            Threads.emplace_back([&Table, Handle]()
+                                 {
+                                     for (;;)
+                                     {
+                                         auto Device = Table.Reference(Handle);
+                                         if (!Device || wcscmp(Device->DeviceID.InstanceID, L"SN0001") != 0)
+                                         {
+                                             return;
+                                         }
+                                     }
+                                 });
+        }
+
+        auto Closed = Table.Close(Handle);
+
+        for (auto &Thread : Threads)
+        {
+            Thread.join();
+        }
+
+        USBDK_CHECK(Closed);
+        USBDK_CHECK(!Table.Reference(Handle));
+    }
+}
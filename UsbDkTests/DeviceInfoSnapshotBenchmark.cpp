@@ -0,0 +1,313 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkData.h"
+
+#include <atomic>
+#include <thread>
+
+// Driver side enumeration replayed over a simulated device tree.
+// Hub filters keep their children in lists guarded by reader/writer
+// locks and COUNT/ENUM requests either walk all of them or copy the
+// USB_DK_DEVICE_INFO array prebuilt when children come and go.
+
+struct CSimChild
+{
+    wstring DeviceID;
+    wstring InstanceID;
+    ULONG Port;
+    USB_DEVICE_DESCRIPTOR DeviceDescriptor;
+};
+
+struct CSimFilter
+{
+    ULONG ID;
+    SRWLOCK Lock = SRWLOCK_INIT;
+    vector<CSimChild> Children;
+};
+
+class CSimDeviceTree
+{
+public:
+    typedef vector<USB_DK_DEVICE_INFO> TSnapshot;
+
+    void AddHub(ULONG Ports)
+    {
+        unique_ptr<CSimFilter> Filter(new CSimFilter);
+        Filter->ID = static_cast<ULONG>(m_Filters.size());
+        Filter->Children.reserve(Ports);
+
+        AcquireSRWLockExclusive(&m_FiltersLock);
+        m_Filters.push_back(move(Filter));
+        ReleaseSRWLockExclusive(&m_FiltersLock);
+    }
+
+    void AddChild(ULONG FilterIndex)
+    {
+        auto &Filter = *m_Filters[FilterIndex];
+
+        CSimChild Child;
+        Child.Port = static_cast<ULONG>(Filter.Children.size()) + 1;
+        Child.DeviceID = L"USB\\VID_1234&PID_" + to_wstring(1000 + Child.Port);
+        Child.InstanceID = L"SN" + to_wstring(FilterIndex) + L"_" + to_wstring(Child.Port);
+        ZeroMemory(&Child.DeviceDescriptor, sizeof(Child.DeviceDescriptor));
+        Child.DeviceDescriptor.bLength = sizeof(USB_DEVICE_DESCRIPTOR);
+        Child.DeviceDescriptor.idVendor = 0x1234;
+
+        AcquireSRWLockExclusive(&Filter.Lock);
+        Filter.Children.push_back(Child);
+        ReleaseSRWLockExclusive(&Filter.Lock);
+    }
+
+    size_t CountChildren()
+    {
+        size_t Count = 0;
+        AcquireSRWLockShared(&m_FiltersLock);
+        for (auto &Filter : m_Filters)
+        {
+            AcquireSRWLockShared(&Filter->Lock);
+            Count += Filter->Children.size();
+            ReleaseSRWLockShared(&Filter->Lock);
+        }
+        ReleaseSRWLockShared(&m_FiltersLock);
+        return Count;
+    }
+
+    bool EnumerateChildren(USB_DK_DEVICE_INFO *Devices, size_t NumAllocated, size_t &NumExisting)
+    {
+        NumExisting = 0;
+        AcquireSRWLockShared(&m_FiltersLock);
+        for (auto &Filter : m_Filters)
+        {
+            AcquireSRWLockShared(&Filter->Lock);
+            for (auto &Child : Filter->Children)
+            {
+                if (NumExisting == NumAllocated)
+                {
+                    ReleaseSRWLockShared(&Filter->Lock);
+                    ReleaseSRWLockShared(&m_FiltersLock);
+                    return false;
+                }
+
+                auto &Info = Devices[NumExisting++];
+                UsbDkFillIDStruct(&Info.ID, Child.DeviceID.c_str(), Child.InstanceID.c_str());
+                Info.FilterID = Filter->ID;
+                Info.Port = Child.Port;
+                Info.Speed = HighSpeed;
+                Info.DeviceDescriptor = Child.DeviceDescriptor;
+            }
+            ReleaseSRWLockShared(&Filter->Lock);
+        }
+        ReleaseSRWLockShared(&m_FiltersLock);
+        return true;
+    }
+
+    void RebuildSnapshot()
+    {
+        shared_ptr<TSnapshot> Snapshot;
+        for (;;)
+        {
+            Snapshot = make_shared<TSnapshot>(CountChildren());
+
+            size_t NumExisting;
+            if (EnumerateChildren(Snapshot->data(), Snapshot->size(), NumExisting))
+            {
+                Snapshot->resize(NumExisting);
+                break;
+            }
+        }
+
+        AcquireSRWLockExclusive(&m_SnapshotLock);
+        m_Snapshot = Snapshot;
+        ReleaseSRWLockExclusive(&m_SnapshotLock);
+
+        m_Rebuilds++;
+        m_RebuildBytes += Snapshot->size() * sizeof(USB_DK_DEVICE_INFO);
+    }
+
+    shared_ptr<const TSnapshot> ReferenceSnapshot()
+    {
+        AcquireSRWLockExclusive(&m_SnapshotLock);
+        shared_ptr<const TSnapshot> Snapshot = m_Snapshot;
+        ReleaseSRWLockExclusive(&m_SnapshotLock);
+        return Snapshot;
+    }
+
+    void ResetStatistics()
+    {
+        m_Rebuilds = 0;
+        m_RebuildBytes = 0;
+    }
+    ULONG Rebuilds() const { return m_Rebuilds; }
+    ULONG64 RebuildBytes() const { return m_RebuildBytes; }
+
+private:
+    SRWLOCK m_FiltersLock = SRWLOCK_INIT;
+    vector<unique_ptr<CSimFilter>> m_Filters;
+
+    SRWLOCK m_SnapshotLock = SRWLOCK_INIT;
+    shared_ptr<TSnapshot> m_Snapshot;
+
+    ULONG m_Rebuilds = 0;
+    ULONG64 m_RebuildBytes = 0;
+};
+
+static const ULONG BENCHMARK_NUM_HUBS = 16;
+static const ULONG BENCHMARK_PORTS_PER_HUB = 32;
+static const ULONG BENCHMARK_NUM_THREADS = 4;
+static const ULONG BENCHMARK_REQUESTS_PER_THREAD = 2000;
+
+// Each request is COUNT followed by ENUM into a buffer of the counted size,
+// as UsbDk_GetDevicesList issues them. Request returns number of devices.
+template <typename TRequest>
+static ULONG64 RunEnumerationRequests(TRequest Request, size_t NumDevices)
+{
+    atomic<ULONG> Failures(0);
+
+    UsbDkBenchmarkTimer Timer;
+
+    vector<thread> Threads;
+    for (ULONG i = 0; i < BENCHMARK_NUM_THREADS; i++)
+    {
+        Threads.emplace_back([Request, NumDevices, &Failures]()
+                             {
+                                 vector<USB_DK_DEVICE_INFO> Devices;
+                                 for (ULONG j = 0; j < BENCHMARK_REQUESTS_PER_THREAD; j++)
+                                 {
+                                     if (Request(Devices) != NumDevices)
+                                     {
+                                         Failures++;
+                                     }
+                                 }
+                             });
+    }
+
+    for (auto &Thread : Threads)
+    {
+        Thread.join();
+    }
+
+    auto Time = Timer.ElapsedMicroseconds();
+    USBDK_CHECK(Failures == 0);
+    return Time;
+}
+
+USBDK_BENCHMARK(DeviceInfoSnapshot_Enumeration)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    CSimDeviceTree Tree;
+    for (ULONG i = 0; i < BENCHMARK_NUM_HUBS; i++)
+    {
+        Tree.AddHub(BENCHMARK_PORTS_PER_HUB);
+        for (ULONG j = 0; j < BENCHMARK_PORTS_PER_HUB; j++)
+        {
+            Tree.AddChild(i);
+        }
+    }
+    Tree.RebuildSnapshot();
+
+    const size_t NumDevices = BENCHMARK_NUM_HUBS * BENCHMARK_PORTS_PER_HUB;
+
+    auto WalkTime = RunEnumerationRequests([&Tree](vector<USB_DK_DEVICE_INFO> &Devices) -> size_t
+                                           {
+                                               Devices.resize(Tree.CountChildren());
+                                               size_t NumExisting;
+                                               return Tree.EnumerateChildren(Devices.data(), Devices.size(), NumExisting) ? NumExisting : 0;
+                                           }, NumDevices);
+
+    // COUNT and ENUM reference the snapshot separately, as IOCTLs do
+    auto SnapshotTime = RunEnumerationRequests([&Tree](vector<USB_DK_DEVICE_INFO> &Devices) -> size_t
+                                               {
+                                                   Devices.resize(Tree.ReferenceSnapshot()->size());
+                                                   auto Snapshot = Tree.ReferenceSnapshot();
+                                                   if (Snapshot->size() > Devices.size())
+                                                   {
+                                                       return 0;
+                                                   }
+                                                   memcpy(Devices.data(), Snapshot->data(), Snapshot->size() * sizeof(USB_DK_DEVICE_INFO));
+                                                   return Snapshot->size();
+                                               }, NumDevices);
+
+    tcout << NumDevices << TEXT(" devices behind ") << BENCHMARK_NUM_HUBS << TEXT(" hubs, ")
+          << BENCHMARK_NUM_THREADS << TEXT(" threads x ") << BENCHMARK_REQUESTS_PER_THREAD
+          << TEXT(" COUNT+ENUM requests: children walk ") << WalkTime
+          << TEXT(" us, snapshot ") << SnapshotTime << TEXT(" us") << endl;
+}
+
+// Relations pass of a 255-port hub reporting all of its ports at once,
+// snapshot rebuilt after each registered child versus once per pass
+
+static const ULONG BENCHMARK_HUB_PORTS = 255;
+static const ULONG BENCHMARK_OTHER_DEVICES = 64;
+
+static ULONG64 RunHubArrival(bool RebuildPerChild, CSimDeviceTree &Tree)
+{
+    Tree.AddHub(BENCHMARK_OTHER_DEVICES);
+    for (ULONG i = 0; i < BENCHMARK_OTHER_DEVICES; i++)
+    {
+        Tree.AddChild(0);
+    }
+    Tree.RebuildSnapshot();
+
+    Tree.AddHub(BENCHMARK_HUB_PORTS);
+    Tree.ResetStatistics();
+
+    UsbDkBenchmarkTimer Timer;
+
+    for (ULONG i = 0; i < BENCHMARK_HUB_PORTS; i++)
+    {
+        Tree.AddChild(1);
+        if (RebuildPerChild)
+        {
+            Tree.RebuildSnapshot();
+        }
+    }
+    if (!RebuildPerChild)
+    {
+        Tree.RebuildSnapshot();
+    }
+
+    auto Time = Timer.ElapsedMicroseconds();
+    USBDK_CHECK(Tree.ReferenceSnapshot()->size() == BENCHMARK_OTHER_DEVICES + BENCHMARK_HUB_PORTS);
+    return Time;
+}
+
+USBDK_BENCHMARK(DeviceInfoSnapshot_HubArrival)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    CSimDeviceTree PerChildTree;
+    auto PerChildTime = RunHubArrival(true, PerChildTree);
+
+    CSimDeviceTree PerPassTree;
+    auto PerPassTime = RunHubArrival(false, PerPassTree);
+
+    tcout << BENCHMARK_HUB_PORTS << TEXT("-port hub arrival next to ") << BENCHMARK_OTHER_DEVICES
+          << TEXT(" devices: rebuild per child ") << PerChildTime << TEXT(" us, ")
+          << PerChildTree.Rebuilds() << TEXT(" rebuilds, ")
+          << PerChildTree.RebuildBytes() << TEXT(" bytes; rebuild per pass ")
+          << PerPassTime << TEXT(" us, ") << PerPassTree.Rebuilds() << TEXT(" rebuilds, ")
+          << PerPassTree.RebuildBytes() << TEXT(" bytes") << endl;
+}
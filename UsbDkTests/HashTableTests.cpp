@@ -0,0 +1,558 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+
+#include <functional>
+
+// Lock contexts UsbDkHashTable.h expects from the includer,
+// tables below are used by one thread and need no locking
+template <typename T>
+class CLockedContext
+{
+public:
+    CLockedContext(T &LockObject)
+        : m_LockObject(LockObject)
+    { m_LockObject.Lock(); }
+    ~CLockedContext()
+    { m_LockObject.Unlock(); }
+
+    CLockedContext(const CLockedContext&) = delete;
+    CLockedContext& operator= (const CLockedContext&) = delete;
+private:
+    T &m_LockObject;
+};
+
+template <typename T>
+class CSharedLockedContext
+{
+public:
+    CSharedLockedContext(T &LockObject)
+        : m_LockObject(LockObject)
+    { m_LockObject.LockShared(); }
+    ~CSharedLockedContext()
+    { m_LockObject.UnlockShared(); }
+
+    CSharedLockedContext(const CSharedLockedContext&) = delete;
+    CSharedLockedContext& operator= (const CSharedLockedContext&) = delete;
+private:
+    T &m_LockObject;
+};
+
+class CTestRawAccess
+{
+public:
+    void Lock() {}
+    void Unlock() {}
+    void LockShared() {}
+    void UnlockShared() {}
+};
+
+#include "UsbDkHashTable.h"
+
+// Stands for DEVICE_OBJECT of a hub port PDO, only its address
+// matters for the indices. Size keeps addresses 16 bytes apart
+// at least, as pool allocations are.
+struct CTestPDO
+{
+    BYTE Body[0x1B0];
+};
+
+// Child linked into global and per hub PDO indices
+// the way CUsbDkChildDevice is
+struct CTestChild
+{
+    explicit CTestChild(const CTestPDO *ChildPDO)
+        : PDO(ChildPDO)
+    {}
+
+    bool Match(const CTestPDO *OtherPDO) const
+    { return PDO == OtherPDO; }
+
+    const CTestPDO *PDO;
+    ULONG RelationsPass = 0;
+    CTestChild *PDOHashNext = nullptr;
+    CTestChild *HubPDOHashNext = nullptr;
+};
+
+struct CTestPDOHashTraits
+{
+    static CTestChild *&Next(CTestChild *Child)
+    { return Child->PDOHashNext; }
+    static ULONG Hash(const CTestChild *Child)
+    { return UsbDkPointerHash(Child->PDO); }
+};
+
+struct CTestHubPDOHashTraits
+{
+    static CTestChild *&Next(CTestChild *Child)
+    { return Child->HubPDOHashNext; }
+    static ULONG Hash(const CTestChild *Child)
+    { return UsbDkPointerHash(Child->PDO); }
+};
+
+// Chain counts of CUsbDkControlDevice and CUsbDkHubFilterStrategy indices
+typedef CWdmHashTable<CTestChild, CTestPDOHashTraits, CTestRawAccess, 256> CTestGlobalIndex;
+typedef CWdmHashTable<CTestChild, CTestHubPDOHashTraits, CTestRawAccess, 128> CTestHubIndex;
+
+static const ULONG MAX_HUB_PORTS = 255;
+
+template <typename TIndex>
+static CTestChild *FindChild(TIndex &Index, const CTestPDO *PDO, ULONG *PredicateCalls = nullptr)
+{
+    CTestChild *Found = nullptr;
+    Index.ForEachIf(UsbDkPointerHash(PDO),
+                    [PDO, PredicateCalls](CTestChild *Child)
+                    {
+                        if (PredicateCalls != nullptr)
+                        {
+                            (*PredicateCalls)++;
+                        }
+                        return Child->Match(PDO);
+                    },
+                    [&Found](CTestChild *Child)
+                    {
+                        Found = Child;
+                        return false;
+                    });
+    return Found;
+}
+
+USBDK_TEST(HashTable_FindsChildrenOfFullHub)
+{
+    vector<CTestPDO> PDOs(MAX_HUB_PORTS + 1);
+    list<CTestChild> Children;
+    CTestHubIndex Index;
+
+    for (ULONG i = 0; i < MAX_HUB_PORTS; i++)
+    {
+        Children.emplace_back(&PDOs[i]);
+        Index.Add(&Children.back());
+    }
+
+    for (auto &Child : Children)
+    {
+        USBDK_CHECK(FindChild(Index, Child.PDO) == &Child);
+    }
+
+    USBDK_CHECK(FindChild(Index, &PDOs[MAX_HUB_PORTS]) == nullptr);
+}
+
+USBDK_TEST(HashTable_RemoveKeepsChainNeighbours)
+{
+    // Few chains, so every chain holds several children
+    typedef CWdmHashTable<CTestChild, CTestHubPDOHashTraits, CTestRawAccess, 4> CTestSmallIndex;
+
+    vector<CTestPDO> PDOs(32);
+    list<CTestChild> Children;
+    CTestSmallIndex Index;
+
+    for (auto &PDO : PDOs)
+    {
+        Children.emplace_back(&PDO);
+        Index.Add(&Children.back());
+    }
+
+    // Removes heads, middles and tails of the chains
+    ULONG i = 0;
+    for (auto &Child : Children)
+    {
+        if (i++ % 3 == 0)
+        {
+            Index.Remove(&Child);
+            USBDK_CHECK(Child.HubPDOHashNext == nullptr);
+        }
+    }
+
+    i = 0;
+    for (auto &Child : Children)
+    {
+        auto Removed = (i++ % 3 == 0);
+        USBDK_CHECK(FindChild(Index, Child.PDO) == (Removed ? nullptr : &Child));
+    }
+
+    // Removing an entry that is not in the table is harmless
+    Index.Remove(&Children.front());
+    USBDK_CHECK(FindChild(Index, Children.back().PDO) == &Children.back());
+}
+
+USBDK_TEST(HashTable_HubAndGlobalIndicesAreIndependent)
+{
+    vector<CTestPDO> PDOs(MAX_HUB_PORTS);
+    list<CTestChild> Children;
+    CTestGlobalIndex GlobalIndex;
+    CTestHubIndex HubIndex;
+
+    for (auto &PDO : PDOs)
+    {
+        Children.emplace_back(&PDO);
+        GlobalIndex.Add(&Children.back());
+        HubIndex.Add(&Children.back());
+    }
+
+    // Dropping from hub index relinks hub chains only
+    for (auto &Child : Children)
+    {
+        HubIndex.Remove(&Child);
+        USBDK_CHECK(FindChild(HubIndex, Child.PDO) == nullptr);
+        USBDK_CHECK(FindChild(GlobalIndex, Child.PDO) == &Child);
+    }
+}
+
+USBDK_TEST(HashTable_ForEachIfStopsWhenFunctorReturnsFalse)
+{
+    CTestPDO PDO;
+    CTestChild First(&PDO);
+    CTestChild Second(&PDO);
+    CTestHubIndex Index;
+    Index.Add(&First);
+    Index.Add(&Second);
+
+    ULONG Calls = 0;
+    USBDK_CHECK(Index.ForEachIf(UsbDkPointerHash(&PDO), [](CTestChild *) { return true; },
+                                [&Calls](CTestChild *) { Calls++; return true; }));
+    USBDK_CHECK(Calls == 2);
+
+    Calls = 0;
+    USBDK_CHECK(!Index.ForEachIf(UsbDkPointerHash(&PDO), [](CTestChild *) { return true; },
+                                 [&Calls](CTestChild *) { Calls++; return false; }));
+    USBDK_CHECK(Calls == 1);
+}
+
+// Relations processing of CUsbDkHubFilterStrategy replayed over the hub index:
+// children reported in relations are marked with the pass number, unmarked
+// ones are dropped, unknown PDOs are registered. Returns number of
+// predicate calls made by index lookups.
+static ULONG ProcessRelations(CTestHubIndex &Index, list<CTestChild> &Children, ULONG &Pass,
+                              const vector<const CTestPDO *> &Relations)
+{
+    ULONG PredicateCalls = 0;
+
+    Pass++;
+    for (auto PDO : Relations)
+    {
+        auto Child = FindChild(Index, PDO, &PredicateCalls);
+        if (Child != nullptr)
+        {
+            Child->RelationsPass = Pass;
+        }
+    }
+
+    for (auto Child = Children.begin(); Child != Children.end();)
+    {
+        if (Child->RelationsPass != Pass)
+        {
+            Index.Remove(&*Child);
+            Child = Children.erase(Child);
+        }
+        else
+        {
+            ++Child;
+        }
+    }
+
+    for (auto PDO : Relations)
+    {
+        if (FindChild(Index, PDO, &PredicateCalls) == nullptr)
+        {
+            Children.emplace_back(PDO);
+            Children.back().RelationsPass = Pass;
+            Index.Add(&Children.back());
+        }
+    }
+
+    return PredicateCalls;
+}
+
+USBDK_TEST(HashTable_RelationsOfFullHubProcessedInLinearTime)
+{
+    vector<CTestPDO> PDOs(MAX_HUB_PORTS * 2);
+    list<CTestChild> Children;
+    CTestHubIndex Index;
+    ULONG Pass = 0;
+
+    vector<const CTestPDO *> Relations;
+    for (ULONG i = 0; i < MAX_HUB_PORTS; i++)
+    {
+        Relations.push_back(&PDOs[i]);
+    }
+
+    // All ports populated at once
+    auto Calls = ProcessRelations(Index, Children, Pass, Relations);
+    USBDK_CHECK(Children.size() == MAX_HUB_PORTS);
+    USBDK_CHECK(Calls <= 4 * MAX_HUB_PORTS);
+
+    // Every third device replugged, gets a new PDO
+    for (ULONG i = 0; i < MAX_HUB_PORTS; i += 3)
+    {
+        Relations[i] = &PDOs[MAX_HUB_PORTS + i];
+    }
+
+    Calls = ProcessRelations(Index, Children, Pass, Relations);
+    USBDK_CHECK(Children.size() == MAX_HUB_PORTS);
+    USBDK_CHECK(Calls <= 4 * MAX_HUB_PORTS);
+
+    for (auto PDO : Relations)
+    {
+        USBDK_CHECK(FindChild(Index, PDO) != nullptr);
+    }
+    for (ULONG i = 0; i < MAX_HUB_PORTS; i += 3)
+    {
+        USBDK_CHECK(FindChild(Index, &PDOs[i]) == nullptr);
+    }
+}
+
+// Same relations processing with the children list scan the hub filter
+// used before the index, for hubs of growing size
+
+static ULONG64 RunRelationsPasses(ULONG NumPorts, ULONG NumPasses, bool UseIndex)
+{
+    vector<CTestPDO> PDOs(NumPorts * 2);
+    list<CTestChild> Children;
+    CTestHubIndex Index;
+    ULONG Pass = 0;
+
+    vector<const CTestPDO *> Relations;
+    for (ULONG i = 0; i < NumPorts; i++)
+    {
+        Relations.push_back(&PDOs[i]);
+    }
+
+    auto ListFind = [&Children](const CTestPDO *PDO) -> CTestChild *
+    {
+        for (auto &Child : Children)
+        {
+            if (Child.Match(PDO))
+            {
+                return &Child;
+            }
+        }
+        return nullptr;
+    };
+
+    UsbDkBenchmarkTimer Timer;
+
+    for (ULONG i = 0; i < NumPasses; i++)
+    {
+        // One device replugged per pass
+        auto Port = i % NumPorts;
+        Relations[Port] = (Relations[Port] == &PDOs[Port]) ? &PDOs[NumPorts + Port] : &PDOs[Port];
+
+        if (UseIndex)
+        {
+            ProcessRelations(Index, Children, Pass, Relations);
+            continue;
+        }
+
+        Pass++;
+        for (auto PDO : Relations)
+        {
+            auto Child = ListFind(PDO);
+            if (Child != nullptr)
+            {
+                Child->RelationsPass = Pass;
+            }
+        }
+        Children.remove_if([Pass](const CTestChild &Child) { return Child.RelationsPass != Pass; });
+        for (auto PDO : Relations)
+        {
+            if (ListFind(PDO) == nullptr)
+            {
+                Children.emplace_back(PDO);
+                Children.back().RelationsPass = Pass;
+            }
+        }
+    }
+
+    auto Time = Timer.ElapsedMicroseconds();
+    USBDK_CHECK(Children.size() == NumPorts);
+    return Time;
+}
+
+USBDK_BENCHMARK(HashTable_HubRelations)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    const ULONG NumPasses = 1000;
+    ULONG PortCounts[] = { 16, 64, 128, MAX_HUB_PORTS };
+
+    for (auto NumPorts : PortCounts)
+    {
+        auto ListTime = RunRelationsPasses(NumPorts, NumPasses, false);
+        auto IndexTime = RunRelationsPasses(NumPorts, NumPasses, true);
+
+        tcout << NumPorts << TEXT(" ports, ") << NumPasses << TEXT(" relations passes: list scan ")
+              << ListTime << TEXT(" us, PDO index ") << IndexTime << TEXT(" us") << endl;
+    }
+}
+
+// Control device index of children by (DeviceID, InstanceID)
+
+struct CTestIDChild
+{
+    CTestIDChild(const wstring &ChildDeviceID, const wstring &ChildInstanceID)
+        : DeviceID(ChildDeviceID)
+        , InstanceID(ChildInstanceID)
+    {}
+
+    bool Match(PCWCHAR OtherDeviceID, PCWCHAR OtherInstanceID) const
+    { return (DeviceID == OtherDeviceID) && (InstanceID == OtherInstanceID); }
+
+    static ULONG IDHash(PCWCHAR ChildDeviceID, PCWCHAR ChildInstanceID)
+    { return UsbDkStringHash(ChildInstanceID, UsbDkStringHash(ChildDeviceID)); }
+
+    wstring DeviceID;
+    wstring InstanceID;
+    CTestIDChild *IDHashNext = nullptr;
+};
+
+struct CTestIDHashTraits
+{
+    static CTestIDChild *&Next(CTestIDChild *Child)
+    { return Child->IDHashNext; }
+    static ULONG Hash(const CTestIDChild *Child)
+    { return CTestIDChild::IDHash(Child->DeviceID.c_str(), Child->InstanceID.c_str()); }
+};
+
+typedef CWdmHashTable<CTestIDChild, CTestIDHashTraits, CTestRawAccess, 256> CTestIDIndex;
+
+static CTestIDChild *FindChildByID(CTestIDIndex &Index, PCWCHAR DeviceID, PCWCHAR InstanceID)
+{
+    CTestIDChild *Found = nullptr;
+    Index.ForEachIf(CTestIDChild::IDHash(DeviceID, InstanceID),
+                    [DeviceID, InstanceID](CTestIDChild *Child) { return Child->Match(DeviceID, InstanceID); },
+                    [&Found](CTestIDChild *Child)
+                    {
+                        Found = Child;
+                        return false;
+                    });
+    return Found;
+}
+
+// Identical devices differ in instance ID only
+static void MakeTestIDChildren(ULONG NumChildren, list<CTestIDChild> &Children)
+{
+    for (ULONG i = 0; i < NumChildren; i++)
+    {
+        Children.emplace_back(L"USB\\VID_1234&PID_" + to_wstring(1000 + i % 16),
+                              L"6&1a2b3c4d&0&" + to_wstring(i));
+    }
+}
+
+USBDK_TEST(HashTable_IDIndexMatchesDeviceAndInstanceID)
+{
+    list<CTestIDChild> Children;
+    MakeTestIDChildren(64, Children);
+
+    CTestIDIndex Index;
+    for (auto &Child : Children)
+    {
+        Index.Add(&Child);
+    }
+
+    for (auto &Child : Children)
+    {
+        USBDK_CHECK(FindChildByID(Index, Child.DeviceID.c_str(), Child.InstanceID.c_str()) == &Child);
+    }
+
+    auto &First = Children.front();
+    auto &Second = *next(Children.begin());
+    USBDK_CHECK(FindChildByID(Index, First.DeviceID.c_str(), Second.InstanceID.c_str()) == nullptr);
+    USBDK_CHECK(FindChildByID(Index, L"USB\\VID_1234&PID_1000", L"") == nullptr);
+
+    Index.Remove(&First);
+    USBDK_CHECK(FindChildByID(Index, First.DeviceID.c_str(), First.InstanceID.c_str()) == nullptr);
+    USBDK_CHECK(FindChildByID(Index, Second.DeviceID.c_str(), Second.InstanceID.c_str()) == &Second);
+}
+
+// Lookups by device ID, as redirection and descriptor requests do them,
+// over children of several hubs. Compares the index with the walk over
+// all filters and their children it replaced.
+
+static const ULONG BENCHMARK_ID_CHILDREN = 1000;
+static const ULONG BENCHMARK_ID_HUBS = 8;
+static const ULONG BENCHMARK_ID_LOOKUPS = 100000;
+
+USBDK_BENCHMARK(HashTable_ChildrenByID)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    list<CTestIDChild> Children;
+    MakeTestIDChildren(BENCHMARK_ID_CHILDREN, Children);
+
+    CTestIDIndex Index;
+    vector<vector<CTestIDChild *>> Hubs(BENCHMARK_ID_HUBS);
+    vector<CTestIDChild *> All;
+    ULONG i = 0;
+    for (auto &Child : Children)
+    {
+        Index.Add(&Child);
+        Hubs[i++ % BENCHMARK_ID_HUBS].push_back(&Child);
+        All.push_back(&Child);
+    }
+
+    auto WalkFind = [&Hubs](PCWCHAR DeviceID, PCWCHAR InstanceID) -> CTestIDChild *
+    {
+        for (auto &Hub : Hubs)
+        {
+            for (auto Child : Hub)
+            {
+                if (Child->Match(DeviceID, InstanceID))
+                {
+                    return Child;
+                }
+            }
+        }
+        return nullptr;
+    };
+
+    // Fixed LCG sequence, both lookups see the same devices
+    auto RunLookups = [&All](function<CTestIDChild *(PCWCHAR, PCWCHAR)> Find)
+    {
+        ULONG Seed = 1;
+        ULONG Misses = 0;
+
+        UsbDkBenchmarkTimer Timer;
+        for (ULONG j = 0; j < BENCHMARK_ID_LOOKUPS; j++)
+        {
+            Seed = Seed * 1103515245 + 12345;
+            auto Child = All[(Seed >> 16) % All.size()];
+            if (Find(Child->DeviceID.c_str(), Child->InstanceID.c_str()) != Child)
+            {
+                Misses++;
+            }
+        }
+        auto Time = Timer.ElapsedMicroseconds();
+
+        USBDK_CHECK(Misses == 0);
+        return Time;
+    };
+
+    auto WalkTime = RunLookups(WalkFind);
+    auto IndexTime = RunLookups([&Index](PCWCHAR DeviceID, PCWCHAR InstanceID)
+                                { return FindChildByID(Index, DeviceID, InstanceID); });
+
+    tcout << BENCHMARK_ID_CHILDREN << TEXT(" children behind ") << BENCHMARK_ID_HUBS << TEXT(" hubs, ")
+          << BENCHMARK_ID_LOOKUPS << TEXT(" lookups by ID: children walk ") << WalkTime
+          << TEXT(" us, ID index ") << IndexTime << TEXT(" us") << endl;
+}
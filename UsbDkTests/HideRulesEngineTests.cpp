@@ -0,0 +1,317 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkDataHider.h"
+#include "HideRulesRegPublic.h"
+#include "UsbDkHideRulesEngine.h"
+
+struct CTestEntriesAllocator
+{
+    static CUsbDkHideRulesLookupEntry *allocate(size_t NumEntries)
+    { return static_cast<CUsbDkHideRulesLookupEntry *>(operator new(NumEntries * sizeof(CUsbDkHideRulesLookupEntry), nothrow)); }
+    static void destroy(CUsbDkHideRulesLookupEntry *Entries)
+    { operator delete(Entries); }
+};
+
+typedef CUsbDkHideRulesLookup<CTestEntriesAllocator> CTestHideRulesLookup;
+
+static const ULONG ALL = USBDK_REG_HIDE_RULE_MATCH_ALL;
+
+// Rule sets of the control device, walked in order of addition
+class CTestRuleSets
+{
+public:
+    void Add(CUsbDkHideRulesLayers::TLayer Layer, bool Hide, ULONG Class, ULONG VID, ULONG PID, ULONG BCD = ALL)
+    { m_Layers[Layer].emplace_back(Hide, Class, VID, PID, BCD); }
+
+    template <typename TFunctor>
+    bool ForEach(CUsbDkHideRulesLayers::TLayer Layer, TFunctor Functor)
+    {
+        for (const auto &Rule : m_Layers[Layer])
+        {
+            if (!Functor(Rule))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t Size() const
+    {
+        size_t Size = 0;
+        for (const auto &Layer : m_Layers)
+        {
+            Size += Layer.size();
+        }
+        return Size;
+    }
+
+    // Same order CUsbDkControlDevice::CompileHideRules adds the sets in
+    bool Compile(CTestHideRulesLookup &Lookup)
+    {
+        if (!Lookup.Reserve(Size()))
+        {
+            return false;
+        }
+
+        for (ULONG Layer = 0; Layer < CUsbDkHideRulesLayers::NUM_LAYERS; Layer++)
+        {
+            for (const auto &Rule : m_Layers[Layer])
+            {
+                if (!Lookup.Add(static_cast<CUsbDkHideRulesLayers::TLayer>(Layer), Rule))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    vector<CUsbDkHideRuleBase> m_Layers[CUsbDkHideRulesLayers::NUM_LAYERS];
+};
+
+static USB_DEVICE_DESCRIPTOR MakeDescriptor(UCHAR Class, USHORT VID, USHORT PID, USHORT BCD = 0x0100)
+{
+    USB_DEVICE_DESCRIPTOR Descriptor = {};
+    Descriptor.bLength = sizeof(Descriptor);
+    Descriptor.bDeviceClass = Class;
+    Descriptor.idVendor = VID;
+    Descriptor.idProduct = PID;
+    Descriptor.bcdDevice = BCD;
+    return Descriptor;
+}
+
+// Both the rule sets walk and the compiled engine must reach Expected
+static bool DecidesBoth(CTestRuleSets &Sets, const USB_DEVICE_DESCRIPTOR &Descriptor, ULONG Classes, bool Expected)
+{
+    CTestHideRulesLookup Lookup;
+    if (!Sets.Compile(Lookup))
+    {
+        return false;
+    }
+
+    return (UsbDkShouldHideByRuleSets(Sets, Descriptor, Classes) == Expected) &&
+           (Lookup.ShouldHide(Descriptor, Classes) == Expected);
+}
+
+USBDK_TEST(HideRulesEngine_HidesMatchingDevicesOnly)
+{
+    CTestRuleSets Sets;
+    Sets.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, true, ALL, 0x1234, 0x0001);
+    Sets.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, true, 0x08, ALL, ALL);
+
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0, 0x1234, 0x0001), 0, true));
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0, 0x1234, 0x0002), 0, false));
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0x08, 0x4321, 0x0002), 0, true));
+
+    CTestRuleSets Empty;
+    USBDK_CHECK(DecidesBoth(Empty, MakeDescriptor(0x08, 0x1234, 0x0001), ALL, false));
+}
+
+USBDK_TEST(HideRulesEngine_DontHideRuleWinsWithinLayer)
+{
+    // Exact rule added before wildcard, and the other way round
+    CTestRuleSets ExactFirst;
+    ExactFirst.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, true, ALL, 0x1234, 0x0001);
+    ExactFirst.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, false, ALL, 0x1234, ALL);
+    USBDK_CHECK(DecidesBoth(ExactFirst, MakeDescriptor(0, 0x1234, 0x0001), 0, false));
+
+    CTestRuleSets WildcardFirst;
+    WildcardFirst.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, false, ALL, ALL, ALL, 0x0100);
+    WildcardFirst.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, true, ALL, 0x1234, 0x0001);
+    USBDK_CHECK(DecidesBoth(WildcardFirst, MakeDescriptor(0, 0x1234, 0x0001), 0, false));
+
+    CTestRuleSets HideAfterDontHide;
+    HideAfterDontHide.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, false, ALL, 0x1234, 0x0001);
+    HideAfterDontHide.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, true, ALL, ALL, ALL);
+    USBDK_CHECK(DecidesBoth(HideAfterDontHide, MakeDescriptor(0, 0x1234, 0x0001), 0, false));
+    USBDK_CHECK(DecidesBoth(HideAfterDontHide, MakeDescriptor(0, 0x1234, 0x0002), 0, true));
+}
+
+USBDK_TEST(HideRulesEngine_LaterLayerOverridesEarlierOne)
+{
+    CTestRuleSets Unhidden;
+    Unhidden.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, true, ALL, 0x1234, ALL);
+    Unhidden.Add(CUsbDkHideRulesLayers::LAYER_PERSISTENT, false, ALL, 0x1234, 0x0001);
+    USBDK_CHECK(DecidesBoth(Unhidden, MakeDescriptor(0, 0x1234, 0x0001), 0, false));
+    USBDK_CHECK(DecidesBoth(Unhidden, MakeDescriptor(0, 0x1234, 0x0002), 0, true));
+
+    CTestRuleSets Hidden;
+    Hidden.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, false, ALL, 0x1234, 0x0001);
+    Hidden.Add(CUsbDkHideRulesLayers::LAYER_PERSISTENT, true, ALL, ALL, ALL);
+    USBDK_CHECK(DecidesBoth(Hidden, MakeDescriptor(0, 0x1234, 0x0001), 0, true));
+
+    // Layer without matching rules keeps the decision
+    Hidden.Add(CUsbDkHideRulesLayers::LAYER_PERSISTENT_EXT, false, 0x02, ALL, ALL);
+    USBDK_CHECK(DecidesBoth(Hidden, MakeDescriptor(0, 0x1234, 0x0001), 0x01, true));
+}
+
+USBDK_TEST(HideRulesEngine_ExtLayersMatchClassesOfUnhiddenDevices)
+{
+    CTestRuleSets Sets;
+    Sets.Add(CUsbDkHideRulesLayers::LAYER_DEFAULT, true, ALL, 0x1234, 0x0001);
+    Sets.Add(CUsbDkHideRulesLayers::LAYER_EXT, false, ALL, 0x1234, ALL);
+    Sets.Add(CUsbDkHideRulesLayers::LAYER_EXT, true, 0x0100, ALL, ALL);
+
+    // Hidden by default layer, ext do-not-hide rule is not consulted
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0, 0x1234, 0x0001), 0, true));
+
+    // Ext rules match interface classes bitmask, not bDeviceClass
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0, 0x4321, 0x0001), 0x0100, true));
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0, 0x4321, 0x0001), 0x0200, false));
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0x08, 0x4321, 0x0001), 0, false));
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0, 0x1234, 0x0002), 0x0100, false));
+
+    Sets.Add(CUsbDkHideRulesLayers::LAYER_PERSISTENT_EXT, true, 0x0200, 0x1234, 0x0002);
+    USBDK_CHECK(DecidesBoth(Sets, MakeDescriptor(0, 0x1234, 0x0002), 0x0300, true));
+}
+
+// Fixed LCG sequence, so failures are reproducible
+class CTestRandom
+{
+public:
+    ULONG Next(ULONG Range)
+    {
+        m_Seed = m_Seed * 1103515245 + 12345;
+        return (m_Seed >> 16) % Range;
+    }
+
+    template <typename T, size_t N>
+    T Pick(const T (&Values)[N])
+    { return Values[Next(N)]; }
+
+private:
+    ULONG m_Seed = 1;
+};
+
+USBDK_TEST(HideRulesEngine_MatchesRuleSetsWalkOnRandomRules)
+{
+    // Small value domains, so rules overlap a lot
+    const ULONG VIDs[] = { 0x1, 0x2, 0x3, ALL };
+    const ULONG PIDs[] = { 0x1, 0x2, ALL };
+    const ULONG BCDs[] = { 0x1, ALL };
+    const ULONG Classes[] = { 0x0, 0x3, 0x8, ALL };
+    const ULONG ExtClasses[] = { 0x1, 0x8, 0x100, 0x108, ALL };
+    const ULONG DeviceClasses[] = { 0x0, 0x1, 0x8, 0x100, 0x109 };
+
+    CTestRandom Random;
+    for (ULONG Round = 0; Round < 500; Round++)
+    {
+        CTestRuleSets Sets;
+        auto NumRules = 1 + Random.Next(12);
+        for (ULONG i = 0; i < NumRules; i++)
+        {
+            auto Layer = static_cast<CUsbDkHideRulesLayers::TLayer>(Random.Next(CUsbDkHideRulesLayers::NUM_LAYERS));
+            auto Ext = (Layer == CUsbDkHideRulesLayers::LAYER_EXT) || (Layer == CUsbDkHideRulesLayers::LAYER_PERSISTENT_EXT);
+            Sets.Add(Layer, Random.Next(2) != 0,
+                     Ext ? Random.Pick(ExtClasses) : Random.Pick(Classes),
+                     Random.Pick(VIDs), Random.Pick(PIDs), Random.Pick(BCDs));
+        }
+
+        CTestHideRulesLookup Lookup;
+        USBDK_CHECK(Sets.Compile(Lookup));
+
+        for (USHORT VID = 1; VID <= 4; VID++)
+        {
+            for (USHORT PID = 1; PID <= 3; PID++)
+            {
+                for (USHORT BCD = 1; BCD <= 2; BCD++)
+                {
+                    for (auto Class : { 0x0, 0x3, 0x8 })
+                    {
+                        auto Descriptor = MakeDescriptor(static_cast<UCHAR>(Class), VID, PID, BCD);
+                        auto DeviceClassesMask = Random.Pick(DeviceClasses);
+                        USBDK_CHECK(Lookup.ShouldHide(Descriptor, DeviceClassesMask) ==
+                                    UsbDkShouldHideByRuleSets(Sets, Descriptor, DeviceClassesMask));
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Decisions for a thousand devices against ten thousand rules,
+// mostly exact VID/PID rules with a few wildcards in every layer
+
+static const ULONG BENCHMARK_NUM_RULES = 10000;
+static const ULONG BENCHMARK_NUM_DEVICES = 1000;
+
+USBDK_BENCHMARK(HideRulesEngine_Decisions)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    CTestRandom Random;
+    CTestRuleSets Sets;
+    for (ULONG i = 0; i < BENCHMARK_NUM_RULES; i++)
+    {
+        auto Layer = static_cast<CUsbDkHideRulesLayers::TLayer>(i % CUsbDkHideRulesLayers::NUM_LAYERS);
+        if (i % 100 == 0)
+        {
+            Sets.Add(Layer, false, 0xFF, 0x1000 + Random.Next(64), ALL);
+        }
+        else
+        {
+            Sets.Add(Layer, Random.Next(4) != 0, ALL, 0x1000 + Random.Next(64), Random.Next(4096));
+        }
+    }
+
+    vector<USB_DEVICE_DESCRIPTOR> Devices;
+    vector<ULONG> DevicesClasses;
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        Devices.push_back(MakeDescriptor(static_cast<UCHAR>(Random.Next(2) ? 0xFF : 0x00),
+                                         static_cast<USHORT>(0x1000 + Random.Next(64)),
+                                         static_cast<USHORT>(Random.Next(4096))));
+        DevicesClasses.push_back(1UL << Random.Next(32));
+    }
+
+    vector<bool> WalkDecisions;
+    UsbDkBenchmarkTimer WalkTimer;
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        WalkDecisions.push_back(UsbDkShouldHideByRuleSets(Sets, Devices[i], DevicesClasses[i]));
+    }
+    auto WalkTime = WalkTimer.ElapsedMicroseconds();
+
+    UsbDkBenchmarkTimer CompileTimer;
+    CTestHideRulesLookup Lookup;
+    USBDK_CHECK(Sets.Compile(Lookup));
+    auto CompileTime = CompileTimer.ElapsedMicroseconds();
+
+    ULONG Hidden = 0;
+    UsbDkBenchmarkTimer LookupTimer;
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        auto Hide = Lookup.ShouldHide(Devices[i], DevicesClasses[i]);
+        USBDK_CHECK(Hide == WalkDecisions[i]);
+        Hidden += Hide ? 1 : 0;
+    }
+    auto LookupTime = LookupTimer.ElapsedMicroseconds();
+
+    tcout << BENCHMARK_NUM_RULES << TEXT(" rules, ") << BENCHMARK_NUM_DEVICES << TEXT(" devices, ")
+          << Hidden << TEXT(" hidden: rule sets walk ") << WalkTime << TEXT(" us, engine compile ")
+          << CompileTime << TEXT(" us, engine lookups ") << LookupTime << TEXT(" us") << endl;
+}
@@ -0,0 +1,224 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkNumberBitmap.h"
+
+#include <list>
+
+struct CTestWordsAllocator
+{
+    static ULONG *allocate(size_t NumWords) { return new (nothrow) ULONG[NumWords]; }
+    static void destroy(ULONG *Words) { delete[] Words; }
+};
+
+typedef CUsbDkNumberBitmap<CTestWordsAllocator> CTestNumberBitmap;
+
+USBDK_TEST(NumberBitmap_AllocatesLowestFreeNumber)
+{
+    CTestNumberBitmap Bitmap;
+
+    USBDK_CHECK(Bitmap.Size() == 0);
+    USBDK_CHECK(Bitmap.Allocate() == CTestNumberBitmap::NO_NUMBER);
+
+    USBDK_CHECK(Bitmap.Grow());
+    USBDK_CHECK(Bitmap.Size() == CTestNumberBitmap::INITIAL_WORDS * CTestNumberBitmap::BITS_PER_WORD);
+
+    for (ULONG i = 0; i < Bitmap.Size(); i++)
+    {
+        USBDK_CHECK(Bitmap.Allocate() == i);
+        USBDK_CHECK(Bitmap.IsUsed(i));
+    }
+
+    USBDK_CHECK(Bitmap.Allocate() == CTestNumberBitmap::NO_NUMBER);
+}
+
+USBDK_TEST(NumberBitmap_ReusesFreedNumbers)
+{
+    CTestNumberBitmap Bitmap;
+    USBDK_CHECK(Bitmap.Grow());
+
+    for (ULONG i = 0; i < 40; i++)
+    {
+        USBDK_CHECK(Bitmap.Allocate() == i);
+    }
+
+    // Freed numbers are re-used lowest first, in both words
+    Bitmap.Free(35);
+    Bitmap.Free(7);
+    Bitmap.Free(3);
+    USBDK_CHECK(!Bitmap.IsUsed(3));
+
+    USBDK_CHECK(Bitmap.Allocate() == 3);
+    USBDK_CHECK(Bitmap.Allocate() == 7);
+    USBDK_CHECK(Bitmap.Allocate() == 35);
+    USBDK_CHECK(Bitmap.Allocate() == 40);
+}
+
+USBDK_TEST(NumberBitmap_GrowPreservesNumbersInUse)
+{
+    CTestNumberBitmap Bitmap;
+    USBDK_CHECK(Bitmap.Grow());
+
+    auto OldSize = Bitmap.Size();
+    for (ULONG i = 0; i < OldSize; i++)
+    {
+        Bitmap.Allocate();
+    }
+    Bitmap.Free(5);
+    USBDK_CHECK(Bitmap.Allocate() == 5);
+    USBDK_CHECK(Bitmap.Allocate() == CTestNumberBitmap::NO_NUMBER);
+
+    USBDK_CHECK(Bitmap.Grow());
+    USBDK_CHECK(Bitmap.Size() == OldSize * 2);
+
+    for (ULONG i = 0; i < OldSize; i++)
+    {
+        USBDK_CHECK(Bitmap.IsUsed(i));
+    }
+    for (ULONG i = OldSize; i < Bitmap.Size(); i++)
+    {
+        USBDK_CHECK(!Bitmap.IsUsed(i));
+    }
+
+    USBDK_CHECK(Bitmap.Allocate() == OldSize);
+}
+
+USBDK_TEST(NumberBitmap_IgnoresNumbersBeyondSize)
+{
+    CTestNumberBitmap Bitmap;
+
+    // Must be harmless on empty bitmap as well
+    Bitmap.MarkUsed(0);
+    Bitmap.Free(0);
+    USBDK_CHECK(!Bitmap.IsUsed(0));
+
+    USBDK_CHECK(Bitmap.Grow());
+    auto Size = Bitmap.Size();
+
+    Bitmap.MarkUsed(Size);
+    Bitmap.MarkUsed(1000);
+    Bitmap.Free(Size + 1);
+    USBDK_CHECK(!Bitmap.IsUsed(Size));
+    USBDK_CHECK(!Bitmap.IsUsed(1000));
+    USBDK_CHECK(Bitmap.Size() == Size);
+
+    // Numbers marked inside of the bitmap are skipped by Allocate()
+    Bitmap.MarkUsed(0);
+    Bitmap.MarkUsed(2);
+    USBDK_CHECK(Bitmap.Allocate() == 1);
+    USBDK_CHECK(Bitmap.Allocate() == 3);
+}
+
+// Serial number assignment for thousands of simulated hidden devices,
+// plug all of them, then replug devices in pseudo-random order.
+// Compares the bitmap with the list scan it replaced in the driver.
+
+static const ULONG BENCHMARK_NUM_DEVICES = 2048;
+static const ULONG BENCHMARK_NUM_REPLUGS = 1024;
+
+static ULONG ListScanAllocate(const list<ULONG> &Devices)
+{
+    for (ULONG MinSN = 0;; MinSN++)
+    {
+        auto NoSuchSN = true;
+        for (auto SN : Devices)
+        {
+            if (SN == MinSN)
+            {
+                NoSuchSN = false;
+                break;
+            }
+        }
+
+        if (NoSuchSN)
+        {
+            return MinSN;
+        }
+    }
+}
+
+static ULONG BitmapAllocate(CTestNumberBitmap &Bitmap)
+{
+    auto SN = Bitmap.Allocate();
+    if (SN == CTestNumberBitmap::NO_NUMBER)
+    {
+        USBDK_CHECK(Bitmap.Grow());
+        SN = Bitmap.Allocate();
+    }
+    return SN;
+}
+
+template <typename TAllocate, typename TFree>
+static ULONG64 RunSerialNumbersWorkload(TAllocate Allocate, TFree Free)
+{
+    vector<ULONG> Plugged;
+    Plugged.reserve(BENCHMARK_NUM_DEVICES);
+
+    UsbDkBenchmarkTimer Timer;
+
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        Plugged.push_back(Allocate());
+    }
+
+    // Fixed LCG sequence, both allocators see the same replug order
+    ULONG Seed = 1;
+    for (ULONG i = 0; i < BENCHMARK_NUM_REPLUGS; i++)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        auto &Device = Plugged[(Seed >> 16) % BENCHMARK_NUM_DEVICES];
+
+        Free(Device);
+        Device = Allocate();
+        USBDK_CHECK(Device < BENCHMARK_NUM_DEVICES);
+    }
+
+    return Timer.ElapsedMicroseconds();
+}
+
+USBDK_BENCHMARK(NumberBitmap_SerialNumbers)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    list<ULONG> Devices;
+    auto ListTime = RunSerialNumbersWorkload([&Devices]()
+                                             {
+                                                 auto SN = ListScanAllocate(Devices);
+                                                 Devices.push_back(SN);
+                                                 return SN;
+                                             },
+                                             [&Devices](ULONG SN)
+                                             { Devices.remove(SN); });
+
+    CTestNumberBitmap Bitmap;
+    auto BitmapTime = RunSerialNumbersWorkload([&Bitmap]()
+                                               { return BitmapAllocate(Bitmap); },
+                                               [&Bitmap](ULONG SN)
+                                               { Bitmap.Free(SN); });
+
+    tcout << BENCHMARK_NUM_DEVICES << TEXT(" devices, ")
+          << BENCHMARK_NUM_REPLUGS << TEXT(" replugs: list scan ")
+          << ListTime << TEXT(" us, bitmap ")
+          << BitmapTime << TEXT(" us") << endl;
+}
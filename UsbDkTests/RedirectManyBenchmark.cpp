@@ -0,0 +1,146 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+
+#include <chrono>
+#include <thread>
+
+// Acquisition of a VDI session worth of devices, one by one as through
+// UsbDk_StartRedirect, versus all at once as through
+// UsbDk_StartRedirectMany, where the control device hands each port
+// reset to a system worker thread and pends the request until the
+// device attaches to the redirector. Devices are fake PDOs with made up
+// reset and re-enumeration times, one of them fails its reset.
+
+static const ULONG BENCHMARK_NUM_DEVICES = 16;
+static const ULONG BENCHMARK_FAILING_DEVICE = 5;
+
+class CSimPDO
+{
+public:
+    CSimPDO(ULONG ResetMs, ULONG AttachMs, bool FailsReset)
+        : m_ResetMs(ResetMs)
+        , m_AttachMs(AttachMs)
+        , m_FailsReset(FailsReset)
+    {}
+
+    // Port reset or cycle, then re-enumeration up to the
+    // point the redirector attaches to the new PDO
+    DWORD ResetAndAttach() const
+    {
+        this_thread::sleep_for(chrono::milliseconds(m_ResetMs));
+        if (m_FailsReset)
+        {
+            return ERROR_GEN_FAILURE;
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(m_AttachMs));
+        return ERROR_SUCCESS;
+    }
+
+private:
+    ULONG m_ResetMs;
+    ULONG m_AttachMs;
+    bool m_FailsReset;
+};
+
+struct CRedirectResults
+{
+    vector<DWORD> Errors;
+    vector<ULONG64> CompletedAt;
+    ULONG64 Total;
+};
+
+static CRedirectResults RedirectSerially(const vector<CSimPDO> &Devices)
+{
+    CRedirectResults Results = { vector<DWORD>(Devices.size()), vector<ULONG64>(Devices.size()), 0 };
+
+    UsbDkBenchmarkTimer Timer;
+    for (size_t i = 0; i < Devices.size(); i++)
+    {
+        Results.Errors[i] = Devices[i].ResetAndAttach();
+        Results.CompletedAt[i] = Timer.ElapsedMicroseconds();
+    }
+    Results.Total = Timer.ElapsedMicroseconds();
+
+    return Results;
+}
+
+static CRedirectResults RedirectAtOnce(const vector<CSimPDO> &Devices)
+{
+    CRedirectResults Results = { vector<DWORD>(Devices.size()), vector<ULONG64>(Devices.size()), 0 };
+
+    UsbDkBenchmarkTimer Timer;
+
+    vector<thread> Workers;
+    for (size_t i = 0; i < Devices.size(); i++)
+    {
+        Workers.emplace_back([&Devices, &Results, &Timer, i]()
+                             {
+                                 Results.Errors[i] = Devices[i].ResetAndAttach();
+                                 Results.CompletedAt[i] = Timer.ElapsedMicroseconds();
+                             });
+    }
+
+    for (auto &Worker : Workers)
+    {
+        Worker.join();
+    }
+    Results.Total = Timer.ElapsedMicroseconds();
+
+    return Results;
+}
+
+static void PrintResults(LPCTSTR Name, const CRedirectResults &Results)
+{
+    tcout << Name << TEXT(": total ") << Results.Total / 1000 << TEXT(" ms") << endl;
+    for (size_t i = 0; i < Results.Errors.size(); i++)
+    {
+        tcout << TEXT("  device ") << i << TEXT(": error ") << Results.Errors[i]
+              << TEXT(", done at ") << Results.CompletedAt[i] / 1000 << TEXT(" ms") << endl;
+    }
+}
+
+USBDK_BENCHMARK(RedirectMany_FakeDevices)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    vector<CSimPDO> Devices;
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        Devices.emplace_back(20 + (i % 4) * 10, 100 + (i % 3) * 50, i == BENCHMARK_FAILING_DEVICE);
+    }
+
+    auto Serial = RedirectSerially(Devices);
+    auto AtOnce = RedirectAtOnce(Devices);
+
+    for (ULONG i = 0; i < BENCHMARK_NUM_DEVICES; i++)
+    {
+        USBDK_CHECK(Serial.Errors[i] == AtOnce.Errors[i]);
+        USBDK_CHECK((Serial.Errors[i] == ERROR_SUCCESS) == (i != BENCHMARK_FAILING_DEVICE));
+    }
+
+    PrintResults(TEXT("One by one"), Serial);
+    PrintResults(TEXT("All at once"), AtOnce);
+}
@@ -0,0 +1,129 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#pragma once
+
+// Minimal self-registering test harness.
+// Tests are plain functions defined by USBDK_TEST, a test fails
+// when USBDK_CHECK condition does not hold or an exception escapes.
+// Benchmarks defined by USBDK_BENCHMARK are run on request only,
+// they receive extra command line arguments and print own timings.
+
+class UsbDkTestFailure
+{
+public:
+    UsbDkTestFailure(LPCTSTR File, int Line, LPCTSTR Expression)
+        : m_File(File)
+        , m_Line(Line)
+        , m_Expression(Expression)
+    {}
+
+    LPCTSTR File() const { return m_File; }
+    int Line() const { return m_Line; }
+    LPCTSTR Expression() const { return m_Expression; }
+
+private:
+    LPCTSTR m_File;
+    int m_Line;
+    LPCTSTR m_Expression;
+};
+
+typedef void (*UsbDkTestFunction)();
+typedef void (*UsbDkBenchmarkFunction)(const std::vector<tstring> &Arguments);
+
+class UsbDkTestRegistry
+{
+public:
+    template <typename TFunction>
+    struct CEntry
+    {
+        LPCTSTR Name;
+        TFunction Function;
+    };
+
+    static std::vector<CEntry<UsbDkTestFunction>> &Tests()
+    {
+        static std::vector<CEntry<UsbDkTestFunction>> List;
+        return List;
+    }
+
+    static std::vector<CEntry<UsbDkBenchmarkFunction>> &Benchmarks()
+    {
+        static std::vector<CEntry<UsbDkBenchmarkFunction>> List;
+        return List;
+    }
+
+    class CTest
+    {
+    public:
+        CTest(LPCTSTR Name, UsbDkTestFunction Function)
+        { Tests().push_back({ Name, Function }); }
+    };
+
+    class CBenchmark
+    {
+    public:
+        CBenchmark(LPCTSTR Name, UsbDkBenchmarkFunction Function)
+        { Benchmarks().push_back({ Name, Function }); }
+    };
+};
+
+class UsbDkBenchmarkTimer
+{
+public:
+    UsbDkBenchmarkTimer()
+    {
+        QueryPerformanceFrequency(&m_Frequency);
+        QueryPerformanceCounter(&m_Start);
+    }
+
+    ULONG64 ElapsedMicroseconds() const
+    {
+        LARGE_INTEGER Now;
+        QueryPerformanceCounter(&Now);
+        return static_cast<ULONG64>(Now.QuadPart - m_Start.QuadPart) * 1000000 / m_Frequency.QuadPart;
+    }
+
+private:
+    LARGE_INTEGER m_Frequency;
+    LARGE_INTEGER m_Start;
+};
+
+#define USBDK_TEST(Name)                                                        \
+    static void Name();                                                         \
+    static UsbDkTestRegistry::CTest Name##Registration(TEXT(#Name), Name);      \
+    static void Name()
+
+#define USBDK_BENCHMARK(Name)                                                   \
+    static void Name(const std::vector<tstring> &Arguments);                    \
+    static UsbDkTestRegistry::CBenchmark Name##Registration(TEXT(#Name), Name); \
+    static void Name(const std::vector<tstring> &Arguments)
+
+#define USBDK_CHECK(Condition)                                                  \
+    do                                                                          \
+    {                                                                           \
+        if (!(Condition))                                                       \
+        {                                                                       \
+            throw UsbDkTestFailure(TEXT(__FILE__), __LINE__, TEXT(#Condition)); \
+        }                                                                       \
+    } while (0)
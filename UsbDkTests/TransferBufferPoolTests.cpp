@@ -0,0 +1,189 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "TransferBufferPool.h"
+
+#include <set>
+
+static bool IsPageAligned(PVOID Buffer)
+{
+    return (reinterpret_cast<ULONG_PTR>(Buffer) % 4096) == 0;
+}
+
+USBDK_TEST(TransferBufferPool_AllocatesPageAlignedBuffers)
+{
+    UsbDkTransferBufferPool Pool;
+
+    SIZE_T Sizes[] = { 1, 4096, 4097, 60000, 64 * 1024, 100000, 1024 * 1024, 1024 * 1024 + 1 };
+    for (auto Size : Sizes)
+    {
+        auto Buffer = static_cast<PBYTE>(Pool.Alloc(Size));
+        USBDK_CHECK(Buffer != nullptr);
+        USBDK_CHECK(IsPageAligned(Buffer));
+
+        // Whole requested size is committed and writable
+        memset(Buffer, 0xA5, Size);
+        USBDK_CHECK(Buffer[Size - 1] == 0xA5);
+
+        USBDK_CHECK(Pool.Free(Buffer));
+    }
+}
+
+USBDK_TEST(TransferBufferPool_RecyclesBuffersOfSizeClass)
+{
+    UsbDkTransferBufferPool Pool;
+
+    // Sizes of the same power of two class share buffers
+    auto Buffer4K = Pool.Alloc(100);
+    USBDK_CHECK(Pool.Free(Buffer4K));
+    USBDK_CHECK(Pool.Alloc(4096) == Buffer4K);
+
+    auto Buffer8K = Pool.Alloc(5000);
+    USBDK_CHECK(Pool.Free(Buffer8K));
+    USBDK_CHECK(Pool.Alloc(8192) == Buffer8K);
+
+    // ...while buffers of other classes are not handed out
+    USBDK_CHECK(Pool.Free(Buffer4K));
+    USBDK_CHECK(Pool.Alloc(8192) != Buffer4K);
+
+    USBDK_CHECK(Pool.Free(Buffer8K));
+}
+
+USBDK_TEST(TransferBufferPool_BuffersDoNotOverlap)
+{
+    UsbDkTransferBufferPool Pool;
+    const SIZE_T Size = 16 * 1024;
+
+    // More buffers than fit into a single slab
+    set<PBYTE> Buffers;
+    for (ULONG i = 0; i < 10; i++)
+    {
+        auto Buffer = static_cast<PBYTE>(Pool.Alloc(Size));
+        USBDK_CHECK(Buffer != nullptr);
+        Buffers.insert(Buffer);
+    }
+    USBDK_CHECK(Buffers.size() == 10);
+
+    PBYTE Previous = nullptr;
+    for (auto Buffer : Buffers)
+    {
+        USBDK_CHECK((Previous == nullptr) || (Previous + Size <= Buffer));
+        Previous = Buffer;
+    }
+
+    for (auto Buffer : Buffers)
+    {
+        USBDK_CHECK(Pool.Free(Buffer));
+    }
+}
+
+USBDK_TEST(TransferBufferPool_RejectsForeignBuffers)
+{
+    UsbDkTransferBufferPool Pool;
+    UsbDkTransferBufferPool OtherPool;
+
+    auto Buffer = static_cast<PBYTE>(Pool.Alloc(4096));
+    auto LargeBuffer = Pool.Alloc(2 * 1024 * 1024);
+    BYTE Stack[16];
+
+    USBDK_CHECK(!Pool.Free(nullptr));
+    USBDK_CHECK(!Pool.Free(Stack));
+    USBDK_CHECK(!Pool.Free(Buffer + 1));
+    USBDK_CHECK(!OtherPool.Free(Buffer));
+    USBDK_CHECK(!OtherPool.Free(LargeBuffer));
+
+    USBDK_CHECK(Pool.Free(Buffer));
+    USBDK_CHECK(Pool.Free(LargeBuffer));
+
+    // Double free is detected, large buffer went back to the system
+    USBDK_CHECK(!Pool.Free(Buffer));
+    USBDK_CHECK(!Pool.Free(LargeBuffer));
+}
+
+// Alloc/submit/free cycles of a streaming client. Submission is simulated
+// by touching every page of the buffer, as locking pages for DMA faults
+// in fresh ones. Pool recycles the same pages, malloc may hand out new
+// ones, especially for large buffers served directly by the system.
+
+static const ULONG BENCHMARK_NUM_CYCLES = 20000;
+static const ULONG BENCHMARK_BUFFERS_IN_FLIGHT = 8;
+
+static void SubmitBuffer(PVOID Buffer, SIZE_T Size)
+{
+    auto Bytes = static_cast<volatile BYTE *>(Buffer);
+    for (SIZE_T Offset = 0; Offset < Size; Offset += 4096)
+    {
+        Bytes[Offset] = static_cast<BYTE>(Offset);
+    }
+    Bytes[Size - 1] = 0;
+}
+
+template <typename TAlloc, typename TFree>
+static ULONG64 RunTransferCycles(SIZE_T Size, TAlloc Alloc, TFree Free)
+{
+    PVOID InFlight[BENCHMARK_BUFFERS_IN_FLIGHT] = {};
+
+    UsbDkBenchmarkTimer Timer;
+    for (ULONG i = 0; i < BENCHMARK_NUM_CYCLES; i++)
+    {
+        auto &Slot = InFlight[i % BENCHMARK_BUFFERS_IN_FLIGHT];
+        if (Slot != nullptr)
+        {
+            Free(Slot);
+        }
+        Slot = Alloc(Size);
+        USBDK_CHECK(Slot != nullptr);
+        SubmitBuffer(Slot, Size);
+    }
+
+    for (auto Buffer : InFlight)
+    {
+        if (Buffer != nullptr)
+        {
+            Free(Buffer);
+        }
+    }
+    return Timer.ElapsedMicroseconds();
+}
+
+USBDK_BENCHMARK(TransferBufferPool_AllocSubmitFree)
+{
+    UNREFERENCED_PARAMETER(Arguments);
+
+    SIZE_T Sizes[] = { 512, 4096, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+    for (auto Size : Sizes)
+    {
+        UsbDkTransferBufferPool Pool;
+        auto PoolTime = RunTransferCycles(Size,
+                                          [&Pool](SIZE_T Size) { return Pool.Alloc(Size); },
+                                          [&Pool](PVOID Buffer) { USBDK_CHECK(Pool.Free(Buffer)); });
+
+        auto MallocTime = RunTransferCycles(Size,
+                                            [](SIZE_T Size) { return malloc(Size); },
+                                            [](PVOID Buffer) { free(Buffer); });
+
+        tcout << BENCHMARK_NUM_CYCLES << TEXT(" cycles of ") << Size << TEXT(" bytes: pool ")
+              << PoolTime << TEXT(" us, malloc ") << MallocTime << TEXT(" us") << endl;
+    }
+}
@@ -0,0 +1,129 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkHelper.h"
+#include "DriverFile.h"
+#include "Public.h"
+
+// Cost of failed transfers reported by exceptions, as UsbDk_ReadPipe and
+// UsbDkDriverFile::Ioctl do, compared with error codes of UsbDk_ReadPipeEx
+// and UsbDkDriverFile::IoctlNoThrow. No device is needed, transfers fail
+// on handle validation in the helper and in DeviceIoControl issued on
+// an event handle.
+//
+// Arguments: [TRANSFERS]
+
+static const ULONG BENCHMARK_DEFAULT_TRANSFERS = 100000;
+
+// Event objects do not accept I/O control requests,
+// driver file closes the event on destruction
+static unique_ptr<UsbDkDriverFile> CreateRejectingDriverFile()
+{
+    auto Event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (Event == nullptr)
+    {
+        throw UsbDkW32ErrorException(TEXT("CreateEvent failed"));
+    }
+    return unique_ptr<UsbDkDriverFile>(new UsbDkDriverFile(Event));
+}
+
+static DWORD IoctlErrorByException(UsbDkDriverFile &File, USB_DK_TRANSFER_REQUEST &Request)
+{
+    try
+    {
+        File.Ioctl(IOCTL_USBDK_DEVICE_READ_PIPE, false, &Request, sizeof(Request), &Request, sizeof(Request));
+        return ERROR_SUCCESS;
+    }
+    catch (const UsbDkNumErrorException &e)
+    {
+        return e.GetErrorCode();
+    }
+}
+
+USBDK_TEST(TransferErrorPath_NoThrowReportsSameErrors)
+{
+    USB_DK_TRANSFER_REQUEST Request = {};
+
+    USBDK_CHECK(UsbDk_ReadPipe(INVALID_HANDLE_VALUE, &Request, nullptr) == TransferFailure);
+    USBDK_CHECK(UsbDk_ReadPipeEx(INVALID_HANDLE_VALUE, &Request, nullptr) == ERROR_INVALID_HANDLE);
+    USBDK_CHECK(UsbDk_WritePipeEx(INVALID_HANDLE_VALUE, &Request, nullptr) == ERROR_INVALID_HANDLE);
+
+    auto File = CreateRejectingDriverFile();
+    auto Error = File->IoctlNoThrow(IOCTL_USBDK_DEVICE_READ_PIPE, &Request, sizeof(Request), &Request, sizeof(Request), nullptr);
+    USBDK_CHECK(Error != ERROR_SUCCESS);
+    USBDK_CHECK(IoctlErrorByException(*File, Request) == Error);
+}
+
+USBDK_BENCHMARK(TransferErrorPath_FailedTransfers)
+{
+    auto NumTransfers = !Arguments.empty() ? _tcstoul(Arguments[0].c_str(), nullptr, 10)
+                                           : BENCHMARK_DEFAULT_TRANSFERS;
+    USB_DK_TRANSFER_REQUEST Request = {};
+    ULONG Failures;
+
+    Failures = 0;
+    UsbDkBenchmarkTimer ReadPipeTimer;
+    for (ULONG i = 0; i < NumTransfers; i++)
+    {
+        Failures += (UsbDk_ReadPipe(INVALID_HANDLE_VALUE, &Request, nullptr) == TransferFailure) ? 1 : 0;
+    }
+    auto ReadPipeTime = ReadPipeTimer.ElapsedMicroseconds();
+    USBDK_CHECK(Failures == NumTransfers);
+
+    Failures = 0;
+    UsbDkBenchmarkTimer ReadPipeExTimer;
+    for (ULONG i = 0; i < NumTransfers; i++)
+    {
+        Failures += (UsbDk_ReadPipeEx(INVALID_HANDLE_VALUE, &Request, nullptr) != ERROR_SUCCESS) ? 1 : 0;
+    }
+    auto ReadPipeExTime = ReadPipeExTimer.ElapsedMicroseconds();
+    USBDK_CHECK(Failures == NumTransfers);
+
+    auto File = CreateRejectingDriverFile();
+
+    Failures = 0;
+    UsbDkBenchmarkTimer IoctlTimer;
+    for (ULONG i = 0; i < NumTransfers; i++)
+    {
+        Failures += (IoctlErrorByException(*File, Request) != ERROR_SUCCESS) ? 1 : 0;
+    }
+    auto IoctlTime = IoctlTimer.ElapsedMicroseconds();
+    USBDK_CHECK(Failures == NumTransfers);
+
+    Failures = 0;
+    UsbDkBenchmarkTimer IoctlNoThrowTimer;
+    for (ULONG i = 0; i < NumTransfers; i++)
+    {
+        Failures += (File->IoctlNoThrow(IOCTL_USBDK_DEVICE_READ_PIPE, &Request, sizeof(Request),
+                                        &Request, sizeof(Request), nullptr) != ERROR_SUCCESS) ? 1 : 0;
+    }
+    auto IoctlNoThrowTime = IoctlNoThrowTimer.ElapsedMicroseconds();
+    USBDK_CHECK(Failures == NumTransfers);
+
+    tcout << NumTransfers << TEXT(" failed transfers:") << endl
+          << TEXT("  invalid handle: UsbDk_ReadPipe ") << ReadPipeTime
+          << TEXT(" us, UsbDk_ReadPipeEx ") << ReadPipeExTime << TEXT(" us") << endl
+          << TEXT("  rejected IOCTL: Ioctl ") << IoctlTime
+          << TEXT(" us, IoctlNoThrow ") << IoctlNoThrowTime << TEXT(" us") << endl;
+}
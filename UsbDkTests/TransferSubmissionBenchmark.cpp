@@ -0,0 +1,108 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+#include "UsbDkData.h"
+
+#include <atomic>
+#include <thread>
+
+// Transfers submitted from many threads, with bytes returned of each
+// fast completion stored in one slot shared by all threads, as
+// UsbDkRedirectorAccess::TransactPipe did with its static dummy, versus
+// per-call storage on stack of the submitting thread, as Ioctl() does.
+// Completion is simulated by writing results the way DeviceIoControl
+// does, so the benchmark isolates cost of the shared cache line.
+//
+// Arguments: [THREADS]
+
+static const ULONG BENCHMARK_TRANSFERS_PER_THREAD = 5000000;
+
+static DWORD BytesTransferredDummy;
+
+// Fast completion of DeviceIoControl fills transfer result in the output
+// buffer and reports its size through lpBytesReturned
+static void CompleteTransfer(USB_DK_TRANSFER_REQUEST &Request, volatile DWORD *BytesReturned)
+{
+    auto Result = reinterpret_cast<volatile USB_DK_GEN_TRANSFER_RESULT *>(&Request.Result.GenResult);
+    Result->BytesTransferred = Request.BufferLength;
+    Result->UsbdStatus = 0;
+    *BytesReturned = sizeof(Request.Result.GenResult);
+}
+
+template <typename TSubmit>
+static ULONG64 RunSubmissionThreads(ULONG NumThreads, TSubmit Submit)
+{
+    atomic<ULONG> Failures(0);
+
+    UsbDkBenchmarkTimer Timer;
+
+    vector<thread> Threads;
+    for (ULONG i = 0; i < NumThreads; i++)
+    {
+        Threads.emplace_back([Submit, &Failures]()
+                             {
+                                 USB_DK_TRANSFER_REQUEST Request = {};
+                                 for (ULONG j = 0; j < BENCHMARK_TRANSFERS_PER_THREAD; j++)
+                                 {
+                                     Request.BufferLength = j;
+                                     Submit(Request);
+                                     if (Request.Result.GenResult.BytesTransferred != j)
+                                     {
+                                         Failures++;
+                                     }
+                                 }
+                             });
+    }
+
+    for (auto &Thread : Threads)
+    {
+        Thread.join();
+    }
+
+    auto Time = Timer.ElapsedMicroseconds();
+    USBDK_CHECK(Failures == 0);
+    return Time;
+}
+
+USBDK_BENCHMARK(TransferSubmission_BytesReturnedStorage)
+{
+    auto MaxThreads = !Arguments.empty() ? _tcstoul(Arguments[0].c_str(), nullptr, 10)
+                                         : max(thread::hardware_concurrency(), 1U);
+
+    for (ULONG NumThreads = 1; NumThreads <= MaxThreads; NumThreads *= 2)
+    {
+        auto SharedTime = RunSubmissionThreads(NumThreads, [](USB_DK_TRANSFER_REQUEST &Request)
+                                                           { CompleteTransfer(Request, &BytesTransferredDummy); });
+
+        auto PerCallTime = RunSubmissionThreads(NumThreads, [](USB_DK_TRANSFER_REQUEST &Request)
+                                                            {
+                                                                DWORD BytesReturned;
+                                                                CompleteTransfer(Request, &BytesReturned);
+                                                            });
+
+        tcout << NumThreads << TEXT(" threads x ") << BENCHMARK_TRANSFERS_PER_THREAD
+              << TEXT(" transfers: shared slot ") << SharedTime
+              << TEXT(" us, per-call slot ") << PerCallTime << TEXT(" us") << endl;
+    }
+}
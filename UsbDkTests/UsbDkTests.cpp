@@ -0,0 +1,134 @@
+/**********************************************************************
+* Copyright (c) 2013-2014  Red Hat, Inc.
+*
+* Developed by Daynix Computing LTD.
+*
+* Authors:
+*     Dmitry Fleytman <dmitry@daynix.com>
+*     Pavel Gurvich <pavel@daynix.com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+**********************************************************************/
+
+#include "stdafx.h"
+
+static void ShowUsage()
+{
+    tcout << endl;
+    tcout << TEXT("    UsbDkTests usage:") << endl;
+    tcout << endl;
+    tcout << TEXT("        UsbDkTests -h              - show this help screen and exit") << endl;
+    tcout << TEXT("        UsbDkTests                 - run unit tests") << endl;
+    tcout << TEXT("        UsbDkTests -b [ARGS]       - run unit tests, then benchmarks.") << endl;
+    tcout << TEXT("                                     ARGS are passed to benchmarks,") << endl;
+    tcout << TEXT("                                     see benchmark sources for details") << endl;
+    tcout << TEXT("        UsbDkTests -b VID PID      - run transfer benchmarks as well,") << endl;
+    tcout << TEXT("                                     device is detached from its driver") << endl;
+    tcout << endl;
+    tcout << TEXT("    Exit code is the number of failed tests") << endl;
+    tcout << endl;
+}
+
+static int RunTests()
+{
+    int Failed = 0;
+
+    for (auto &Test : UsbDkTestRegistry::Tests())
+    {
+        tcout << TEXT("[ RUN  ] ") << Test.Name << endl;
+
+        try
+        {
+            Test.Function();
+            tcout << TEXT("[  OK  ] ") << Test.Name << endl;
+            continue;
+        }
+        catch (const UsbDkTestFailure &e)
+        {
+            tcout << e.File() << TEXT("(") << e.Line() << TEXT("): check failed: ") << e.Expression() << endl;
+        }
+        catch (const exception &e)
+        {
+            tcout << TEXT("Unexpected exception: ") << e.what() << endl;
+        }
+
+        tcout << TEXT("[ FAIL ] ") << Test.Name << endl;
+        Failed++;
+    }
+
+    auto Total = static_cast<int>(UsbDkTestRegistry::Tests().size());
+    tcout << Total - Failed << TEXT(" tests passed, ") << Failed << TEXT(" failed") << endl;
+    return Failed;
+}
+
+static int RunBenchmarks(const vector<tstring> &Arguments)
+{
+    int Failed = 0;
+
+    for (auto &Benchmark : UsbDkTestRegistry::Benchmarks())
+    {
+        tcout << TEXT("[ BENCH ] ") << Benchmark.Name << endl;
+
+        try
+        {
+            Benchmark.Function(Arguments);
+            continue;
+        }
+        catch (const UsbDkTestFailure &e)
+        {
+            tcout << e.File() << TEXT("(") << e.Line() << TEXT("): check failed: ") << e.Expression() << endl;
+        }
+        catch (const exception &e)
+        {
+            tcout << TEXT("Unexpected exception: ") << e.what() << endl;
+        }
+
+        tcout << TEXT("[ FAIL  ] ") << Benchmark.Name << endl;
+        Failed++;
+    }
+
+    return Failed;
+}
+
+int __cdecl _tmain(int argc, TCHAR* argv[])
+{
+    auto Benchmark = false;
+
+    if (argc > 1)
+    {
+        if (_tcscmp(L"-h", argv[1]) == 0)
+        {
+            ShowUsage();
+            return 0;
+        }
+        else if (_tcscmp(L"-b", argv[1]) == 0)
+        {
+            Benchmark = true;
+        }
+        else
+        {
+            ShowUsage();
+            return -1;
+        }
+    }
+
+    auto Failed = RunTests();
+
+    if (Benchmark)
+    {
+        Failed += RunBenchmarks(vector<tstring>(argv + 2, argv + argc));
+    }
+
+    return Failed;
+}